@@ -0,0 +1,417 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addrindex.h"
+
+#include "crypto/common.h"
+#include "hash.h"
+#include "primitives/block.h"
+#include "pubkey.h"
+#include "script/standard.h"
+#include "util.h"
+
+#include <boost/scoped_ptr.hpp>
+
+using namespace std;
+
+namespace {
+
+/** Write n big endian, so that keys sort by it */
+template<typename Stream>
+void WriteKeyBE32(Stream& s, uint32_t n)
+{
+    unsigned char buf[4];
+    WriteBE32(buf, n);
+    s.write((const char*)buf, sizeof(buf));
+}
+
+template<typename Stream>
+uint32_t ReadKeyBE32(Stream& s)
+{
+    unsigned char buf[4];
+    s.read((char*)buf, sizeof(buf));
+    return ReadBE32(buf);
+}
+
+/**
+ * History entry: 'h', script hash, height, txid, spend flag and output or input index.
+ * The value is the amount, followed by the output spent for spends.
+ */
+struct CAddrIndexHistoryKey
+{
+    uint160 hashScript;
+    int nHeight;
+    uint256 txid;
+    bool fSpend;
+    unsigned int n;
+
+    CAddrIndexHistoryKey() : nHeight(0), fSpend(false), n(0) {}
+    CAddrIndexHistoryKey(const uint160& hashScriptIn, int nHeightIn, const uint256& txidIn, bool fSpendIn, unsigned int nIn) :
+        hashScript(hashScriptIn), nHeight(nHeightIn), txid(txidIn), fSpend(fSpendIn), n(nIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return 1 + 20 + 4 + 32 + 1 + 4;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const {
+        ::Serialize(s, 'h', nType, nVersion);
+        ::Serialize(s, hashScript, nType, nVersion);
+        WriteKeyBE32(s, nHeight);
+        ::Serialize(s, txid, nType, nVersion);
+        ::Serialize(s, fSpend, nType, nVersion);
+        WriteKeyBE32(s, n);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion) {
+        char chType;
+        ::Unserialize(s, chType, nType, nVersion);
+        ::Unserialize(s, hashScript, nType, nVersion);
+        nHeight = ReadKeyBE32(s);
+        ::Unserialize(s, txid, nType, nVersion);
+        ::Unserialize(s, fSpend, nType, nVersion);
+        n = ReadKeyBE32(s);
+    }
+};
+
+/** Unspent output: 'u', script hash, txid and output index. The value is the amount and the height. */
+struct CAddrIndexUnspentKey
+{
+    uint160 hashScript;
+    COutPoint outpoint;
+
+    CAddrIndexUnspentKey() {}
+    CAddrIndexUnspentKey(const uint160& hashScriptIn, const COutPoint& outpointIn) :
+        hashScript(hashScriptIn), outpoint(outpointIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return 1 + 20 + 32 + 4;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream& s, int nType, int nVersion) const {
+        ::Serialize(s, 'u', nType, nVersion);
+        ::Serialize(s, hashScript, nType, nVersion);
+        ::Serialize(s, outpoint.hash, nType, nVersion);
+        WriteKeyBE32(s, outpoint.n);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s, int nType, int nVersion) {
+        char chType;
+        ::Unserialize(s, chType, nType, nVersion);
+        ::Unserialize(s, hashScript, nType, nVersion);
+        ::Unserialize(s, outpoint.hash, nType, nVersion);
+        outpoint.n = ReadKeyBE32(s);
+    }
+};
+
+/** Prefix shared by all entries of one type for one script */
+string GetKeyPrefix(char chType, const uint160& hashScript)
+{
+    CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+    ssKey << chType << hashScript;
+    return ssKey.str();
+}
+
+/** Position pcursor at the first entry under strPrefix that comes after the one strAfter is the cursor of */
+void SeekAfter(leveldb::Iterator* pcursor, const string& strPrefix, const string& strAfter)
+{
+    const string strStart = strPrefix + strAfter;
+    pcursor->Seek(strStart);
+    if (!strAfter.empty() && pcursor->Valid() && pcursor->key() == leveldb::Slice(strStart))
+        pcursor->Next();
+}
+
+/** Script hash of an entry key of any type; the type comes first */
+uint160 GetKeyScriptHash(const leveldb::Slice& slKey)
+{
+    CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+    char chType;
+    uint160 hashScript;
+    ssKey >> chType >> hashScript;
+    return hashScript;
+}
+
+//! Number of scripts whose totals are written in one batch by WriteMissingBalances
+static const size_t BALANCES_BATCH_SCRIPTS = 10000;
+
+} // anon namespace
+
+uint160 GetAddrIndexScriptHash(const CScript& script)
+{
+    CTxDestination dest;
+    if (ExtractDestination(script, dest)) {
+        CScript scriptDest = GetScriptForDestination(dest);
+        return Hash160(scriptDest.begin(), scriptDest.end());
+    }
+    return Hash160(script.begin(), script.end());
+}
+
+CAddrIndexDB::CAddrIndexDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "addrindex", nCacheSize, fMemory, fWipe, CLevelDBParams::FromArgs("addrindex")) {
+    // A new index keeps the totals from the start
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+    pcursor->SeekToFirst();
+    if (!pcursor->Valid())
+        Write('T', '1');
+}
+
+CAddrIndexBalance& CAddrIndexDB::GetBatchBalance(CAddrIndexBatch& batch, const uint160& hashScript)
+{
+    map<uint160, CAddrIndexBalance>::iterator it = batch.mapBalances.find(hashScript);
+    if (it == batch.mapBalances.end()) {
+        it = batch.mapBalances.insert(make_pair(hashScript, CAddrIndexBalance())).first;
+        Read(make_pair('s', hashScript), it->second);
+    }
+    return it->second;
+}
+
+bool CAddrIndexDB::ConnectBlock(const CBlock& block, int nHeight, const vector<CSpentOutput>& vSpent, CAddrIndexBatch& batch)
+{
+    // Entries are written in block order, so an output spent in its own block ends up erased
+    size_t nSpent = 0;
+    for (unsigned int i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        const uint256 txid = tx.GetHash();
+        if (!tx.IsCoinBase()) {
+            for (unsigned int j = 0; j < tx.vin.size(); j++) {
+                if (nSpent >= vSpent.size())
+                    return error("%s : spent outputs missing", __func__);
+                const CSpentOutput& spent = vSpent[nSpent++];
+                uint160 hashScript = GetAddrIndexScriptHash(spent.txout.scriptPubKey);
+                batch.batch.Write(CAddrIndexHistoryKey(hashScript, nHeight, txid, true, j), make_pair(spent.txout.nValue, tx.vin[j].prevout));
+                batch.batch.Erase(CAddrIndexUnspentKey(hashScript, tx.vin[j].prevout));
+                CAddrIndexBalance& balance = GetBatchBalance(batch, hashScript);
+                balance.nBalance -= spent.txout.nValue;
+                balance.nUnspent--;
+            }
+        }
+        for (unsigned int n = 0; n < tx.vout.size(); n++) {
+            const CTxOut& txout = tx.vout[n];
+            if (txout.scriptPubKey.IsUnspendable())
+                continue;
+            uint160 hashScript = GetAddrIndexScriptHash(txout.scriptPubKey);
+            batch.batch.Write(CAddrIndexHistoryKey(hashScript, nHeight, txid, false, n), txout.nValue);
+            batch.batch.Write(CAddrIndexUnspentKey(hashScript, COutPoint(txid, n)), make_pair(txout.nValue, nHeight));
+            CAddrIndexBalance& balance = GetBatchBalance(batch, hashScript);
+            balance.nBalance += txout.nValue;
+            balance.nUnspent++;
+            balance.nReceived += txout.nValue;
+        }
+    }
+    if (nSpent != vSpent.size())
+        return error("%s : spent outputs do not match the block", __func__);
+    return true;
+}
+
+bool CAddrIndexDB::DisconnectBlock(const CBlock& block, int nHeight, const vector<CSpentOutput>& vSpent, CAddrIndexBatch& batch)
+{
+    // Undo in reverse block order, so an output spent in its own block ends up erased
+    size_t nSpent = vSpent.size();
+    for (unsigned int i = block.vtx.size(); i-- > 0;) {
+        const CTransaction& tx = block.vtx[i];
+        const uint256 txid = tx.GetHash();
+        for (unsigned int n = 0; n < tx.vout.size(); n++) {
+            const CTxOut& txout = tx.vout[n];
+            if (txout.scriptPubKey.IsUnspendable())
+                continue;
+            uint160 hashScript = GetAddrIndexScriptHash(txout.scriptPubKey);
+            batch.batch.Erase(CAddrIndexHistoryKey(hashScript, nHeight, txid, false, n));
+            batch.batch.Erase(CAddrIndexUnspentKey(hashScript, COutPoint(txid, n)));
+            CAddrIndexBalance& balance = GetBatchBalance(batch, hashScript);
+            balance.nBalance -= txout.nValue;
+            balance.nUnspent--;
+            balance.nReceived -= txout.nValue;
+        }
+        if (!tx.IsCoinBase()) {
+            if (nSpent < tx.vin.size())
+                return error("%s : spent outputs missing", __func__);
+            nSpent -= tx.vin.size();
+            for (unsigned int j = tx.vin.size(); j-- > 0;) {
+                const CSpentOutput& spent = vSpent[nSpent + j];
+                uint160 hashScript = GetAddrIndexScriptHash(spent.txout.scriptPubKey);
+                batch.batch.Erase(CAddrIndexHistoryKey(hashScript, nHeight, txid, true, j));
+                batch.batch.Write(CAddrIndexUnspentKey(hashScript, tx.vin[j].prevout), make_pair(spent.txout.nValue, spent.nHeight));
+                CAddrIndexBalance& balance = GetBatchBalance(batch, hashScript);
+                balance.nBalance += spent.txout.nValue;
+                balance.nUnspent++;
+            }
+        }
+    }
+    if (nSpent != 0)
+        return error("%s : spent outputs do not match the block", __func__);
+    return true;
+}
+
+void CAddrIndexDB::WriteBestBlock(CAddrIndexBatch& batch, const uint256& hashBlock)
+{
+    batch.batch.Write('B', hashBlock);
+}
+
+bool CAddrIndexDB::WriteBatch(CAddrIndexBatch& batch, bool fSync)
+{
+    for (map<uint160, CAddrIndexBalance>::const_iterator it = batch.mapBalances.begin(); it != batch.mapBalances.end(); it++) {
+        if (it->second.IsNull())
+            batch.batch.Erase(make_pair('s', it->first));
+        else
+            batch.batch.Write(make_pair('s', it->first), it->second);
+    }
+    batch.mapBalances.clear();
+    return WriteBatch(batch.batch, fSync);
+}
+
+bool CAddrIndexDB::WriteMissingBalances()
+{
+    if (Exists('T'))
+        return true;
+    LogPrintf("Computing the totals of the address index...\n");
+
+    try {
+        // Start over from any earlier attempt that did not finish
+        CLevelDBBatch batch;
+        size_t nScripts = 0;
+        boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+        const string strBalancePrefix(1, 's');
+        for (pcursor->Seek(strBalancePrefix); pcursor->Valid() && pcursor->key().starts_with(strBalancePrefix); pcursor->Next()) {
+            batch.Erase(make_pair('s', GetKeyScriptHash(pcursor->key())));
+            if (++nScripts % BALANCES_BATCH_SCRIPTS == 0) {
+                WriteBatch(batch);
+                batch = CLevelDBBatch();
+            }
+        }
+        HandleError(pcursor->status());
+        WriteBatch(batch);
+
+        // Unspent outputs first, then what was received, each sorted by script
+        for (int nPass = 0; nPass < 2; nPass++) {
+            const string strPrefix(1, nPass == 0 ? 'u' : 'h');
+            batch = CLevelDBBatch();
+            nScripts = 0;
+            pcursor.reset(NewIterator());
+            pcursor->Seek(strPrefix);
+            while (pcursor->Valid() && pcursor->key().starts_with(strPrefix)) {
+                const uint160 hashScript = GetKeyScriptHash(pcursor->key());
+                const string strScriptPrefix = GetKeyPrefix(strPrefix[0], hashScript);
+                CAddrIndexBalance balance;
+                if (nPass == 1)
+                    Read(make_pair('s', hashScript), balance);
+                for (; pcursor->Valid() && pcursor->key().starts_with(strScriptPrefix); pcursor->Next()) {
+                    leveldb::Slice slValue = pcursor->value();
+                    CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                    CAmount nValue;
+                    if (nPass == 0) {
+                        ssValue >> nValue;
+                        balance.nBalance += nValue;
+                        balance.nUnspent++;
+                    } else {
+                        leveldb::Slice slKey = pcursor->key();
+                        CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+                        CAddrIndexHistoryKey key;
+                        ssKey >> key;
+                        if (key.fSpend)
+                            continue;
+                        ssValue >> nValue;
+                        balance.nReceived += nValue;
+                    }
+                }
+                if (!balance.IsNull())
+                    batch.Write(make_pair('s', hashScript), balance);
+                if (++nScripts % BALANCES_BATCH_SCRIPTS == 0) {
+                    WriteBatch(batch);
+                    batch = CLevelDBBatch();
+                }
+            }
+            HandleError(pcursor->status());
+            WriteBatch(batch);
+        }
+    } catch (std::exception &e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    return Write('T', '1', true);
+}
+
+bool CAddrIndexDB::ReadBestBlock(uint256& hashBlock)
+{
+    return Read('B', hashBlock);
+}
+
+bool CAddrIndexDB::ReadHistory(const uint160& hashScript, const string& strAfter, size_t nCount, vector<CAddrIndexHistoryEntry>& vEntries, bool& fMore, string& strNext)
+{
+    const string strPrefix = GetKeyPrefix('h', hashScript);
+    fMore = false;
+    strNext.clear();
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+    for (SeekAfter(pcursor.get(), strPrefix, strAfter); pcursor->Valid() && pcursor->key().starts_with(strPrefix); pcursor->Next()) {
+        if (vEntries.size() >= nCount) {
+            fMore = true;
+            break;
+        }
+        leveldb::Slice slKey = pcursor->key();
+        leveldb::Slice slValue = pcursor->value();
+        try {
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAddrIndexHistoryKey key;
+            ssKey >> key;
+            CAddrIndexHistoryEntry entry;
+            entry.nHeight = key.nHeight;
+            entry.txid = key.txid;
+            entry.n = key.n;
+            entry.fSpend = key.fSpend;
+            ssValue >> entry.nValue;
+            if (entry.fSpend)
+                ssValue >> entry.prevout;
+            vEntries.push_back(entry);
+            strNext.assign(slKey.data() + strPrefix.size(), slKey.size() - strPrefix.size());
+        } catch (std::exception &e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    HandleError(pcursor->status());
+    return true;
+}
+
+bool CAddrIndexDB::ReadUnspent(const uint160& hashScript, const string& strAfter, size_t nCount, vector<CAddrIndexUnspent>& vUnspent, bool& fMore, string& strNext)
+{
+    const string strPrefix = GetKeyPrefix('u', hashScript);
+    fMore = false;
+    strNext.clear();
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+    for (SeekAfter(pcursor.get(), strPrefix, strAfter); pcursor->Valid() && pcursor->key().starts_with(strPrefix); pcursor->Next()) {
+        if (vUnspent.size() >= nCount) {
+            fMore = true;
+            break;
+        }
+        leveldb::Slice slKey = pcursor->key();
+        leveldb::Slice slValue = pcursor->value();
+        try {
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAddrIndexUnspentKey key;
+            ssKey >> key;
+            CAddrIndexUnspent unspent;
+            unspent.outpoint = key.outpoint;
+            ssValue >> unspent.nValue >> unspent.nHeight;
+            vUnspent.push_back(unspent);
+            strNext.assign(slKey.data() + strPrefix.size(), slKey.size() - strPrefix.size());
+        } catch (std::exception &e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    HandleError(pcursor->status());
+    return true;
+}
+
+bool CAddrIndexDB::ReadBalance(const uint160& hashScript, CAddrIndexBalance& balance)
+{
+    // Scripts that never received anything have no totals
+    balance = CAddrIndexBalance();
+    try {
+        Read(make_pair('s', hashScript), balance);
+    } catch (std::exception &e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    return true;
+}
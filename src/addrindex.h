@@ -0,0 +1,137 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_ADDRINDEX_H
+#define BITCOIN_ADDRINDEX_H
+
+#include "amount.h"
+#include "leveldbwrapper.h"
+#include "primitives/transaction.h"
+#include "uint256.h"
+#include "undo.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+class CBlock;
+class CScript;
+
+/** Default and maximum number of entries returned by one address index query */
+static const unsigned int DEFAULT_ADDRINDEX_PAGE_SIZE = 100;
+static const unsigned int MAX_ADDRINDEX_PAGE_SIZE = 1000;
+
+/** Output paying to a script, or input spending from it */
+struct CAddrIndexHistoryEntry
+{
+    int nHeight;
+    uint256 txid;
+    //! Index of the output, or of the input for spends
+    unsigned int n;
+    bool fSpend;
+    CAmount nValue;
+    //! For spends, the output spent
+    COutPoint prevout;
+};
+
+/** Unspent output paying to a script */
+struct CAddrIndexUnspent
+{
+    COutPoint outpoint;
+    CAmount nValue;
+    int nHeight;
+};
+
+/** Totals of the outputs paying to a script, kept up to date with its entries */
+struct CAddrIndexBalance
+{
+    //! Total and number of the unspent outputs
+    CAmount nBalance;
+    uint64_t nUnspent;
+    //! Total of all outputs ever received
+    CAmount nReceived;
+
+    CAddrIndexBalance() : nBalance(0), nUnspent(0), nReceived(0) {}
+
+    bool IsNull() const { return nBalance == 0 && nUnspent == 0 && nReceived == 0; }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(nBalance);
+        READWRITE(nUnspent);
+        READWRITE(nReceived);
+    }
+};
+
+/** Writes to the address index, with the totals of the scripts they touch as they will be once written */
+struct CAddrIndexBatch
+{
+    CLevelDBBatch batch;
+    std::map<uint160, CAddrIndexBalance> mapBalances;
+};
+
+/**
+ * Hash under which outputs paying to a script are indexed. Scripts paying to the same
+ * destination (e.g. pay-to-pubkey and pay-to-pubkey-hash of one key) share it.
+ */
+uint160 GetAddrIndexScriptHash(const CScript& script);
+
+/**
+ * Optional index (-addrindex) of the outputs paying to and spent from each script, with the
+ * ones still unspent and their totals, in its own database (addrindex/). It is kept up to date
+ * as blocks are connected and disconnected. History is ordered by height, and is read in pages
+ * that resume from the key of the last entry read, so any page is one seek away. The hash of
+ * the block it is up to date with is kept under 'B', so that it can be brought back in line
+ * with the chain state after a crash.
+ *
+ * Readers need no lock: every batch is applied atomically, and an iterator sees the database
+ * as it was when it was created.
+ */
+class CAddrIndexDB : public CLevelDBWrapper
+{
+public:
+    CAddrIndexDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+private:
+    CAddrIndexDB(const CAddrIndexDB&);
+    void operator=(const CAddrIndexDB&);
+
+    //! Totals of a script as of the writes in batch
+    CAddrIndexBalance& GetBatchBalance(CAddrIndexBatch& batch, const uint160& hashScript);
+public:
+    using CLevelDBWrapper::WriteBatch;
+
+    /**
+     * Add the writes indexing a block connected at nHeight to batch, for the caller to
+     * apply with WriteBatch. vSpent holds the outputs spent by its inputs, in block order.
+     */
+    bool ConnectBlock(const CBlock& block, int nHeight, const std::vector<CSpentOutput>& vSpent, CAddrIndexBatch& batch);
+    /** Add the writes undoing ConnectBlock for the same arguments to batch */
+    bool DisconnectBlock(const CBlock& block, int nHeight, const std::vector<CSpentOutput>& vSpent, CAddrIndexBatch& batch);
+    /** Record in batch the block the index is up to date with, written along with its entries */
+    void WriteBestBlock(CAddrIndexBatch& batch, const uint256& hashBlock);
+    bool ReadBestBlock(uint256& hashBlock);
+    /** Write the entries in batch, together with the totals they change */
+    bool WriteBatch(CAddrIndexBatch& batch, bool fSync = false);
+
+    /**
+     * Compute the totals of every script, for indexes built before they were kept. Does
+     * nothing if they are already there.
+     */
+    bool WriteMissingBalances();
+
+    /**
+     * Read up to nCount history entries of a script, oldest first, starting after the entry
+     * strAfter is the cursor of (from the first one if empty). strNext is set to the cursor of
+     * the last entry read, and fMore tells if there are more.
+     */
+    bool ReadHistory(const uint160& hashScript, const std::string& strAfter, size_t nCount, std::vector<CAddrIndexHistoryEntry>& vEntries, bool& fMore, std::string& strNext);
+    /** Read up to nCount unspent outputs of a script, in txid order, the same way as ReadHistory */
+    bool ReadUnspent(const uint160& hashScript, const std::string& strAfter, size_t nCount, std::vector<CAddrIndexUnspent>& vUnspent, bool& fMore, std::string& strNext);
+    /** Total of the unspent outputs of a script, their number, and the total ever received */
+    bool ReadBalance(const uint160& hashScript, CAddrIndexBalance& balance);
+};
+
+#endif // BITCOIN_ADDRINDEX_H
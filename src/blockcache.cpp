@@ -0,0 +1,57 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcache.h"
+
+std::list<CRecentBlockCache::CEntry>::const_iterator CRecentBlockCache::Find(const uint256& hash) const
+{
+    // There are only a few entries, and the one wanted is usually the most recent
+    std::list<CEntry>::const_iterator it = listEntries.begin();
+    while (it != listEntries.end() && it->hash != hash)
+        it++;
+    return it;
+}
+
+void CRecentBlockCache::SetMaxBlocks(size_t nMaxBlocksIn)
+{
+    nMaxBlocks = nMaxBlocksIn;
+    while (listEntries.size() > nMaxBlocks)
+        listEntries.pop_back();
+}
+
+void CRecentBlockCache::Add(const uint256& hash, const boost::shared_ptr<const CBlock>& pblock, const boost::shared_ptr<const CBlockUndo>& pundo)
+{
+    if (nMaxBlocks == 0)
+        return;
+    std::list<CEntry>::iterator it = listEntries.begin();
+    while (it != listEntries.end() && it->hash != hash)
+        it++;
+    if (it != listEntries.end())
+        listEntries.erase(it);
+
+    CEntry entry;
+    entry.hash = hash;
+    entry.pblock = pblock;
+    entry.pundo = pundo;
+    listEntries.push_front(entry);
+    while (listEntries.size() > nMaxBlocks)
+        listEntries.pop_back();
+}
+
+boost::shared_ptr<const CBlock> CRecentBlockCache::GetBlock(const uint256& hash) const
+{
+    std::list<CEntry>::const_iterator it = Find(hash);
+    return it == listEntries.end() ? boost::shared_ptr<const CBlock>() : it->pblock;
+}
+
+boost::shared_ptr<const CBlockUndo> CRecentBlockCache::GetUndo(const uint256& hash) const
+{
+    std::list<CEntry>::const_iterator it = Find(hash);
+    return it == listEntries.end() ? boost::shared_ptr<const CBlockUndo>() : it->pundo;
+}
+
+void CRecentBlockCache::Clear()
+{
+    listEntries.clear();
+}
@@ -0,0 +1,54 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKCACHE_H
+#define BITCOIN_BLOCKCACHE_H
+
+#include "uint256.h"
+
+#include <list>
+
+#include <boost/shared_ptr.hpp>
+
+class CBlock;
+class CBlockUndo;
+
+/**
+ * The most recently connected blocks and their undo data, kept in memory so that
+ * disconnecting them in a reorganization does not have to read and checksum them
+ * from disk again. Entries are shared, so one evicted while in use stays valid.
+ */
+class CRecentBlockCache
+{
+private:
+    struct CEntry
+    {
+        uint256 hash;
+        boost::shared_ptr<const CBlock> pblock;
+        boost::shared_ptr<const CBlockUndo> pundo;
+    };
+
+    //! Most recently added first
+    std::list<CEntry> listEntries;
+    size_t nMaxBlocks;
+
+    std::list<CEntry>::const_iterator Find(const uint256& hash) const;
+
+public:
+    CRecentBlockCache(size_t nMaxBlocksIn) : nMaxBlocks(nMaxBlocksIn) {}
+
+    void SetMaxBlocks(size_t nMaxBlocksIn);
+
+    /** Remember a connected block and its undo data, evicting the oldest entry if full. */
+    void Add(const uint256& hash, const boost::shared_ptr<const CBlock>& pblock, const boost::shared_ptr<const CBlockUndo>& pundo);
+
+    /** Look up a block, or its undo data. Returns an empty pointer if not cached. */
+    boost::shared_ptr<const CBlock> GetBlock(const uint256& hash) const;
+    boost::shared_ptr<const CBlockUndo> GetUndo(const uint256& hash) const;
+
+    void Clear();
+    size_t size() const { return listEntries.size(); }
+};
+
+#endif // BITCOIN_BLOCKCACHE_H
@@ -0,0 +1,164 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockencodings.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "hash.h"
+#include "random.h"
+#include "streams.h"
+#include "txmempool.h"
+#include "util.h"
+#include "version.h"
+
+#include <boost/unordered_map.hpp>
+
+/** Smallest possible serialized transaction, used to bound the transaction count of a compact block. */
+static const unsigned int MIN_TRANSACTION_SIZE = 60;
+
+struct ShortIDHasher
+{
+    size_t operator()(uint64_t nShortID) const { return nShortID; }
+};
+
+CBlockHeaderAndShortTxIDs::CBlockHeaderAndShortTxIDs(const CBlock& block) :
+        nonce(GetRand(std::numeric_limits<uint64_t>::max())),
+        header(block.GetBlockHeader())
+{
+    FillShortTxIDSelector();
+    // Always send the coinbase, which the receiver cannot have in its memory pool
+    if (!block.vtx.empty()) {
+        prefilledtxn.resize(1);
+        prefilledtxn[0].index = 0;
+        prefilledtxn[0].tx = block.vtx[0];
+    }
+    shorttxids.reserve(block.vtx.size() > 0 ? block.vtx.size() - 1 : 0);
+    for (size_t i = 1; i < block.vtx.size(); i++)
+        shorttxids.push_back(GetShortID(block.vtx[i].GetHash()));
+}
+
+void CBlockHeaderAndShortTxIDs::FillShortTxIDSelector() const
+{
+    // The SipHash keys are the first two little-endian words of the single
+    // SHA256 of the serialized header and nonce
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    stream << header << nonce;
+    unsigned char hash[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write((const unsigned char*)&stream[0], stream.size()).Finalize(hash);
+    shorttxidk0 = ReadLE64(hash);
+    shorttxidk1 = ReadLE64(hash + 8);
+}
+
+uint64_t CBlockHeaderAndShortTxIDs::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(shorttxidk0, shorttxidk1, txhash) & 0xffffffffffffULL;
+}
+
+ReadStatus PartiallyDownloadedBlock::InitData(const CBlockHeaderAndShortTxIDs& cmpctblock)
+{
+    if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
+        return READ_STATUS_INVALID;
+    if (cmpctblock.BlockTxCount() > MAX_BLOCK_SIZE / MIN_TRANSACTION_SIZE)
+        return READ_STATUS_INVALID;
+
+    assert(header.IsNull() && txn_available.empty());
+    header = cmpctblock.header;
+    txn_available.resize(cmpctblock.BlockTxCount());
+    vHave.assign(cmpctblock.BlockTxCount(), false);
+
+    int32_t lastprefilledindex = -1;
+    for (size_t i = 0; i < cmpctblock.prefilledtxn.size(); i++) {
+        const PrefilledTransaction& prefilled = cmpctblock.prefilledtxn[i];
+        if (prefilled.tx.IsNull())
+            return READ_STATUS_INVALID;
+        // Prefilled transactions must be sent in increasing index order
+        if ((int32_t)prefilled.index <= lastprefilledindex || prefilled.index >= txn_available.size())
+            return READ_STATUS_INVALID;
+        lastprefilledindex = prefilled.index;
+        txn_available[prefilled.index] = prefilled.tx;
+        vHave[prefilled.index] = true;
+    }
+
+    // Map each short ID to its slot in the block, skipping over the prefilled ones
+    boost::unordered_map<uint64_t, uint16_t, ShortIDHasher> mapShortIDs;
+    mapShortIDs.rehash(cmpctblock.shorttxids.size());
+    uint16_t nIndexOffset = 0;
+    for (size_t i = 0; i < cmpctblock.shorttxids.size(); i++) {
+        while (vHave[i + nIndexOffset])
+            nIndexOffset++;
+        if (!mapShortIDs.insert(std::make_pair(cmpctblock.shorttxids[i], i + nIndexOffset)).second) {
+            // Two transactions of the block share a short ID; we cannot tell them apart
+            return READ_STATUS_FAILED;
+        }
+    }
+
+    std::vector<bool> vFromPool(txn_available.size(), false);
+    {
+        LOCK(pool->cs);
+        for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = pool->mapTx.begin(); it != pool->mapTx.end(); ++it) {
+            boost::unordered_map<uint64_t, uint16_t, ShortIDHasher>::iterator idit = mapShortIDs.find(cmpctblock.GetShortID(it->first));
+            if (idit == mapShortIDs.end())
+                continue;
+            uint16_t nIndex = idit->second;
+            if (!vHave[nIndex]) {
+                txn_available[nIndex] = it->second.GetTx();
+                vHave[nIndex] = true;
+                vFromPool[nIndex] = true;
+            } else if (vFromPool[nIndex]) {
+                // Two memory pool transactions match the same short ID; request the slot
+                // from the peer instead of guessing.
+                txn_available[nIndex] = CTransaction();
+                vHave[nIndex] = false;
+                vFromPool[nIndex] = false;
+                mapShortIDs.erase(idit);
+            }
+        }
+    }
+
+    LogPrint("cmpctblock", "Initialized PartiallyDownloadedBlock for block %s using a cmpctblock of size %lu\n",
+        cmpctblock.header.GetHash().ToString(), ::GetSerializeSize(cmpctblock, SER_NETWORK, PROTOCOL_VERSION));
+
+    return READ_STATUS_OK;
+}
+
+bool PartiallyDownloadedBlock::IsTxAvailable(size_t index) const
+{
+    assert(!header.IsNull());
+    assert(index < vHave.size());
+    return vHave[index];
+}
+
+ReadStatus PartiallyDownloadedBlock::FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing) const
+{
+    assert(!header.IsNull());
+    block = header;
+    block.vtx.resize(txn_available.size());
+
+    size_t nTxMissingOffset = 0;
+    size_t nPrefilledOrPool = 0;
+    for (size_t i = 0; i < txn_available.size(); i++) {
+        if (vHave[i]) {
+            block.vtx[i] = txn_available[i];
+            nPrefilledOrPool++;
+        } else {
+            if (nTxMissingOffset >= vtx_missing.size())
+                return READ_STATUS_INVALID;
+            block.vtx[i] = vtx_missing[nTxMissingOffset++];
+        }
+    }
+    if (nTxMissingOffset != vtx_missing.size())
+        return READ_STATUS_INVALID;
+
+    // A short ID collision with a memory pool transaction shows up as a wrong merkle
+    // root. That is not the peer's fault, so the caller should fetch the full block.
+    bool fMutated = false;
+    if (block.BuildMerkleTree(&fMutated) != header.hashMerkleRoot || fMutated)
+        return READ_STATUS_FAILED;
+
+    LogPrint("cmpctblock", "Successfully reconstructed block %s with %lu txn prefilled or from mempool, %lu txn requested\n",
+        header.GetHash().ToString(), nPrefilledOrPool, vtx_missing.size());
+
+    return READ_STATUS_OK;
+}
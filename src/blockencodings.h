@@ -0,0 +1,218 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKENCODINGS_H
+#define BITCOIN_BLOCKENCODINGS_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <ios>
+#include <limits>
+#include <vector>
+
+class CTxMemPool;
+
+/** Serialize a vector of transaction indexes as compact sizes, each relative to the previous one. */
+template <typename Stream>
+void SerializeDifferentialIndexes(Stream& s, const std::vector<uint16_t>& vIndexes)
+{
+    WriteCompactSize(s, vIndexes.size());
+    for (size_t i = 0; i < vIndexes.size(); i++) {
+        uint64_t nDiff = vIndexes[i] - (i == 0 ? 0 : (vIndexes[i - 1] + 1));
+        WriteCompactSize(s, nDiff);
+    }
+}
+
+template <typename Stream>
+void UnserializeDifferentialIndexes(Stream& s, std::vector<uint16_t>& vIndexes)
+{
+    uint64_t nCount = ReadCompactSize(s);
+    vIndexes.clear();
+    uint64_t nOffset = 0;
+    for (uint64_t i = 0; i < nCount; i++) {
+        // Grow as we read, so a bogus count cannot make us allocate a huge vector up front.
+        uint64_t nIndex = ReadCompactSize(s) + nOffset;
+        if (nIndex > std::numeric_limits<uint16_t>::max())
+            throw std::ios_base::failure("differential index overflowed 16 bits");
+        vIndexes.push_back(nIndex);
+        nOffset = nIndex + 1;
+    }
+}
+
+/**
+ * A transaction sent along with a compact block. The index is its absolute
+ * position in the block; on the wire it is sent relative to the previous
+ * prefilled transaction, as part of CBlockHeaderAndShortTxIDs.
+ */
+struct PrefilledTransaction
+{
+    uint16_t index;
+    CTransaction tx;
+};
+
+/**
+ * A block announced as its header plus 6-byte short IDs of its transactions.
+ * The receiver reconstructs it from its own memory pool and only fetches the
+ * transactions it does not have. Short IDs are salted with the header and a
+ * random nonce, so collisions cannot be prepared in advance and differ per peer.
+ * This is the "cmpctblock" message of BIP 152.
+ */
+class CBlockHeaderAndShortTxIDs
+{
+private:
+    //! Memory only: the SipHash keys derived from header and nonce
+    mutable uint64_t shorttxidk0, shorttxidk1;
+    uint64_t nonce;
+
+    void FillShortTxIDSelector() const;
+
+public:
+    static const int SHORTTXIDS_LENGTH = 6;
+
+    CBlockHeader header;
+    std::vector<uint64_t> shorttxids;
+    std::vector<PrefilledTransaction> prefilledtxn;
+
+    //! Dummy for deserialization
+    CBlockHeaderAndShortTxIDs() : shorttxidk0(0), shorttxidk1(0), nonce(0) {}
+
+    //! Build the compact encoding of a block; only the coinbase is prefilled.
+    CBlockHeaderAndShortTxIDs(const CBlock& block);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    size_t BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        ::Serialize(s, header, nType, nVersion);
+        ::Serialize(s, nonce, nType, nVersion);
+        WriteCompactSize(s, shorttxids.size());
+        for (size_t i = 0; i < shorttxids.size(); i++) {
+            uint32_t nLSB = shorttxids[i] & 0xffffffff;
+            uint16_t nMSB = (shorttxids[i] >> 32) & 0xffff;
+            ::Serialize(s, nLSB, nType, nVersion);
+            ::Serialize(s, nMSB, nType, nVersion);
+        }
+        WriteCompactSize(s, prefilledtxn.size());
+        for (size_t i = 0; i < prefilledtxn.size(); i++) {
+            uint64_t nDiff = prefilledtxn[i].index - (i == 0 ? 0 : (prefilledtxn[i - 1].index + 1));
+            WriteCompactSize(s, nDiff);
+            ::Serialize(s, prefilledtxn[i].tx, nType, nVersion);
+        }
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        ::Unserialize(s, header, nType, nVersion);
+        ::Unserialize(s, nonce, nType, nVersion);
+        uint64_t nShortTxIDs = ReadCompactSize(s);
+        shorttxids.clear();
+        // Grow as we read, so a bogus count cannot make us allocate a huge vector up front.
+        for (uint64_t i = 0; i < nShortTxIDs; i++) {
+            uint32_t nLSB = 0;
+            uint16_t nMSB = 0;
+            ::Unserialize(s, nLSB, nType, nVersion);
+            ::Unserialize(s, nMSB, nType, nVersion);
+            shorttxids.push_back((uint64_t(nMSB) << 32) | uint64_t(nLSB));
+        }
+        uint64_t nPrefilled = ReadCompactSize(s);
+        prefilledtxn.clear();
+        uint64_t nOffset = 0;
+        for (uint64_t i = 0; i < nPrefilled; i++) {
+            uint64_t nIndex = ReadCompactSize(s) + nOffset;
+            if (nIndex > std::numeric_limits<uint16_t>::max())
+                throw std::ios_base::failure("prefilled index overflowed 16 bits");
+            prefilledtxn.push_back(PrefilledTransaction());
+            prefilledtxn.back().index = nIndex;
+            ::Unserialize(s, prefilledtxn.back().tx, nType, nVersion);
+            nOffset = nIndex + 1;
+        }
+        FillShortTxIDSelector();
+    }
+};
+
+/** Request for the transactions of a compact block that could not be found locally. */
+class BlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    //! Indexes into the block, serialized differentially
+    std::vector<uint16_t> indexes;
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        CSizeComputer s(nType, nVersion);
+        Serialize(s, nType, nVersion);
+        return s.size();
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        ::Serialize(s, blockhash, nType, nVersion);
+        SerializeDifferentialIndexes(s, indexes);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        ::Unserialize(s, blockhash, nType, nVersion);
+        UnserializeDifferentialIndexes(s, indexes);
+    }
+};
+
+/** Response to a BlockTransactionsRequest, in the order the indexes were requested. */
+class BlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    BlockTransactions() {}
+    BlockTransactions(const BlockTransactionsRequest& req) :
+        blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(blockhash);
+        READWRITE(txn);
+    }
+};
+
+enum ReadStatus {
+    READ_STATUS_OK,
+    READ_STATUS_INVALID, //!< Invalid object, peer is sending bogus data
+    READ_STATUS_FAILED,  //!< Failed to process object (e.g. short ID collision), fall back to a full block
+};
+
+/** A compact block being reconstructed from the memory pool and any transactions fetched from the peer. */
+class PartiallyDownloadedBlock
+{
+private:
+    std::vector<CTransaction> txn_available;
+    std::vector<bool> vHave;
+    CTxMemPool* pool;
+
+public:
+    CBlockHeader header;
+
+    PartiallyDownloadedBlock(CTxMemPool* poolIn) : pool(poolIn) {}
+
+    //! Match the short IDs against the memory pool. Takes pool->cs.
+    ReadStatus InitData(const CBlockHeaderAndShortTxIDs& cmpctblock);
+    bool IsTxAvailable(size_t index) const;
+    size_t GetTxCount() const { return txn_available.size(); }
+    //! Assemble the block using vtx_missing for the unavailable slots, in order, and verify its merkle root.
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtx_missing) const;
+};
+
+#endif // BITCOIN_BLOCKENCODINGS_H
@@ -0,0 +1,115 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilemap.h"
+
+#include "util.h"
+
+#include <algorithm>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+CMappedFile::~CMappedFile()
+{
+#ifndef WIN32
+    munmap((void*)pdata, nSize);
+#endif
+}
+
+CMappedFile* CMappedFile::Open(const boost::filesystem::path& path)
+{
+#ifndef WIN32
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping keeps its own reference to the file
+    close(fd);
+    if (p == MAP_FAILED) {
+        LogPrintf("Unable to map file %s\n", path.string());
+        return NULL;
+    }
+    // Blocks are read one at a time from anywhere in the file, so readahead of
+    // the surrounding data is mostly wasted; WillNeed() asks for what is used.
+    madvise(p, st.st_size, MADV_RANDOM);
+    return new CMappedFile((const char*)p, st.st_size);
+#else
+    return NULL;
+#endif
+}
+
+void CMappedFile::WillNeed(size_t nPos, size_t nLength) const
+{
+#ifndef WIN32
+    static const size_t nPageSize = sysconf(_SC_PAGESIZE);
+    if (nPos >= nSize)
+        return;
+    size_t nStart = nPos - nPos % nPageSize;
+    size_t nEnd = std::min(nPos + nLength, nSize);
+    madvise((void*)(pdata + nStart), nEnd - nStart, MADV_WILLNEED);
+#endif
+}
+
+boost::shared_ptr<CMappedFile> CBlockFileMapper::Get(const boost::filesystem::path& path, size_t nMinSize)
+{
+    boost::shared_ptr<CMappedFile> pmapped;
+    if (nMaxFiles == 0)
+        return pmapped;
+
+    LOCK(cs);
+    const std::string strPath = path.string();
+    std::map<std::string, MappingList::iterator>::iterator it = mapMapped.find(strPath);
+    if (it != mapMapped.end()) {
+        pmapped = it->second->second;
+        listMapped.erase(it->second);
+        mapMapped.erase(it);
+        // The file grew since it was mapped; map it again below.
+        if (pmapped->size() < nMinSize)
+            pmapped.reset();
+    }
+
+    if (!pmapped) {
+        CMappedFile* pnew = CMappedFile::Open(path);
+        if (pnew == NULL)
+            return pmapped;
+        pmapped.reset(pnew);
+        if (pmapped->size() < nMinSize)
+            return boost::shared_ptr<CMappedFile>();
+    }
+
+    listMapped.push_front(std::make_pair(strPath, pmapped));
+    mapMapped[strPath] = listMapped.begin();
+    while (listMapped.size() > nMaxFiles) {
+        mapMapped.erase(listMapped.back().first);
+        listMapped.pop_back();
+    }
+    return pmapped;
+}
+
+void CBlockFileMapper::Forget(const boost::filesystem::path& path)
+{
+    LOCK(cs);
+    std::map<std::string, MappingList::iterator>::iterator it = mapMapped.find(path.string());
+    if (it != mapMapped.end()) {
+        listMapped.erase(it->second);
+        mapMapped.erase(it);
+    }
+}
+
+void CBlockFileMapper::Clear()
+{
+    LOCK(cs);
+    mapMapped.clear();
+    listMapped.clear();
+}
@@ -0,0 +1,80 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_BLOCKFILEMAP_H
+#define BITCOIN_BLOCKFILEMAP_H
+
+#include "sync.h"
+
+#include <list>
+#include <map>
+#include <string>
+#include <utility>
+
+#include <boost/filesystem/path.hpp>
+#include <boost/shared_ptr.hpp>
+
+/** A read-only memory mapping of a whole block or undo file. */
+class CMappedFile
+{
+private:
+    // Disallow copies
+    CMappedFile(const CMappedFile&);
+    CMappedFile& operator=(const CMappedFile&);
+
+    const char* pdata;
+    size_t nSize;
+
+public:
+    CMappedFile(const char* pdataIn, size_t nSizeIn) : pdata(pdataIn), nSize(nSizeIn) {}
+    ~CMappedFile();
+
+    /** Open and map a file. Returns NULL if it does not exist, is empty, or cannot be mapped. */
+    static CMappedFile* Open(const boost::filesystem::path& path);
+
+    const char* data() const { return pdata; }
+    size_t size() const { return nSize; }
+
+    /** Hint the kernel to start reading [nPos, nPos + nLength) in. */
+    void WillNeed(size_t nPos, size_t nLength) const;
+};
+
+/**
+ * Cache of read-only mappings of blk?????.dat and rev?????.dat files.
+ *
+ * Reading a block through a mapping avoids opening, seeking and reading the
+ * file with a copy through stdio on every call. Mappings are shared, so one
+ * evicted while a reader still uses it stays valid until that reader is done.
+ * Block files only grow, and a mapping too short for a position is replaced
+ * by one covering the current file size.
+ */
+class CBlockFileMapper
+{
+private:
+    typedef std::list<std::pair<std::string, boost::shared_ptr<CMappedFile> > > MappingList;
+
+    CCriticalSection cs;
+    //! Most recently used first
+    MappingList listMapped;
+    std::map<std::string, MappingList::iterator> mapMapped;
+    size_t nMaxFiles;
+
+public:
+    CBlockFileMapper(size_t nMaxFilesIn) : nMaxFiles(nMaxFilesIn) {}
+
+    /**
+     * Get a mapping of a file that covers at least its first nMinSize bytes.
+     * Returns an empty pointer if mapping is disabled or not possible, in which
+     * case callers should fall back to stdio.
+     */
+    boost::shared_ptr<CMappedFile> Get(const boost::filesystem::path& path, size_t nMinSize);
+
+    /** Drop the mapping of a file, e.g. when it is about to be removed. */
+    void Forget(const boost::filesystem::path& path);
+
+    /** Drop all mappings. */
+    void Clear();
+};
+
+#endif // BITCOIN_BLOCKFILEMAP_H
@@ -7,6 +7,33 @@
 
 using namespace std;
 
+/**
+ * CBlockIndexArena implementation
+ */
+CBlockIndexArena::~CBlockIndexArena() {
+    for (vector<CBlockIndex*>::iterator it = vSlabs.begin(); it != vSlabs.end(); ++it)
+        delete[] *it;
+}
+
+void CBlockIndexArena::Reserve(size_t nCount) {
+    if (nSlabSize - nSlabUsed >= nCount)
+        return;
+    nSlabSize = max(nCount, (size_t)DEFAULT_SLAB_SIZE);
+    nSlabUsed = 0;
+    vSlabs.push_back(new CBlockIndex[nSlabSize]);
+}
+
+CBlockIndex* CBlockIndexArena::Allocate() {
+    Reserve(1);
+    return &vSlabs.back()[nSlabUsed++];
+}
+
+void CBlockIndexArena::swap(CBlockIndexArena& other) {
+    vSlabs.swap(other.vSlabs);
+    std::swap(nSlabSize, other.nSlabSize);
+    std::swap(nSlabUsed, other.nSlabUsed);
+}
+
 /**
  * CChain implementation
  */
@@ -95,8 +95,10 @@ enum BlockStatus {
 class CBlockIndex
 {
 public:
-    //! pointer to the hash of the block, if any. memory is owned by this CBlockIndex
-    const uint256* phashBlock;
+    // The fields used when walking and comparing chains (GetAncestor, FindFork,
+    // FindMostWorkChain, CBlockIndexWorkComparator) come first, next to each other:
+    // 64 bytes on 64-bit platforms. Entries are not cache line aligned, so these
+    // fields span one or two cache lines rather than being spread over the entry.
 
     //! pointer to the index of the predecessor of this block
     CBlockIndex* pprev;
@@ -104,9 +106,26 @@ public:
     //! pointer to the index of some further predecessor of this block
     CBlockIndex* pskip;
 
+    //! (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
+    uint256 nChainWork;
+
     //! height of the entry in the chain. The genesis block has height 0
     int nHeight;
 
+    //! Verification status of this block. See enum BlockStatus
+    unsigned int nStatus;
+
+    //! (memory only) Number of transactions in the chain up to and including this block.
+    //! This value will be non-zero only if and only if transactions for this block and all its parents are available.
+    //! Change to 64-bit type when necessary; won't happen before 2030
+    unsigned int nChainTx;
+
+    //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
+    uint32_t nSequenceId;
+
+    //! pointer to the hash of the block, if any. memory is owned by this CBlockIndex
+    const uint256* phashBlock;
+
     //! Which # file this block is stored in (blk?????.dat)
     int nFile;
 
@@ -116,21 +135,10 @@ public:
     //! Byte offset within rev?????.dat where this block's undo data is stored
     unsigned int nUndoPos;
 
-    //! (memory only) Total amount of work (expected number of hashes) in the chain up to and including this block
-    uint256 nChainWork;
-
     //! Number of transactions in this block.
     //! Note: in a potential headers-first mode, this number cannot be relied upon
     unsigned int nTx;
 
-    //! (memory only) Number of transactions in the chain up to and including this block.
-    //! This value will be non-zero only if and only if transactions for this block and all its parents are available.
-    //! Change to 64-bit type when necessary; won't happen before 2030
-    unsigned int nChainTx;
-
-    //! Verification status of this block. See enum BlockStatus
-    unsigned int nStatus;
-
     //! block header
     int nVersion;
     uint256 hashMerkleRoot;
@@ -138,9 +146,6 @@ public:
     unsigned int nBits;
     unsigned int nNonce;
 
-    //! (memory only) Sequential id assigned to distinguish order in which blocks are received.
-    uint32_t nSequenceId;
-
     void SetNull()
     {
         phashBlock = NULL;
@@ -288,6 +293,40 @@ public:
     const CBlockIndex* GetAncestor(int height) const;
 };
 
+/**
+ * Allocator for CBlockIndex objects. Entries are handed out from large contiguous slabs
+ * instead of being allocated one by one, so entries allocated together (e.g. when loading
+ * the block index in height order) are close in memory. They are only freed all together,
+ * when the arena is destroyed.
+ */
+class CBlockIndexArena
+{
+private:
+    // Disallow copies
+    CBlockIndexArena(const CBlockIndexArena&);
+    CBlockIndexArena& operator=(const CBlockIndexArena&);
+
+    std::vector<CBlockIndex*> vSlabs;
+    //! Number of entries in the last slab, and how many of them are in use
+    size_t nSlabSize;
+    size_t nSlabUsed;
+
+public:
+    static const size_t DEFAULT_SLAB_SIZE = 4096;
+
+    CBlockIndexArena() : nSlabSize(0), nSlabUsed(0) {}
+    ~CBlockIndexArena();
+
+    //! Make sure the next nCount allocations come from one slab
+    void Reserve(size_t nCount);
+
+    //! Get a new entry, in the state of a default-constructed CBlockIndex
+    CBlockIndex* Allocate();
+
+    //! Exchange all entries with another arena
+    void swap(CBlockIndexArena& other);
+};
+
 /** Used to marshal pointers into hashes for db storage. */
 class CDiskBlockIndex : public CBlockIndex
 {
@@ -4,6 +4,7 @@
 
 #include "coins.h"
 
+#include "hash.h"
 #include "random.h"
 
 #include <assert.h>
@@ -260,3 +261,40 @@ CCoinsModifier::~CCoinsModifier()
         cache.cacheCoins.erase(it);
     }
 }
+
+uint256 CCoinsSetHash::GetOutputHash(const COutPoint &outpoint, const CTxOut &out)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << outpoint << out;
+    return ss.GetHash();
+}
+
+void CCoinsSetHash::Add(const COutPoint &outpoint, const CTxOut &out)
+{
+    hash += GetOutputHash(outpoint, out);
+    nOutputs++;
+    nAmount += out.nValue;
+}
+
+void CCoinsSetHash::Remove(const COutPoint &outpoint, const CTxOut &out)
+{
+    hash -= GetOutputHash(outpoint, out);
+    nOutputs--;
+    nAmount -= out.nValue;
+}
+
+CCoinsSetHash& CCoinsSetHash::operator+=(const CCoinsSetHash &other)
+{
+    hash += other.hash;
+    nOutputs += other.nOutputs;
+    nAmount += other.nAmount;
+    return *this;
+}
+
+CCoinsSetHash& CCoinsSetHash::operator-=(const CCoinsSetHash &other)
+{
+    hash -= other.hash;
+    nOutputs -= other.nOutputs;
+    nAmount -= other.nAmount;
+    return *this;
+}
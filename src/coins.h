@@ -291,6 +291,39 @@ struct CCoinsCacheEntry
 
 typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
 
+/**
+ * Order-independent digest of a set of unspent outputs, with their number and total value.
+ *
+ * The hash is the sum, modulo 2^256, of a hash of each output and its outpoint. Outputs can be
+ * added and removed in any order, and digests of disjoint sets can be added together, so the
+ * digest of the whole UTXO set can be kept up to date block by block or computed in parallel.
+ * It is meant for comparing UTXO sets between nodes, not as a commitment resistant to
+ * deliberately constructed collisions.
+ */
+class CCoinsSetHash
+{
+private:
+    uint256 hash;
+    int64_t nOutputs;
+    CAmount nAmount;
+
+    static uint256 GetOutputHash(const COutPoint &outpoint, const CTxOut &out);
+
+public:
+    CCoinsSetHash() : hash(0), nOutputs(0), nAmount(0) {}
+    CCoinsSetHash(const uint256 &hashIn, int64_t nOutputsIn, CAmount nAmountIn) : hash(hashIn), nOutputs(nOutputsIn), nAmount(nAmountIn) {}
+
+    void Add(const COutPoint &outpoint, const CTxOut &out);
+    void Remove(const COutPoint &outpoint, const CTxOut &out);
+
+    CCoinsSetHash& operator+=(const CCoinsSetHash &other);
+    CCoinsSetHash& operator-=(const CCoinsSetHash &other);
+
+    const uint256& GetHash() const { return hash; }
+    int64_t GetOutputs() const { return nOutputs; }
+    CAmount GetAmount() const { return nAmount; }
+};
+
 struct CCoinsStats
 {
     int nHeight;
@@ -300,8 +333,9 @@ struct CCoinsStats
     uint64_t nSerializedSize;
     uint256 hashSerialized;
     CAmount nTotalAmount;
+    uint256 hashSet; //! See CCoinsSetHash
 
-    CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0) {}
+    CCoinsStats() : nHeight(0), hashBlock(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), hashSerialized(0), nTotalAmount(0), hashSet(0) {}
 };
 
 
@@ -0,0 +1,247 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinselection.h"
+
+#include "random.h"
+#include "util.h"
+#include "utilmoneystr.h"
+
+#include <algorithm>
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+namespace {
+
+struct CompareValueOnly
+{
+    bool operator()(const CInputCoin& t1, const CInputCoin& t2) const
+    {
+        return t1.first < t2.first;
+    }
+};
+
+/**
+ * Depth first search for coins adding up to exactly nTargetValue, among
+ * nCoins coins sorted largest first. pnSuffix[i] is the total of
+ * pcoins[i..nCoins), and pnSuffix[nCoins] is 0.
+ */
+bool SearchExactSubset(const CInputCoin* pcoins, const CAmount* pnSuffix, size_t nCoins, const CAmount& nTargetValue,
+                       vector<char>& vfSelected, unsigned int nMaxTries)
+{
+    // Indices of the coins included on the current branch, in increasing order
+    vector<size_t> vIncluded;
+    CAmount nValue = 0;
+    // Next coin to decide on; all coins from here on are still undecided
+    size_t i = 0;
+
+    for (unsigned int nTries = 0; nTries < nMaxTries; nTries++)
+    {
+        if (nValue == nTargetValue)
+        {
+            vfSelected.assign(nCoins, false);
+            BOOST_FOREACH(size_t j, vIncluded)
+                vfSelected[j] = true;
+            return true;
+        }
+
+        if (nValue > nTargetValue || nValue + pnSuffix[i] < nTargetValue)
+        {
+            // Dead end: leave out the last coin included, and go on after it
+            if (vIncluded.empty())
+                return false;
+            size_t j = vIncluded.back();
+            vIncluded.pop_back();
+            nValue -= pcoins[j].first;
+            i = j + 1;
+            continue;
+        }
+
+        // A coin worth the same as the previous one, which was left out,
+        // would only lead to the totals already tried without that one
+        if (i > 0 && pcoins[i].first == pcoins[i - 1].first && (vIncluded.empty() || vIncluded.back() != i - 1))
+        {
+            i++;
+            continue;
+        }
+
+        vIncluded.push_back(i);
+        nValue += pcoins[i].first;
+        i++;
+    }
+    return false;
+}
+
+}
+
+bool SelectCoinsBnB(const vector<CInputCoin>& vValue, const CAmount& nTargetValue, vector<char>& vfSelected, unsigned int nMaxTries)
+{
+    vector<CAmount> vSuffix(vValue.size() + 1, 0);
+    for (size_t i = vValue.size(); i > 0; i--)
+        vSuffix[i - 1] = vSuffix[i] + vValue[i - 1].first;
+    if (vValue.empty())
+        return false;
+    return SearchExactSubset(&vValue[0], &vSuffix[0], vValue.size(), nTargetValue, vfSelected, nMaxTries);
+}
+
+void ApproximateBestSubset(const vector<CInputCoin>& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
+                           vector<char>& vfBest, CAmount& nBest, int iterations)
+{
+    vector<char> vfIncluded;
+
+    vfBest.assign(vValue.size(), true);
+    nBest = nTotalLower;
+
+    seed_insecure_rand();
+
+    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
+    {
+        vfIncluded.assign(vValue.size(), false);
+        CAmount nTotal = 0;
+        bool fReachedTarget = false;
+        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
+        {
+            for (unsigned int i = 0; i < vValue.size(); i++)
+            {
+                //The solver here uses a randomized algorithm,
+                //the randomness serves no real security purpose but is just
+                //needed to prevent degenerate behavior and it is important
+                //that the rng is fast. We do not use a constant random sequence,
+                //because there may be some privacy improvement by making
+                //the selection random.
+                if (nPass == 0 ? insecure_rand()&1 : !vfIncluded[i])
+                {
+                    nTotal += vValue[i].first;
+                    vfIncluded[i] = true;
+                    if (nTotal >= nTargetValue)
+                    {
+                        fReachedTarget = true;
+                        if (nTotal < nBest)
+                        {
+                            nBest = nTotal;
+                            vfBest = vfIncluded;
+                        }
+                        nTotal -= vValue[i].first;
+                        vfIncluded[i] = false;
+                    }
+                }
+            }
+        }
+    }
+}
+
+CCoinSelectionPool::CCoinSelectionPool(const vector<CInputCoin>& vCoinsIn) : vCoins(vCoinsIn)
+{
+    // Shuffle first, so that which of several equal coins gets picked is random
+    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    sort(vCoins.rbegin(), vCoins.rend(), CompareValueOnly());
+
+    vSuffixTotal.assign(vCoins.size() + 1, 0);
+    for (size_t i = vCoins.size(); i > 0; i--)
+        vSuffixTotal[i - 1] = vSuffixTotal[i] + vCoins[i - 1].first;
+}
+
+bool CCoinSelectionPool::Select(const CAmount& nTargetValue, set<pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const
+{
+    setCoinsRet.clear();
+    nValueRet = 0;
+
+    const size_t nCoins = vCoins.size();
+    // First coin worth less than target + CENT; coins before it are "larger", from it on "lower"
+    const CInputCoin coinLower(nTargetValue + CENT, make_pair((const CWalletTx*)NULL, 0U));
+    const size_t nLower = lower_bound(vCoins.rbegin(), vCoins.rend(), coinLower, CompareValueOnly()).base() - vCoins.begin();
+    // ... and first coin worth no more than the target
+    const CInputCoin coinTarget(nTargetValue, make_pair((const CWalletTx*)NULL, 0U));
+    const size_t nAtMost = upper_bound(vCoins.rbegin(), vCoins.rend(), coinTarget, CompareValueOnly()).base() - vCoins.begin();
+
+    if (nAtMost < nCoins && vCoins[nAtMost].first == nTargetValue)
+    {
+        setCoinsRet.insert(vCoins[nAtMost].second);
+        nValueRet += vCoins[nAtMost].first;
+        return true;
+    }
+
+    const CInputCoin* pcoinLowestLarger = nLower > 0 ? &vCoins[nLower - 1] : NULL;
+    const CAmount nTotalLower = vSuffixTotal[nLower];
+
+    if (nTotalLower == nTargetValue)
+    {
+        for (size_t i = nLower; i < nCoins; i++)
+        {
+            setCoinsRet.insert(vCoins[i].second);
+            nValueRet += vCoins[i].first;
+        }
+        return true;
+    }
+
+    if (nTotalLower < nTargetValue)
+    {
+        if (pcoinLowestLarger == NULL)
+            return false;
+        setCoinsRet.insert(pcoinLowestLarger->second);
+        nValueRet += pcoinLowestLarger->first;
+        return true;
+    }
+
+    // Look for an exact match, which needs no change at all
+    vector<char> vfBest;
+    if (SearchExactSubset(&vCoins[nLower], &vSuffixTotal[nLower], nCoins - nLower, nTargetValue, vfBest, MAX_BNB_TRIES))
+    {
+        for (size_t i = 0; i < vfBest.size(); i++)
+            if (vfBest[i])
+            {
+                setCoinsRet.insert(vCoins[nLower + i].second);
+                nValueRet += vCoins[nLower + i].first;
+            }
+        LogPrint("selectcoins", "SelectCoins() exact subset of %u coins: total %s\n", setCoinsRet.size(), FormatMoney(nValueRet));
+        return true;
+    }
+
+    // Solve subset sum by stochastic approximation. With many small coins,
+    // only search the largest of them: enough to reach target + CENT, and
+    // at least MAX_SUBSET_SEARCH_COINS.
+    size_t nEnd = nCoins;
+    if (nCoins - nLower > MAX_SUBSET_SEARCH_COINS)
+    {
+        // Smallest nEnd with vSuffixTotal[nLower] - vSuffixTotal[nEnd] >= nTargetValue + CENT
+        const CAmount nMaxSuffix = nTotalLower - (nTargetValue + CENT);
+        if (nMaxSuffix >= 0)
+            nEnd = lower_bound(vSuffixTotal.begin() + nLower, vSuffixTotal.end(), nMaxSuffix, greater<CAmount>()) - vSuffixTotal.begin();
+        nEnd = min(nCoins, max(nEnd, nLower + MAX_SUBSET_SEARCH_COINS));
+    }
+    const vector<CInputCoin> vValue(vCoins.begin() + nLower, vCoins.begin() + nEnd);
+    const CAmount nTotalSearched = nTotalLower - vSuffixTotal[nEnd];
+
+    CAmount nBest;
+    ApproximateBestSubset(vValue, nTotalSearched, nTargetValue, vfBest, nBest, 1000);
+    if (nBest != nTargetValue && nTotalSearched >= nTargetValue + CENT)
+        ApproximateBestSubset(vValue, nTotalSearched, nTargetValue + CENT, vfBest, nBest, 1000);
+
+    // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
+    //                                   or the next bigger coin is closer), return the bigger coin
+    if (pcoinLowestLarger &&
+        ((nBest != nTargetValue && nBest < nTargetValue + CENT) || pcoinLowestLarger->first <= nBest))
+    {
+        setCoinsRet.insert(pcoinLowestLarger->second);
+        nValueRet += pcoinLowestLarger->first;
+    }
+    else {
+        for (unsigned int i = 0; i < vValue.size(); i++)
+            if (vfBest[i])
+            {
+                setCoinsRet.insert(vValue[i].second);
+                nValueRet += vValue[i].first;
+            }
+
+        LogPrint("selectcoins", "SelectCoins() best subset: ");
+        for (unsigned int i = 0; i < vValue.size(); i++)
+            if (vfBest[i])
+                LogPrint("selectcoins", "%s ", FormatMoney(vValue[i].first));
+        LogPrint("selectcoins", "total %s\n", FormatMoney(nBest));
+    }
+
+    return true;
+}
@@ -0,0 +1,70 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COINSELECTION_H
+#define BITCOIN_COINSELECTION_H
+
+#include "amount.h"
+
+#include <set>
+#include <utility>
+#include <vector>
+
+class CWalletTx;
+
+//! Maximum number of branches the exact match search visits per selection
+static const unsigned int MAX_BNB_TRIES = 100000;
+//! Number of coins below the target the stochastic subset search is limited to, if they are enough
+static const unsigned int MAX_SUBSET_SEARCH_COINS = 1000;
+
+/** A wallet output that can be selected, with its value. */
+typedef std::pair<CAmount, std::pair<const CWalletTx*, unsigned int> > CInputCoin;
+
+/**
+ * Look for a subset of vValue adding up to exactly nTargetValue, so that no
+ * change output is needed. vValue must be sorted largest first. Branches are
+ * cut as soon as they overshoot the target or can't reach it with the coins
+ * left, and coins equal in value to one just left out are not tried again.
+ * Gives up after nMaxTries branches.
+ */
+bool SelectCoinsBnB(const std::vector<CInputCoin>& vValue, const CAmount& nTargetValue, std::vector<char>& vfSelected,
+                    unsigned int nMaxTries = MAX_BNB_TRIES);
+
+/** Randomized search for the subset of vValue with the smallest total of at least nTargetValue. */
+void ApproximateBestSubset(const std::vector<CInputCoin>& vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
+                           std::vector<char>& vfBest, CAmount& nBest, int iterations = 1000);
+
+/**
+ * The coins one selection may choose from, indexed by value.
+ *
+ * Coins are sorted largest first, once, with the running totals of the
+ * smaller ones, so that where the coins below a target start and how much
+ * they add up to are found by binary search. The same pool serves every
+ * target CreateTransaction tries while it converges on the fee.
+ */
+class CCoinSelectionPool
+{
+private:
+    //! Largest first; coins of equal value in random order
+    std::vector<CInputCoin> vCoins;
+    //! vSuffixTotal[i] is the total value of vCoins[i..], with one extra entry of 0
+    std::vector<CAmount> vSuffixTotal;
+
+public:
+    CCoinSelectionPool() : vSuffixTotal(1, 0) {}
+    explicit CCoinSelectionPool(const std::vector<CInputCoin>& vCoinsIn);
+
+    /**
+     * Choose coins worth at least nTargetValue. Prefers, in order: a single
+     * coin of exactly the target, an exact subset of the smaller coins, the
+     * subset of smaller coins closest to the target plus a cent (so change
+     * isn't dust), and the smallest coin larger than that.
+     */
+    bool Select(const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*, unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+
+    size_t size() const { return vCoins.size(); }
+    CAmount GetTotal() const { return vSuffixTotal[0]; }
+};
+
+#endif // BITCOIN_COINSELECTION_H
@@ -0,0 +1,90 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinsmemory.h"
+
+#include "clientversion.h"
+#include "streams.h"
+#include "txdb.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <boost/bind.hpp>
+
+CCoinsViewMemory::CCoinsViewMemory(CCoinsView* viewIn) : CCoinsViewBacked(viewIn), nSerializedSize(0) { }
+
+void CCoinsViewMemory::Add(const uint256 &txid, const char* pbegin, const char* pend)
+{
+    std::vector<char>& vch = mapSerialized[txid];
+    nSerializedSize -= vch.size();
+    // Build a new vector rather than assigning, to not keep a larger capacity around
+    std::vector<char>(pbegin, pend).swap(vch);
+    nSerializedSize += vch.size();
+}
+
+bool CCoinsViewMemory::Load(const CCoinsViewDB& db)
+{
+    int64_t nStart = GetTimeMillis();
+    LOCK(cs);
+    mapSerialized.clear();
+    nSerializedSize = 0;
+    if (!db.ReadAllCoins(boost::bind(&CCoinsViewMemory::Add, this, _1, _2, _3)))
+        return false;
+    LogPrintf("Loaded %u transactions with unspent outputs (%u bytes) into memory in %dms\n",
+        mapSerialized.size(), nSerializedSize, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool CCoinsViewMemory::GetCoins(const uint256 &txid, CCoins &coins) const
+{
+    LOCK(cs);
+    CCoinsSerializedMap::const_iterator it = mapSerialized.find(txid);
+    if (it == mapSerialized.end())
+        return false;
+    CMemoryReader(&it->second[0], &it->second[0] + it->second.size(), SER_DISK, CLIENT_VERSION) >> coins;
+    return true;
+}
+
+bool CCoinsViewMemory::HaveCoins(const uint256 &txid) const
+{
+    LOCK(cs);
+    return mapSerialized.count(txid) > 0;
+}
+
+bool CCoinsViewMemory::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock)
+{
+    {
+        LOCK(cs);
+        CDataStream ss(SER_DISK, CLIENT_VERSION);
+        for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+            if (!(it->second.flags & CCoinsCacheEntry::DIRTY))
+                continue;
+            if (it->second.coins.IsPruned()) {
+                CCoinsSerializedMap::iterator itOld = mapSerialized.find(it->first);
+                if (itOld != mapSerialized.end()) {
+                    nSerializedSize -= itOld->second.size();
+                    mapSerialized.erase(itOld);
+                }
+            } else {
+                ss.clear();
+                ss << it->second.coins;
+                Add(it->first, &ss[0], &ss[0] + ss.size());
+            }
+        }
+    }
+    // Write through, so the database is complete for the next start
+    return base->BatchWrite(mapCoins, hashBlock);
+}
+
+size_t CCoinsViewMemory::GetCount() const
+{
+    LOCK(cs);
+    return mapSerialized.size();
+}
+
+size_t CCoinsViewMemory::GetSerializedSize() const
+{
+    LOCK(cs);
+    return nSerializedSize;
+}
@@ -0,0 +1,56 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COINSMEMORY_H
+#define BITCOIN_COINSMEMORY_H
+
+#include "coins.h"
+#include "sync.h"
+
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+class CCoinsViewDB;
+
+/**
+ * CCoinsView holding the complete unspent transaction output set in memory.
+ *
+ * The set is read from the coin database once, by Load(), and kept in the
+ * compressed form the database uses, which takes a fraction of the memory of
+ * CCoins objects. Lookups never reach the backing view. Writes update the
+ * in-memory set and are then passed on to the backing view, which stays a
+ * complete copy to start from the next time.
+ */
+class CCoinsViewMemory : public CCoinsViewBacked
+{
+private:
+    typedef boost::unordered_map<uint256, std::vector<char>, CCoinsKeyHasher> CCoinsSerializedMap;
+
+    //! Protects everything below
+    mutable CCriticalSection cs;
+
+    CCoinsSerializedMap mapSerialized;
+    //! Total size of the serialized coins
+    size_t nSerializedSize;
+
+    void Add(const uint256 &txid, const char* pbegin, const char* pend);
+
+public:
+    CCoinsViewMemory(CCoinsView* viewIn);
+
+    //! Read all coins from the coin database; the backing view must not be written meanwhile
+    bool Load(const CCoinsViewDB& db);
+
+    bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    bool HaveCoins(const uint256 &txid) const;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+
+    //! Number of transactions with unspent outputs
+    size_t GetCount() const;
+    //! Total size of the coins as stored
+    size_t GetSerializedSize() const;
+};
+
+#endif // BITCOIN_COINSMEMORY_H
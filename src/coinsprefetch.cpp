@@ -0,0 +1,111 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinsprefetch.h"
+
+#include "primitives/block.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+CCoinsViewPrefetch::CCoinsViewPrefetch(CCoinsView* viewIn, size_t nMaxEntriesIn) :
+    CCoinsViewBacked(viewIn), nGeneration(0), nMaxEntries(nMaxEntriesIn) { }
+
+bool CCoinsViewPrefetch::GetCoins(const uint256 &txid, CCoins &coins) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        CCoinsStagingMap::iterator it = mapStaged.find(txid);
+        if (it != mapStaged.end()) {
+            coins.swap(it->second);
+            mapStaged.erase(it);
+            return true;
+        }
+    }
+    return base->GetCoins(txid, coins);
+}
+
+bool CCoinsViewPrefetch::HaveCoins(const uint256 &txid) const
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (mapStaged.count(txid))
+            return true;
+    }
+    return base->HaveCoins(txid);
+}
+
+bool CCoinsViewPrefetch::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock)
+{
+    // Anything staged, or read while the write is in progress, may be outdated by it.
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        mapStaged.clear();
+        nGeneration++;
+    }
+    bool ret = base->BatchWrite(mapCoins, hashBlock);
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        mapStaged.clear();
+        nGeneration++;
+    }
+    return ret;
+}
+
+void CCoinsViewPrefetch::Prefetch(const CBlock& block)
+{
+    std::set<uint256> setCreated;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+        setCreated.insert(tx.GetHash());
+
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+            if (tx.IsCoinBase())
+                continue;
+            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                const uint256& txid = txin.prevout.hash;
+                if (setCreated.count(txid) || setQueued.count(txid) || mapStaged.count(txid))
+                    continue;
+                if (mapStaged.size() + queueToFetch.size() >= nMaxEntries)
+                    break;
+                queueToFetch.push_back(txid);
+                setQueued.insert(txid);
+            }
+        }
+    }
+    condWork.notify_all();
+}
+
+size_t CCoinsViewPrefetch::GetStagedCount() const
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    return mapStaged.size();
+}
+
+void CCoinsViewPrefetch::Thread()
+{
+    RenameThread("litecoin-prefetch");
+    while (true) {
+        uint256 txid;
+        uint64_t nGenerationRead;
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            while (queueToFetch.empty())
+                condWork.wait(lock);
+            txid = queueToFetch.front();
+            queueToFetch.pop_front();
+            nGenerationRead = nGeneration;
+        }
+
+        CCoins coins;
+        bool fFound = base->GetCoins(txid, coins);
+
+        boost::unique_lock<boost::mutex> lock(cs);
+        setQueued.erase(txid);
+        if (fFound && nGenerationRead == nGeneration)
+            mapStaged[txid].swap(coins);
+    }
+}
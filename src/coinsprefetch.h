@@ -0,0 +1,64 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_COINSPREFETCH_H
+#define BITCOIN_COINSPREFETCH_H
+
+#include "coins.h"
+#include "sync.h"
+
+#include <deque>
+#include <set>
+
+#include <boost/unordered_map.hpp>
+
+class CBlock;
+
+/**
+ * CCoinsView that warms the coins spent by blocks waiting to be connected.
+ *
+ * Prefetch() queues the prevout txids of a block; threads running Thread()
+ * read them from the backing view (in practice the LevelDB coins database)
+ * in parallel and keep the results in a staging area. When the cache on top
+ * misses, the lookup is answered from that staging area instead of disk.
+ *
+ * Staged entries are handed out once, after which the cache on top owns them.
+ * Writes clear the staging area, and reads that overlap a write are thrown
+ * away, so a staged entry is never older than the backing view.
+ */
+class CCoinsViewPrefetch : public CCoinsViewBacked
+{
+private:
+    typedef boost::unordered_map<uint256, CCoins, CCoinsKeyHasher> CCoinsStagingMap;
+
+    //! Protects everything below
+    mutable CWaitableCriticalSection cs;
+    CConditionVariable condWork;
+
+    mutable CCoinsStagingMap mapStaged;
+    std::deque<uint256> queueToFetch;
+    std::set<uint256> setQueued;
+    //! Incremented around every write to the backing view
+    uint64_t nGeneration;
+    //! Maximum number of staged plus queued entries
+    size_t nMaxEntries;
+
+public:
+    CCoinsViewPrefetch(CCoinsView* viewIn, size_t nMaxEntriesIn);
+
+    bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    bool HaveCoins(const uint256 &txid) const;
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+
+    //! Queue the coins spent by a block that are not created by the block itself
+    void Prefetch(const CBlock& block);
+
+    //! Number of entries currently staged
+    size_t GetStagedCount() const;
+
+    //! Worker thread; serves the queue until interrupted
+    void Thread();
+};
+
+#endif // BITCOIN_COINSPREFETCH_H
@@ -8,8 +8,10 @@
 #include "script/standard.h"
 #include "util.h"
 
+#include <algorithm>
 #include <string>
 #include <vector>
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
 #include <openssl/aes.h>
 #include <openssl/evp.h>
@@ -122,6 +124,41 @@ bool DecryptSecret(const CKeyingMaterial& vMasterKey, const std::vector<unsigned
     return cKeyCrypter.Decrypt(vchCiphertext, *((CKeyingMaterial*)&vchPlaintext));
 }
 
+namespace {
+
+typedef CryptedKeyMap::mapped_type CryptedKey;
+
+/** Decrypt a key with the master key and check that it matches its public key. */
+bool CheckCryptedKey(const CKeyingMaterial& vMasterKey, const CryptedKey& cryptedKey)
+{
+    const CPubKey &vchPubKey = cryptedKey.first;
+    const std::vector<unsigned char> &vchCryptedSecret = cryptedKey.second;
+    CKeyingMaterial vchSecret;
+    if (!DecryptSecret(vMasterKey, vchCryptedSecret, vchPubKey.GetHash(), vchSecret))
+        return false;
+    if (vchSecret.size() != 32)
+        return false;
+    CKey key;
+    key.Set(vchSecret.begin(), vchSecret.end(), vchPubKey.IsCompressed());
+    return key.GetPubKey() == vchPubKey;
+}
+
+void CheckCryptedKeyAt(const CKeyingMaterial* pMasterKey, const std::vector<const CryptedKey*>* pvKeys, std::vector<char>* pvfOK, size_t i)
+{
+    (*pvfOK)[i] = CheckCryptedKey(*pMasterKey, *(*pvKeys)[i]);
+}
+
+void EncryptKeyAt(const CKeyingMaterial* pMasterKey, const std::vector<const CKey*>* pvKeys, std::vector<CryptedKey>* pvCrypted, std::vector<char>* pvfOK, size_t i)
+{
+    const CKey &key = *(*pvKeys)[i];
+    CryptedKey& cryptedKey = (*pvCrypted)[i];
+    cryptedKey.first = key.GetPubKey();
+    CKeyingMaterial vchSecret(key.begin(), key.end());
+    (*pvfOK)[i] = EncryptSecret(*pMasterKey, vchSecret, cryptedKey.first.GetHash(), cryptedKey.second);
+}
+
+}
+
 bool CCryptoKeyStore::SetCrypted()
 {
     LOCK(cs_KeyStore);
@@ -147,7 +184,7 @@ bool CCryptoKeyStore::Lock()
     return true;
 }
 
-bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
+bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn, int nThreads)
 {
     {
         LOCK(cs_KeyStore);
@@ -157,31 +194,26 @@ bool CCryptoKeyStore::Unlock(const CKeyingMaterial& vMasterKeyIn)
         bool keyPass = false;
         bool keyFail = false;
         CryptedKeyMap::const_iterator mi = mapCryptedKeys.begin();
-        for (; mi != mapCryptedKeys.end(); ++mi)
+        if (mi != mapCryptedKeys.end())
         {
-            const CPubKey &vchPubKey = (*mi).second.first;
-            const std::vector<unsigned char> &vchCryptedSecret = (*mi).second.second;
-            CKeyingMaterial vchSecret;
-            if(!DecryptSecret(vMasterKeyIn, vchCryptedSecret, vchPubKey.GetHash(), vchSecret))
-            {
+            // A wrong master key fails on the first key already
+            if (CheckCryptedKey(vMasterKeyIn, mi->second))
+                keyPass = true;
+            else
                 keyFail = true;
-                break;
-            }
-            if (vchSecret.size() != 32)
-            {
-                keyFail = true;
-                break;
-            }
-            CKey key;
-            key.Set(vchSecret.begin(), vchSecret.end(), vchPubKey.IsCompressed());
-            if (key.GetPubKey() != vchPubKey)
-            {
-                keyFail = true;
-                break;
-            }
-            keyPass = true;
-            if (fDecryptionThoroughlyChecked)
-                break;
+            ++mi;
+        }
+        if (keyPass && !fDecryptionThoroughlyChecked)
+        {
+            // The first unlock checks all other keys too, deriving the
+            // public key of every one of them, which is spread over threads
+            std::vector<const CryptedKey*> vKeys;
+            vKeys.reserve(mapCryptedKeys.size());
+            for (; mi != mapCryptedKeys.end(); ++mi)
+                vKeys.push_back(&mi->second);
+            std::vector<char> vfOK(vKeys.size(), false);
+            ParallelFor(vKeys.size(), nThreads, boost::bind(&CheckCryptedKeyAt, &vMasterKeyIn, &vKeys, &vfOK, _1));
+            keyFail = std::find(vfOK.begin(), vfOK.end(), false) != vfOK.end();
         }
         if (keyPass && keyFail)
         {
@@ -272,7 +304,7 @@ bool CCryptoKeyStore::GetPubKey(const CKeyID &address, CPubKey& vchPubKeyOut) co
     return false;
 }
 
-bool CCryptoKeyStore::EncryptKeys(CKeyingMaterial& vMasterKeyIn)
+bool CCryptoKeyStore::EncryptKeys(CKeyingMaterial& vMasterKeyIn, int nThreads)
 {
     {
         LOCK(cs_KeyStore);
@@ -280,15 +312,22 @@ bool CCryptoKeyStore::EncryptKeys(CKeyingMaterial& vMasterKeyIn)
             return false;
 
         fUseCrypto = true;
-        BOOST_FOREACH(KeyMap::value_type& mKey, mapKeys)
+
+        // Deriving the public keys and encrypting is spread over threads,
+        // adding the encrypted keys (and writing them out) is not
+        std::vector<const CKey*> vKeys;
+        vKeys.reserve(mapKeys.size());
+        BOOST_FOREACH(const KeyMap::value_type& mKey, mapKeys)
+            vKeys.push_back(&mKey.second);
+        std::vector<CryptedKey> vCrypted(vKeys.size());
+        std::vector<char> vfOK(vKeys.size(), false);
+        ParallelFor(vKeys.size(), nThreads, boost::bind(&EncryptKeyAt, &vMasterKeyIn, &vKeys, &vCrypted, &vfOK, _1));
+
+        for (unsigned int i = 0; i < vCrypted.size(); i++)
         {
-            const CKey &key = mKey.second;
-            CPubKey vchPubKey = key.GetPubKey();
-            CKeyingMaterial vchSecret(key.begin(), key.end());
-            std::vector<unsigned char> vchCryptedSecret;
-            if (!EncryptSecret(vMasterKeyIn, vchSecret, vchPubKey.GetHash(), vchCryptedSecret))
+            if (!vfOK[i])
                 return false;
-            if (!AddCryptedKey(vchPubKey, vchCryptedSecret))
+            if (!AddCryptedKey(vCrypted[i].first, vCrypted[i].second))
                 return false;
         }
         mapKeys.clear();
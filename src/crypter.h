@@ -130,10 +130,11 @@ private:
 protected:
     bool SetCrypted();
 
-    //! will encrypt previously unencrypted keys
-    bool EncryptKeys(CKeyingMaterial& vMasterKeyIn);
+    //! will encrypt previously unencrypted keys, on up to nThreads threads
+    bool EncryptKeys(CKeyingMaterial& vMasterKeyIn, int nThreads = 1);
 
-    bool Unlock(const CKeyingMaterial& vMasterKeyIn);
+    //! the first unlock checks every key, on up to nThreads threads
+    bool Unlock(const CKeyingMaterial& vMasterKeyIn, int nThreads = 1);
 
 public:
     CCryptoKeyStore() : fUseCrypto(false), fDecryptionThoroughlyChecked(false)
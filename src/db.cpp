@@ -10,7 +10,9 @@
 #include "protocol.h"
 #include "util.h"
 #include "utilstrencodings.h"
+#include "walletlog.h"
 
+#include <errno.h>
 #include <stdint.h>
 
 #ifndef WIN32
@@ -18,6 +20,7 @@
 #endif
 
 #include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
 #include <boost/thread.hpp>
 #include <boost/version.hpp>
 
@@ -53,11 +56,14 @@ CDBEnv::CDBEnv() : dbenv(DB_CXX_NO_EXCEPTIONS)
 {
     fDbEnvInit = false;
     fMockDb = false;
+    fCreateLogs = false;
 }
 
 CDBEnv::~CDBEnv()
 {
     EnvShutdown();
+    for (map<string, CWalletLog*>::iterator it = mapLog.begin(); it != mapLog.end(); ++it)
+        delete it->second;
 }
 
 void CDBEnv::Close()
@@ -147,6 +153,10 @@ CDBEnv::VerifyResult CDBEnv::Verify(std::string strFile, bool (*recoverFunc)(CDB
     LOCK(cs_db);
     assert(mapFileUseCount.count(strFile) == 0);
 
+    // A record log checks itself while it is replayed
+    if (IsLog(strFile, false))
+        return VERIFY_OK;
+
     Db db(&dbenv, 0);
     int result = db.verify(strFile.c_str(), NULL, NULL, 0);
     if (result == 0)
@@ -212,13 +222,412 @@ bool CDBEnv::Salvage(std::string strFile, bool fAggressive, std::vector<CDBEnv::
 void CDBEnv::CheckpointLSN(const std::string& strFile)
 {
     dbenv.txn_checkpoint(0, 0, 0);
-    if (fMockDb)
+    if (fMockDb || IsLog(strFile, false))
         return;
     dbenv.lsn_reset(strFile.c_str(), 0);
 }
 
 
-CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activeTxn(NULL)
+bool CDBEnv::IsLog(const string& strFile, bool fCreate)
+{
+    LOCK(cs_db);
+    if (mapLog.count(strFile))
+        return true;
+    // Files opened as Berkeley databases before keep their handle slot
+    if (mapDb.count(strFile))
+        return false;
+    boost::filesystem::path pathFile = GetDataDir() / strFile;
+    if (boost::filesystem::exists(pathFile))
+        return CWalletLog::IsLogFile(pathFile);
+    return fCreate && fCreateLogs;
+}
+
+CWalletLog* CDBEnv::OpenLog(const string& strFile, bool fCreate)
+{
+    LOCK(cs_db);
+    CWalletLog*& plog = mapLog[strFile];
+    if (plog == NULL) {
+        plog = new CWalletLog();
+        if (!plog->Open(GetDataDir() / strFile, fCreate)) {
+            delete plog;
+            mapLog.erase(strFile);
+            return NULL;
+        }
+    }
+    return plog;
+}
+
+bool CDBEnv::IsLogCorrupt(const string& strFile)
+{
+    LOCK(cs_db);
+    map<string, CWalletLog*>::iterator it = mapLog.find(strFile);
+    return it != mapLog.end() && it->second->IsCorrupt();
+}
+
+CWalletLog* CDBEnv::SalvageLog(const string& strFile)
+{
+    LOCK(cs_db);
+    assert(mapFileUseCount.count(strFile) == 0 || mapFileUseCount[strFile] == 0);
+    CWalletLog*& plog = mapLog[strFile];
+    delete plog;
+    plog = new CWalletLog();
+    if (!plog->Open(GetDataDir() / strFile, false, true)) {
+        delete plog;
+        mapLog.erase(strFile);
+        return NULL;
+    }
+    return plog;
+}
+
+namespace {
+
+class CBerkeleyCursor : public CDBCursor
+{
+private:
+    Dbc* pcursor;
+
+public:
+    explicit CBerkeleyCursor(Dbc* pcursorIn) : pcursor(pcursorIn) {}
+    ~CBerkeleyCursor() { pcursor->close(); }
+
+    int Read(CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags)
+    {
+        // Read at cursor
+        Dbt datKey;
+        if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE) {
+            datKey.set_data(&ssKey[0]);
+            datKey.set_size(ssKey.size());
+        }
+        Dbt datValue;
+        if (fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE) {
+            datValue.set_data(&ssValue[0]);
+            datValue.set_size(ssValue.size());
+        }
+        datKey.set_flags(DB_DBT_MALLOC);
+        datValue.set_flags(DB_DBT_MALLOC);
+        int ret = pcursor->get(&datKey, &datValue, fFlags);
+        if (ret != 0)
+            return ret;
+        else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
+            return 99999;
+
+        // Convert to streams
+        ssKey.SetType(SER_DISK);
+        ssKey.clear();
+        ssKey.write((char*)datKey.get_data(), datKey.get_size());
+        ssValue.SetType(SER_DISK);
+        ssValue.clear();
+        ssValue.write((char*)datValue.get_data(), datValue.get_size());
+
+        // Clear and free memory
+        memset(datKey.get_data(), 0, datKey.get_size());
+        memset(datValue.get_data(), 0, datValue.get_size());
+        free(datKey.get_data());
+        free(datValue.get_data());
+        return 0;
+    }
+};
+
+/** A Berkeley database shared through bitdb, with the transaction of one CDB */
+class CBerkeleyStore : public CDBStore
+{
+private:
+    Db* pdb;
+    DbTxn* activeTxn;
+
+public:
+    explicit CBerkeleyStore(Db* pdbIn) : pdb(pdbIn), activeTxn(NULL) {}
+    ~CBerkeleyStore()
+    {
+        if (activeTxn)
+            activeTxn->abort();
+    }
+
+    bool Read(const CDataStream& ssKey, CDataStream& ssValue)
+    {
+        Dbt datKey((void*)&ssKey[0], ssKey.size());
+        Dbt datValue;
+        datValue.set_flags(DB_DBT_MALLOC);
+        int ret = pdb->get(activeTxn, &datKey, &datValue, 0);
+        if (datValue.get_data() == NULL)
+            return false;
+
+        ssValue.SetType(SER_DISK);
+        ssValue.clear();
+        ssValue.write((char*)datValue.get_data(), datValue.get_size());
+
+        // Clear and free memory
+        memset(datValue.get_data(), 0, datValue.get_size());
+        free(datValue.get_data());
+        return (ret == 0);
+    }
+
+    bool Write(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite)
+    {
+        Dbt datKey((void*)&ssKey[0], ssKey.size());
+        Dbt datValue((void*)&ssValue[0], ssValue.size());
+        int ret = pdb->put(activeTxn, &datKey, &datValue, (fOverwrite ? 0 : DB_NOOVERWRITE));
+        return (ret == 0);
+    }
+
+    bool Erase(const CDataStream& ssKey)
+    {
+        Dbt datKey((void*)&ssKey[0], ssKey.size());
+        int ret = pdb->del(activeTxn, &datKey, 0);
+        return (ret == 0 || ret == DB_NOTFOUND);
+    }
+
+    bool Exists(const CDataStream& ssKey)
+    {
+        Dbt datKey((void*)&ssKey[0], ssKey.size());
+        int ret = pdb->exists(activeTxn, &datKey, 0);
+        return (ret == 0);
+    }
+
+    CDBCursor* GetCursor()
+    {
+        Dbc* pcursor = NULL;
+        int ret = pdb->cursor(activeTxn, &pcursor, 0);
+        if (ret != 0)
+            return NULL;
+        return new CBerkeleyCursor(pcursor);
+    }
+
+    bool TxnBegin()
+    {
+        if (activeTxn)
+            return false;
+        DbTxn* ptxn = bitdb.TxnBegin();
+        if (!ptxn)
+            return false;
+        activeTxn = ptxn;
+        return true;
+    }
+
+    bool TxnCommit()
+    {
+        if (!activeTxn)
+            return false;
+        int ret = activeTxn->commit(0);
+        activeTxn = NULL;
+        return (ret == 0);
+    }
+
+    bool TxnAbort()
+    {
+        if (!activeTxn)
+            return false;
+        int ret = activeTxn->abort();
+        activeTxn = NULL;
+        return (ret == 0);
+    }
+
+    bool IsInTxn() const
+    {
+        return activeTxn != NULL;
+    }
+
+    void Flush(bool fReadOnly)
+    {
+        // Flush database activity from memory pool to disk log
+        unsigned int nMinutes = 0;
+        if (fReadOnly)
+            nMinutes = 1;
+
+        bitdb.dbenv.txn_checkpoint(nMinutes ? GetArg("-dblogsize", 100) * 1024 : 0, nMinutes, 0);
+    }
+};
+
+CSerializeData StreamData(const CDataStream& ss)
+{
+    return CSerializeData(ss.begin(), ss.end());
+}
+
+/**
+ * A record log shared through bitdb, with the transaction of one CDB. The
+ * transaction's writes and erases are kept aside, by key, until they are
+ * committed as one entry of the log.
+ */
+class CWalletLogStore : public CDBStore
+{
+private:
+    CWalletLog& log;
+    bool fTxn;
+    //! Writes and erases of the transaction, and the order they were made in
+    std::map<CSerializeData, CWalletLogOp, CWalletLogKeyCompare> mapTxn;
+    std::vector<CSerializeData> vTxnKeys;
+
+    //! The operation of the transaction on key, if any
+    const CWalletLogOp* GetTxnOp(const CSerializeData& key) const
+    {
+        std::map<CSerializeData, CWalletLogOp, CWalletLogKeyCompare>::const_iterator it = mapTxn.find(key);
+        return it == mapTxn.end() ? NULL : &it->second;
+    }
+
+    bool Add(const CWalletLogOp& op)
+    {
+        if (!fTxn)
+            return log.Write(std::vector<CWalletLogOp>(1, op));
+        if (!mapTxn.count(op.key))
+            vTxnKeys.push_back(op.key);
+        mapTxn[op.key] = op;
+        return true;
+    }
+
+    friend class CWalletLogCursor;
+
+public:
+    explicit CWalletLogStore(CWalletLog& logIn) : log(logIn), fTxn(false) {}
+
+    bool Read(const CDataStream& ssKey, CDataStream& ssValue)
+    {
+        CSerializeData key = StreamData(ssKey);
+        CSerializeData value;
+        const CWalletLogOp* pop = GetTxnOp(key);
+        if (pop) {
+            if (pop->fErase)
+                return false;
+            value = pop->value;
+        } else if (!log.Read(key, value))
+            return false;
+
+        ssValue.SetType(SER_DISK);
+        ssValue.clear();
+        ssValue.write(value.empty() ? NULL : &value[0], value.size());
+        return true;
+    }
+
+    bool Write(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite)
+    {
+        CWalletLogOp op(StreamData(ssKey), StreamData(ssValue));
+        if (!fTxn)
+            return log.Write(std::vector<CWalletLogOp>(1, op), fOverwrite);
+        if (!fOverwrite && Exists(ssKey))
+            return false;
+        return Add(op);
+    }
+
+    bool Erase(const CDataStream& ssKey)
+    {
+        return Add(CWalletLogOp(StreamData(ssKey)));
+    }
+
+    bool Exists(const CDataStream& ssKey)
+    {
+        CSerializeData key = StreamData(ssKey);
+        const CWalletLogOp* pop = GetTxnOp(key);
+        if (pop)
+            return !pop->fErase;
+        return log.Exists(key);
+    }
+
+    CDBCursor* GetCursor();
+
+    bool TxnBegin()
+    {
+        if (fTxn)
+            return false;
+        fTxn = true;
+        return true;
+    }
+
+    bool TxnCommit()
+    {
+        if (!fTxn)
+            return false;
+        std::vector<CWalletLogOp> vOps;
+        vOps.reserve(vTxnKeys.size());
+        BOOST_FOREACH(const CSerializeData& key, vTxnKeys)
+            vOps.push_back(mapTxn[key]);
+        TxnAbort();
+        return log.Write(vOps);
+    }
+
+    bool TxnAbort()
+    {
+        if (!fTxn)
+            return false;
+        fTxn = false;
+        mapTxn.clear();
+        vTxnKeys.clear();
+        return true;
+    }
+
+    bool IsInTxn() const
+    {
+        return fTxn;
+    }
+
+    void Flush(bool fReadOnly)
+    {
+        // Entries are handed to the operating system as they are appended;
+        // CDBEnv::CloseDb commits them to disk.
+    }
+};
+
+/** Walks the records of the log and those of the transaction together */
+class CWalletLogCursor : public CDBCursor
+{
+private:
+    const CWalletLogStore& store;
+    CSerializeData keyLast;
+    bool fStarted;
+
+public:
+    explicit CWalletLogCursor(const CWalletLogStore& storeIn) : store(storeIn), fStarted(false) {}
+
+    int Read(CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags)
+    {
+        bool fInclusive = false;
+        if (fFlags == DB_SET_RANGE) {
+            keyLast = StreamData(ssKey);
+            fInclusive = true;
+        } else if (fFlags != DB_NEXT)
+            return EINVAL;
+        else if (!fStarted) {
+            keyLast.clear();
+            fInclusive = true;
+        }
+        fStarted = true;
+
+        while (true) {
+            // The first record after keyLast in the log, and in the transaction
+            CSerializeData key, value;
+            bool fLog = store.log.ReadNext(keyLast, fInclusive, key, value);
+            std::map<CSerializeData, CWalletLogOp, CWalletLogKeyCompare>::const_iterator it =
+                fInclusive ? store.mapTxn.lower_bound(keyLast) : store.mapTxn.upper_bound(keyLast);
+            bool fTxn = it != store.mapTxn.end();
+            if (!fLog && !fTxn)
+                return DB_NOTFOUND;
+
+            fInclusive = false;
+            if (fTxn && (!fLog || !CWalletLogKeyCompare()(key, it->first))) {
+                keyLast = it->first;
+                if (it->second.fErase)
+                    continue;
+                value = it->second.value;
+            } else
+                keyLast = key;
+
+            ssKey.SetType(SER_DISK);
+            ssKey.clear();
+            ssKey.write(&keyLast[0], keyLast.size());
+            ssValue.SetType(SER_DISK);
+            ssValue.clear();
+            ssValue.write(value.empty() ? NULL : &value[0], value.size());
+            return 0;
+        }
+    }
+};
+
+CDBCursor* CWalletLogStore::GetCursor()
+{
+    return new CWalletLogCursor(*this);
+}
+
+}
+
+CDB::CDB(const std::string& strFilename, const char* pszMode) : pstore(NULL)
 {
     int ret;
     fReadOnly = (!strchr(pszMode, '+') && !strchr(pszMode, 'w'));
@@ -237,7 +646,23 @@ CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activ
 
         strFile = strFilename;
         ++bitdb.mapFileUseCount[strFile];
-        pdb = bitdb.mapDb[strFile];
+        if (bitdb.IsLog(strFile, fCreate)) {
+            CWalletLog* plog = bitdb.OpenLog(strFile, fCreate);
+            if (plog == NULL) {
+                --bitdb.mapFileUseCount[strFile];
+                throw runtime_error(strprintf("CDB : Can't open record log %s", strFile));
+            }
+            pstore = new CWalletLogStore(*plog);
+            if (fCreate && !Exists(string("version"))) {
+                bool fTmp = fReadOnly;
+                fReadOnly = false;
+                WriteVersion(CLIENT_VERSION);
+                fReadOnly = fTmp;
+            }
+            return;
+        }
+
+        Db* pdb = bitdb.mapDb[strFile];
         if (pdb == NULL) {
             pdb = new Db(&bitdb.dbenv, 0);
 
@@ -264,6 +689,7 @@ CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activ
                 throw runtime_error(strprintf("CDB : Error %d, can't open database %s", ret, strFile));
             }
 
+            pstore = new CBerkeleyStore(pdb);
             if (fCreate && !Exists(string("version"))) {
                 bool fTmp = fReadOnly;
                 fReadOnly = false;
@@ -272,33 +698,28 @@ CDB::CDB(const std::string& strFilename, const char* pszMode) : pdb(NULL), activ
             }
 
             bitdb.mapDb[strFile] = pdb;
-        }
+        } else
+            pstore = new CBerkeleyStore(pdb);
     }
 }
 
 void CDB::Flush()
 {
-    if (activeTxn)
+    if (!pstore || pstore->IsInTxn())
         return;
-
-    // Flush database activity from memory pool to disk log
-    unsigned int nMinutes = 0;
-    if (fReadOnly)
-        nMinutes = 1;
-
-    bitdb.dbenv.txn_checkpoint(nMinutes ? GetArg("-dblogsize", 100) * 1024 : 0, nMinutes, 0);
+    pstore->Flush(fReadOnly);
 }
 
 void CDB::Close()
 {
-    if (!pdb)
+    if (!pstore)
         return;
-    if (activeTxn)
-        activeTxn->abort();
-    activeTxn = NULL;
-    pdb = NULL;
+    if (pstore->IsInTxn())
+        pstore->TxnAbort();
 
     Flush();
+    delete pstore;
+    pstore = NULL;
 
     {
         LOCK(bitdb.cs_db);
@@ -310,12 +731,19 @@ void CDBEnv::CloseDb(const string& strFile)
 {
     {
         LOCK(cs_db);
-        if (mapDb[strFile] != NULL) {
+        map<string, CWalletLog*>::iterator it = mapLog.find(strFile);
+        if (it != mapLog.end()) {
+            // Commit the log, and compact it if worth it
+            it->second->Flush();
+            return;
+        }
+        map<string, Db*>::iterator mi = mapDb.find(strFile);
+        if (mi != mapDb.end() && mi->second != NULL) {
             // Close the database handle
-            Db* pdb = mapDb[strFile];
+            Db* pdb = mi->second;
             pdb->close(0);
             delete pdb;
-            mapDb[strFile] = NULL;
+            mi->second = NULL;
         }
     }
 }
@@ -325,6 +753,12 @@ bool CDBEnv::RemoveDb(const string& strFile)
     this->CloseDb(strFile);
 
     LOCK(cs_db);
+    if (IsLog(strFile, false)) {
+        delete mapLog[strFile];
+        mapLog.erase(strFile);
+        return boost::filesystem::remove(GetDataDir() / strFile);
+    }
+    mapDb.erase(strFile);
     int rc = dbenv.dbremove(NULL, strFile.c_str(), NULL, DB_AUTO_COMMIT);
     return (rc == 0);
 }
@@ -335,13 +769,26 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
         {
             LOCK(bitdb.cs_db);
             if (!bitdb.mapFileUseCount.count(strFile) || bitdb.mapFileUseCount[strFile] == 0) {
+                bool fSuccess = true;
+                LogPrintf("CDB::Rewrite : Rewriting %s...\n", strFile);
+                if (bitdb.IsLog(strFile, false)) {
+                    // Compacting a log leaves out what was overwritten or erased too
+                    CWalletLog* plog = bitdb.OpenLog(strFile, false);
+                    fSuccess = plog && plog->Compact(pszSkip);
+                    if (fSuccess) {
+                        CDB db(strFile.c_str(), "r+");
+                        fSuccess = db.WriteVersion(CLIENT_VERSION);
+                    }
+                    if (!fSuccess)
+                        LogPrintf("CDB::Rewrite : Failed to rewrite record log %s\n", strFile);
+                    return fSuccess;
+                }
+
                 // Flush log data to the dat file
                 bitdb.CloseDb(strFile);
                 bitdb.CheckpointLSN(strFile);
                 bitdb.mapFileUseCount.erase(strFile);
 
-                bool fSuccess = true;
-                LogPrintf("CDB::Rewrite : Rewriting %s...\n", strFile);
                 string strFileRes = strFile + ".rewrite";
                 { // surround usage of db with extra {}
                     CDB db(strFile.c_str(), "r");
@@ -358,17 +805,17 @@ bool CDB::Rewrite(const string& strFile, const char* pszSkip)
                         fSuccess = false;
                     }
 
-                    Dbc* pcursor = db.GetCursor();
+                    CDBCursor* pcursor = db.GetCursor();
                     if (pcursor)
                         while (fSuccess) {
                             CDataStream ssKey(SER_DISK, CLIENT_VERSION);
                             CDataStream ssValue(SER_DISK, CLIENT_VERSION);
                             int ret = db.ReadAtCursor(pcursor, ssKey, ssValue, DB_NEXT);
                             if (ret == DB_NOTFOUND) {
-                                pcursor->close();
+                                delete pcursor;
                                 break;
                             } else if (ret != 0) {
-                                pcursor->close();
+                                delete pcursor;
                                 fSuccess = false;
                                 break;
                             }
@@ -433,7 +880,7 @@ void CDBEnv::Flush(bool fShutdown)
                 LogPrint("db", "CDBEnv::Flush : %s checkpoint\n", strFile);
                 dbenv.txn_checkpoint(0, 0, 0);
                 LogPrint("db", "CDBEnv::Flush : %s detach\n", strFile);
-                if (!fMockDb)
+                if (!fMockDb && !IsLog(strFile, false))
                     dbenv.lsn_reset(strFile.c_str(), 0);
                 LogPrint("db", "CDBEnv::Flush : %s closed\n", strFile);
                 mapFileUseCount.erase(mi++);
@@ -446,6 +893,9 @@ void CDBEnv::Flush(bool fShutdown)
             if (mapFileUseCount.empty()) {
                 dbenv.log_archive(&listp, DB_ARCH_REMOVE);
                 Close();
+                for (map<string, CWalletLog*>::iterator it = mapLog.begin(); it != mapLog.end(); ++it)
+                    delete it->second;
+                mapLog.clear();
                 if (!fMockDb)
                     boost::filesystem::remove_all(path / "database");
             }
@@ -22,6 +22,7 @@
 
 class CDiskBlockIndex;
 class COutPoint;
+class CWalletLog;
 
 struct CBlockLocator;
 
@@ -44,6 +45,10 @@ public:
     DbEnv dbenv;
     std::map<std::string, int> mapFileUseCount;
     std::map<std::string, Db*> mapDb;
+    //! Record logs open, by file name. They stay open until shutdown, so that they are replayed only once.
+    std::map<std::string, CWalletLog*> mapLog;
+    //! Create new database files as record logs (see walletlog.h) instead of Berkeley databases
+    bool fCreateLogs;
 
     CDBEnv();
     ~CDBEnv();
@@ -75,6 +80,16 @@ public:
     void Flush(bool fShutdown);
     void CheckpointLSN(const std::string& strFile);
 
+    /** Whether strFile is kept in a record log, or would be created as one if fCreate */
+    bool IsLog(const std::string& strFile, bool fCreate);
+    /** The record log strFile is kept in, opened and replayed if it isn't yet. NULL on failure. */
+    CWalletLog* OpenLog(const std::string& strFile, bool fCreate);
+    /** Whether the record log strFile is open and has damage that only salvaging gets past */
+    bool IsLogCorrupt(const std::string& strFile);
+    /** Reopen the record log strFile skipping its bad entries, and rewrite it without them. NULL on failure. */
+    CWalletLog* SalvageLog(const std::string& strFile);
+
+    /** Close the Berkeley database strFile, or commit the record log strFile to disk */
     void CloseDb(const std::string& strFile);
     bool RemoveDb(const std::string& strFile);
 
@@ -91,13 +106,55 @@ public:
 extern CDBEnv bitdb;
 
 
-/** RAII class that provides access to a Berkeley database */
+/** A cursor over the records of a CDBStore, in key order */
+class CDBCursor
+{
+public:
+    virtual ~CDBCursor() {}
+
+    /**
+     * Read the record at the cursor into ssKey and ssValue. fFlags is DB_NEXT
+     * for the next record, or DB_SET_RANGE for the first one at or after the
+     * key given in ssKey. Returns 0, or DB_NOTFOUND after the last record.
+     */
+    virtual int Read(CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags) = 0;
+};
+
+/**
+ * Storage of a database file, as seen through one CDB: serialized keys
+ * mapped to serialized values. Writes made in a transaction are seen by
+ * the CDB that made them, and by others once committed. CDB, and so
+ * CWalletDB, work the same over a Berkeley database and a record log.
+ */
+class CDBStore
+{
+public:
+    virtual ~CDBStore() {}
+
+    virtual bool Read(const CDataStream& ssKey, CDataStream& ssValue) = 0;
+    virtual bool Write(const CDataStream& ssKey, const CDataStream& ssValue, bool fOverwrite) = 0;
+    //! Erasing a record that doesn't exist succeeds
+    virtual bool Erase(const CDataStream& ssKey) = 0;
+    virtual bool Exists(const CDataStream& ssKey) = 0;
+    //! NULL on failure; the caller deletes it
+    virtual CDBCursor* GetCursor() = 0;
+
+    virtual bool TxnBegin() = 0;
+    virtual bool TxnCommit() = 0;
+    virtual bool TxnAbort() = 0;
+    virtual bool IsInTxn() const = 0;
+
+    //! Write what was done through this CDB out of memory, as far as the store keeps any
+    virtual void Flush(bool fReadOnly) = 0;
+};
+
+
+/** RAII class that provides access to a wallet database file, a Berkeley database or a record log */
 class CDB
 {
 protected:
-    Db* pdb;
+    CDBStore* pstore;
     std::string strFile;
-    DbTxn* activeTxn;
     bool fReadOnly;
 
     explicit CDB(const std::string& strFilename, const char* pszMode = "r+");
@@ -115,41 +172,32 @@ protected:
     template <typename K, typename T>
     bool Read(const K& key, T& value)
     {
-        if (!pdb)
+        if (!pstore)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         // Read
-        Dbt datValue;
-        datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pdb->get(activeTxn, &datKey, &datValue, 0);
-        memset(datKey.get_data(), 0, datKey.get_size());
-        if (datValue.get_data() == NULL)
+        CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+        if (!pstore->Read(ssKey, ssValue))
             return false;
 
         // Unserialize value
         try {
-            CDataStream ssValue((char*)datValue.get_data(), (char*)datValue.get_data() + datValue.get_size(), SER_DISK, CLIENT_VERSION);
             ssValue >> value;
         } catch (const std::exception&) {
             return false;
         }
-
-        // Clear and free memory
-        memset(datValue.get_data(), 0, datValue.get_size());
-        free(datValue.get_data());
-        return (ret == 0);
+        return true;
     }
 
     template <typename K, typename T>
     bool Write(const K& key, const T& value, bool fOverwrite = true)
     {
-        if (!pdb)
+        if (!pstore)
             return false;
         if (fReadOnly)
             assert(!"Write called on database in read-only mode");
@@ -158,27 +206,20 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         // Value
         CDataStream ssValue(SER_DISK, CLIENT_VERSION);
         ssValue.reserve(10000);
         ssValue << value;
-        Dbt datValue(&ssValue[0], ssValue.size());
-
-        // Write
-        int ret = pdb->put(activeTxn, &datKey, &datValue, (fOverwrite ? 0 : DB_NOOVERWRITE));
 
-        // Clear memory in case it was a private key
-        memset(datKey.get_data(), 0, datKey.get_size());
-        memset(datValue.get_data(), 0, datValue.get_size());
-        return (ret == 0);
+        // Write; the streams clear their memory in case it was a private key
+        return pstore->Write(ssKey, ssValue, fOverwrite);
     }
 
     template <typename K>
     bool Erase(const K& key)
     {
-        if (!pdb)
+        if (!pstore)
             return false;
         if (fReadOnly)
             assert(!"Erase called on database in read-only mode");
@@ -187,112 +228,58 @@ protected:
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         // Erase
-        int ret = pdb->del(activeTxn, &datKey, 0);
-
-        // Clear memory
-        memset(datKey.get_data(), 0, datKey.get_size());
-        return (ret == 0 || ret == DB_NOTFOUND);
+        return pstore->Erase(ssKey);
     }
 
     template <typename K>
     bool Exists(const K& key)
     {
-        if (!pdb)
+        if (!pstore)
             return false;
 
         // Key
         CDataStream ssKey(SER_DISK, CLIENT_VERSION);
         ssKey.reserve(1000);
         ssKey << key;
-        Dbt datKey(&ssKey[0], ssKey.size());
 
         // Exists
-        int ret = pdb->exists(activeTxn, &datKey, 0);
-
-        // Clear memory
-        memset(datKey.get_data(), 0, datKey.get_size());
-        return (ret == 0);
+        return pstore->Exists(ssKey);
     }
 
-    Dbc* GetCursor()
+    CDBCursor* GetCursor()
     {
-        if (!pdb)
-            return NULL;
-        Dbc* pcursor = NULL;
-        int ret = pdb->cursor(NULL, &pcursor, 0);
-        if (ret != 0)
+        if (!pstore)
             return NULL;
-        return pcursor;
+        return pstore->GetCursor();
     }
 
-    int ReadAtCursor(Dbc* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags = DB_NEXT)
+    int ReadAtCursor(CDBCursor* pcursor, CDataStream& ssKey, CDataStream& ssValue, unsigned int fFlags = DB_NEXT)
     {
-        // Read at cursor
-        Dbt datKey;
-        if (fFlags == DB_SET || fFlags == DB_SET_RANGE || fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE) {
-            datKey.set_data(&ssKey[0]);
-            datKey.set_size(ssKey.size());
-        }
-        Dbt datValue;
-        if (fFlags == DB_GET_BOTH || fFlags == DB_GET_BOTH_RANGE) {
-            datValue.set_data(&ssValue[0]);
-            datValue.set_size(ssValue.size());
-        }
-        datKey.set_flags(DB_DBT_MALLOC);
-        datValue.set_flags(DB_DBT_MALLOC);
-        int ret = pcursor->get(&datKey, &datValue, fFlags);
-        if (ret != 0)
-            return ret;
-        else if (datKey.get_data() == NULL || datValue.get_data() == NULL)
-            return 99999;
-
-        // Convert to streams
-        ssKey.SetType(SER_DISK);
-        ssKey.clear();
-        ssKey.write((char*)datKey.get_data(), datKey.get_size());
-        ssValue.SetType(SER_DISK);
-        ssValue.clear();
-        ssValue.write((char*)datValue.get_data(), datValue.get_size());
-
-        // Clear and free memory
-        memset(datKey.get_data(), 0, datKey.get_size());
-        memset(datValue.get_data(), 0, datValue.get_size());
-        free(datKey.get_data());
-        free(datValue.get_data());
-        return 0;
+        return pcursor->Read(ssKey, ssValue, fFlags);
     }
 
 public:
     bool TxnBegin()
     {
-        if (!pdb || activeTxn)
-            return false;
-        DbTxn* ptxn = bitdb.TxnBegin();
-        if (!ptxn)
+        if (!pstore)
             return false;
-        activeTxn = ptxn;
-        return true;
+        return pstore->TxnBegin();
     }
 
     bool TxnCommit()
     {
-        if (!pdb || !activeTxn)
+        if (!pstore)
             return false;
-        int ret = activeTxn->commit(0);
-        activeTxn = NULL;
-        return (ret == 0);
+        return pstore->TxnCommit();
     }
 
     bool TxnAbort()
     {
-        if (!pdb || !activeTxn)
+        if (!pstore)
             return false;
-        int ret = activeTxn->abort();
-        activeTxn = NULL;
-        return (ret == 0);
+        return pstore->TxnAbort();
     }
 
     bool ReadVersion(int& nVersion)
@@ -157,6 +157,23 @@ uint256 SerializeHash(const T& obj, int nType=SER_GETHASH, int nVersion=PROTOCOL
     return ss.GetHash();
 }
 
+/** SipHash-2-4, keyed with k0 and k1, over a message of 64-bit words. */
+class CSipHasher
+{
+private:
+    uint64_t v[4];
+    int count;
+
+public:
+    CSipHasher(uint64_t k0, uint64_t k1);
+    //! Hash a 64-bit word, as its 8 little-endian bytes
+    CSipHasher& Write(uint64_t data);
+    uint64_t Finalize() const;
+};
+
+/** SipHash-2-4 of the 32 bytes of val, as used for compact block short IDs (BIP 152). */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+
 unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
 
 void BIP32Hash(const unsigned char chainCode[32], unsigned int nChild, unsigned char header, const unsigned char data[32], unsigned char output[64]);
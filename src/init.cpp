@@ -9,9 +9,12 @@
 
 #include "init.h"
 
+#include "addrindex.h"
 #include "addrman.h"
 #include "amount.h"
 #include "checkpoints.h"
+#include "coinsmemory.h"
+#include "coinsprefetch.h"
 #include "compat/sanity.h"
 #include "key.h"
 #include "main.h"
@@ -19,7 +22,9 @@
 #include "net.h"
 #include "rpcserver.h"
 #include "script/standard.h"
+#include "spentindex.h"
 #include "txdb.h"
+#include "txindex.h"
 #include "ui_interface.h"
 #include "util.h"
 #include "utilmoneystr.h"
@@ -27,6 +32,7 @@
 #include "db.h"
 #include "wallet.h"
 #include "walletdb.h"
+#include "walletscan.h"
 #endif
 
 #include <stdint.h>
@@ -133,7 +139,10 @@ public:
 };
 
 static CCoinsViewDB *pcoinsdbview = NULL;
+static CCoinsViewMemory *pcoinsmemory = NULL;
 static CCoinsViewErrorCatcher *pcoinscatcher = NULL;
+static int nPrefetchThreads = 0;
+static bool fCoinsInMemory = false;
 
 void Shutdown()
 {
@@ -173,15 +182,26 @@ void Shutdown()
         LOCK(cs_main);
         if (pcoinsTip != NULL) {
             FlushStateToDisk();
+            // Not while reindexing, as the index is still incomplete
+            if (!fReindex && !mapBlockIndex.empty())
+                WriteBlockIndexSnapshot();
         }
         delete pcoinsTip;
         pcoinsTip = NULL;
+        delete pcoinsPrefetch;
+        pcoinsPrefetch = NULL;
         delete pcoinscatcher;
         pcoinscatcher = NULL;
+        delete pcoinsmemory;
+        pcoinsmemory = NULL;
         delete pcoinsdbview;
         pcoinsdbview = NULL;
         delete pblocktree;
         pblocktree = NULL;
+        delete paddrindex;
+        paddrindex = NULL;
+        delete pspentindex;
+        pspentindex = NULL;
     }
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -240,11 +260,13 @@ std::string HelpMessage(HelpMessageMode mode)
     // When adding new options to the categories, please keep and ensure alphabetical ordering.
     string strUsage = _("Options:") + "\n";
     strUsage += "  -?                     " + _("This help message") + "\n";
+    strUsage += "  -addrindex             " + strprintf(_("Maintain an index of the outputs paying to and spent from each address, used by the getaddress* rpc calls (default: %u)"), 0) + "\n";
     strUsage += "  -alertnotify=<cmd>     " + _("Execute command when a relevant alert is received or we see a really long fork (%s in cmd is replaced by message)") + "\n";
     strUsage += "  -alerts                " + strprintf(_("Receive and display P2P network alerts (default: %u)"), DEFAULT_ALERTS);
     strUsage += "  -blocknotify=<cmd>     " + _("Execute command when the best block changes (%s in cmd is replaced by block hash)") + "\n";
     strUsage += "  -checkblocks=<n>       " + strprintf(_("How many blocks to check at startup (default: %u, 0 = all)"), 288) + "\n";
     strUsage += "  -checklevel=<n>        " + strprintf(_("How thorough the block verification of -checkblocks is (0-4, default: %u)"), 3) + "\n";
+    strUsage += "  -coinsinmemory         " + strprintf(_("Keep all unspent transaction outputs in memory, loaded at startup; the database is still kept up to date (default: %u)"), 0) + "\n";
     strUsage += "  -conf=<file>           " + strprintf(_("Specify configuration file (default: %s)"), "litecoin.conf") + "\n";
     if (mode == HMM_BITCOIND)
     {
@@ -257,20 +279,28 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + " " + _("on startup") + "\n";
     strUsage += "  -maxorphantx=<n>       " + strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS) + "\n";
     strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
+    strUsage += "  -parblock=<n>          " + strprintf(_("Set the number of block checking threads used during initial block download (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_BLOCKCHECK_THREADS, DEFAULT_BLOCKCHECK_THREADS) + "\n";
 #ifndef WIN32
     strUsage += "  -pid=<file>            " + strprintf(_("Specify pid file (default: %s)"), "litecoind.pid") + "\n";
 #endif
+    strUsage += "  -prune=<n>             " + strprintf(_("Reduce storage requirements by pruning (deleting) old blocks. This mode disables wallet rescans and is incompatible with -txindex. "
+            "Warning: Reverting this setting requires re-downloading the entire blockchain. "
+            "(default: 0 = disable pruning blocks, >%u = target size in MiB to use for block files)"), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024) + "\n";
+    strUsage += "  -prefetchthreads=<n>   " + strprintf(_("Set the number of threads reading coins of downloaded blocks ahead of their connection (0 to %d, default: %d)"), MAX_PREFETCH_THREADS, DEFAULT_PREFETCH_THREADS) + "\n";
+    strUsage += "  -recentblocks=<n>      " + strprintf(_("Keep the last <n> connected blocks and their undo data in memory to speed up reorganizations (default: %u)"), DEFAULT_RECENT_BLOCKS) + "\n";
     strUsage += "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + " " + _("on startup") + "\n";
+    strUsage += "  -spentindex            " + strprintf(_("Maintain an index of where each output was spent, used to show input values and fees of confirmed transactions (default: %u)"), 0) + "\n";
 #if !defined(WIN32)
     strUsage += "  -sysperms              " + _("Create new files with system default permissions, instead of umask 077 (only effective with disabled wallet functionality)") + "\n";
 #endif
-    strUsage += "  -txindex               " + strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call (default: %u)"), 0) + "\n";
+    strUsage += "  -txindex               " + strprintf(_("Maintain a full transaction index, used by the getrawtransaction rpc call; it is built in the background (default: %u)"), 0) + "\n";
 
     strUsage += "\n" + _("Connection options:") + "\n";
     strUsage += "  -addnode=<ip>          " + _("Add a node to connect to and attempt to keep the connection open") + "\n";
     strUsage += "  -banscore=<n>          " + strprintf(_("Threshold for disconnecting misbehaving peers (default: %u)"), 100) + "\n";
     strUsage += "  -bantime=<n>           " + strprintf(_("Number of seconds to keep misbehaving peers from reconnecting (default: %u)"), 86400) + "\n";
     strUsage += "  -bind=<addr>           " + _("Bind to given address and always listen on it. Use [host]:port notation for IPv6") + "\n";
+    strUsage += "  -compactblocks         " + strprintf(_("Request new blocks as header and short transaction IDs, reconstructed from the memory pool (default: %u)"), DEFAULT_COMPACTBLOCKS) + "\n";
     strUsage += "  -connect=<ip>          " + _("Connect only to the specified node(s)") + "\n";
     strUsage += "  -discover              " + _("Discover own IP address (default: 1 when listening and no -externalip)") + "\n";
     strUsage += "  -dns                   " + _("Allow DNS lookups for -addnode, -seednode and -connect") + " " + _("(default: 1)") + "\n";
@@ -308,6 +338,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -paytxfee=<amt>        " + strprintf(_("Fee (in LTC/kB) to add to transactions you send (default: %s)"), FormatMoney(payTxFee.GetFeePerK())) + "\n";
     strUsage += "  -mininput=<amt>        " + _("Wallet ignores inputs with value less than this (default: 0.0001)") + "\n";
     strUsage += "  -rescan                " + _("Rescan the block chain for missing wallet transactions") + " " + _("on startup") + "\n";
+    strUsage += "  -rescanthreads=<n>     " + strprintf(_("Set the number of threads reading blocks for wallet rescans (up to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), MAX_RESCAN_THREADS, DEFAULT_RESCAN_THREADS) + "\n";
     strUsage += "  -salvagewallet         " + _("Attempt to recover private keys from a corrupt wallet.dat") + " " + _("on startup") + "\n";
     strUsage += "  -sendfreetransactions  " + strprintf(_("Send transactions as zero-fee transactions if possible (default: %u)"), 0) + "\n";
     strUsage += "  -spendzeroconfchange   " + strprintf(_("Spend unconfirmed change when sending transactions (default: %u)"), 1) + "\n";
@@ -315,7 +346,9 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -maxtxfee=<amt>        " + strprintf(_("Maximum total fees to use in a single wallet transaction, setting too low may abort large transactions (default: %s)"), FormatMoney(maxTxFee)) + "\n";
     strUsage += "  -upgradewallet         " + _("Upgrade wallet to latest format") + " " + _("on startup") + "\n";
     strUsage += "  -wallet=<file>         " + _("Specify wallet file (within data directory)") + " " + strprintf(_("(default: %s)"), "wallet.dat") + "\n";
+    strUsage += "  -walletlog             " + strprintf(_("Create a new wallet file as an append-only record log instead of a Berkeley database (default: %u)"), 0) + "\n";
     strUsage += "  -walletnotify=<cmd>    " + _("Execute command when a wallet transaction changes (%s in cmd is replaced by TxID)") + "\n";
+    strUsage += "  -walletthreads=<n>     " + strprintf(_("Set the number of threads decoding wallet records on startup, checking or encrypting keys and signing transactions (up to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), MAX_WALLET_THREADS, DEFAULT_WALLET_THREADS) + "\n";
     strUsage += "  -zapwallettxes=<mode>  " + _("Delete all wallet transactions and only recover those parts of the blockchain through -rescan on startup") + "\n";
     strUsage += "                         " + _("(1 = keep tx meta data e.g. account owner and payment request information, 2 = drop tx meta data)") + "\n";
 #endif
@@ -325,6 +358,13 @@ std::string HelpMessage(HelpMessageMode mode)
     {
         strUsage += "  -checkpoints           " + strprintf(_("Only accept block chain matching built-in checkpoints (default: %u)"), 1) + "\n";
         strUsage += "  -dblogsize=<n>         " + strprintf(_("Flush database activity from memory pool to disk log every <n> megabytes (default: %u)"), 100) + "\n";
+        strUsage += "  -dbblocksize=<n>       " + strprintf(_("Approximate size in bytes of the blocks LevelDB tables are made of (default: %u)"), 4096) + "\n";
+        strUsage += "  -dbbloombits=<n>       " + strprintf(_("Bits per key of the bloom filters of LevelDB tables, 0 to disable (default: %u)"), 10) + "\n";
+        strUsage += "  -dbcompression         " + strprintf(_("Compress LevelDB tables, if built with Snappy (default: %u)"), 0) + "\n";
+        strUsage += "  -dbmaxopenfiles=<n>    " + strprintf(_("Number of files each LevelDB database keeps open (default: %u)"), 64) + "\n";
+        strUsage += "  -dbrestartinterval=<n> " + strprintf(_("Number of keys between restart points in LevelDB blocks (default: %u)"), 16) + "\n";
+        strUsage += "  -dbwritebuffer=<n>     " + _("Size in megabytes of the LevelDB memory table, written out as a new table when full (default: a quarter of the database cache)") + "\n";
+        strUsage += "                         " + _("Each of the -db options above can be set for the coin database or the block index only, as -chainstatedb<option> or -blockindexdb<option>") + "\n";
         strUsage += "  -disablesafemode       " + strprintf(_("Disable safemode, override a real safe mode event (default: %u)"), 0) + "\n";
         strUsage += "  -testsafemode          " + strprintf(_("Force safe mode (default: %u)"), 0) + "\n";
         strUsage += "  -dropmessagestest=<n>  " + _("Randomly drop 1 of every <n> network messages") + "\n";
@@ -335,7 +375,7 @@ std::string HelpMessage(HelpMessageMode mode)
     strUsage += "  -debug=<category>      " + strprintf(_("Output debugging information (default: %u, supplying <category> is optional)"), 0) + "\n";
     strUsage += "                         " + _("If <category> is not supplied, output all debugging information.") + "\n";
     strUsage += "                         " + _("<category> can be:");
-    strUsage +=                                 " addrman, alert, bench, coindb, db, lock, rand, rpc, selectcoins, mempool, net"; // Don't translate these and qt below
+    strUsage +=                                 " addrman, alert, bench, cmpctblock, coindb, db, lock, rand, rpc, selectcoins, mempool, net, prune, txindex"; // Don't translate these and qt below
     if (mode == HMM_BITCOIN_QT)
         strUsage += ", qt";
     strUsage += ".\n";
@@ -429,6 +469,50 @@ struct CImportingNow
     }
 };
 
+/**
+ * If we're using -prune with -reindex, then delete block files that will be ignored by the
+ * reindex.  Since reindexing works by starting at block file 0 and looping until a blockfile
+ * is missing, do the same here to delete any later block files after a gap.  Also delete all
+ * rev files since they'll be rewritten by the reindex anyway.  This ensures that vinfoBlockFile
+ * is in sync with what's actually on disk by the time we start downloading, so that pruning
+ * works correctly.
+ */
+void CleanupBlockRevFiles()
+{
+    using namespace boost::filesystem;
+    map<string, path> mapBlockFiles;
+
+    // Glob all blk?????.dat and rev?????.dat files from the blocks directory.
+    // Remove the rev files immediately and insert the blk file paths into an
+    // ordered map keyed by block file index.
+    LogPrintf("Removing unusable blk?????.dat and rev?????.dat files for -reindex with -prune\n");
+    path blocksdir = GetDataDir() / "blocks";
+    for (directory_iterator it(blocksdir); it != directory_iterator(); it++) {
+        if (is_regular_file(*it) &&
+            it->path().filename().string().length() == 12 &&
+            it->path().filename().string().substr(8,4) == ".dat")
+        {
+            if (it->path().filename().string().substr(0,3) == "blk")
+                mapBlockFiles[it->path().filename().string().substr(3,5)] = it->path();
+            else if (it->path().filename().string().substr(0,3) == "rev")
+                remove(it->path());
+        }
+    }
+
+    // Remove all block files that aren't part of a contiguous set starting at
+    // zero by walking the ordered map (keys are block file indices) by
+    // keeping a separate counter.  Once we hit a gap (or if 0 doesn't exist)
+    // start removing block files.
+    int nContigCounter = 0;
+    BOOST_FOREACH(const PAIRTYPE(string, path)& item, mapBlockFiles) {
+        if (atoi(item.first) == nContigCounter) {
+            nContigCounter++;
+            continue;
+        }
+        remove(item.second);
+    }
+}
+
 void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
 {
     RenameThread("litecoin-loadblk");
@@ -436,17 +520,22 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     // -reindex
     if (fReindex) {
         CImportingNow imp;
-        int nFile = 0;
-        while (true) {
-            CDiskBlockPos pos(nFile, 0);
-            if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
-                break; // No block files left to reindex
-            FILE *file = OpenBlockFile(pos, true);
-            if (!file)
-                break; // This error is logged in OpenBlockFile
-            LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
-            LoadExternalBlockFile(file, &pos);
-            nFile++;
+        if (nBlockCheckThreads > 0) {
+            // Check blocks on the block checking threads' worth of cores, connect them here
+            ReindexBlockFiles(nBlockCheckThreads);
+        } else {
+            int nFile = 0;
+            while (true) {
+                CDiskBlockPos pos(nFile, 0);
+                if (!boost::filesystem::exists(GetBlockPosFilename(pos, "blk")))
+                    break; // No block files left to reindex
+                FILE *file = OpenBlockFile(pos, true);
+                if (!file)
+                    break; // This error is logged in OpenBlockFile
+                LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
+                LoadExternalBlockFile(file, &pos);
+                nFile++;
+            }
         }
         pblocktree->WriteReindexing(false);
         fReindex = false;
@@ -633,6 +722,16 @@ bool AppInit2(boost::thread_group& threadGroup)
             LogPrintf("AppInit2 : parameter interaction: -zapwallettxes=<mode> -> setting -rescan=1\n");
     }
 
+    // if using block pruning, then disable txindex, addrindex and spentindex
+    if (GetArg("-prune", 0)) {
+        if (GetBoolArg("-txindex", false))
+            return InitError(_("Prune mode is incompatible with -txindex."));
+        if (GetBoolArg("-addrindex", false))
+            return InitError(_("Prune mode is incompatible with -addrindex."));
+        if (GetBoolArg("-spentindex", false))
+            return InitError(_("Prune mode is incompatible with -spentindex."));
+    }
+
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind") + (int)mapArgs.count("-whitebind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
@@ -678,6 +777,15 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    // -parblock=0 means autodetect, nBlockCheckThreads==0 disables the block validation pipeline
+    nBlockCheckThreads = GetArg("-parblock", DEFAULT_BLOCKCHECK_THREADS);
+    if (nBlockCheckThreads <= 0)
+        nBlockCheckThreads += boost::thread::hardware_concurrency();
+    if (nBlockCheckThreads < 0)
+        nBlockCheckThreads = 0;
+    else if (nBlockCheckThreads > MAX_BLOCKCHECK_THREADS)
+        nBlockCheckThreads = MAX_BLOCKCHECK_THREADS;
+
     fServer = GetBoolArg("-server", false);
 #ifdef ENABLE_WALLET
     bool fDisableWallet = GetBoolArg("-disablewallet", false);
@@ -742,6 +850,9 @@ bool AppInit2(boost::thread_group& threadGroup)
     nTxConfirmTarget = GetArg("-txconfirmtarget", 1);
     bSpendZeroConfChange = GetArg("-spendzeroconfchange", true);
     fSendFreeTransactions = GetArg("-sendfreetransactions", false);
+    nRescanThreads = GetArg("-rescanthreads", DEFAULT_RESCAN_THREADS);
+    nWalletThreads = GetArg("-walletthreads", DEFAULT_WALLET_THREADS);
+    bitdb.fCreateLogs = GetBoolArg("-walletlog", false);
 
     std::string strWalletFile = GetArg("-wallet", "wallet.dat");
 
@@ -754,6 +865,7 @@ bool AppInit2(boost::thread_group& threadGroup)
 #endif // ENABLE_WALLET
 
     fIsBareMultisigStd = GetArg("-permitbaremultisig", true) != 0;
+    fCompactBlocks = GetBoolArg("-compactblocks", DEFAULT_COMPACTBLOCKS);
     nMaxDatacarrierBytes = GetArg("-datacarriersize", nMaxDatacarrierBytes);
 
     fAlerts = GetBoolArg("-alerts", DEFAULT_ALERTS);
@@ -802,6 +914,35 @@ bool AppInit2(boost::thread_group& threadGroup)
             threadGroup.create_thread(&ThreadScriptCheck);
     }
 
+    SetRecentBlocks(std::max((int64_t)0, GetArg("-recentblocks", DEFAULT_RECENT_BLOCKS)));
+
+    // block pruning; get the amount of disk space (in MiB) to allot for block & undo files
+    int64_t nSignedPruneTarget = GetArg("-prune", 0) * 1024 * 1024;
+    if (nSignedPruneTarget < 0) {
+        return InitError(_("Prune cannot be configured with a negative value."));
+    }
+    nPruneTarget = (uint64_t) nSignedPruneTarget;
+    if (nPruneTarget) {
+        if (nPruneTarget < MIN_DISK_SPACE_FOR_BLOCK_FILES) {
+            return InitError(strprintf(_("Prune configured below the minimum of %d MiB.  Please use a higher number."), MIN_DISK_SPACE_FOR_BLOCK_FILES / 1024 / 1024));
+        }
+        LogPrintf("Prune configured to target %uMiB on disk for block and undo files.\n", nPruneTarget / 1024 / 1024);
+        fPruneMode = true;
+    }
+
+    fCoinsInMemory = GetBoolArg("-coinsinmemory", false);
+
+    // Prefetching feeds on blocks from the validation pipeline, and is of no use with all coins in memory
+    nPrefetchThreads = (nBlockCheckThreads && !fCoinsInMemory) ? GetArg("-prefetchthreads", DEFAULT_PREFETCH_THREADS) : 0;
+    nPrefetchThreads = std::max(0, std::min(nPrefetchThreads, MAX_PREFETCH_THREADS));
+
+    LogPrintf("Using %u threads for block checking during initial block download\n", nBlockCheckThreads);
+    if (nBlockCheckThreads) {
+        for (int i=0; i<nBlockCheckThreads; i++)
+            threadGroup.create_thread(&ThreadBlockCheck);
+        threadGroup.create_thread(&ThreadBlockConnect);
+    }
+
     /* Start the RPC server already.  It will be started in "warmup" mode
      * and not really process calls already (but it will signify connections
      * that the server is there and will be ready later).  Warmup mode will
@@ -1009,6 +1150,16 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false))
         nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
     nTotalCache -= nBlockTreeDBCache;
+    size_t nAddrIndexDBCache = 0;
+    if (GetBoolArg("-addrindex", false)) {
+        nAddrIndexDBCache = nTotalCache / 8;
+        nTotalCache -= nAddrIndexDBCache;
+    }
+    size_t nSpentIndexDBCache = 0;
+    if (GetBoolArg("-spentindex", false)) {
+        nSpentIndexDBCache = nTotalCache / 8;
+        nTotalCache -= nSpentIndexDBCache;
+    }
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
     nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
@@ -1025,17 +1176,47 @@ bool AppInit2(boost::thread_group& threadGroup)
             try {
                 UnloadBlockIndex();
                 delete pcoinsTip;
-                delete pcoinsdbview;
+                delete pcoinsPrefetch;
                 delete pcoinscatcher;
+                delete pcoinsmemory;
+                delete pcoinsdbview;
                 delete pblocktree;
+                delete paddrindex;
+                delete pspentindex;
+                pcoinsPrefetch = NULL;
+                pcoinsmemory = NULL;
+                paddrindex = NULL;
+                pspentindex = NULL;
 
                 pblocktree = new CBlockTreeDB(nBlockTreeDBCache, false, fReindex);
+                if (GetBoolArg("-addrindex", false))
+                    paddrindex = new CAddrIndexDB(nAddrIndexDBCache, false, fReindex);
+                if (GetBoolArg("-spentindex", false))
+                    pspentindex = new CSpentIndexDB(nSpentIndexDBCache, false, fReindex);
                 pcoinsdbview = new CCoinsViewDB(nCoinDBCache, false, fReindex);
-                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsdbview);
-                pcoinsTip = new CCoinsViewCache(pcoinscatcher);
+                if (fCoinsInMemory) {
+                    uiInterface.InitMessage(_("Loading unspent transaction outputs into memory..."));
+                    pcoinsmemory = new CCoinsViewMemory(pcoinsdbview);
+                    if (!pcoinsmemory->Load(*pcoinsdbview)) {
+                        strLoadError = _("Error loading unspent transaction outputs into memory");
+                        break;
+                    }
+                    uiInterface.InitMessage(_("Loading block index..."));
+                }
+                pcoinscatcher = new CCoinsViewErrorCatcher(pcoinsmemory ? (CCoinsView*)pcoinsmemory : pcoinsdbview);
+                if (nPrefetchThreads) {
+                    pcoinsPrefetch = new CCoinsViewPrefetch(pcoinscatcher, MAX_PREFETCH_COINS);
+                    pcoinsTip = new CCoinsViewCache(pcoinsPrefetch);
+                } else {
+                    pcoinsTip = new CCoinsViewCache(pcoinscatcher);
+                }
 
-                if (fReindex)
+                if (fReindex) {
                     pblocktree->WriteReindexing(true);
+                    // If we're reindexing in prune mode, wipe away unusable block files and all undo data files
+                    if (fPruneMode)
+                        CleanupBlockRevFiles();
+                }
 
                 if (!LoadBlockIndex()) {
                     strLoadError = _("Error loading block database");
@@ -1053,9 +1234,32 @@ bool AppInit2(boost::thread_group& threadGroup)
                     break;
                 }
 
-                // Check for changed -txindex state
-                if (fTxIndex != GetBoolArg("-txindex", false)) {
-                    strLoadError = _("You need to rebuild the database using -reindex to change -txindex");
+                // A transaction index written by versions that kept it up to date in ConnectBlock
+                // covers the active chain; build on it instead of starting over
+                uint256 hashTxIndexBest;
+                if (fTxIndex && chainActive.Tip() && !pblocktree->ReadTxIndexBestBlock(hashTxIndexBest))
+                    pblocktree->WriteTxIndexEntries(std::vector<std::pair<uint256, CDiskTxPos> >(), chainActive.Tip()->GetBlockHash());
+
+                // The transaction index is built in the background, so -txindex can change freely
+                fTxIndex = GetBoolArg("-txindex", false);
+                pblocktree->WriteFlag("txindex", fTxIndex);
+
+                // Check for changed -addrindex state
+                if (fAddrIndex != GetBoolArg("-addrindex", false)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -addrindex");
+                    break;
+                }
+
+                // Check for changed -spentindex state
+                if (fSpentIndex != GetBoolArg("-spentindex", false)) {
+                    strLoadError = _("You need to rebuild the database using -reindex to change -spentindex");
+                    break;
+                }
+
+                // Check for changed -prune state. Blocks pruned in the past cannot be served
+                // or rescanned, so going back to unpruned mode means downloading them again.
+                if (fHavePruned && !fPruneMode) {
+                    strLoadError = _("You need to rebuild the database using -reindex to go back to unpruned mode.  This will redownload the entire blockchain");
                     break;
                 }
 
@@ -1065,6 +1269,11 @@ bool AppInit2(boost::thread_group& threadGroup)
                     strLoadError = _("Corrupted block database detected");
                     break;
                 }
+
+                if (!CatchUpIndexes()) {
+                    strLoadError = _("Error bringing the address and spent indexes up to date with the block database");
+                    break;
+                }
             } catch(std::exception &e) {
                 if (fDebug) LogPrintf("%s\n", e.what());
                 strLoadError = _("Error opening block database");
@@ -1103,6 +1312,25 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
     LogPrintf(" block index %15dms\n", GetTimeMillis() - nStart);
 
+    if (pcoinsPrefetch) {
+        LogPrintf("Using %u threads for coins prefetching\n", nPrefetchThreads);
+        for (int i=0; i<nPrefetchThreads; i++)
+            threadGroup.create_thread(boost::bind(&CCoinsViewPrefetch::Thread, pcoinsPrefetch));
+    }
+
+    if (fTxIndex)
+        threadGroup.create_thread(&ThreadTxIndex);
+
+    // if prune mode, unset NODE_NETWORK and prune block files
+    if (fPruneMode) {
+        LogPrintf("Unsetting NODE_NETWORK on prune mode\n");
+        nLocalServices &= ~NODE_NETWORK;
+        if (!fReindex) {
+            uiInterface.InitMessage(_("Pruning blockstore..."));
+            PruneAndFlush();
+        }
+    }
+
     boost::filesystem::path est_path = GetDataDir() / FEE_ESTIMATES_FILENAME;
     CAutoFile est_filein(fopen(est_path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
     // Allowed to fail as this file IS missing on first startup.
@@ -1143,7 +1371,11 @@ bool AppInit2(boost::thread_group& threadGroup)
         if (nLoadWalletRet != DB_LOAD_OK)
         {
             if (nLoadWalletRet == DB_CORRUPT)
+            {
                 strErrors << _("Error loading wallet.dat: Wallet corrupted") << "\n";
+                if (bitdb.IsLogCorrupt(strWalletFile))
+                    strErrors << _("Restart with -salvagewallet to recover the records after the damaged part of wallet.dat") << "\n";
+            }
             else if (nLoadWalletRet == DB_NONCRITICAL_ERROR)
             {
                 string msg(_("Warning: error reading wallet.dat! All keys read correctly, but transaction data"
@@ -1212,6 +1444,18 @@ bool AppInit2(boost::thread_group& threadGroup)
         }
         if (chainActive.Tip() && chainActive.Tip() != pindexRescan)
         {
+            // We can't rescan beyond pruned blocks; this happens when an old wallet
+            // is used with a pruned node, or one left unused for a long time.
+            if (fPruneMode)
+            {
+                CBlockIndex *block = chainActive.Tip();
+                while (block && block->pprev && (block->pprev->nStatus & BLOCK_HAVE_DATA) && block->pprev->nTx > 0 && pindexRescan != block)
+                    block = block->pprev;
+
+                if (pindexRescan != block)
+                    return InitError(_("Prune: last wallet synchronisation goes beyond pruned data. You need to -reindex (download the whole blockchain again in case of pruned node)"));
+            }
+
             uiInterface.InitMessage(_("Rescanning..."));
             LogPrintf("Rescanning last %i blocks (from block %i)...\n", chainActive.Height() - pindexRescan->nHeight, pindexRescan->nHeight);
             nStart = GetTimeMillis();
@@ -6,7 +6,11 @@
 
 #include "util.h"
 
+#include <set>
+#include <stdio.h>
+
 #include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
 
 #include <leveldb/cache.h>
 #include <leveldb/env.h>
@@ -27,14 +31,64 @@ void HandleError(const leveldb::Status& status) throw(leveldb_error)
     throw leveldb_error("Unknown database error");
 }
 
-static leveldb::Options GetOptions(size_t nCacheSize)
+namespace {
+//! All open databases, for GetAllStats()
+CCriticalSection cs_databases;
+std::set<const CLevelDBWrapper*> setDatabases;
+}
+
+CLevelDBParams::CLevelDBParams(const std::string& strNameIn) :
+    strName(strNameIn), nBlockSize(4096), nBlockRestartInterval(16), nMaxOpenFiles(64),
+    fCompression(false), nBloomBits(10), nWriteBufferSize(0) { }
+
+CLevelDBParams CLevelDBParams::FromArgs(const std::string& strNameIn)
+{
+    CLevelDBParams params(strNameIn);
+    const std::string strPrefix = "-" + strNameIn + "db";
+    // LevelDB clips block size, write buffer size and open files to sane ranges itself
+    params.nBlockSize = std::max(GetArg(strPrefix + "blocksize", GetArg("-dbblocksize", params.nBlockSize)), (int64_t)0);
+    params.nBlockRestartInterval = std::max(GetArg(strPrefix + "restartinterval", GetArg("-dbrestartinterval", params.nBlockRestartInterval)), (int64_t)1);
+    params.nMaxOpenFiles = GetArg(strPrefix + "maxopenfiles", GetArg("-dbmaxopenfiles", params.nMaxOpenFiles));
+    params.fCompression = GetBoolArg(strPrefix + "compression", GetBoolArg("-dbcompression", params.fCompression));
+    params.nBloomBits = std::max(GetArg(strPrefix + "bloombits", GetArg("-dbbloombits", params.nBloomBits)), (int64_t)0);
+    params.nWriteBufferSize = std::max(GetArg(strPrefix + "writebuffer", GetArg("-dbwritebuffer", 0)), (int64_t)0) << 20;
+    return params;
+}
+
+double CLevelDBStats::GetWriteAmplification() const
+{
+    if (nBytesWritten == 0)
+        return 0;
+    double dWritten = nBytesWritten;
+    BOOST_FOREACH(const CLevelDBLevelStats& level, vLevels)
+        dWritten += level.dCompactionWriteMB * 1048576.0;
+    return dWritten / nBytesWritten;
+}
+
+int CLevelDBStats::GetReadAmplification() const
+{
+    int nTables = 0;
+    BOOST_FOREACH(const CLevelDBLevelStats& level, vLevels) {
+        if (level.nLevel == 0)
+            nTables += level.nFiles;
+        else if (level.nFiles > 0)
+            nTables++;
+    }
+    return nTables;
+}
+
+static leveldb::Options GetOptions(size_t nCacheSize, const CLevelDBParams& params)
 {
     leveldb::Options options;
     options.block_cache = leveldb::NewLRUCache(nCacheSize / 2);
     options.write_buffer_size = nCacheSize / 4; // up to two write buffers may be held in memory simultaneously
-    options.filter_policy = leveldb::NewBloomFilterPolicy(10);
-    options.compression = leveldb::kNoCompression;
-    options.max_open_files = 64;
+    if (params.nWriteBufferSize)
+        options.write_buffer_size = params.nWriteBufferSize;
+    options.filter_policy = params.nBloomBits ? leveldb::NewBloomFilterPolicy(params.nBloomBits) : NULL;
+    options.compression = params.fCompression ? leveldb::kSnappyCompression : leveldb::kNoCompression;
+    options.max_open_files = params.nMaxOpenFiles;
+    options.block_size = params.nBlockSize;
+    options.block_restart_interval = params.nBlockRestartInterval;
     if (leveldb::kMajorVersion > 1 || (leveldb::kMajorVersion == 1 && leveldb::kMinorVersion >= 16)) {
         // LevelDB versions before 1.16 consider short writes to be corruption. Only trigger error
         // on corruption in later versions.
@@ -43,14 +97,17 @@ static leveldb::Options GetOptions(size_t nCacheSize)
     return options;
 }
 
-CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe)
+CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory, bool fWipe, const CLevelDBParams& paramsIn) :
+    params(paramsIn), strPath(path.string()), nBytesWritten(0), fTrackGeneration(false), chGenerationKey(0), nWriteGeneration(0)
 {
+    if (params.strName.empty())
+        params.strName = path.filename().string();
     penv = NULL;
     readoptions.verify_checksums = true;
     iteroptions.verify_checksums = true;
     iteroptions.fill_cache = false;
     syncoptions.sync = true;
-    options = GetOptions(nCacheSize);
+    options = GetOptions(nCacheSize, params);
     options.create_if_missing = true;
     if (fMemory) {
         penv = leveldb::NewMemEnv(leveldb::Env::Default());
@@ -67,10 +124,17 @@ CLevelDBWrapper::CLevelDBWrapper(const boost::filesystem::path& path, size_t nCa
     leveldb::Status status = leveldb::DB::Open(options, path.string(), &pdb);
     HandleError(status);
     LogPrintf("Opened LevelDB successfully\n");
+
+    LOCK(cs_databases);
+    setDatabases.insert(this);
 }
 
 CLevelDBWrapper::~CLevelDBWrapper()
 {
+    {
+        LOCK(cs_databases);
+        setDatabases.erase(this);
+    }
     delete pdb;
     pdb = NULL;
     delete options.filter_policy;
@@ -81,9 +145,79 @@ CLevelDBWrapper::~CLevelDBWrapper()
     options.env = NULL;
 }
 
+void CLevelDBWrapper::TrackWriteGeneration(char chKey)
+{
+    LOCK(cs_generation);
+    fTrackGeneration = true;
+    chGenerationKey = chKey;
+    if (!Read(chKey, nWriteGeneration))
+        nWriteGeneration = 0;
+}
+
+uint64_t CLevelDBWrapper::GetWriteGeneration()
+{
+    LOCK(cs_generation);
+    return nWriteGeneration;
+}
+
 bool CLevelDBWrapper::WriteBatch(CLevelDBBatch& batch, bool fSync) throw(leveldb_error)
 {
-    leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
-    HandleError(status);
+    {
+        LOCK(cs_generation);
+        if (fTrackGeneration)
+            batch.Write(chGenerationKey, nWriteGeneration + 1);
+        leveldb::Status status = pdb->Write(fSync ? syncoptions : writeoptions, &batch.batch);
+        HandleError(status);
+        if (fTrackGeneration)
+            nWriteGeneration++;
+    }
+    LOCK(cs_stats);
+    nBytesWritten += batch.nSize;
     return true;
 }
+
+CLevelDBStats CLevelDBWrapper::GetStats() const
+{
+    CLevelDBStats stats;
+    stats.params = params;
+    stats.strPath = strPath;
+    {
+        LOCK(cs_stats);
+        stats.nBytesWritten = nBytesWritten;
+    }
+
+    pdb->GetProperty("leveldb.stats", &stats.strStats);
+    // Skip the three header lines, then read one line per level
+    size_t nPos = 0;
+    for (int i = 0; i < 3 && nPos != std::string::npos; i++) {
+        nPos = stats.strStats.find('\n', nPos);
+        if (nPos != std::string::npos)
+            nPos++;
+    }
+    while (nPos != std::string::npos && nPos < stats.strStats.size()) {
+        CLevelDBLevelStats level;
+        if (sscanf(stats.strStats.c_str() + nPos, "%d %d %lf %lf %lf %lf", &level.nLevel, &level.nFiles,
+                   &level.dSizeMB, &level.dCompactionSeconds, &level.dCompactionReadMB, &level.dCompactionWriteMB) != 6)
+            break;
+        stats.vLevels.push_back(level);
+        nPos = stats.strStats.find('\n', nPos);
+        if (nPos != std::string::npos)
+            nPos++;
+    }
+
+    // Keys are short binary strings; none starts with 0xff bytes
+    const std::string strLimit(16, '\xff');
+    leveldb::Range range("", strLimit);
+    stats.nApproximateSize = 0;
+    pdb->GetApproximateSizes(&range, 1, &stats.nApproximateSize);
+    return stats;
+}
+
+std::vector<CLevelDBStats> CLevelDBWrapper::GetAllStats()
+{
+    std::vector<CLevelDBStats> vStats;
+    LOCK(cs_databases);
+    BOOST_FOREACH(const CLevelDBWrapper* pdbwrapper, setDatabases)
+        vStats.push_back(pdbwrapper->GetStats());
+    return vStats;
+}
@@ -8,9 +8,13 @@
 #include "clientversion.h"
 #include "serialize.h"
 #include "streams.h"
+#include "sync.h"
 #include "util.h"
 #include "version.h"
 
+#include <string>
+#include <vector>
+
 #include <boost/filesystem/path.hpp>
 
 #include <leveldb/db.h>
@@ -24,6 +28,74 @@ public:
 
 void HandleError(const leveldb::Status& status) throw(leveldb_error);
 
+/**
+ * Tuning parameters of a LevelDB database. The defaults are what the block and coin databases
+ * have always used; FromArgs() lets them be overridden per database from the command line.
+ */
+struct CLevelDBParams
+{
+    //! Name of the database, used for its command line options and in statistics
+    std::string strName;
+    //! Approximate amount of uncompressed data per table block
+    size_t nBlockSize;
+    //! Number of keys between restart points for delta encoding of keys in a block
+    int nBlockRestartInterval;
+    //! Number of table files kept open
+    int nMaxOpenFiles;
+    //! Compress blocks with Snappy, if LevelDB was built with it
+    bool fCompression;
+    //! Bits per key of the bloom filter in each table; 0 for no filter
+    int nBloomBits;
+    //! Size of the memory table, which is written out as a level-0 table once full; 0 for a quarter of the cache
+    size_t nWriteBufferSize;
+
+    CLevelDBParams(const std::string& strNameIn = "");
+
+    /**
+     * Read -db<option> arguments, where -<name>db<option> takes precedence for the database
+     * called strNameIn (e.g. -chainstatedbbloombits over -dbbloombits).
+     */
+    static CLevelDBParams FromArgs(const std::string& strNameIn);
+};
+
+/** Statistics of a compaction level of a LevelDB database, as reported by leveldb.stats */
+struct CLevelDBLevelStats
+{
+    int nLevel;
+    int nFiles;
+    double dSizeMB;
+    //! Time spent, data read and data written by compactions into this level since the database was opened
+    double dCompactionSeconds;
+    double dCompactionReadMB;
+    double dCompactionWriteMB;
+};
+
+/** Statistics of an open LevelDB database, see CLevelDBWrapper::GetStats() */
+struct CLevelDBStats
+{
+    CLevelDBParams params;
+    std::string strPath;
+    //! Raw leveldb.stats report
+    std::string strStats;
+    std::vector<CLevelDBLevelStats> vLevels;
+    //! Approximate space used on disk
+    uint64_t nApproximateSize;
+    //! Keys and values written through this wrapper since the database was opened
+    uint64_t nBytesWritten;
+
+    /**
+     * Bytes written to disk, for the log and by compactions (including memory table flushes),
+     * per byte written by us.
+     */
+    double GetWriteAmplification() const;
+
+    /**
+     * Upper bound on the number of tables consulted by a lookup of a key that is not cached:
+     * every level-0 table, plus one per other non-empty level.
+     */
+    int GetReadAmplification() const;
+};
+
 /** Batch of changes queued to be written to a CLevelDBWrapper */
 class CLevelDBBatch
 {
@@ -31,8 +103,12 @@ class CLevelDBBatch
 
 private:
     leveldb::WriteBatch batch;
+    //! Size of the keys and values in the batch
+    size_t nSize;
 
 public:
+    CLevelDBBatch() : nSize(0) {}
+
     template <typename K, typename V>
     void Write(const K& key, const V& value)
     {
@@ -47,6 +123,7 @@ public:
         leveldb::Slice slValue(&ssValue[0], ssValue.size());
 
         batch.Put(slKey, slValue);
+        nSize += ssKey.size() + ssValue.size();
     }
 
     template <typename K>
@@ -58,6 +135,7 @@ public:
         leveldb::Slice slKey(&ssKey[0], ssKey.size());
 
         batch.Delete(slKey);
+        nSize += ssKey.size();
     }
 };
 
@@ -85,10 +163,35 @@ private:
     //! the database itself
     leveldb::DB* pdb;
 
+    //! tuning parameters the database was opened with
+    CLevelDBParams params;
+
+    std::string strPath;
+
+    mutable CCriticalSection cs_stats;
+    uint64_t nBytesWritten;
+
+    //! Whether every batch also stores the write generation, under chGenerationKey
+    bool fTrackGeneration;
+    char chGenerationKey;
+    //! Number of batches written since the database was created, if tracked
+    uint64_t nWriteGeneration;
+    //! Keeps the stored write generation in step with the order batches are written in
+    CCriticalSection cs_generation;
+
+protected:
+    //! Count every batch written from now on, storing the count under chKey with the batch
+    void TrackWriteGeneration(char chKey);
+
 public:
-    CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CLevelDBWrapper(const boost::filesystem::path& path, size_t nCacheSize, bool fMemory = false, bool fWipe = false, const CLevelDBParams& paramsIn = CLevelDBParams());
     ~CLevelDBWrapper();
 
+    CLevelDBStats GetStats() const;
+
+    //! Statistics of all databases currently open
+    static std::vector<CLevelDBStats> GetAllStats();
+
     template <typename K, typename V>
     bool Read(const K& key, V& value) const throw(leveldb_error)
     {
@@ -151,6 +254,9 @@ public:
 
     bool WriteBatch(CLevelDBBatch& batch, bool fSync = false) throw(leveldb_error);
 
+    //! Write generation of the last batch written, if tracked
+    uint64_t GetWriteGeneration();
+
     // not available for LevelDB; provide for compatibility with BDB
     bool Flush()
     {
@@ -168,6 +274,25 @@ public:
     {
         return pdb->NewIterator(iteroptions);
     }
+
+    //! Iterator over the database as it was when psnapshot was taken
+    leveldb::Iterator* NewIterator(const leveldb::Snapshot* psnapshot)
+    {
+        leveldb::ReadOptions options = iteroptions;
+        options.snapshot = psnapshot;
+        return pdb->NewIterator(options);
+    }
+
+    //! Take a consistent, read-only snapshot of the database; release it with ReleaseSnapshot()
+    const leveldb::Snapshot* GetSnapshot()
+    {
+        return pdb->GetSnapshot();
+    }
+
+    void ReleaseSnapshot(const leveldb::Snapshot* psnapshot)
+    {
+        pdb->ReleaseSnapshot(psnapshot);
+    }
 };
 
 #endif // BITCOIN_LEVELDBWRAPPER_H
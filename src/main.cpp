@@ -5,16 +5,24 @@
 
 #include "main.h"
 
+#include "addrindex.h"
 #include "addrman.h"
 #include "alert.h"
+#include "blockcache.h"
+#include "blockencodings.h"
+#include "blockfilemap.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "coinsprefetch.h"
+#include "crypto/common.h"
 #include "init.h"
 #include "merkleblock.h"
 #include "net.h"
 #include "pow.h"
+#include "spentindex.h"
 #include "txdb.h"
+#include "txindex.h"
 #include "txmempool.h"
 #include "ui_interface.h"
 #include "util.h"
@@ -25,7 +33,10 @@
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
 
 using namespace boost;
 using namespace std;
@@ -41,18 +52,27 @@ using namespace std;
 CCriticalSection cs_main;
 
 BlockMap mapBlockIndex;
+/** Owns the CBlockIndex objects in mapBlockIndex. */
+static CBlockIndexArena blockIndexArena;
 CChain chainActive;
 CBlockIndex *pindexBestHeader = NULL;
 int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+int nBlockCheckThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = false;
+bool fAddrIndex = false;
+bool fSpentIndex = false;
+bool fHavePruned = false;
+bool fPruneMode = false;
 bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
+bool fCompactBlocks = DEFAULT_COMPACTBLOCKS;
 unsigned int nCoinCacheSize = 5000;
+uint64_t nPruneTarget = 0;
 bool fAlerts = DEFAULT_ALERTS;
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for relaying and mining) */
@@ -68,7 +88,6 @@ map<uint256, COrphanTx> mapOrphanTransactions;
 map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
 void EraseOrphansFor(NodeId peer);
 
-static void CheckBlockIndex();
 
 /** Constant stuff for coinbase transactions we create: */
 CScript COINBASE_FLAGS;
@@ -142,6 +161,28 @@ namespace {
     /** Number of blocks in flight with validated headers. */
     int nQueuedValidatedHeaders = 0;
 
+    /** Blocks that have been received, but are still waiting in the validation pipeline. Protected by cs_main. */
+    set<uint256> setBlocksPipelined;
+
+    /** A block received during initial block download, on its way through the validation pipeline. */
+    struct CPipelinedBlock {
+        CBlock block;
+        NodeId nodeid;
+        CValidationState state;
+        bool fChecking;  //! Whether a check thread has picked this block up.
+        bool fChecked;   //! Whether the context-free checks have completed.
+        bool fValid;     //! Result of the context-free checks.
+    };
+
+    /**
+     * Blocks in the validation pipeline, in order of arrival. Context-free checks run on any
+     * number of check threads; acceptance and connection happen strictly from the front,
+     * on the connect thread. Protected by csBlockPipeline.
+     */
+    deque<boost::shared_ptr<CPipelinedBlock> > vBlockPipeline;
+    CWaitableCriticalSection csBlockPipeline;
+    CConditionVariable cvBlockPipeline;
+
     /** Number of preferable block download peers. */
     int nPreferredDownload = 0;
 
@@ -150,6 +191,9 @@ namespace {
 
     /** Dirty block file entries. */
     set<int> setDirtyFileInfo;
+
+    /** Global flag to indicate we should check to see if there are block/undo files that should be deleted. Set on startup or if we allocate more file space when we're in prune mode. */
+    bool fCheckForPruning = false;
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -260,6 +304,10 @@ struct CNodeState {
     int nBlocksInFlight;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Compact blocks from this peer still waiting for their "blocktxn" response.
+    map<uint256, boost::shared_ptr<PartiallyDownloadedBlock> > mapPartialBlocks;
+    //! Whether this peer sent a "sendcmpct" for the compact block version we speak.
+    bool fSupportsCompactBlocks;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -272,6 +320,7 @@ struct CNodeState {
         nStallingSince = 0;
         nBlocksInFlight = 0;
         fPreferredDownload = false;
+        fSupportsCompactBlocks = false;
     }
 };
 
@@ -337,6 +386,7 @@ void MarkBlockAsReceived(const uint256& hash) {
         state->vBlocksInFlight.erase(itInFlight->second.second);
         state->nBlocksInFlight--;
         state->nStallingSince = 0;
+        state->mapPartialBlocks.erase(hash);
         mapBlocksInFlight.erase(itInFlight);
     }
 }
@@ -356,6 +406,11 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, CBlockIndex *pindex
     mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
 }
 
+/** Whether blocks near the tip may be requested from this peer as compact blocks. Requires cs_main. */
+bool CanRequestCompactBlock(const CNode* pnode) {
+    return fCompactBlocks && State(pnode->GetId())->fSupportsCompactBlocks && !IsInitialBlockDownload();
+}
+
 /** Check whether the last unknown block a peer advertized is not yet known. */
 void ProcessBlockAvailability(NodeId nodeid) {
     CNodeState *state = State(nodeid);
@@ -466,9 +521,12 @@ void FindNextBlocksToDownload(NodeId nodeid, unsigned int count, std::vector<CBl
                 // We consider the chain that this peer is on invalid.
                 return;
             }
-            if (pindex->nStatus & BLOCK_HAVE_DATA) {
+            if (pindex->nStatus & BLOCK_HAVE_DATA || chainActive.Contains(pindex)) {
                 if (pindex->nChainTx)
                     state->pindexLastCommonBlock = pindex;
+            } else if (setBlocksPipelined.count(pindex->GetBlockHash())) {
+                // Already downloaded, but still being validated.
+                continue;
             } else if (mapBlocksInFlight.count(pindex->GetBlockHash()) == 0) {
                 // The block is not already downloaded, and not yet in flight.
                 if (pindex->nHeight > nWindowEnd) {
@@ -542,7 +600,10 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewPrefetch *pcoinsPrefetch = NULL;
 CBlockTreeDB *pblocktree = NULL;
+CAddrIndexDB *paddrindex = NULL;
+CSpentIndexDB *pspentindex = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -1127,25 +1188,30 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
         return true;
     }
 
+    // A copy found through the transaction index in a block off the active chain, used if
+    // there is none in the active chain
+    CTransaction txOffChain;
+    uint256 hashBlockOffChain;
+    bool fOffChain = false;
     if (fTxIndex) {
+        if (FindIndexedTransaction(hash, txOut, hashBlock, fOffChain))
+            return true;
+        if (fOffChain) {
+            txOffChain = txOut;
+            hashBlockOffChain = hashBlock;
+        }
+        // Index written by versions that kept it up to date in ConnectBlock
         CDiskTxPos postx;
         if (pblocktree->ReadTxIndex(hash, postx)) {
-            CAutoFile file(OpenBlockFile(postx, true), SER_DISK, CLIENT_VERSION);
-            if (file.IsNull())
-                return error("%s: OpenBlockFile failed", __func__);
-            CBlockHeader header;
-            try {
-                file >> header;
-                fseek(file.Get(), postx.nTxOffset, SEEK_CUR);
-                file >> txOut;
-            } catch (std::exception &e) {
-                return error("%s : Deserialize or I/O error - %s", __func__, e.what());
-            }
-            hashBlock = header.GetHash();
+            if (!ReadTransactionFromDisk(txOut, hashBlock, postx))
+                return false;
             if (txOut.GetHash() != hash)
                 return error("%s : txid mismatch", __func__);
             return true;
         }
+        // The index follows the tip from its own thread, and may not cover the latest blocks yet
+        if (FindUnindexedTransaction(hash, txOut, hashBlock))
+            return true;
     }
 
     if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
@@ -1173,6 +1239,12 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
         }
     }
 
+    if (fOffChain) {
+        txOut = txOffChain;
+        hashBlock = hashBlockOffChain;
+        return true;
+    }
+
     return false;
 }
 
@@ -1207,18 +1279,68 @@ bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos)
     return true;
 }
 
+/** Read-only mappings of recently used block and undo files; disabled where address space is scarce. */
+static CBlockFileMapper blockFileMapper(sizeof(void*) >= 8 ? MAX_MAPPED_BLOCK_FILES : 0);
+
+/** Blocks and undo data of the last connected tips, for fast reorganizations (protected by cs_main). */
+static CRecentBlockCache recentBlocks(DEFAULT_RECENT_BLOCKS);
+
+void SetRecentBlocks(unsigned int nBlocks)
+{
+    LOCK(cs_main);
+    recentBlocks.SetMaxBlocks(nBlocks);
+}
+
+/**
+ * Find the data of the record written by WriteBlockToDisk or CBlockUndo::WriteToDisk at pos,
+ * followed by nTrailerSize more bytes, in a memory mapping of its file. Returns false when the
+ * file cannot be mapped or the record header is not there, so the caller should use stdio.
+ */
+static bool GetMappedRecord(const CDiskBlockPos& pos, const char* prefix, unsigned int nTrailerSize,
+                            boost::shared_ptr<CMappedFile>& pmapped, const char*& pbegin, const char*& pend)
+{
+    // The record is preceded by the message start and its size
+    static const unsigned int nHeaderSize = MESSAGE_START_SIZE + sizeof(uint32_t);
+    if (pos.IsNull() || pos.nPos < nHeaderSize)
+        return false;
+
+    boost::filesystem::path path = GetBlockPosFilename(pos, prefix);
+    pmapped = blockFileMapper.Get(path, pos.nPos);
+    if (!pmapped)
+        return false;
+    const char* pheader = pmapped->data() + pos.nPos - nHeaderSize;
+    if (memcmp(pheader, Params().MessageStart(), MESSAGE_START_SIZE) != 0)
+        return false;
+    uint64_t nEnd = (uint64_t)pos.nPos + ReadLE32((const unsigned char*)pheader + MESSAGE_START_SIZE) + nTrailerSize;
+    if (nEnd > pmapped->size()) {
+        pmapped = blockFileMapper.Get(path, nEnd);
+        if (!pmapped)
+            return false;
+    }
+
+    pmapped->WillNeed(pos.nPos, nEnd - pos.nPos);
+    pbegin = pmapped->data() + pos.nPos;
+    pend = pmapped->data() + nEnd;
+    return true;
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("ReadBlockFromDisk : OpenBlockFile failed");
-
-    // Read block
+    // Read block, through a mapping of the file if possible
     try {
-        filein >> block;
+        boost::shared_ptr<CMappedFile> pmapped;
+        const char *pbegin, *pend;
+        if (GetMappedRecord(pos, "blk", 0, pmapped, pbegin, pend)) {
+            CMemoryReader reader(pbegin, pend, SER_DISK, CLIENT_VERSION);
+            reader >> block;
+        } else {
+            CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("ReadBlockFromDisk : OpenBlockFile failed");
+            filein >> block;
+        }
     }
     catch (std::exception &e) {
         return error("%s : Deserialize or I/O error - %s", __func__, e.what());
@@ -1231,6 +1353,32 @@ bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos)
     return true;
 }
 
+bool ReadTransactionFromDisk(CTransaction& tx, uint256& hashBlock, const CDiskTxPos& pos)
+{
+    CBlockHeader header;
+    try {
+        boost::shared_ptr<CMappedFile> pmapped;
+        const char *pbegin, *pend;
+        if (GetMappedRecord(pos, "blk", 0, pmapped, pbegin, pend)) {
+            CMemoryReader reader(pbegin, pend, SER_DISK, CLIENT_VERSION);
+            reader >> header;
+            reader.ignore(pos.nTxOffset);
+            reader >> tx;
+        } else {
+            CAutoFile file(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (file.IsNull())
+                return error("%s : OpenBlockFile failed", __func__);
+            file >> header;
+            fseek(file.Get(), pos.nTxOffset, SEEK_CUR);
+            file >> tx;
+        }
+    } catch (std::exception &e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    hashBlock = header.GetHash();
+    return true;
+}
+
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
 {
     if (!ReadBlockFromDisk(block, pindex->GetBlockPos()))
@@ -1531,7 +1679,28 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
 
 
 
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean)
+/** Updates of the optional address and spent indexes, applied once the block's view is committed to the pcoinsTip cache. */
+struct CIndexWrites
+{
+    CAddrIndexBatch batchAddrIndex;
+    CLevelDBBatch batchSpentIndex;
+};
+
+/** Apply the index updates collected while (dis)connecting blocks, which leave hashBestBlock as the tip */
+static bool WriteIndexes(CValidationState& state, CIndexWrites& writes, const uint256& hashBestBlock)
+{
+    if (fAddrIndex)
+        paddrindex->WriteBestBlock(writes.batchAddrIndex, hashBestBlock);
+    if (fSpentIndex)
+        pspentindex->WriteBestBlock(writes.batchSpentIndex, hashBestBlock);
+    if (fAddrIndex && !paddrindex->WriteBatch(writes.batchAddrIndex))
+        return state.Abort("Failed to write address index");
+    if (fSpentIndex && !pspentindex->WriteBatch(writes.batchSpentIndex))
+        return state.Abort("Failed to write spent index");
+    return true;
+}
+
+bool DisconnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool* pfClean, CIndexWrites* pwrites)
 {
     assert(pindex->GetBlockHash() == view.GetBestBlock());
 
@@ -1540,16 +1709,31 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 
     bool fClean = true;
 
-    CBlockUndo blockUndo;
-    CDiskBlockPos pos = pindex->GetUndoPos();
-    if (pos.IsNull())
-        return error("DisconnectBlock() : no undo data available");
-    if (!blockUndo.ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
-        return error("DisconnectBlock() : failure reading undo data");
+    boost::shared_ptr<const CBlockUndo> pundo = recentBlocks.GetUndo(pindex->GetBlockHash());
+    if (!pundo) {
+        boost::shared_ptr<CBlockUndo> pundoRead(new CBlockUndo());
+        CDiskBlockPos pos = pindex->GetUndoPos();
+        if (pos.IsNull())
+            return error("DisconnectBlock() : no undo data available");
+        if (!pundoRead->ReadFromDisk(pos, pindex->pprev->GetBlockHash()))
+            return error("DisconnectBlock() : failure reading undo data");
+        pundo = pundoRead;
+    }
+    const CBlockUndo& blockUndo = *pundo;
 
     if (blockUndo.vtxundo.size() + 1 != block.vtx.size())
         return error("DisconnectBlock() : block and undo data inconsistent");
 
+    // Outputs spent by the block, in block order, for the address and spent indexes
+    const bool fIndexSpent = (fAddrIndex || fSpentIndex) && pwrites;
+    std::vector<CSpentOutput> vSpent;
+    size_t nSpentPos = 0;
+    if (fIndexSpent) {
+        for (unsigned int i = 1; i < block.vtx.size(); i++)
+            nSpentPos += block.vtx[i].vin.size();
+        vSpent.resize(nSpentPos);
+    }
+
     // undo transactions in reverse order
     for (int i = block.vtx.size() - 1; i >= 0; i--) {
         const CTransaction &tx = block.vtx[i];
@@ -1582,6 +1766,7 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
             const CTxUndo &txundo = blockUndo.vtxundo[i-1];
             if (txundo.vprevout.size() != tx.vin.size())
                 return error("DisconnectBlock() : transaction and undo data inconsistent");
+            nSpentPos -= tx.vin.size();
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
                 const CTxInUndo &undo = txundo.vprevout[j];
@@ -1603,10 +1788,19 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
                 if (coins->vout.size() < out.n+1)
                     coins->vout.resize(out.n+1);
                 coins->vout[out.n] = undo.txout;
+                if (fIndexSpent)
+                    vSpent[nSpentPos + j] = CSpentOutput(undo.txout, coins->nHeight);
             }
         }
     }
 
+    if (pwrites) {
+        if (fAddrIndex && !paddrindex->DisconnectBlock(block, pindex->nHeight, vSpent, pwrites->batchAddrIndex))
+            return error("DisconnectBlock() : address index does not match the block");
+        if (fSpentIndex && !pspentindex->DisconnectBlock(block, pwrites->batchSpentIndex))
+            return error("DisconnectBlock() : spent index does not match the block");
+    }
+
     // move best block pointer to prevout block
     view.SetBestBlock(pindex->pprev->GetBlockHash());
 
@@ -1656,11 +1850,11 @@ static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
-bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
+bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck, CIndexWrites* pwrites, bool fAlreadyChecked)
 {
     AssertLockHeld(cs_main);
     // Check it again in case a previous version let a bad block in
-    if (!CheckBlock(block, state, !fJustCheck, !fJustCheck))
+    if (!fAlreadyChecked && !CheckBlock(block, state, !fJustCheck, !fJustCheck))
         return false;
 
     // verify that the view's current state corresponds to the previous block
@@ -1717,15 +1911,16 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     CBlockUndo blockundo;
 
+    // Outputs spent by the block, in block order, for the address and spent indexes
+    const bool fIndexSpent = (fAddrIndex || fSpentIndex) && pwrites && !fJustCheck;
+    std::vector<CSpentOutput> vSpent;
+
     CCheckQueueControl<CScriptCheck> control(fScriptChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
     int64_t nTimeStart = GetTimeMicros();
     CAmount nFees = 0;
     int nInputs = 0;
     unsigned int nSigOps = 0;
-    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
-    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
-    vPos.reserve(block.vtx.size());
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
     for (unsigned int i = 0; i < block.vtx.size(); i++)
     {
@@ -1760,6 +1955,13 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             if (!CheckInputs(tx, state, view, fScriptChecks, flags, false, nScriptCheckThreads ? &vChecks : NULL))
                 return false;
             control.Add(vChecks);
+
+            if (fIndexSpent) {
+                BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                    const CCoins* coins = view.AccessCoins(txin.prevout.hash);
+                    vSpent.push_back(CSpentOutput(coins->vout[txin.prevout.n], coins->nHeight));
+                }
+            }
         }
 
         CTxUndo undoDummy;
@@ -1767,9 +1969,6 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
             blockundo.vtxundo.push_back(CTxUndo());
         }
         UpdateCoins(tx, state, view, i == 0 ? undoDummy : blockundo.vtxundo.back(), pindex->nHeight);
-
-        vPos.push_back(std::make_pair(tx.GetHash(), pos));
-        pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
     int64_t nTime1 = GetTimeMicros(); nTimeConnect += nTime1 - nTimeStart;
     LogPrint("bench", "      - Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin) [%.2fs]\n", (unsigned)block.vtx.size(), 0.001 * (nTime1 - nTimeStart), 0.001 * (nTime1 - nTimeStart) / block.vtx.size(), nInputs <= 1 ? 0 : 0.001 * (nTime1 - nTimeStart) / (nInputs-1), nTimeConnect * 0.000001);
@@ -1807,9 +2006,20 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         setDirtyBlockIndex.insert(pindex);
     }
 
-    if (fTxIndex)
-        if (!pblocktree->WriteTxIndex(vPos))
-            return state.Abort("Failed to write transaction index");
+    // Keep the block and its undo data at hand in case it is disconnected again soon. Reorganizations
+    // during the initial download are rare, so skip the copy there.
+    if (!IsInitialBlockDownload()) {
+        boost::shared_ptr<CBlockUndo> pundo(new CBlockUndo());
+        pundo->vtxundo.swap(blockundo.vtxundo);
+        recentBlocks.Add(pindex->GetBlockHash(), boost::shared_ptr<const CBlock>(new CBlock(block)), pundo);
+    }
+
+    if (fIndexSpent) {
+        if (fAddrIndex && !paddrindex->ConnectBlock(block, pindex->nHeight, vSpent, pwrites->batchAddrIndex))
+            return error("ConnectBlock() : address index does not match the block");
+        if (fSpentIndex && !pspentindex->ConnectBlock(block, pindex->nHeight, vSpent, pwrites->batchSpentIndex))
+            return error("ConnectBlock() : spent index does not match the block");
+    }
 
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
@@ -1829,21 +2039,161 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 }
 
 enum FlushStateMode {
+    FLUSH_STATE_NONE,
     FLUSH_STATE_IF_NEEDED,
     FLUSH_STATE_PERIODIC,
     FLUSH_STATE_ALWAYS
 };
 
+uint64_t CalculateCurrentUsage()
+{
+    uint64_t retval = 0;
+    BOOST_FOREACH(const CBlockFileInfo &file, vinfoBlockFile) {
+        retval += file.nSize + file.nUndoSize;
+    }
+    return retval;
+}
+
+std::vector<CBlockIndex*> PruneBlockIndexFile(BlockMap& mapIndex, std::multimap<CBlockIndex*, CBlockIndex*>& mapUnlinked, int nFile)
+{
+    std::vector<CBlockIndex*> vPruned;
+    for (BlockMap::iterator it = mapIndex.begin(); it != mapIndex.end(); ++it) {
+        CBlockIndex* pindex = it->second;
+        if (pindex->nFile == nFile) {
+            pindex->nStatus &= ~BLOCK_HAVE_DATA;
+            pindex->nStatus &= ~BLOCK_HAVE_UNDO;
+            pindex->nFile = 0;
+            pindex->nDataPos = 0;
+            pindex->nUndoPos = 0;
+            vPruned.push_back(pindex);
+
+            // Prune from mapBlocksUnlinked -- any block we prune would have
+            // to be downloaded again in order to consider its chain, at which
+            // point it would be considered as a candidate for
+            // mapBlocksUnlinked or setBlockIndexCandidates.
+            std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapUnlinked.equal_range(pindex->pprev);
+            while (range.first != range.second) {
+                std::multimap<CBlockIndex *, CBlockIndex *>::iterator it = range.first;
+                range.first++;
+                if (it->second == pindex) {
+                    mapUnlinked.erase(it);
+                }
+            }
+        }
+    }
+    return vPruned;
+}
+
+/** Forget the data of all blocks stored in a block file, so it can be removed. */
+void static PruneOneBlockFile(const int fileNumber)
+{
+    std::vector<CBlockIndex*> vPruned = PruneBlockIndexFile(mapBlockIndex, mapBlocksUnlinked, fileNumber);
+    setDirtyBlockIndex.insert(vPruned.begin(), vPruned.end());
+
+    vinfoBlockFile[fileNumber].SetNull();
+    setDirtyFileInfo.insert(fileNumber);
+}
+
+void static UnlinkPrunedFiles(const std::set<int>& setFilesToPrune)
+{
+    for (set<int>::const_iterator it = setFilesToPrune.begin(); it != setFilesToPrune.end(); ++it) {
+        CDiskBlockPos pos(*it, 0);
+        boost::filesystem::path pathBlock = GetBlockPosFilename(pos, "blk");
+        boost::filesystem::path pathUndo = GetBlockPosFilename(pos, "rev");
+        blockFileMapper.Forget(pathBlock);
+        blockFileMapper.Forget(pathUndo);
+        boost::filesystem::remove(pathBlock);
+        boost::filesystem::remove(pathUndo);
+        LogPrintf("Prune: %s deleted blk/rev (%05u)\n", __func__, *it);
+    }
+}
+
+uint64_t SelectFilesToPrune(const std::vector<CBlockFileInfo>& vinfo, int nLastFile, unsigned int nLastBlockWeCanPrune, uint64_t nTarget, std::set<int>& setFilesToPrune)
+{
+    uint64_t nCurrentUsage = 0;
+    BOOST_FOREACH(const CBlockFileInfo& file, vinfo) {
+        nCurrentUsage += file.nSize + file.nUndoSize;
+    }
+    // We don't check to prune until after we've allocated new space for files,
+    // so we should leave a buffer under our target to account for another allocation
+    // before the next pruning.
+    uint64_t nBuffer = BLOCKFILE_CHUNK_SIZE + UNDOFILE_CHUNK_SIZE;
+    uint64_t nBytesToPrune;
+
+    if (nCurrentUsage + nBuffer >= nTarget) {
+        for (int fileNumber = 0; fileNumber < nLastFile; fileNumber++) {
+            nBytesToPrune = vinfo[fileNumber].nSize + vinfo[fileNumber].nUndoSize;
+
+            if (vinfo[fileNumber].nSize == 0)
+                continue;
+
+            if (nCurrentUsage + nBuffer < nTarget)  // are we below our target?
+                break;
+
+            // don't prune files that could have a block within MIN_BLOCKS_TO_KEEP of the main chain's tip
+            if (vinfo[fileNumber].nHeightLast > nLastBlockWeCanPrune)
+                break;
+
+            setFilesToPrune.insert(fileNumber);
+            nCurrentUsage -= nBytesToPrune;
+        }
+    }
+    return nCurrentUsage;
+}
+
+/**
+ * Prune the block files SelectFilesToPrune picks for the active chain, and
+ * queue them up for removal in setFilesToPrune. Nothing is pruned before the
+ * chain is past the PruneAfterHeight of the network.
+ */
+void static FindFilesToPrune(std::set<int>& setFilesToPrune)
+{
+    LOCK2(cs_main, cs_LastBlockFile);
+    if (chainActive.Tip() == NULL || nPruneTarget == 0) {
+        return;
+    }
+    if ((uint64_t)chainActive.Tip()->nHeight <= Params().PruneAfterHeight()) {
+        return;
+    }
+
+    unsigned int nLastBlockWeCanPrune = chainActive.Tip()->nHeight - MIN_BLOCKS_TO_KEEP;
+    std::set<int> setPicked;
+    uint64_t nCurrentUsage = SelectFilesToPrune(vinfoBlockFile, nLastBlockFile, nLastBlockWeCanPrune, nPruneTarget, setPicked);
+    BOOST_FOREACH(int fileNumber, setPicked) {
+        PruneOneBlockFile(fileNumber);
+    }
+    setFilesToPrune.insert(setPicked.begin(), setPicked.end());
+
+    LogPrint("prune", "Prune: target=%dMiB actual=%dMiB diff=%dMiB max_prune_height=%d removed %d blk/rev pairs\n",
+           nPruneTarget/1024/1024, nCurrentUsage/1024/1024,
+           ((int64_t)nPruneTarget - (int64_t)nCurrentUsage)/1024/1024,
+           nLastBlockWeCanPrune, setPicked.size());
+}
+
 /**
  * Update the on-disk chain state.
- * The caches and indexes are flushed if either they're too large, forceWrite is set, or
- * fast is not set and it's been a while since the last write.
+ * The caches and indexes are flushed depending on the mode we're called with
+ * if they're too large, if it's been a while since the last write,
+ * or always and in all cases if we're in prune mode and are deleting files.
  */
 bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
-    LOCK(cs_main);
+    LOCK2(cs_main, cs_LastBlockFile);
     static int64_t nLastWrite = 0;
+    std::set<int> setFilesToPrune;
+    bool fFlushForPrune = false;
     try {
-    if ((mode == FLUSH_STATE_ALWAYS) ||
+    if (fPruneMode && fCheckForPruning && !fReindex) {
+        FindFilesToPrune(setFilesToPrune);
+        fCheckForPruning = false;
+        if (!setFilesToPrune.empty()) {
+            fFlushForPrune = true;
+            if (!fHavePruned) {
+                pblocktree->WriteFlag("prunedblockfiles", true);
+                fHavePruned = true;
+            }
+        }
+    }
+    if ((mode == FLUSH_STATE_ALWAYS) || fFlushForPrune ||
         ((mode == FLUSH_STATE_PERIODIC || mode == FLUSH_STATE_IF_NEEDED) && pcoinsTip->GetCacheSize() > nCoinCacheSize) ||
         (mode == FLUSH_STATE_PERIODIC && GetTimeMicros() > nLastWrite + DATABASE_WRITE_INTERVAL * 1000000)) {
         // Typical CCoins structures on disk are around 100 bytes in size.
@@ -1874,11 +2224,14 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
              setDirtyBlockIndex.erase(it++);
         }
         pblocktree->Sync();
+        // Then remove any files pruned above, now that no block index entry refers to them.
+        if (fFlushForPrune)
+            UnlinkPrunedFiles(setFilesToPrune);
         // Finally flush the chainstate (which may refer to block index entries).
         if (!pcoinsTip->Flush())
             return state.Abort("Failed to write to coin database");
         // Update best block in wallet (so we can detect restored wallets).
-        if (mode != FLUSH_STATE_IF_NEEDED) {
+        if (mode != FLUSH_STATE_IF_NEEDED && mode != FLUSH_STATE_NONE) {
             g_signals.SetBestChain(chainActive.GetLocator());
         }
         nLastWrite = GetTimeMicros();
@@ -1894,6 +2247,138 @@ void FlushStateToDisk() {
     FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
 }
 
+void PruneAndFlush() {
+    CValidationState state;
+    fCheckForPruning = true;
+    FlushStateToDisk(state, FLUSH_STATE_NONE);
+}
+
+/** Digest of the UTXO set at the tip, kept up to date once a GetUTXOStats() scan has set it. Protected by cs_main. */
+static CCoinsSetHash coinsSetHashTip;
+static bool fCoinsSetHashTip = false;
+/** Number of GetUTXOStats() scans in progress. Protected by cs_main. */
+static int nCoinsStatsScans = 0;
+/** While any scan is in progress, the tip after each block (dis)connection and the change it made. Protected by cs_main. */
+static std::vector<std::pair<uint256, CCoinsSetHash> > vCoinsSetHashChanges;
+
+/**
+ * Compute the change a block makes to the UTXO set digest: the outputs it creates minus
+ * the outputs it spends. Spent outputs not created in the block itself are looked up in
+ * view, which must have them unspent.
+ */
+static void GetBlockCoinsSetChange(const CBlock& block, const CCoinsViewCache& view, CCoinsSetHash& change)
+{
+    std::map<uint256, const CTransaction*> mapBlockTxs;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        const uint256 hash = tx.GetHash();
+        mapBlockTxs[hash] = &tx;
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            if (!tx.vout[i].scriptPubKey.IsUnspendable())
+                change.Add(COutPoint(hash, i), tx.vout[i]);
+        }
+    }
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (tx.IsCoinBase())
+            continue;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            std::map<uint256, const CTransaction*>::const_iterator it = mapBlockTxs.find(txin.prevout.hash);
+            if (it != mapBlockTxs.end()) {
+                change.Remove(txin.prevout, it->second->vout[txin.prevout.n]);
+            } else {
+                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
+                assert(coins && coins->IsAvailable(txin.prevout.n));
+                change.Remove(txin.prevout, coins->vout[txin.prevout.n]);
+            }
+        }
+    }
+}
+
+/**
+ * Compute the change connecting (fConnect) or disconnecting a block makes to the UTXO set
+ * digest. Returns false if the digest is not being kept up to date, or the block makes none.
+ */
+static bool GetCoinsSetHashChange(const CBlock& block, const CCoinsViewCache& view, bool fConnect, CCoinsSetHash& change)
+{
+    AssertLockHeld(cs_main);
+    if (!fCoinsSetHashTip && nCoinsStatsScans == 0)
+        return false;
+    // The genesis block's outputs are not part of the UTXO set
+    if (block.GetHash() == Params().HashGenesisBlock())
+        return false;
+
+    change = CCoinsSetHash();
+    GetBlockCoinsSetChange(block, view, change);
+    if (!fConnect) {
+        CCoinsSetHash inverse;
+        inverse -= change;
+        change = inverse;
+    }
+    return true;
+}
+
+/** Apply a change from GetCoinsSetHashChange to the UTXO set digest of the tip, which is now hashNewTip. */
+static void ApplyCoinsSetHashChange(const uint256& hashNewTip, const CCoinsSetHash& change)
+{
+    AssertLockHeld(cs_main);
+    if (fCoinsSetHashTip)
+        coinsSetHashTip += change;
+    if (nCoinsStatsScans > 0)
+        vCoinsSetHashChanges.push_back(std::make_pair(hashNewTip, change));
+}
+
+bool GetUTXOStats(CCoinsStats &stats, bool fIncremental)
+{
+    size_t nChangesStart;
+    uint256 hashScanStart;
+    {
+        LOCK(cs_main);
+        if (fIncremental && fCoinsSetHashTip) {
+            stats.nHeight = chainActive.Height();
+            stats.hashBlock = chainActive.Tip()->GetBlockHash();
+            stats.nTransactionOutputs = coinsSetHashTip.GetOutputs();
+            stats.nTotalAmount = coinsSetHashTip.GetAmount();
+            stats.hashSet = coinsSetHashTip.GetHash();
+            return true;
+        }
+        FlushStateToDisk();
+        // Record changes from here on, to bring the scanned digest forward to the tip afterwards
+        nCoinsStatsScans++;
+        nChangesStart = vCoinsSetHashChanges.size();
+        hashScanStart = pcoinsTip->GetBestBlock();
+    }
+
+    // The coin database is scanned from a snapshot, without holding cs_main
+    bool ret = false;
+    try {
+        ret = pcoinsTip->GetStats(stats);
+    } catch (...) {
+        LOCK(cs_main);
+        if (--nCoinsStatsScans == 0)
+            vCoinsSetHashChanges.clear();
+        throw;
+    }
+
+    LOCK(cs_main);
+    if (ret && !fCoinsSetHashTip) {
+        // The snapshot may have been taken after later blocks were flushed; find the
+        // last change that led to its block. The digest of a set does not depend on
+        // the path to it, so any occurrence of that block would do.
+        size_t nChange = vCoinsSetHashChanges.size();
+        while (nChange > nChangesStart && vCoinsSetHashChanges[nChange - 1].first != stats.hashBlock)
+            nChange--;
+        if (nChange > nChangesStart || stats.hashBlock == hashScanStart) {
+            coinsSetHashTip = CCoinsSetHash(stats.hashSet, stats.nTransactionOutputs, stats.nTotalAmount);
+            for (; nChange < vCoinsSetHashChanges.size(); nChange++)
+                coinsSetHashTip += vCoinsSetHashChanges[nChange].second;
+            fCoinsSetHashTip = true;
+            LogPrint("coindb", "%s: UTXO set digest initialized at %s\n", __func__, chainActive.Tip()->GetBlockHash().ToString());
+        }
+    }
+    if (--nCoinsStatsScans == 0)
+        vCoinsSetHashChanges.clear();
+    return ret;
+}
+
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex *pindexNew) {
     chainActive.SetTip(pindexNew);
@@ -1933,43 +2418,75 @@ void static UpdateTip(CBlockIndex *pindexNew) {
     }
 }
 
-/** Disconnect chainActive's tip. */
-bool static DisconnectTip(CValidationState &state) {
-    CBlockIndex *pindexDelete = chainActive.Tip();
-    assert(pindexDelete);
+/**
+ * Disconnect blocks from chainActive's tip down to pindexFork, or at most MAX_DISCONNECT_BATCH_BLOCKS
+ * of them. Their effects on the UTXO set are applied to one cache layer, which is flushed once.
+ * The index updates and UTXO set digest changes are collected as well, and only applied once
+ * every block of the batch is disconnected, so a failure leaves no trace of the batch.
+ */
+bool static DisconnectTips(CValidationState &state, const CBlockIndex *pindexFork) {
+    CBlockIndex *pindexNewTip = chainActive.Tip();
+    assert(pindexNewTip && pindexNewTip != pindexFork);
     mempool.check(pcoinsTip);
-    // Read block from disk.
-    CBlock block;
-    if (!ReadBlockFromDisk(block, pindexDelete))
-        return state.Abort("Failed to read block");
-    // Apply the block atomically to the chain state.
+    // The disconnected blocks, tip first
+    std::vector<boost::shared_ptr<const CBlock> > vBlocks;
+    CIndexWrites indexWrites;
+    // The UTXO set digest changes, with the tip each one leaves
+    std::vector<std::pair<uint256, CCoinsSetHash> > vSetHashChanges;
+    // Apply the blocks atomically to the chain state.
     int64_t nStart = GetTimeMicros();
     {
         CCoinsViewCache view(pcoinsTip);
-        if (!DisconnectBlock(block, state, pindexDelete, view))
-            return error("DisconnectTip() : DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
+        while (pindexNewTip != pindexFork && vBlocks.size() < MAX_DISCONNECT_BATCH_BLOCKS) {
+            CBlockIndex *pindexDelete = pindexNewTip;
+            // Read block from memory or disk.
+            boost::shared_ptr<const CBlock> pblock = recentBlocks.GetBlock(pindexDelete->GetBlockHash());
+            if (!pblock) {
+                boost::shared_ptr<CBlock> pblockRead(new CBlock());
+                if (!ReadBlockFromDisk(*pblockRead, pindexDelete))
+                    return state.Abort("Failed to read block");
+                pblock = pblockRead;
+            }
+            if (!DisconnectBlock(*pblock, state, pindexDelete, view, NULL, &indexWrites))
+                return error("DisconnectTips() : DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
+            // The spent outputs are back in view
+            CCoinsSetHash change;
+            if (GetCoinsSetHashChange(*pblock, view, false, change))
+                vSetHashChanges.push_back(std::make_pair(pindexDelete->pprev->GetBlockHash(), change));
+            vBlocks.push_back(pblock);
+            pindexNewTip = pindexDelete->pprev;
+        }
         assert(view.Flush());
     }
-    LogPrint("bench", "- Disconnect block: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
+    if (!WriteIndexes(state, indexWrites, pindexNewTip->GetBlockHash()))
+        return false;
+    for (unsigned int i = 0; i < vSetHashChanges.size(); i++)
+        ApplyCoinsSetHashChange(vSetHashChanges[i].first, vSetHashChanges[i].second);
+    LogPrint("bench", "- Disconnect %u blocks: %.2fms\n", (unsigned int)vBlocks.size(), (GetTimeMicros() - nStart) * 0.001);
     // Write the chain state to disk, if necessary.
     if (!FlushStateToDisk(state, FLUSH_STATE_IF_NEEDED))
         return false;
-    // Resurrect mempool transactions from the disconnected block.
-    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-        // ignore validation errors in resurrected transactions
-        list<CTransaction> removed;
-        CValidationState stateDummy;
-        if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
-            mempool.remove(tx, removed, true);
-    }
-    mempool.removeCoinbaseSpends(pcoinsTip, pindexDelete->nHeight);
+    // Resurrect mempool transactions from the disconnected blocks, oldest block first so that
+    // transactions come back after the ones they spend.
+    BOOST_REVERSE_FOREACH(const boost::shared_ptr<const CBlock> &pblock, vBlocks) {
+        BOOST_FOREACH(const CTransaction &tx, pblock->vtx) {
+            // ignore validation errors in resurrected transactions
+            list<CTransaction> removed;
+            CValidationState stateDummy;
+            if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+                mempool.remove(tx, removed, true);
+        }
+    }
+    mempool.removeCoinbaseSpends(pcoinsTip, pindexNewTip->nHeight + 1);
     mempool.check(pcoinsTip);
     // Update chainActive and related variables.
-    UpdateTip(pindexDelete->pprev);
+    UpdateTip(pindexNewTip);
     // Let wallets know transactions went from 1-confirmed to
     // 0-confirmed or conflicted:
-    BOOST_FOREACH(const CTransaction &tx, block.vtx) {
-        SyncWithWallets(tx, NULL);
+    BOOST_FOREACH(const boost::shared_ptr<const CBlock> &pblock, vBlocks) {
+        BOOST_FOREACH(const CTransaction &tx, pblock->vtx) {
+            SyncWithWallets(tx, NULL);
+        }
     }
     return true;
 }
@@ -1990,6 +2507,8 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     // Read block from disk.
     int64_t nTime1 = GetTimeMicros();
     CBlock block;
+    // A block handed over was checked as it was accepted; one read from disk may be from a previous version
+    bool fAlreadyChecked = pblock != NULL;
     if (!pblock) {
         if (!ReadBlockFromDisk(block, pindexNew))
             return state.Abort("Failed to read block");
@@ -1999,10 +2518,11 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
     int64_t nTime3;
     LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    CIndexWrites indexWrites;
     {
         CCoinsViewCache view(pcoinsTip);
         CInv inv(MSG_BLOCK, pindexNew->GetBlockHash());
-        bool rv = ConnectBlock(*pblock, state, pindexNew, view);
+        bool rv = ConnectBlock(*pblock, state, pindexNew, view, false, &indexWrites, fAlreadyChecked);
         g_signals.BlockChecked(*pblock, state);
         if (!rv) {
             if (state.IsInvalid())
@@ -2010,10 +2530,16 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
             return error("ConnectTip() : ConnectBlock %s failed", pindexNew->GetBlockHash().ToString());
         }
         mapBlockSource.erase(inv.hash);
+        // The spent outputs are still in pcoinsTip until view is flushed
+        CCoinsSetHash change;
+        if (GetCoinsSetHashChange(*pblock, *pcoinsTip, true, change))
+            ApplyCoinsSetHashChange(pindexNew->GetBlockHash(), change);
         nTime3 = GetTimeMicros(); nTimeConnectTotal += nTime3 - nTime2;
         LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
         assert(view.Flush());
     }
+    if (!WriteIndexes(state, indexWrites, pindexNew->GetBlockHash()))
+        return false;
     int64_t nTime4 = GetTimeMicros(); nTimeFlush += nTime4 - nTime3;
     LogPrint("bench", "  - Flush: %.2fms [%.2fs]\n", (nTime4 - nTime3) * 0.001, nTimeFlush * 0.000001);
     // Write the chain state to disk, if necessary.
@@ -2064,15 +2590,29 @@ static CBlockIndex* FindMostWorkChain() {
         CBlockIndex *pindexTest = pindexNew;
         bool fInvalidAncestor = false;
         while (pindexTest && !chainActive.Contains(pindexTest)) {
-            assert(pindexTest->nStatus & BLOCK_HAVE_DATA);
             assert(pindexTest->nChainTx || pindexTest->nHeight == 0);
-            if (pindexTest->nStatus & BLOCK_FAILED_MASK) {
-                // Candidate has an invalid ancestor, remove entire chain from the set.
-                if (pindexBestInvalid == NULL || pindexNew->nChainWork > pindexBestInvalid->nChainWork)
+
+            // Pruned nodes may have entries in setBlockIndexCandidates for
+            // which block files have been deleted.  Remove those as candidates
+            // for the most work chain if we come across them; we can't switch
+            // to a chain unless we have all the non-active-chain parent blocks.
+            bool fFailedChain = pindexTest->nStatus & BLOCK_FAILED_MASK;
+            bool fMissingData = !(pindexTest->nStatus & BLOCK_HAVE_DATA);
+            if (fFailedChain || fMissingData) {
+                // Candidate chain is not usable (either invalid or missing data)
+                if (fFailedChain && (pindexBestInvalid == NULL || pindexNew->nChainWork > pindexBestInvalid->nChainWork))
                     pindexBestInvalid = pindexNew;
                 CBlockIndex *pindexFailed = pindexNew;
+                // Remove the entire chain from the set.
                 while (pindexTest != pindexFailed) {
-                    pindexFailed->nStatus |= BLOCK_FAILED_CHILD;
+                    if (fFailedChain) {
+                        pindexFailed->nStatus |= BLOCK_FAILED_CHILD;
+                    } else if (fMissingData) {
+                        // If we're missing data, then add back to mapBlocksUnlinked,
+                        // so that if the block arrives in the future we can try adding
+                        // to setBlockIndexCandidates again.
+                        mapBlocksUnlinked.insert(std::make_pair(pindexFailed->pprev, pindexFailed));
+                    }
                     setBlockIndexCandidates.erase(pindexFailed);
                     pindexFailed = pindexFailed->pprev;
                 }
@@ -2111,7 +2651,7 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
 
     // Disconnect active blocks which are no longer in the best chain.
     while (chainActive.Tip() && chainActive.Tip() != pindexFork) {
-        if (!DisconnectTip(state))
+        if (!DisconnectTips(state, pindexFork))
             return false;
     }
 
@@ -2170,7 +2710,8 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
 /**
  * Make the best chain active, in multiple steps. The result is either failure
  * or an activated best chain. pblock is either NULL or a pointer to a block
- * that is already loaded (to avoid loading it again from disk).
+ * that is already loaded and passed CheckBlock (to avoid loading and checking
+ * it again).
  */
 bool ActivateBestChain(CValidationState &state, CBlock *pblock) {
     CBlockIndex *pindexNewTip = NULL;
@@ -2228,14 +2769,17 @@ bool InvalidateBlock(CValidationState& state, CBlockIndex *pindex) {
     setDirtyBlockIndex.insert(pindex);
     setBlockIndexCandidates.erase(pindex);
 
+    if (chainActive.Contains(pindex)) {
+        for (CBlockIndex *pindexWalk = chainActive.Tip(); pindexWalk != pindex->pprev; pindexWalk = pindexWalk->pprev) {
+            pindexWalk->nStatus |= BLOCK_FAILED_CHILD;
+            setDirtyBlockIndex.insert(pindexWalk);
+            setBlockIndexCandidates.erase(pindexWalk);
+        }
+    }
     while (chainActive.Contains(pindex)) {
-        CBlockIndex *pindexWalk = chainActive.Tip();
-        pindexWalk->nStatus |= BLOCK_FAILED_CHILD;
-        setDirtyBlockIndex.insert(pindexWalk);
-        setBlockIndexCandidates.erase(pindexWalk);
         // ActivateBestChain considers blocks already in chainActive
         // unconditionally valid already, so force disconnect away from it.
-        if (!DisconnectTip(state)) {
+        if (!DisconnectTips(state, pindex->pprev)) {
             return false;
         }
     }
@@ -2296,8 +2840,8 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
         return it->second;
 
     // Construct new block index object
-    CBlockIndex* pindexNew = new CBlockIndex(block);
-    assert(pindexNew);
+    CBlockIndex* pindexNew = blockIndexArena.Allocate();
+    *pindexNew = CBlockIndex(block);
     // We assign the sequence id to blocks only when the full data is available,
     // to avoid miners withholding blocks but broadcasting headers, to get a
     // competitive advantage.
@@ -2404,6 +2948,8 @@ bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAdd
                 FILE *file = OpenBlockFile(pos);
                 if (file) {
                     LogPrintf("Pre-allocating up to position 0x%x in blk%05u.dat\n", nNewChunks * BLOCKFILE_CHUNK_SIZE, pos.nFile);
+                    if (fPruneMode)
+                        fCheckForPruning = true;
                     AllocateFileRange(file, pos.nPos, nNewChunks * BLOCKFILE_CHUNK_SIZE - pos.nPos);
                     fclose(file);
                 }
@@ -2435,6 +2981,8 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
             FILE *file = OpenUndoFile(pos);
             if (file) {
                 LogPrintf("Pre-allocating up to position 0x%x in rev%05u.dat\n", nNewChunks * UNDOFILE_CHUNK_SIZE, pos.nFile);
+                if (fPruneMode)
+                    fCheckForPruning = true;
                 AllocateFileRange(file, pos.nPos, nNewChunks * UNDOFILE_CHUNK_SIZE - pos.nPos);
                 fclose(file);
             }
@@ -2633,7 +3181,7 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     return true;
 }
 
-bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex)
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex, bool fCheckPOW)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
@@ -2650,7 +3198,7 @@ bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBloc
         return true;
     }
 
-    if (!CheckBlockHeader(block, state))
+    if (!CheckBlockHeader(block, state, fCheckPOW))
         return false;
 
     // Get prev block index
@@ -2676,13 +3224,14 @@ bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBloc
     return true;
 }
 
-bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex, CDiskBlockPos* dbp)
+bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex, CDiskBlockPos* dbp, bool fAlreadyChecked)
 {
     AssertLockHeld(cs_main);
 
     CBlockIndex *&pindex = *ppindex;
 
-    if (!AcceptBlockHeader(block, state, &pindex))
+    // The scrypt proof of work is costly; don't compute it again for a block that already passed CheckBlock.
+    if (!AcceptBlockHeader(block, state, &pindex, !fAlreadyChecked))
         return false;
 
     if (pindex->nStatus & BLOCK_HAVE_DATA) {
@@ -2691,7 +3240,7 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex** ppindex,
         return true;
     }
 
-    if ((!CheckBlock(block, state)) || !ContextualCheckBlock(block, state, pindex->pprev)) {
+    if ((!fAlreadyChecked && !CheckBlock(block, state)) || !ContextualCheckBlock(block, state, pindex->pprev)) {
         if (state.IsInvalid() && !state.CorruptionPossible()) {
             pindex->nStatus |= BLOCK_FAILED_VALID;
             setDirtyBlockIndex.insert(pindex);
@@ -2783,23 +3332,21 @@ void CBlockIndex::BuildSkip()
         pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
 
-bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
+/** Store and connect a block whose context-free checks (with result fChecked) have already been run. */
+static bool ProcessCheckedBlock(CValidationState &state, bool fChecked, NodeId nodeid, CBlock* pblock, CDiskBlockPos *dbp)
 {
-    // Preliminary checks
-    bool checked = CheckBlock(*pblock, state);
-
     {
         LOCK(cs_main);
         MarkBlockAsReceived(pblock->GetHash());
-        if (!checked) {
+        if (!fChecked) {
             return error("%s : CheckBlock FAILED", __func__);
         }
 
         // Store to disk
         CBlockIndex *pindex = NULL;
-        bool ret = AcceptBlock(*pblock, state, &pindex, dbp);
-        if (pindex && pfrom) {
-            mapBlockSource[pindex->GetBlockHash()] = pfrom->GetId();
+        bool ret = AcceptBlock(*pblock, state, &pindex, dbp, true);
+        if (pindex && nodeid != -1) {
+            mapBlockSource[pindex->GetBlockHash()] = nodeid;
         }
         CheckBlockIndex();
         if (!ret)
@@ -2812,6 +3359,106 @@ bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDis
     return true;
 }
 
+bool ProcessNewBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
+{
+    // Preliminary checks
+    bool checked = CheckBlock(*pblock, state);
+
+    return ProcessCheckedBlock(state, checked, pfrom ? pfrom->GetId() : -1, pblock, dbp);
+}
+
+bool QueueBlockForValidation(CNode* pfrom, const CBlock& block)
+{
+    if (nBlockCheckThreads == 0)
+        return false;
+
+    boost::shared_ptr<CPipelinedBlock> pentry(new CPipelinedBlock());
+    {
+        boost::unique_lock<boost::mutex> lock(csBlockPipeline);
+        if (vBlockPipeline.size() >= MAX_BLOCKS_PIPELINED)
+            return false;
+        pentry->block = block;
+        pentry->nodeid = pfrom->GetId();
+        pentry->fChecking = false;
+        pentry->fChecked = false;
+        pentry->fValid = false;
+        vBlockPipeline.push_back(pentry);
+    }
+    {
+        // The peer delivered; free its download slot, but keep others from fetching the block again.
+        LOCK(cs_main);
+        MarkBlockAsReceived(block.GetHash());
+        setBlocksPipelined.insert(block.GetHash());
+    }
+    cvBlockPipeline.notify_all();
+    return true;
+}
+
+void ThreadBlockCheck()
+{
+    RenameThread("litecoin-blockchk");
+    while (true) {
+        boost::shared_ptr<CPipelinedBlock> pentry;
+        {
+            boost::unique_lock<boost::mutex> lock(csBlockPipeline);
+            while (!pentry) {
+                BOOST_FOREACH(const boost::shared_ptr<CPipelinedBlock>& p, vBlockPipeline) {
+                    if (!p->fChecking) {
+                        pentry = p;
+                        pentry->fChecking = true;
+                        break;
+                    }
+                }
+                if (!pentry)
+                    cvBlockPipeline.wait(lock);
+            }
+        }
+
+        // Proof of work and merkle root are the expensive part, and need no locks.
+        bool fValid = CheckBlock(pentry->block, pentry->state);
+
+        // Start reading the coins it spends while it waits to be connected.
+        if (fValid && pcoinsPrefetch)
+            pcoinsPrefetch->Prefetch(pentry->block);
+
+        {
+            boost::unique_lock<boost::mutex> lock(csBlockPipeline);
+            pentry->fValid = fValid;
+            pentry->fChecked = true;
+        }
+        cvBlockPipeline.notify_all();
+    }
+}
+
+void ThreadBlockConnect()
+{
+    RenameThread("litecoin-blockconn");
+    while (true) {
+        boost::shared_ptr<CPipelinedBlock> pentry;
+        {
+            boost::unique_lock<boost::mutex> lock(csBlockPipeline);
+            while (vBlockPipeline.empty() || !vBlockPipeline.front()->fChecked)
+                cvBlockPipeline.wait(lock);
+            pentry = vBlockPipeline.front();
+            vBlockPipeline.pop_front();
+        }
+
+        const uint256 hash = pentry->block.GetHash();
+        ProcessCheckedBlock(pentry->state, pentry->fValid, pentry->nodeid, &pentry->block, NULL);
+
+        LOCK(cs_main);
+        setBlocksPipelined.erase(hash);
+        // The peer may be gone by now; otherwise report like the "block" message handler would.
+        int nDoS = 0;
+        if (pentry->state.IsInvalid(nDoS) && State(pentry->nodeid)) {
+            CBlockReject reject = {pentry->state.GetRejectCode(), pentry->state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), hash};
+            State(pentry->nodeid)->rejects.push_back(reject);
+            if (nDoS > 0)
+                Misbehaving(pentry->nodeid, nDoS);
+        }
+    }
+}
+
 bool TestBlockValidity(CValidationState &state, const CBlock& block, CBlockIndex * const pindexPrev, bool fCheckPOW, bool fCheckMerkleRoot)
 {
     AssertLockHeld(cs_main);
@@ -2911,36 +3558,340 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
         return (*mi).second;
 
     // Create new
-    CBlockIndex* pindexNew = new CBlockIndex();
-    if (!pindexNew)
-        throw runtime_error("LoadBlockIndex() : new CBlockIndex failed");
+    CBlockIndex* pindexNew = blockIndexArena.Allocate();
     mi = mapBlockIndex.insert(make_pair(hash, pindexNew)).first;
     pindexNew->phashBlock = &((*mi).first);
 
     return pindexNew;
 }
 
-bool static LoadBlockIndexDB()
+namespace {
+
+/**
+ * Block index entry as stored in the block index snapshot. Entries refer to their predecessor
+ * and skip entry by position in the snapshot, and carry their chain work, so the index can be
+ * rebuilt without hash lookups or big number arithmetic.
+ */
+struct CBlockIndexSnapshotEntry
 {
-    if (!pblocktree->LoadBlockIndexGuts())
-        return false;
+    uint256 hash;
+    int32_t nPrev;
+    int32_t nSkip;
+    int32_t nHeight;
+    int32_t nFile;
+    uint32_t nDataPos;
+    uint32_t nUndoPos;
+    uint256 nChainWork;
+    uint32_t nTx;
+    uint32_t nStatus;
+    int32_t nVersion;
+    uint256 hashMerkleRoot;
+    uint32_t nTime;
+    uint32_t nBits;
+    uint32_t nNonce;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersionIn) {
+        READWRITE(hash);
+        READWRITE(nPrev);
+        READWRITE(nSkip);
+        READWRITE(nHeight);
+        READWRITE(nFile);
+        READWRITE(nDataPos);
+        READWRITE(nUndoPos);
+        READWRITE(nChainWork);
+        READWRITE(nTx);
+        READWRITE(nStatus);
+        READWRITE(nVersion);
+        READWRITE(hashMerkleRoot);
+        READWRITE(nTime);
+        READWRITE(nBits);
+        READWRITE(nNonce);
+    }
+};
 
-    boost::this_thread::interruption_point();
+//! Format version of the block index snapshot; snapshots of any other version are ignored
+static const int BLOCK_INDEX_SNAPSHOT_VERSION = 1;
 
-    // Calculate nChainWork
-    vector<pair<int, CBlockIndex*> > vSortedByHeight;
-    vSortedByHeight.reserve(mapBlockIndex.size());
-    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
-    {
-        CBlockIndex* pindex = item.second;
-        vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
+/**
+ * Header of the block index snapshot. The snapshot is only valid for the block tree database
+ * holding the same id, with nothing written to it after the id and as many block index entries,
+ * and for a coin database at the same best block.
+ */
+struct CBlockIndexSnapshotHeader
+{
+    int nVersion;
+    uint256 id;
+    //! Write generation of the block tree database just before the id was written
+    uint64_t nGeneration;
+    uint256 hashBestChain;
+    uint32_t nEntries;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersionIn) {
+        READWRITE(nVersion);
+        READWRITE(id);
+        READWRITE(nGeneration);
+        READWRITE(hashBestChain);
+        READWRITE(nEntries);
     }
-    sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+};
+
+boost::filesystem::path GetBlockIndexSnapshotPath()
+{
+    return GetDataDir() / "blocks" / "index.snapshot";
+}
+
+bool CompareBlockIndexHeight(const CBlockIndex* pa, const CBlockIndex* pb)
+{
+    return pa->nHeight < pb->nHeight;
+}
+
+} // anon namespace
+
+bool WriteBlockIndexSnapshot()
+{
+    AssertLockHeld(cs_main);
+
+    // Order by height, so that every entry comes after its predecessor and skip entry
+    vector<CBlockIndex*> vEntries;
+    vEntries.reserve(mapBlockIndex.size());
+    BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+        vEntries.push_back(item.second);
+    sort(vEntries.begin(), vEntries.end(), CompareBlockIndexHeight);
+    boost::unordered_map<const CBlockIndex*, int32_t> mapPosition;
+    for (unsigned int i = 0; i < vEntries.size(); i++)
+        mapPosition[vEntries[i]] = i;
+
+    CBlockIndexSnapshotHeader header;
+    header.nVersion = BLOCK_INDEX_SNAPSHOT_VERSION;
+    header.id = GetRandHash();
+    header.nGeneration = pblocktree->GetWriteGeneration();
+    header.hashBestChain = pcoinsTip->GetBestBlock();
+    header.nEntries = vEntries.size();
+
+    boost::filesystem::path path = GetBlockIndexSnapshotPath();
+    boost::filesystem::path pathTmp = path;
+    pathTmp += ".new";
+    FILE *file = fopen(pathTmp.string().c_str(), "wb");
+    CAutoFile fileout(file, SER_DISK, CLIENT_VERSION);
+    if (fileout.IsNull())
+        return error("%s : Failed to open file %s", __func__, pathTmp.string());
+
+    try {
+        CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+        fileout << header;
+        hasher << header;
+        BOOST_FOREACH(const CBlockIndex* pindex, vEntries) {
+            CBlockIndexSnapshotEntry entry;
+            entry.hash = pindex->GetBlockHash();
+            entry.nPrev = pindex->pprev ? mapPosition[pindex->pprev] : -1;
+            entry.nSkip = pindex->pskip ? mapPosition[pindex->pskip] : -1;
+            entry.nHeight = pindex->nHeight;
+            entry.nFile = pindex->nFile;
+            entry.nDataPos = pindex->nDataPos;
+            entry.nUndoPos = pindex->nUndoPos;
+            entry.nChainWork = pindex->nChainWork;
+            entry.nTx = pindex->nTx;
+            entry.nStatus = pindex->nStatus;
+            entry.nVersion = pindex->nVersion;
+            entry.hashMerkleRoot = pindex->hashMerkleRoot;
+            entry.nTime = pindex->nTime;
+            entry.nBits = pindex->nBits;
+            entry.nNonce = pindex->nNonce;
+            fileout << entry;
+            hasher << entry;
+        }
+        fileout << hasher.GetHash();
+    } catch (std::exception &e) {
+        return error("%s : Serialize or I/O error - %s", __func__, e.what());
+    }
+    FileCommit(fileout.Get());
+    fileout.fclose();
+
+    // The snapshot only becomes valid once the block tree database refers to it. Any write to
+    // the block tree database after this one invalidates it again.
+    if (!RenameOver(pathTmp, path))
+        return error("%s : Rename-into-place failed", __func__);
+    if (!pblocktree->WriteBlockIndexSnapshotId(header.id))
+        return error("%s : Failed to write snapshot id", __func__);
+
+    LogPrintf("Wrote block index snapshot with %u entries\n", header.nEntries);
+    return true;
+}
+
+/**
+ * Load mapBlockIndex from the snapshot written at the last clean shutdown, if it is still
+ * valid. Fills vSortedByHeight with the entries in height order. The snapshot is used only
+ * once: it is invalidated right away, as the block tree database will change from here on.
+ */
+static bool LoadBlockIndexSnapshot(vector<CBlockIndex*>& vSortedByHeight)
+{
+    boost::filesystem::path path = GetBlockIndexSnapshotPath();
+    if (!boost::filesystem::exists(path))
+        return false;
+    uint256 id;
+    bool fHaveId = pblocktree->ReadBlockIndexSnapshotId(id);
+    uint64_t nGeneration = pblocktree->GetWriteGeneration();
+    if (fHaveId)
+        pblocktree->EraseBlockIndexSnapshotId();
+
+    // Read through a memory mapping, or into memory where files cannot be mapped
+    boost::scoped_ptr<CMappedFile> pmapped(CMappedFile::Open(path));
+    vector<char> vData;
+    const char *pbegin, *pend;
+    if (pmapped) {
+        pbegin = pmapped->data();
+        pend = pbegin + pmapped->size();
+    } else {
+        CAutoFile filein(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        if (filein.IsNull())
+            return false;
+        vData.resize(boost::filesystem::file_size(path));
+        try {
+            filein.read(begin_ptr(vData), vData.size());
+        } catch (std::exception &e) {
+            return error("%s : I/O error - %s", __func__, e.what());
+        }
+        pbegin = begin_ptr(vData);
+        pend = end_ptr(vData);
+    }
+    boost::filesystem::remove(path);
+    if (!fHaveId)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    try {
+        // Check the checksum at the end of the file first
+        CBlockIndexSnapshotHeader header;
+        uint256 hashChecksum;
+        if (pend - pbegin < (ptrdiff_t)sizeof(hashChecksum))
+            return error("%s : Snapshot truncated", __func__);
+        CMemoryReader(pend - sizeof(hashChecksum), pend, SER_DISK, CLIENT_VERSION) >> hashChecksum;
+        CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+        hasher.write(pbegin, pend - pbegin - sizeof(hashChecksum));
+        if (hasher.GetHash() != hashChecksum)
+            return error("%s : Checksum mismatch", __func__);
+
+        // Look at the version before the rest of the header, whose layout depends on it
+        int nVersion;
+        CMemoryReader(pbegin, pend - sizeof(hashChecksum), SER_DISK, CLIENT_VERSION) >> nVersion;
+        if (nVersion != BLOCK_INDEX_SNAPSHOT_VERSION) {
+            LogPrintf("%s: Block index snapshot has unknown version %d, ignoring it\n", __func__, nVersion);
+            return false;
+        }
+        CMemoryReader reader(pbegin, pend - sizeof(hashChecksum), SER_DISK, CLIENT_VERSION);
+        reader >> header;
+        // Only the write of the id itself may have followed the snapshot
+        if (header.id != id || header.nGeneration + 1 != nGeneration || header.hashBestChain != pcoinsTip->GetBestBlock()) {
+            LogPrintf("%s: Block index snapshot is out of date, ignoring it\n", __func__);
+            return false;
+        }
+        // Older clients neither erase the id nor count their writes. They never remove block
+        // index entries though, so any headers or blocks they added show in the number of them.
+        uint64_t nBlockIndexEntries;
+        if (!pblocktree->CountBlockIndex(nBlockIndexEntries) || nBlockIndexEntries != header.nEntries) {
+            LogPrintf("%s: Block index snapshot does not match the block tree database, ignoring it\n", __func__);
+            return false;
+        }
+
+        // All entries come from one slab, in height order
+        blockIndexArena.Reserve(header.nEntries);
+        mapBlockIndex.rehash(ceil(header.nEntries / mapBlockIndex.max_load_factor()));
+        vSortedByHeight.reserve(header.nEntries);
+        for (uint32_t i = 0; i < header.nEntries; i++) {
+            CBlockIndexSnapshotEntry entry;
+            reader >> entry;
+            if (entry.nPrev >= (int32_t)i || entry.nSkip >= (int32_t)i)
+                throw std::runtime_error("entry refers to a later one");
+
+            CBlockIndex* pindex = blockIndexArena.Allocate();
+            std::pair<BlockMap::iterator, bool> ret = mapBlockIndex.insert(make_pair(entry.hash, pindex));
+            if (!ret.second)
+                throw std::runtime_error("duplicate entry");
+            pindex->phashBlock = &ret.first->first;
+            pindex->pprev = entry.nPrev >= 0 ? vSortedByHeight[entry.nPrev] : NULL;
+            pindex->pskip = entry.nSkip >= 0 ? vSortedByHeight[entry.nSkip] : NULL;
+            pindex->nHeight = entry.nHeight;
+            pindex->nFile = entry.nFile;
+            pindex->nDataPos = entry.nDataPos;
+            pindex->nUndoPos = entry.nUndoPos;
+            pindex->nChainWork = entry.nChainWork;
+            pindex->nTx = entry.nTx;
+            pindex->nStatus = entry.nStatus;
+            pindex->nVersion = entry.nVersion;
+            pindex->hashMerkleRoot = entry.hashMerkleRoot;
+            pindex->nTime = entry.nTime;
+            pindex->nBits = entry.nBits;
+            pindex->nNonce = entry.nNonce;
+            vSortedByHeight.push_back(pindex);
+        }
+        if (!reader.empty())
+            throw std::runtime_error("trailing data");
+        if (!vSortedByHeight.empty() && !pblocktree->HaveBlockIndex(vSortedByHeight.back()->GetBlockHash()))
+            throw std::runtime_error("highest entry not in the block tree database");
+    } catch (std::exception &e) {
+        // Entries already allocated stay in the arena, unused
+        mapBlockIndex.clear();
+        vSortedByHeight.clear();
+        return error("%s : Deserialize error - %s", __func__, e.what());
+    }
+
+    LogPrintf("%s: Loaded %u block index entries from snapshot in %dms\n", __func__, vSortedByHeight.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+bool static LoadBlockIndexDB()
+{
+    // Use the snapshot from the last shutdown if possible, or else the block tree database
+    vector<CBlockIndex*> vSortedByHeight;
+    bool fFromSnapshot = LoadBlockIndexSnapshot(vSortedByHeight);
+    if (!fFromSnapshot) {
+        if (!pblocktree->LoadBlockIndexGuts())
+            return false;
+
+        boost::this_thread::interruption_point();
+
+        vSortedByHeight.reserve(mapBlockIndex.size());
+        BOOST_FOREACH(const PAIRTYPE(uint256, CBlockIndex*)& item, mapBlockIndex)
+            vSortedByHeight.push_back(item.second);
+        stable_sort(vSortedByHeight.begin(), vSortedByHeight.end(), CompareBlockIndexHeight);
+
+        // The database is ordered by hash, so entries were allocated in random order. Move
+        // them into a single slab in height order, so that walking a chain touches nearby
+        // memory. pskip is not set up yet, and points from each old entry to its new place.
+        CBlockIndexArena arenaSorted;
+        arenaSorted.Reserve(vSortedByHeight.size());
+        BOOST_FOREACH(CBlockIndex*& pindex, vSortedByHeight) {
+            CBlockIndex* pindexNew = arenaSorted.Allocate();
+            *pindexNew = *pindex;
+            pindex->pskip = pindexNew;
+            pindex = pindexNew;
+        }
+        BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight) {
+            if (pindex->pprev)
+                pindex->pprev = pindex->pprev->pskip;
+        }
+        BOOST_FOREACH(BlockMap::value_type& item, mapBlockIndex)
+            item.second = item.second->pskip;
+        // The old entries are freed along with arenaSorted
+        blockIndexArena.swap(arenaSorted);
+    }
+
+    boost::this_thread::interruption_point();
+
+    // Calculate nChainWork
+    BOOST_FOREACH(CBlockIndex* pindex, vSortedByHeight)
     {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
-        if (pindex->nStatus & BLOCK_HAVE_DATA) {
+        if (!fFromSnapshot)
+            pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
+        // We can link the chain of blocks for which we've received transactions at some point.
+        // Pruned nodes may have deleted the block.
+        if (pindex->nTx > 0) {
             if (pindex->pprev) {
                 if (pindex->pprev->nChainTx) {
                     pindex->nChainTx = pindex->pprev->nChainTx + pindex->nTx;
@@ -2956,7 +3907,7 @@ bool static LoadBlockIndexDB()
             setBlockIndexCandidates.insert(pindex);
         if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->nChainWork > pindexBestInvalid->nChainWork))
             pindexBestInvalid = pindex;
-        if (pindex->pprev)
+        if (pindex->pprev && !fFromSnapshot)
             pindex->BuildSkip();
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
@@ -3006,6 +3957,19 @@ bool static LoadBlockIndexDB()
     pblocktree->ReadFlag("txindex", fTxIndex);
     LogPrintf("LoadBlockIndexDB(): transaction index %s\n", fTxIndex ? "enabled" : "disabled");
 
+    // Check whether we have an address index
+    pblocktree->ReadFlag("addrindex", fAddrIndex);
+    LogPrintf("LoadBlockIndexDB(): address index %s\n", fAddrIndex ? "enabled" : "disabled");
+
+    // Check whether we have a spent index
+    pblocktree->ReadFlag("spentindex", fSpentIndex);
+    LogPrintf("LoadBlockIndexDB(): spent index %s\n", fSpentIndex ? "enabled" : "disabled");
+
+    // Check whether we have ever pruned block & undo files
+    pblocktree->ReadFlag("prunedblockfiles", fHavePruned);
+    if (fHavePruned)
+        LogPrintf("LoadBlockIndexDB(): Block files have previously been pruned\n");
+
     // Load pointer to end of best chain
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     if (it == mapBlockIndex.end())
@@ -3056,6 +4020,11 @@ bool CVerifyDB::VerifyDB(CCoinsView *coinsview, int nCheckLevel, int nCheckDepth
         uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
         if (pindex->nHeight < chainActive.Height()-nCheckDepth)
             break;
+        if (fPruneMode && !(pindex->nStatus & BLOCK_HAVE_DATA)) {
+            // If pruning, only go back as far as we have data.
+            LogPrintf("VerifyDB(): block verification stopping at height %d (pruning, no data)\n", pindex->nHeight);
+            break;
+        }
         CBlock block;
         // check level 0: read from disk
         if (!ReadBlockFromDisk(block, pindex))
@@ -3112,6 +4081,7 @@ bool CVerifyDB::VerifyDB(CCoinsView *coinsview, int nCheckLevel, int nCheckDepth
 
 void UnloadBlockIndex()
 {
+    recentBlocks.Clear();
     mapBlockIndex.clear();
     setBlockIndexCandidates.clear();
     chainActive.SetTip(NULL);
@@ -3126,6 +4096,124 @@ bool LoadBlockIndex()
     return true;
 }
 
+/** Collect the outputs a block spends, as ConnectBlock does for the indexes, and apply the block to view */
+static bool GetSpentOutputs(const CBlock& block, int nHeight, CCoinsViewCache& view, std::vector<CSpentOutput>& vSpent)
+{
+    CValidationState state;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
+                if (!coins || !coins->IsAvailable(txin.prevout.n))
+                    return error("%s : input %s of block %s missing", __func__, txin.prevout.ToString(), block.GetHash().ToString());
+                vSpent.push_back(CSpentOutput(coins->vout[txin.prevout.n], coins->nHeight));
+            }
+        }
+        CTxUndo undoDummy;
+        UpdateCoins(tx, state, view, undoDummy, nHeight);
+    }
+    return true;
+}
+
+/** Add the writes (dis)connecting a block to the address (fAddr) or spent index to writes */
+static bool IndexBlock(bool fAddr, bool fConnect, const CBlock& block, int nHeight, const std::vector<CSpentOutput>& vSpent, CIndexWrites& writes)
+{
+    if (fAddr)
+        return fConnect ? paddrindex->ConnectBlock(block, nHeight, vSpent, writes.batchAddrIndex) : paddrindex->DisconnectBlock(block, nHeight, vSpent, writes.batchAddrIndex);
+    return fConnect ? pspentindex->ConnectBlock(block, nHeight, vSpent, writes.batchSpentIndex) : pspentindex->DisconnectBlock(block, writes.batchSpentIndex);
+}
+
+/**
+ * The address and spent indexes are written when blocks are flushed to pcoinsTip, before
+ * pcoinsTip itself reaches the disk, so after a crash they can be ahead of the chain state,
+ * or on a branch the chain state never saw. Take such an index back to the fork with the
+ * chain state, and forward along it, the way the chain state itself would have gone.
+ */
+static bool CatchUpIndex(bool fAddr)
+{
+    AssertLockHeld(cs_main);
+    const char* pszName = fAddr ? "address index" : "spent index";
+    CBlockIndex* pindexTip = chainActive.Tip();
+
+    CIndexWrites writes;
+    uint256 hashIndexBest;
+    if (!(fAddr ? paddrindex->ReadBestBlock(hashIndexBest) : pspentindex->ReadBestBlock(hashIndexBest))) {
+        // Written by a version that did not record its best block; it went with the chain state
+        hashIndexBest = pindexTip->GetBlockHash();
+    } else if (hashIndexBest == pindexTip->GetBlockHash()) {
+        return true;
+    }
+    BlockMap::iterator mi = mapBlockIndex.find(hashIndexBest);
+    if (mi == mapBlockIndex.end())
+        return error("%s : %s is up to unknown block %s", __func__, pszName, hashIndexBest.ToString());
+    CBlockIndex* pindexIndexBest = mi->second;
+    const CBlockIndex* pindexFork = chainActive.FindFork(pindexIndexBest);
+    LogPrintf("%s: %s is at height %d, chain state at %d, fork at %d\n", __func__, pszName,
+        pindexIndexBest->nHeight, pindexTip->nHeight, pindexFork->nHeight);
+
+    // The UTXO set at the fork, which both branches build on
+    CValidationState state;
+    CCoinsViewCache viewFork(pcoinsTip);
+    for (CBlockIndex* pindex = pindexTip; pindex != pindexFork; pindex = pindex->pprev) {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex))
+            return error("%s : failed to read block %s", __func__, pindex->GetBlockHash().ToString());
+        bool fClean = true;
+        if (!DisconnectBlock(block, state, pindex, viewFork, &fClean) || !fClean)
+            return error("%s : failed to disconnect block %s", __func__, pindex->GetBlockHash().ToString());
+    }
+
+    {
+        // Replay the index's own branch to learn what its blocks spent, then undo it newest first.
+        // Only the spent outputs are kept between the two passes, not the blocks.
+        std::vector<CBlockIndex*> vBranch;
+        for (CBlockIndex* pindex = pindexIndexBest; pindex != pindexFork; pindex = pindex->pprev)
+            vBranch.push_back(pindex);
+        std::vector<std::vector<CSpentOutput> > vvSpent(vBranch.size());
+        CCoinsViewCache view(&viewFork);
+        for (size_t i = vBranch.size(); i-- > 0;) {
+            CBlock block;
+            if (!ReadBlockFromDisk(block, vBranch[i]) || !GetSpentOutputs(block, vBranch[i]->nHeight, view, vvSpent[i]))
+                return error("%s : failed to replay block %s", __func__, vBranch[i]->GetBlockHash().ToString());
+        }
+        for (size_t i = 0; i < vBranch.size(); i++) {
+            CBlock block;
+            if (!ReadBlockFromDisk(block, vBranch[i]) || !IndexBlock(fAddr, false, block, vBranch[i]->nHeight, vvSpent[i], writes))
+                return error("%s : failed to disconnect block %s from the %s", __func__, vBranch[i]->GetBlockHash().ToString(), pszName);
+        }
+    }
+    {
+        CCoinsViewCache view(&viewFork);
+        for (CBlockIndex* pindex = chainActive.Next(pindexFork); pindex != NULL; pindex = chainActive.Next(pindex)) {
+            CBlock block;
+            std::vector<CSpentOutput> vSpent;
+            if (!ReadBlockFromDisk(block, pindex) || !GetSpentOutputs(block, pindex->nHeight, view, vSpent) ||
+                !IndexBlock(fAddr, true, block, pindex->nHeight, vSpent, writes))
+                return error("%s : failed to connect block %s to the %s", __func__, pindex->GetBlockHash().ToString(), pszName);
+        }
+    }
+    if (fAddr) {
+        paddrindex->WriteBestBlock(writes.batchAddrIndex, pindexTip->GetBlockHash());
+        return paddrindex->WriteBatch(writes.batchAddrIndex, true);
+    }
+    pspentindex->WriteBestBlock(writes.batchSpentIndex, pindexTip->GetBlockHash());
+    return pspentindex->WriteBatch(writes.batchSpentIndex, true);
+}
+
+bool CatchUpIndexes()
+{
+    LOCK(cs_main);
+    if (fAddrIndex && !paddrindex->WriteMissingBalances())
+        return false;
+    if (chainActive.Tip() == NULL)
+        return true;
+    if (fAddrIndex && !CatchUpIndex(true))
+        return false;
+    if (fSpentIndex && !CatchUpIndex(false))
+        return false;
+    return true;
+}
+
 
 bool InitBlockIndex() {
     LOCK(cs_main);
@@ -3136,6 +4224,12 @@ bool InitBlockIndex() {
     // Use the provided setting for -txindex in the new database
     fTxIndex = GetBoolArg("-txindex", false);
     pblocktree->WriteFlag("txindex", fTxIndex);
+    // Use the provided setting for -addrindex in the new database
+    fAddrIndex = GetBoolArg("-addrindex", false);
+    pblocktree->WriteFlag("addrindex", fAddrIndex);
+    // Use the provided setting for -spentindex in the new database
+    fSpentIndex = GetBoolArg("-spentindex", false);
+    pblocktree->WriteFlag("spentindex", fSpentIndex);
     LogPrintf("Initializing databases...\n");
 
     // Only add the genesis block if not reindexing (in which case we reuse the one already on disk)
@@ -3153,7 +4247,7 @@ bool InitBlockIndex() {
             CBlockIndex *pindex = AddToBlockIndex(block);
             if (!ReceivedBlockTransactions(block, state, pindex, blockPos))
                 return error("LoadBlockIndex() : genesis block not accepted");
-            if (!ActivateBestChain(state, &block))
+            if (!ActivateBestChain(state))
                 return error("LoadBlockIndex() : genesis block cannot be activated");
             // Force a chainstate write so that when we VerifyDB in a moment, it doesnt check stale data
             return FlushStateToDisk(state, FLUSH_STATE_ALWAYS);
@@ -3167,109 +4261,306 @@ bool InitBlockIndex() {
 
 
 
+/** Map of disk positions for blocks with unknown parent (only used for reindex) */
+static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
+
+/**
+ * Find the blocks in a file of serialized blocks, each preceded by the message start and its
+ * size, and pass them with their position (if dbp is given) to fn, until it returns false.
+ * This takes over fileIn.
+ */
+static void ScanBlockFile(FILE* fileIn, CDiskBlockPos *dbp, const boost::function<bool (CBlock&, CDiskBlockPos*)>& fn)
+{
+    // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
+    CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
+    uint64_t nRewind = blkdat.GetPos();
+    while (!blkdat.eof()) {
+        boost::this_thread::interruption_point();
+
+        blkdat.SetPos(nRewind);
+        nRewind++; // start one byte further next time, in case of failure
+        blkdat.SetLimit(); // remove former limit
+        unsigned int nSize = 0;
+        try {
+            // locate a header
+            unsigned char buf[MESSAGE_START_SIZE];
+            blkdat.FindByte(Params().MessageStart()[0]);
+            nRewind = blkdat.GetPos()+1;
+            blkdat >> FLATDATA(buf);
+            if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
+                continue;
+            // read size
+            blkdat >> nSize;
+            if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                continue;
+        } catch (const std::exception &) {
+            // no valid block header found; don't complain
+            break;
+        }
+        try {
+            // read block
+            uint64_t nBlockPos = blkdat.GetPos();
+            if (dbp)
+                dbp->nPos = nBlockPos;
+            blkdat.SetLimit(nBlockPos + nSize);
+            blkdat.SetPos(nBlockPos);
+            CBlock block;
+            blkdat >> block;
+            nRewind = blkdat.GetPos();
+
+            if (!fn(block, dbp))
+                break;
+        } catch (std::exception &e) {
+            LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+}
+
+/**
+ * Store and connect a block read from a file, unless its parent is not known yet; then it is
+ * set aside (if it is in one of our own block files) until the parent is processed. fChecked
+ * tells that the block already passed CheckBlock. Returns false on a system error.
+ */
+static bool ProcessImportedBlock(CBlock& block, CDiskBlockPos *dbp, int& nLoaded, bool fChecked = false)
+{
+    // detect out of order blocks, and store them for later
+    uint256 hash = block.GetHash();
+    if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
+        LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
+                block.hashPrevBlock.ToString());
+        if (dbp)
+            mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
+        return true;
+    }
+
+    // process in case the block isn't known yet
+    if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
+        CValidationState state;
+        if (fChecked ? ProcessCheckedBlock(state, true, -1, &block, dbp) : ProcessNewBlock(state, NULL, &block, dbp))
+            nLoaded++;
+        if (state.IsError())
+            return false;
+    } else if (hash != Params().HashGenesisBlock() && mapBlockIndex[hash]->nHeight % 1000 == 0) {
+        LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+    }
+
+    // Recursively process earlier encountered successors of this block
+    deque<uint256> queue;
+    queue.push_back(hash);
+    while (!queue.empty()) {
+        uint256 head = queue.front();
+        queue.pop_front();
+        std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
+        while (range.first != range.second) {
+            std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
+            if (ReadBlockFromDisk(block, it->second))
+            {
+                LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
+                        head.ToString());
+                CValidationState dummy;
+                if (ProcessNewBlock(dummy, NULL, &block, &it->second))
+                {
+                    nLoaded++;
+                    queue.push_back(block.GetHash());
+                }
+            }
+            range.first++;
+            mapBlocksUnknownParent.erase(it);
+        }
+    }
+    return true;
+}
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 {
-    // Map of disk positions for blocks with unknown parent (only used for reindex)
-    static std::multimap<uint256, CDiskBlockPos> mapBlocksUnknownParent;
     int64_t nStart = GetTimeMillis();
 
     int nLoaded = 0;
     try {
-        // This takes over fileIn and calls fclose() on it in the CBufferedFile destructor
-        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
-        uint64_t nRewind = blkdat.GetPos();
-        while (!blkdat.eof()) {
-            boost::this_thread::interruption_point();
+        ScanBlockFile(fileIn, dbp, boost::bind(&ProcessImportedBlock, _1, _2, boost::ref(nLoaded), false));
+    } catch(std::runtime_error &e) {
+        AbortNode(std::string("System error: ") + e.what());
+    }
+    if (nLoaded > 0)
+        LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
+    return nLoaded > 0;
+}
 
-            blkdat.SetPos(nRewind);
-            nRewind++; // start one byte further next time, in case of failure
-            blkdat.SetLimit(); // remove former limit
-            unsigned int nSize = 0;
-            try {
-                // locate a header
-                unsigned char buf[MESSAGE_START_SIZE];
-                blkdat.FindByte(Params().MessageStart()[0]);
-                nRewind = blkdat.GetPos()+1;
-                blkdat >> FLATDATA(buf);
-                if (memcmp(buf, Params().MessageStart(), MESSAGE_START_SIZE))
-                    continue;
-                // read size
-                blkdat >> nSize;
-                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
-                    continue;
-            } catch (const std::exception &) {
-                // no valid block header found; don't complain
-                break;
+namespace {
+
+/** A block found in one of our block files during a parallel reindex. */
+struct CReindexBlock {
+    CBlock block;
+    CDiskBlockPos pos;
+    //! Whether the block passed CheckBlock; if not, it is checked again when connected, to report why
+    bool fChecked;
+};
+
+/** A block file being reindexed in parallel. */
+struct CReindexFile {
+    //! Checked blocks not yet connected, in file order.
+    deque<boost::shared_ptr<CReindexBlock> > vBlocks;
+    bool fDone;    //! Whether scanning the file has finished.
+    bool fFailed;  //! Whether the file could not be opened.
+
+    CReindexFile() : fDone(false), fFailed(false) {}
+};
+
+/**
+ * Rebuilds the block index from the block files with several threads. Scanning threads each
+ * take the next file, parse its blocks and run the context-free checks (proof of work and
+ * merkle root, the expensive part) on them. The thread calling Run() stores and connects the
+ * blocks strictly in file order, so the result is the same as that of a sequential reindex.
+ *
+ * To bound memory use, a scanning thread ahead of the file being connected waits while too many
+ * blocks are buffered. The thread scanning the file being connected never waits.
+ */
+class CParallelReindex
+{
+private:
+    CWaitableCriticalSection cs;
+    CConditionVariable cond;
+    //! All of the following are protected by cs.
+    vector<CReindexFile> vFiles;
+    int nNextFile;
+    int nFileConnecting;
+    unsigned int nBuffered;
+
+    bool AddBlock(int nFile, CBlock& block, CDiskBlockPos* dbp)
+    {
+        CValidationState state;
+        bool fChecked = CheckBlock(block, state);
+        if (fChecked && pcoinsPrefetch)
+            pcoinsPrefetch->Prefetch(block);
+
+        boost::shared_ptr<CReindexBlock> pentry(new CReindexBlock());
+        pentry->block = block;
+        pentry->pos = *dbp;
+        pentry->fChecked = fChecked;
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            while (nFile != nFileConnecting && nBuffered >= MAX_REINDEX_BLOCKS_BUFFERED)
+                cond.wait(lock);
+            vFiles[nFile].vBlocks.push_back(pentry);
+            nBuffered++;
+        }
+        cond.notify_all();
+        return true;
+    }
+
+    void ThreadScan()
+    {
+        RenameThread("litecoin-reindex");
+        while (true) {
+            int nFile;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                if (nNextFile >= (int)vFiles.size())
+                    return;
+                nFile = nNextFile++;
             }
-            try {
-                // read block
-                uint64_t nBlockPos = blkdat.GetPos();
-                if (dbp)
-                    dbp->nPos = nBlockPos;
-                blkdat.SetLimit(nBlockPos + nSize);
-                blkdat.SetPos(nBlockPos);
-                CBlock block;
-                blkdat >> block;
-                nRewind = blkdat.GetPos();
-
-                // detect out of order blocks, and store them for later
-                uint256 hash = block.GetHash();
-                if (hash != Params().HashGenesisBlock() && mapBlockIndex.find(block.hashPrevBlock) == mapBlockIndex.end()) {
-                    LogPrint("reindex", "%s: Out of order block %s, parent %s not known\n", __func__, hash.ToString(),
-                            block.hashPrevBlock.ToString());
-                    if (dbp)
-                        mapBlocksUnknownParent.insert(std::make_pair(block.hashPrevBlock, *dbp));
-                    continue;
-                }
 
-                // process in case the block isn't known yet
-                if (mapBlockIndex.count(hash) == 0 || (mapBlockIndex[hash]->nStatus & BLOCK_HAVE_DATA) == 0) {
-                    CValidationState state;
-                    if (ProcessNewBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
-                } else if (hash != Params().HashGenesisBlock() && mapBlockIndex[hash]->nHeight % 1000 == 0) {
-                    LogPrintf("Block Import: already had block %s at height %d\n", hash.ToString(), mapBlockIndex[hash]->nHeight);
+            CDiskBlockPos pos(nFile, 0);
+            FILE *file = OpenBlockFile(pos, true);
+            if (file) {
+                try {
+                    ScanBlockFile(file, &pos, boost::bind(&CParallelReindex::AddBlock, this, nFile, _1, _2));
+                } catch(std::runtime_error &e) {
+                    AbortNode(std::string("System error: ") + e.what());
                 }
+            }
 
-                // Recursively process earlier encountered successors of this block
-                deque<uint256> queue;
-                queue.push_back(hash);
-                while (!queue.empty()) {
-                    uint256 head = queue.front();
-                    queue.pop_front();
-                    std::pair<std::multimap<uint256, CDiskBlockPos>::iterator, std::multimap<uint256, CDiskBlockPos>::iterator> range = mapBlocksUnknownParent.equal_range(head);
-                    while (range.first != range.second) {
-                        std::multimap<uint256, CDiskBlockPos>::iterator it = range.first;
-                        if (ReadBlockFromDisk(block, it->second))
-                        {
-                            LogPrintf("%s: Processing out of order child %s of %s\n", __func__, block.GetHash().ToString(),
-                                    head.ToString());
-                            CValidationState dummy;
-                            if (ProcessNewBlock(dummy, NULL, &block, &it->second))
-                            {
-                                nLoaded++;
-                                queue.push_back(block.GetHash());
-                            }
-                        }
-                        range.first++;
-                        mapBlocksUnknownParent.erase(it);
-                    }
-                }
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                vFiles[nFile].fDone = true;
+                vFiles[nFile].fFailed = (file == NULL);
+            }
+            cond.notify_all();
+        }
+    }
+
+    /** Connect the blocks of one file as they are scanned. Returns false if the file could not be opened. */
+    bool ConnectFile(int nFile, int& nLoaded)
+    {
+        bool fError = false;
+        while (true) {
+            boost::shared_ptr<CReindexBlock> pentry;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                CReindexFile& file = vFiles[nFile];
+                while (file.vBlocks.empty() && !file.fDone)
+                    cond.wait(lock);
+                if (file.vBlocks.empty())
+                    return !file.fFailed;
+                pentry = file.vBlocks.front();
+                file.vBlocks.pop_front();
+                nBuffered--;
+            }
+            cond.notify_all();
+
+            // Like a sequential reindex, skip the rest of a file after a system error.
+            if (fError)
+                continue;
+            try {
+                fError = !ProcessImportedBlock(pentry->block, &pentry->pos, nLoaded, pentry->fChecked);
             } catch (std::exception &e) {
                 LogPrintf("%s : Deserialize or I/O error - %s", __func__, e.what());
             }
         }
-    } catch(std::runtime_error &e) {
-        AbortNode(std::string("System error: ") + e.what());
     }
-    if (nLoaded > 0)
-        LogPrintf("Loaded %i blocks from external file in %dms\n", nLoaded, GetTimeMillis() - nStart);
-    return nLoaded > 0;
+
+public:
+    CParallelReindex(int nFiles) : vFiles(nFiles), nNextFile(0), nFileConnecting(0), nBuffered(0) {}
+
+    /** Reindex all files with nThreads scanning threads. Returns the number of blocks loaded. */
+    int Run(int nThreads)
+    {
+        int nLoaded = 0;
+        boost::thread_group threads;
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CParallelReindex::ThreadScan, this));
+
+        try {
+            for (int nFile = 0; nFile < (int)vFiles.size(); nFile++) {
+                {
+                    boost::unique_lock<boost::mutex> lock(cs);
+                    nFileConnecting = nFile;
+                }
+                cond.notify_all();
+                LogPrintf("Reindexing block file blk%05u.dat...\n", (unsigned int)nFile);
+                if (!ConnectFile(nFile, nLoaded))
+                    break; // This error is logged in OpenBlockFile
+            }
+        } catch (...) {
+            threads.interrupt_all();
+            threads.join_all();
+            throw;
+        }
+
+        // Scanning threads may still be working on files after one that failed to open.
+        threads.interrupt_all();
+        threads.join_all();
+        return nLoaded;
+    }
+};
+
+} // anon namespace
+
+void ReindexBlockFiles(int nThreads)
+{
+    int64_t nStart = GetTimeMillis();
+
+    int nFiles = 0;
+    while (boost::filesystem::exists(GetBlockPosFilename(CDiskBlockPos(nFiles, 0), "blk")))
+        nFiles++;
+
+    nThreads = std::min(nThreads, nFiles);
+    CParallelReindex reindex(nFiles);
+    int nLoaded = reindex.Run(nThreads);
+    LogPrintf("Loaded %i blocks from %d block files in %dms using %d threads\n", nLoaded, nFiles, GetTimeMillis() - nStart, nThreads);
 }
 
-void static CheckBlockIndex()
+void CheckBlockIndex()
 {
     if (!fCheckBlockIndex) {
         return;
@@ -3305,6 +4596,7 @@ void static CheckBlockIndex()
     int nHeight = 0;
     CBlockIndex* pindexFirstInvalid = NULL; // Oldest ancestor of pindex which is invalid.
     CBlockIndex* pindexFirstMissing = NULL; // Oldest ancestor of pindex which does not have BLOCK_HAVE_DATA.
+    CBlockIndex* pindexFirstNeverProcessed = NULL; // Oldest ancestor of pindex for which nTx == 0.
     CBlockIndex* pindexFirstNotTreeValid = NULL; // Oldest ancestor of pindex which does not have BLOCK_VALID_TREE (regardless of being valid or not).
     CBlockIndex* pindexFirstNotChainValid = NULL; // Oldest ancestor of pindex which does not have BLOCK_VALID_CHAIN (regardless of being valid or not).
     CBlockIndex* pindexFirstNotScriptsValid = NULL; // Oldest ancestor of pindex which does not have BLOCK_VALID_SCRIPTS (regardless of being valid or not).
@@ -3312,6 +4604,7 @@ void static CheckBlockIndex()
         nNodes++;
         if (pindexFirstInvalid == NULL && pindex->nStatus & BLOCK_FAILED_VALID) pindexFirstInvalid = pindex;
         if (pindexFirstMissing == NULL && !(pindex->nStatus & BLOCK_HAVE_DATA)) pindexFirstMissing = pindex;
+        if (pindexFirstNeverProcessed == NULL && pindex->nTx == 0) pindexFirstNeverProcessed = pindex;
         if (pindex->pprev != NULL && pindexFirstNotTreeValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_TREE) pindexFirstNotTreeValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotChainValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_CHAIN) pindexFirstNotChainValid = pindex;
         if (pindex->pprev != NULL && pindexFirstNotScriptsValid == NULL && (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS) pindexFirstNotScriptsValid = pindex;
@@ -3322,12 +4615,21 @@ void static CheckBlockIndex()
             assert(pindex->GetBlockHash() == Params().HashGenesisBlock()); // Genesis block's hash must match.
             assert(pindex == chainActive.Genesis()); // The current active chain's genesis block must be this block.
         }
-        // HAVE_DATA is equivalent to VALID_TRANSACTIONS and equivalent to nTx > 0 (we stored the number of transactions in the block)
-        assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
-        assert(((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS) == (pindex->nTx > 0));
+        // VALID_TRANSACTIONS is equivalent to nTx > 0 for all nodes (whether or not pruning has occurred).
+        // HAVE_DATA is only equivalent to nTx > 0 (or VALID_TRANSACTIONS) if no pruning has occurred.
+        if (!fHavePruned) {
+            // If we've never pruned, then HAVE_DATA should be equivalent to nTx > 0
+            assert(!(pindex->nStatus & BLOCK_HAVE_DATA) == (pindex->nTx == 0));
+            assert(pindexFirstMissing == pindexFirstNeverProcessed);
+        } else {
+            // If we have pruned, then we can only say that HAVE_DATA implies nTx > 0
+            if (pindex->nStatus & BLOCK_HAVE_DATA) assert(pindex->nTx > 0);
+        }
+        if (pindex->nStatus & BLOCK_HAVE_UNDO) assert(pindex->nStatus & BLOCK_HAVE_DATA);
+        assert(((pindex->nStatus & BLOCK_VALID_MASK) >= BLOCK_VALID_TRANSACTIONS) == (pindex->nTx > 0)); // This is pruning-independent.
         if (pindex->nChainTx == 0) assert(pindex->nSequenceId == 0);  // nSequenceId can't be set for blocks that aren't linked
-        // All parents having data is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
-        assert((pindexFirstMissing != NULL) == (pindex->nChainTx == 0)); // nChainTx == 0 is used to signal that all parent block's transaction data is available.
+        // All parents having had data (at some point) is equivalent to all parents being VALID_TRANSACTIONS, which is equivalent to nChainTx being set.
+        assert((pindexFirstNeverProcessed != NULL) == (pindex->nChainTx == 0)); // nChainTx != 0 is used to signal that all parent blocks have been processed (but may have been pruned).
         assert(pindex->nHeight == nHeight); // nHeight must be consistent.
         assert(pindex->pprev == NULL || pindex->nChainWork >= pindex->pprev->nChainWork); // For every block except the genesis block, the chainwork must be larger than the parent's.
         assert(nHeight < 2 || (pindex->pskip && (pindex->pskip->nHeight < nHeight))); // The pskip pointer must point back for all but the first 2 blocks.
@@ -3339,9 +4641,18 @@ void static CheckBlockIndex()
             // Checks for not-invalid blocks.
             assert((pindex->nStatus & BLOCK_FAILED_MASK) == 0); // The failed mask cannot be set for blocks without invalid parents.
         }
-        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstMissing == NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block sorts at least as good as the current tip and is valid, it must be in setBlockIndexCandidates.
-                 assert(setBlockIndexCandidates.count(pindex));
+        if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && pindexFirstNeverProcessed == NULL) {
+            if (pindexFirstInvalid == NULL) {
+                // If this block sorts at least as good as the current tip and
+                // is valid and we have all data for its parents, it must be in
+                // setBlockIndexCandidates.  chainActive.Tip() must also be there
+                // even if some data has been pruned.
+                if (pindexFirstMissing == NULL || pindex == chainActive.Tip()) {
+                    assert(setBlockIndexCandidates.count(pindex));
+                }
+                // If some parent is missing, then it could be that this block was in
+                // setBlockIndexCandidates but had to be removed because of the missing data.
+                // In this case it must be in mapBlocksUnlinked -- see test below.
             }
         } else { // If this block sorts worse than the current tip, it cannot be in setBlockIndexCandidates.
             assert(setBlockIndexCandidates.count(pindex) == 0);
@@ -3357,12 +4668,28 @@ void static CheckBlockIndex()
             }
             rangeUnlinked.first++;
         }
-        if (pindex->pprev && pindex->nStatus & BLOCK_HAVE_DATA && pindexFirstMissing != NULL) {
-            if (pindexFirstInvalid == NULL) { // If this block has block data available, some parent doesn't, and has no invalid parents, it must be in mapBlocksUnlinked.
-                assert(foundInUnlinked);
+        if (pindex->pprev && (pindex->nStatus & BLOCK_HAVE_DATA) && pindexFirstNeverProcessed != NULL && pindexFirstInvalid == NULL) {
+            // If this block has block data available, some parent was never received, and has no invalid parents, it must be in mapBlocksUnlinked.
+            assert(foundInUnlinked);
+        }
+        if (!(pindex->nStatus & BLOCK_HAVE_DATA)) assert(!foundInUnlinked); // Can't be in mapBlocksUnlinked if we don't HAVE_DATA
+        if (pindexFirstMissing == NULL) assert(!foundInUnlinked); // We aren't missing data for any parent -- cannot be in mapBlocksUnlinked.
+        if (pindex->pprev && (pindex->nStatus & BLOCK_HAVE_DATA) && pindexFirstNeverProcessed == NULL && pindexFirstMissing != NULL) {
+            // We HAVE_DATA for this block, have received data for all parents at some point, but we're currently missing data for some parent.
+            assert(fHavePruned); // We must have pruned.
+            // This block may have entered mapBlocksUnlinked if:
+            //  - it has a descendant that at some point had more work than the
+            //    tip, and
+            //  - we tried switching to that descendant but were missing
+            //    data for some intermediate block between chainActive and the
+            //    tip.
+            // So if this block is itself better than chainActive.Tip() and it wasn't in
+            // setBlockIndexCandidates, then it must be in mapBlocksUnlinked.
+            if (!CBlockIndexWorkComparator()(pindex, chainActive.Tip()) && setBlockIndexCandidates.count(pindex) == 0) {
+                if (pindexFirstInvalid == NULL) {
+                    assert(foundInUnlinked);
+                }
             }
-        } else { // If this block does not have block data available, or all parents do, it cannot be in mapBlocksUnlinked.
-            assert(!foundInUnlinked);
         }
         // assert(pindex->GetBlockHash() == pindex->GetBlockHeader().GetHash()); // Perhaps too slow
         // End: actual consistency checks.
@@ -3382,6 +4709,7 @@ void static CheckBlockIndex()
             // If pindex was the first with a certain property, unset the corresponding variable.
             if (pindex == pindexFirstInvalid) pindexFirstInvalid = NULL;
             if (pindex == pindexFirstMissing) pindexFirstMissing = NULL;
+            if (pindex == pindexFirstNeverProcessed) pindexFirstNeverProcessed = NULL;
             if (pindex == pindexFirstNotTreeValid) pindexFirstNotTreeValid = NULL;
             if (pindex == pindexFirstNotChainValid) pindexFirstNotChainValid = NULL;
             if (pindex == pindexFirstNotScriptsValid) pindexFirstNotScriptsValid = NULL;
@@ -3525,7 +4853,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
@@ -3544,7 +4872,9 @@ void static ProcessGetData(CNode* pfrom)
                         }
                     }
                 }
-                if (send)
+                // Pruned nodes may have deleted the block, so check whether
+                // it's available before trying to send.
+                if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                 {
                     // Send block from disk
                     CBlock block;
@@ -3552,6 +4882,15 @@ void static ProcessGetData(CNode* pfrom)
                         assert(!"cannot load block from disk");
                     if (inv.type == MSG_BLOCK)
                         pfrom->PushMessage("block", block);
+                    else if (inv.type == MSG_CMPCT_BLOCK)
+                    {
+                        // Peers only reconstruct recent blocks from their memory pool;
+                        // anything deeper is cheaper to send in full.
+                        if (mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH)
+                            pfrom->PushMessage("cmpctblock", CBlockHeaderAndShortTxIDs(block));
+                        else
+                            pfrom->PushMessage("block", block);
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
@@ -3617,7 +4956,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             g_signals.Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -3797,6 +5136,28 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        if (pfrom->nVersion >= SHORT_IDS_BLOCKS_VERSION) {
+            // Tell the peer we serve and understand compact blocks. We never ask
+            // for them to be pushed to us unrequested (high-bandwidth mode).
+            bool fAnnounceUsingCMPCTBLOCK = false;
+            uint64_t nCMPCTBLOCKVersion = CMPCTBLOCKS_VERSION;
+            pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+        }
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        // Blocks are announced to every peer by inv alone, so a request for
+        // high-bandwidth mode is treated like low-bandwidth mode
+        if (nCMPCTBLOCKVersion == CMPCTBLOCKS_VERSION) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fSupportsCompactBlocks = true;
+        }
     }
 
 
@@ -3909,7 +5270,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     CNodeState *nodestate = State(pfrom->GetId());
                     if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - Params().TargetSpacing() * 20 &&
                         nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                        vToFetch.push_back(inv);
+                        vToFetch.push_back(CanRequestCompactBlock(pfrom) ? CInv(MSG_CMPCT_BLOCK, inv.hash) : inv);
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
                         MarkBlockAsInFlight(pfrom->GetId(), inv.hash);
@@ -3976,6 +5337,12 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 LogPrint("net", "  getblocks stopping at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
                 break;
             }
+            // If pruning, don't inv blocks unless we have them.
+            if (fPruneMode && !(pindex->nStatus & BLOCK_HAVE_DATA))
+            {
+                LogPrint("net", "  getblocks stopping, pruned or too old block at %d %s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+                break;
+            }
             pfrom->PushInventory(CInv(MSG_BLOCK, pindex->GetBlockHash()));
             if (--nLimit <= 0)
             {
@@ -4200,6 +5567,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
         pfrom->AddInventoryKnown(inv);
 
+        // During initial block download, hand the block to the validation pipeline, so
+        // checking it overlaps with downloading and connecting the ones around it.
+        if (IsInitialBlockDownload() && QueueBlockForValidation(pfrom, block))
+            return true;
+
         CValidationState state;
         ProcessNewBlock(state, pfrom, &block);
         int nDoS;
@@ -4215,6 +5587,184 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        uint256 hash = cmpctblock.header.GetHash();
+        LogPrint("net", "received cmpctblock %s peer=%d\n", hash.ToString(), pfrom->id);
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+
+        CBlock block;
+        bool fReconstructed = false;
+        {
+            LOCK(cs_main);
+
+            if (!mapBlockIndex.count(cmpctblock.header.hashPrevBlock)) {
+                // We are missing the headers leading up to this block; fetch those,
+                // followed by the full block so it is no orphan when it arrives.
+                pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256(0));
+                map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+                if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == pfrom->GetId()) {
+                    vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                    pfrom->PushMessage("getdata", vInv);
+                }
+                return true;
+            }
+
+            // Check the header, including its proof of work, before spending any effort on the rest
+            CValidationState state;
+            CBlockIndex *pindex = NULL;
+            if (!AcceptBlockHeader(cmpctblock.header, state, &pindex)) {
+                int nDoS;
+                if (state.IsInvalid(nDoS)) {
+                    if (nDoS > 0)
+                        Misbehaving(pfrom->GetId(), nDoS);
+                    return error("invalid header received in cmpctblock");
+                }
+            }
+            if (pindex == NULL || (pindex->nStatus & BLOCK_HAVE_DATA))
+                return true;
+            UpdateBlockAvailability(pfrom->GetId(), hash);
+
+            // Only reconstruct blocks we asked this peer for
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+            if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != pfrom->GetId())
+                return true;
+
+            boost::shared_ptr<PartiallyDownloadedBlock> partialBlock(new PartiallyDownloadedBlock(&mempool));
+            ReadStatus status = partialBlock->InitData(cmpctblock);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(hash);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("invalid compact block %s from peer=%d", hash.ToString(), pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // Short ID collision within the block; fall back to the full block
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                pfrom->PushMessage("getdata", vInv);
+                return true;
+            }
+
+            BlockTransactionsRequest req;
+            req.blockhash = hash;
+            for (size_t i = 0; i < partialBlock->GetTxCount(); i++) {
+                if (!partialBlock->IsTxAvailable(i))
+                    req.indexes.push_back(i);
+            }
+            if (!req.indexes.empty()) {
+                State(pfrom->GetId())->mapPartialBlocks[hash] = partialBlock;
+                LogPrint("net", "requesting %u missing transactions of cmpctblock %s from peer=%d\n", req.indexes.size(), hash.ToString(), pfrom->id);
+                pfrom->PushMessage("getblocktxn", req);
+                return true;
+            }
+
+            status = partialBlock->FillBlock(block, vector<CTransaction>());
+            if (status != READ_STATUS_OK) {
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                pfrom->PushMessage("getdata", vInv);
+                return true;
+            }
+            fReconstructed = true;
+        }
+
+        if (fReconstructed) {
+            CValidationState state;
+            ProcessNewBlock(state, pfrom, &block);
+            int nDoS;
+            if (state.IsInvalid(nDoS)) {
+                pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                                   state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), hash);
+                if (nDoS > 0) {
+                    LOCK(cs_main);
+                    Misbehaving(pfrom->GetId(), nDoS);
+                }
+            }
+        }
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        CBlock block;
+        {
+            LOCK(cs_main);
+
+            CNodeState *nodestate = State(pfrom->GetId());
+            map<uint256, boost::shared_ptr<PartiallyDownloadedBlock> >::iterator it = nodestate->mapPartialBlocks.find(resp.blockhash);
+            if (it == nodestate->mapPartialBlocks.end()) {
+                LogPrint("net", "peer=%d sent us blocktxn for block %s we were not expecting\n", pfrom->id, resp.blockhash.ToString());
+                return true;
+            }
+
+            ReadStatus status = it->second->FillBlock(block, resp.txn);
+            nodestate->mapPartialBlocks.erase(it);
+            if (status == READ_STATUS_INVALID) {
+                MarkBlockAsReceived(resp.blockhash);
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us invalid compact block transactions", pfrom->id);
+            } else if (status == READ_STATUS_FAILED) {
+                // Most likely a short ID collision with our memory pool; get the full block
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, resp.blockhash));
+                pfrom->PushMessage("getdata", vInv);
+                return true;
+            }
+        }
+
+        CValidationState state;
+        ProcessNewBlock(state, pfrom, &block);
+        int nDoS;
+        if (state.IsInvalid(nDoS)) {
+            pfrom->PushMessage("reject", strCommand, state.GetRejectCode(),
+                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), resp.blockhash);
+            if (nDoS > 0) {
+                LOCK(cs_main);
+                Misbehaving(pfrom->GetId(), nDoS);
+            }
+        }
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrint("net", "peer=%d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+        if (!chainActive.Contains(mi->second) || mi->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // We never announce compact blocks this deep, so serve the full block instead
+            LogPrint("net", "peer=%d asked for transactions of old block %s, sending full block\n", pfrom->id, req.blockhash.ToString());
+            vector<CInv> vInv(1, CInv(MSG_BLOCK, req.blockhash));
+            pfrom->vRecvGetData.insert(pfrom->vRecvGetData.end(), vInv.begin(), vInv.end());
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, mi->second))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%d sent us a getblocktxn with out-of-bounds tx indexes", pfrom->id);
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
     // This asymmetric behavior for inbound and outbound connections was introduced
     // to prevent a fingerprinting attack: an attacker can send specific fake addresses
     // to users' AddrMan and later request them by sending getaddr messages. 
@@ -4772,7 +6322,8 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             NodeId staller = -1;
             FindNextBlocksToDownload(pto->GetId(), MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
             BOOST_FOREACH(CBlockIndex *pindex, vToDownload) {
-                vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                bool fCompact = pindex->pprev == chainActive.Tip() && CanRequestCompactBlock(pto);
+                vGetData.push_back(CInv(fCompact ? MSG_CMPCT_BLOCK : MSG_BLOCK, pindex->GetBlockHash()));
                 MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash(), pindex);
                 LogPrint("net", "Requesting block %s (%d) peer=%d\n", pindex->GetBlockHash().ToString(),
                     pindex->nHeight, pto->id);
@@ -4841,16 +6392,22 @@ bool CBlockUndo::WriteToDisk(CDiskBlockPos &pos, const uint256 &hashBlock)
 
 bool CBlockUndo::ReadFromDisk(const CDiskBlockPos &pos, const uint256 &hashBlock)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
-        return error("CBlockUndo::ReadFromDisk : OpenBlockFile failed");
-
-    // Read block
+    // Read undo data and its checksum, through a mapping of the file if possible
     uint256 hashChecksum;
     try {
-        filein >> *this;
-        filein >> hashChecksum;
+        boost::shared_ptr<CMappedFile> pmapped;
+        const char *pbegin, *pend;
+        if (GetMappedRecord(pos, "rev", sizeof(hashChecksum), pmapped, pbegin, pend)) {
+            CMemoryReader reader(pbegin, pend, SER_DISK, CLIENT_VERSION);
+            reader >> *this;
+            reader >> hashChecksum;
+        } else {
+            CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+            if (filein.IsNull())
+                return error("CBlockUndo::ReadFromDisk : OpenBlockFile failed");
+            filein >> *this;
+            filein >> hashChecksum;
+        }
     }
     catch (std::exception &e) {
         return error("%s : Deserialize or I/O error - %s", __func__, e.what());
@@ -4877,10 +6434,7 @@ class CMainCleanup
 public:
     CMainCleanup() {}
     ~CMainCleanup() {
-        // block headers
-        BlockMap::iterator it1 = mapBlockIndex.begin();
-        for (; it1 != mapBlockIndex.end(); it1++)
-            delete (*it1).second;
+        // block headers; the entries themselves are freed with blockIndexArena
         mapBlockIndex.clear();
 
         // orphan transactions
@@ -38,15 +38,20 @@
 
 #include <boost/unordered_map.hpp>
 
+class CAddrIndexDB;
+class CBlockFileInfo;
 class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
+class CCoinsViewPrefetch;
 class CInv;
 class CScriptCheck;
+class CSpentIndexDB;
 class CValidationInterface;
 class CValidationState;
 
 struct CBlockTemplate;
+struct CIndexWrites;
 struct CNodeStateStats;
 
 /** Default for -blockmaxsize and -blockminsize, which control the range of sizes the mining code will create **/
@@ -78,6 +83,35 @@ static const int COINBASE_MATURITY = 100;
 static const int MAX_SCRIPTCHECK_THREADS = 16;
 /** -par default (number of script-checking threads, 0 = auto) */
 static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
+/** -parblock default (number of block checking threads, 0 = auto) */
+static const int DEFAULT_BLOCKCHECK_THREADS = 0;
+/** Maximum number of block checking threads */
+static const int MAX_BLOCKCHECK_THREADS = 8;
+/** Maximum number of block and undo files kept memory-mapped for reading */
+static const unsigned int MAX_MAPPED_BLOCK_FILES = 64;
+/** -recentblocks default (number of connected blocks kept in memory with their undo data) */
+static const unsigned int DEFAULT_RECENT_BLOCKS = 10;
+/** Maximum number of blocks disconnected into one coins cache layer during a reorganization */
+static const unsigned int MAX_DISCONNECT_BATCH_BLOCKS = 16;
+/** Number of blocks at the tip of the active chain whose files are never pruned: a day of 2.5 minute blocks */
+static const unsigned int MIN_BLOCKS_TO_KEEP = 576;
+/**
+ * Smallest -prune target (in bytes). MIN_BLOCKS_TO_KEEP blocks of 1MB are
+ * 576MB; add 15% for undo data and 20% for orphans for a low water mark of
+ * 795MB after pruning. Files are pruned whole, so the high water mark that
+ * triggers it is one 128MB block file with its undo data (147MB) above that.
+ */
+static const uint64_t MIN_DISK_SPACE_FOR_BLOCK_FILES = 945 * 1024 * 1024;
+/** Maximum number of downloaded blocks waiting in the validation pipeline */
+static const unsigned int MAX_BLOCKS_PIPELINED = 128;
+/** Maximum number of checked blocks buffered ahead of the block file being connected during a parallel reindex */
+static const unsigned int MAX_REINDEX_BLOCKS_BUFFERED = 512;
+/** -prefetchthreads default (number of threads reading coins ahead of ConnectBlock) */
+static const int DEFAULT_PREFETCH_THREADS = 4;
+/** Maximum number of threads reading coins ahead of ConnectBlock */
+static const int MAX_PREFETCH_THREADS = 16;
+/** Maximum number of coins held by the prefetcher that ConnectBlock has not picked up yet */
+static const unsigned int MAX_PREFETCH_COINS = 100000;
 /** Number of blocks that can be requested at any given time from a single peer. */
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 16;
 /** Timeout in seconds during which a peer must stall block download progress before being disconnected. */
@@ -94,6 +128,14 @@ static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
 static const unsigned int DATABASE_WRITE_INTERVAL = 3600;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
+/** Default for -compactblocks, requesting new blocks as header plus short transaction IDs. */
+static const bool DEFAULT_COMPACTBLOCKS = true;
+/** Version of BIP 152 compact blocks we speak, sent and expected in "sendcmpct". */
+static const uint64_t CMPCTBLOCKS_VERSION = 1;
+/** Maximum depth of blocks we answer a compact block request with a "cmpctblock" for. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Maximum depth of blocks we serve "getblocktxn" requests for. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
 
 /** Litecoin: Dust Threshold: outputs below this value in satoshis are assessed an additional 1000 bytes per txout */
 static const CAmount DUST_THRESHOLD = 100000; // 0.001 LTC
@@ -132,9 +174,19 @@ extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+extern int nBlockCheckThreads;
 extern bool fTxIndex;
+extern bool fAddrIndex;
+extern bool fSpentIndex;
+/** True if any block files have ever been pruned. */
+extern bool fHavePruned;
+/** True if we're running in -prune mode. */
+extern bool fPruneMode;
+/** Number of bytes of block and undo files to aim for in -prune mode. */
+extern uint64_t nPruneTarget;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
+extern bool fCompactBlocks;
 extern unsigned int nCoinCacheSize;
 extern CFeeRate minRelayTxFee;
 extern bool fAlerts;
@@ -181,12 +233,18 @@ FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 boost::filesystem::path GetBlockPosFilename(const CDiskBlockPos &pos, const char *prefix);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** Rebuild the block index from all block files, checking blocks on nThreads threads */
+void ReindexBlockFiles(int nThreads);
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
 bool LoadBlockIndex();
+/** Bring the address and spent indexes in line with the chain state loaded by LoadBlockIndex, and add missing address index totals */
+bool CatchUpIndexes();
 /** Unload database information */
 void UnloadBlockIndex();
+/** Set how many recently connected blocks are kept in memory, with their undo data, to speed up reorganizations */
+void SetRecentBlocks(unsigned int nBlocks);
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
 /**
@@ -198,13 +256,23 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/**
+ * Queue a block received from the network for validation by the block check and
+ * connect threads. Returns false if the pipeline is disabled or full, in which case
+ * the caller should process the block itself.
+ */
+bool QueueBlockForValidation(CNode* pfrom, const CBlock& block);
+/** Run an instance of the block checking thread, doing context-free checks of pipelined blocks */
+void ThreadBlockCheck();
+/** Run the thread that stores and connects pipelined blocks, in order of arrival */
+void ThreadBlockConnect();
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
 bool IsInitialBlockDownload();
 /** Format a string that describes several potential problems detected by the core */
 std::string GetWarnings(std::string strFor);
 /** Retrieve a transaction (from memory pool, or from disk, if possible) */
 bool GetTransaction(const uint256 &hash, CTransaction &tx, uint256 &hashBlock, bool fAllowSlow = false);
-/** Find the best known block, and make it the tip of the block chain */
+/** Find the best known block, and make it the tip of the block chain. pblock, if given, is a block that passed CheckBlock. */
 bool ActivateBestChain(CValidationState &state, CBlock *pblock = NULL);
 CAmount GetBlockValue(int nHeight, const CAmount& nFees);
 
@@ -218,6 +286,33 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats);
 void Misbehaving(NodeId nodeid, int howmuch);
 /** Flush all state, indexes and buffers to disk. */
 void FlushStateToDisk();
+/** Prune block files and flush state to disk. */
+void PruneAndFlush();
+/** Calculate the amount of disk space the block and undo files currently use */
+uint64_t CalculateCurrentUsage();
+/**
+ * Pick the oldest of block files vinfo[0..nLastFile) to prune, until the space
+ * used by block and undo files is below nTarget, into setFilesToPrune. Files
+ * with a block above nLastBlockWeCanPrune are never picked. Returns the space
+ * the files left use.
+ */
+uint64_t SelectFilesToPrune(const std::vector<CBlockFileInfo>& vinfo, int nLastFile, unsigned int nLastBlockWeCanPrune, uint64_t nTarget, std::set<int>& setFilesToPrune);
+/**
+ * Forget the data of the blocks of mapIndex stored in block file nFile, and
+ * take them out of mapUnlinked. Returns the entries changed.
+ */
+std::vector<CBlockIndex*> PruneBlockIndexFile(BlockMap& mapIndex, std::multimap<CBlockIndex*, CBlockIndex*>& mapUnlinked, int nFile);
+/** Check the consistency of the block index, if fCheckBlockIndex is set. Asserts on failure. */
+void CheckBlockIndex();
+/** Write the block index to a snapshot file, to load it quickly at the next startup. Call after FlushStateToDisk. */
+bool WriteBlockIndexSnapshot();
+/**
+ * Get statistics about the UTXO set by scanning the coin database, without holding cs_main
+ * during the scan. With fIncremental, answer from the digest kept up to date since the first
+ * scan instead, if there was one; then only the height, best block, output count, total
+ * amount and hashSet are filled in.
+ */
+bool GetUTXOStats(CCoinsStats &stats, bool fIncremental);
 
 
 /** (try to) add transaction to memory pool **/
@@ -373,6 +468,8 @@ public:
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
+/** Read the transaction at pos, and the hash of the block it is in, without reading the rest of the block */
+bool ReadTransactionFromDisk(CTransaction& tx, uint256& hashBlock, const CDiskTxPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
 
 
@@ -381,11 +478,14 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
 /** Undo the effects of this block (with given index) on the UTXO set represented by coins.
  *  In case pfClean is provided, operation will try to be tolerant about errors, and *pfClean
  *  will be true if no problems were found. Otherwise, the return value will be false in case
- *  of problems. Note that in any case, coins may be modified. */
-bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL);
+ *  of problems. Note that in any case, coins may be modified. The address and spent index
+ *  updates are added to pwrites, if given, for the caller to apply once coins is flushed. */
+bool DisconnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool* pfClean = NULL, CIndexWrites* pwrites = NULL);
 
-/** Apply the effects of this block (with given index) on the UTXO set represented by coins */
-bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck = false);
+/** Apply the effects of this block (with given index) on the UTXO set represented by coins.
+ *  The address and spent index updates are added to pwrites, if given, as for DisconnectBlock.
+ *  With fAlreadyChecked, the block passed CheckBlock before and isn't checked again. */
+bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, bool fJustCheck = false, CIndexWrites* pwrites = NULL, bool fAlreadyChecked = false);
 
 /** Context-independent validity checks */
 bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
@@ -398,9 +498,12 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
 /** Check a block is completely valid from start to finish (only works on top of our current best block, with cs_main held) */
 bool TestBlockValidity(CValidationState &state, const CBlock& block, CBlockIndex *pindexPrev, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
 
-/** Store block on disk. If dbp is provided, the file is known to already reside on disk */
-bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex **pindex, CDiskBlockPos* dbp = NULL);
-bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex **ppindex= NULL);
+/**
+ * Store block on disk. If dbp is provided, the file is known to already reside on disk. If
+ * fAlreadyChecked, the block passed CheckBlock before, and its context-free checks are skipped.
+ */
+bool AcceptBlock(CBlock& block, CValidationState& state, CBlockIndex **pindex, CDiskBlockPos* dbp = NULL, bool fAlreadyChecked = false);
+bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex **ppindex= NULL, bool fCheckPOW = true);
 
 
 
@@ -544,9 +647,18 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the coins prefetcher below pcoinsTip, or NULL if disabled (thread-safe) */
+extern CCoinsViewPrefetch *pcoinsPrefetch;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/** Global variable that points to the address index, or NULL if disabled (protected by cs_main) */
+extern CAddrIndexDB *paddrindex;
+
+/** Global variable that points to the spent index, or NULL if disabled (protected by cs_main) */
+extern CSpentIndexDB *pspentindex;
+
 struct CBlockTemplate
 {
     CBlock block;
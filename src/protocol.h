@@ -147,6 +147,9 @@ enum {
     // Nodes may always request a MSG_FILTERED_BLOCK in a getdata, however,
     // MSG_FILTERED_BLOCK should not appear in any invs except as a part of getdata.
     MSG_FILTERED_BLOCK,
+    // Only requested in a getdata, from peers that sent a "sendcmpct" (BIP 152).
+    // Answered with a "cmpctblock" for blocks near the tip and a "block" otherwise.
+    MSG_CMPCT_BLOCK,
 };
 
 #endif // BITCOIN_PROTOCOL_H
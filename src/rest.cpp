@@ -3,6 +3,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "addrindex.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "main.h"
@@ -43,6 +44,10 @@ public:
 
 extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry);
 extern Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool txDetails = false);
+extern bool ParseAddrIndexScript(const string& str, uint160& hashScript);
+extern bool ParseAddrIndexCursor(const string& str, string& strCursor);
+extern bool AddrIndexHistoryToJSON(const uint160& hashScript, const string& strAfter, size_t nCount, Object& result);
+extern bool AddrIndexUnspentToJSON(const uint160& hashScript, const string& strAfter, size_t nCount, Object& result);
 
 static RestErr RESTERR(enum HTTPStatusCode status, string message)
 {
@@ -111,6 +116,9 @@ static bool rest_block(AcceptedConnection* conn,
             throw RESTERR(HTTP_NOT_FOUND, hashStr + " not found");
 
         pblockindex = mapBlockIndex[hash];
+        if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
+            throw RESTERR(HTTP_NOT_FOUND, hashStr + " not available (pruned data)");
+
         if (!ReadBlockFromDisk(block, pblockindex))
             throw RESTERR(HTTP_NOT_FOUND, hashStr + " not found");
     }
@@ -214,6 +222,70 @@ static bool rest_tx(AcceptedConnection* conn,
     return true; // continue to process further HTTP reqs on this cxn
 }
 
+static bool rest_address(AcceptedConnection* conn,
+                         string& strReq,
+                         map<string, string>& mapHeaders,
+                         bool fRun,
+                         bool fUnspent)
+{
+    vector<string> params;
+    enum RetFormat rf = ParseDataFormat(params, strReq);
+
+    // <address>/<count>[/<after>]
+    vector<string> path;
+    boost::split(path, params[0], boost::is_any_of("/"));
+    if (path.size() != 2 && path.size() != 3)
+        throw RESTERR(HTTP_BAD_REQUEST, "Expected <address>/<count>[/<after>]");
+
+    uint160 hashScript;
+    if (!ParseAddrIndexScript(path[0], hashScript))
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid address: " + path[0]);
+    int32_t nCount;
+    if (!ParseInt32(path[1], &nCount) || nCount < 1 || nCount > (int32_t)MAX_ADDRINDEX_PAGE_SIZE)
+        throw RESTERR(HTTP_BAD_REQUEST, strprintf("Invalid count (1 to %u): %s", MAX_ADDRINDEX_PAGE_SIZE, path[1]));
+    string strAfter;
+    if (path.size() == 3 && !ParseAddrIndexCursor(path[2], strAfter))
+        throw RESTERR(HTTP_BAD_REQUEST, "Invalid cursor: " + path[2]);
+
+    switch (rf) {
+    case RF_JSON: {
+        Object obj;
+        if (!fAddrIndex)
+            throw RESTERR(HTTP_NOT_FOUND, "Address index not enabled (use -addrindex)");
+        bool fRead = fUnspent ? AddrIndexUnspentToJSON(hashScript, strAfter, nCount, obj) :
+                                AddrIndexHistoryToJSON(hashScript, strAfter, nCount, obj);
+        if (!fRead)
+            throw RESTERR(HTTP_INTERNAL_SERVER_ERROR, "Error reading the address index");
+        string strJSON = write_string(Value(obj), false) + "\n";
+        conn->stream() << HTTPReply(HTTP_OK, strJSON, fRun) << std::flush;
+        return true;
+    }
+
+    default: {
+        throw RESTERR(HTTP_NOT_FOUND, "output format not found (available: json)");
+    }
+    }
+
+    // not reached
+    return true; // continue to process further HTTP reqs on this cxn
+}
+
+static bool rest_address_history(AcceptedConnection* conn,
+                                 string& strReq,
+                                 map<string, string>& mapHeaders,
+                                 bool fRun)
+{
+    return rest_address(conn, strReq, mapHeaders, fRun, false);
+}
+
+static bool rest_address_utxos(AcceptedConnection* conn,
+                               string& strReq,
+                               map<string, string>& mapHeaders,
+                               bool fRun)
+{
+    return rest_address(conn, strReq, mapHeaders, fRun, true);
+}
+
 static const struct {
     const char* prefix;
     bool (*handler)(AcceptedConnection* conn,
@@ -224,6 +296,8 @@ static const struct {
       {"/rest/tx/", rest_tx},
       {"/rest/block/notxdetails/", rest_block_notxdetails},
       {"/rest/block/", rest_block_extended},
+      {"/rest/address/history/", rest_address_history},
+      {"/rest/address/utxos/", rest_address_utxos},
 };
 
 bool HTTPReq_REST(AcceptedConnection* conn,
@@ -3,11 +3,15 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "addrindex.h"
+#include "base58.h"
 #include "checkpoints.h"
+#include "leveldbwrapper.h"
 #include "main.h"
 #include "rpcserver.h"
 #include "sync.h"
 #include "util.h"
+#include "utilstrencodings.h"
 
 #include <stdint.h>
 
@@ -290,6 +294,9 @@ Value getblock(const Array& params, bool fHelp)
     CBlock block;
     CBlockIndex* pblockindex = mapBlockIndex[hash];
 
+    if (fHavePruned && !(pblockindex->nStatus & BLOCK_HAVE_DATA) && pblockindex->nTx > 0)
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
+
     if(!ReadBlockFromDisk(block, pblockindex))
         throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
 
@@ -306,11 +313,14 @@ Value getblock(const Array& params, bool fHelp)
 
 Value gettxoutsetinfo(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( fast )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "Note this call may take some time, unless fast is set and a previous call has computed the set hash.\n"
+            "\nArguments:\n"
+            "1. fast          (boolean, optional, default=false) Answer instantly from statistics kept up to date\n"
+            "                 since the last full call, if any; transactions, bytes_serialized and hash_serialized are then omitted\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
@@ -319,29 +329,112 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
             "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
             "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
+            "  \"hash_set\": \"hash\",     (string) Hash of the set of unspent outputs, independent of their order\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "true")
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
+    bool fFast = false;
+    if (params.size() > 0)
+        fFast = params[0].get_bool();
+
     Object ret;
 
     CCoinsStats stats;
-    FlushStateToDisk();
-    if (pcoinsTip->GetStats(stats)) {
+    if (GetUTXOStats(stats, fFast)) {
+        // Statistics answered incrementally leave the fields that need a scan unset
+        bool fFull = (stats.hashSerialized != 0);
         ret.push_back(Pair("height", (int64_t)stats.nHeight));
         ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
-        ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
+        if (fFull)
+            ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
         ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
-        ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
-        ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+        if (fFull) {
+            ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
+            ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+        }
+        ret.push_back(Pair("hash_set", stats.hashSet.GetHex()));
         ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
     }
     return ret;
 }
 
+Value getdbstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getdbstats\n"
+            "\nReturns statistics of the LevelDB databases, and the options they were opened with.\n"
+            "Compaction figures and bytes written count from the moment a database was opened.\n"
+            "\nResult:\n"
+            "[\n"
+            "  {\n"
+            "    \"name\": \"name\",           (string) The database, e.g. chainstate or blockindex\n"
+            "    \"path\": \"path\",           (string) Its directory\n"
+            "    \"options\": {               (json object) Tuning options, see the -db* command line options\n"
+            "      \"blocksize\": n, \"restartinterval\": n, \"maxopenfiles\": n,\n"
+            "      \"compression\": true|false, \"bloombits\": n, \"writebuffer\": n\n"
+            "    },\n"
+            "    \"approximate_size\": n,     (numeric) Approximate space used on disk, in bytes\n"
+            "    \"bytes_written\": n,        (numeric) Size of the keys and values written\n"
+            "    \"write_amplification\": x.xxx, (numeric) Bytes written to disk per byte in bytes_written\n"
+            "    \"read_amplification\": n,   (numeric) Tables a lookup may have to consult: all of level 0 plus one per other level\n"
+            "    \"levels\": [                (array of json objects)\n"
+            "      {\n"
+            "        \"level\": n, \"files\": n, \"size_mb\": x.xxx,\n"
+            "        \"compaction_seconds\": x.xxx, \"compaction_read_mb\": x.xxx, \"compaction_write_mb\": x.xxx\n"
+            "      }, ...\n"
+            "    ],\n"
+            "    \"stats\": \"text\"           (string) The leveldb.stats report\n"
+            "  }, ...\n"
+            "]\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getdbstats", "")
+            + HelpExampleRpc("getdbstats", "")
+        );
+
+    Array ret;
+    std::vector<CLevelDBStats> vStats = CLevelDBWrapper::GetAllStats();
+    BOOST_FOREACH(const CLevelDBStats& stats, vStats) {
+        Object options;
+        options.push_back(Pair("blocksize", (uint64_t)stats.params.nBlockSize));
+        options.push_back(Pair("restartinterval", stats.params.nBlockRestartInterval));
+        options.push_back(Pair("maxopenfiles", stats.params.nMaxOpenFiles));
+        options.push_back(Pair("compression", stats.params.fCompression));
+        options.push_back(Pair("bloombits", stats.params.nBloomBits));
+        options.push_back(Pair("writebuffer", (uint64_t)stats.params.nWriteBufferSize));
+
+        Array levels;
+        BOOST_FOREACH(const CLevelDBLevelStats& level, stats.vLevels) {
+            Object obj;
+            obj.push_back(Pair("level", level.nLevel));
+            obj.push_back(Pair("files", level.nFiles));
+            obj.push_back(Pair("size_mb", level.dSizeMB));
+            obj.push_back(Pair("compaction_seconds", level.dCompactionSeconds));
+            obj.push_back(Pair("compaction_read_mb", level.dCompactionReadMB));
+            obj.push_back(Pair("compaction_write_mb", level.dCompactionWriteMB));
+            levels.push_back(obj);
+        }
+
+        Object obj;
+        obj.push_back(Pair("name", stats.params.strName));
+        obj.push_back(Pair("path", stats.strPath));
+        obj.push_back(Pair("options", options));
+        obj.push_back(Pair("approximate_size", stats.nApproximateSize));
+        obj.push_back(Pair("bytes_written", stats.nBytesWritten));
+        obj.push_back(Pair("write_amplification", stats.GetWriteAmplification()));
+        obj.push_back(Pair("read_amplification", stats.GetReadAmplification()));
+        obj.push_back(Pair("levels", levels));
+        obj.push_back(Pair("stats", stats.strStats));
+        ret.push_back(obj);
+    }
+    return ret;
+}
+
 Value gettxout(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -420,6 +513,253 @@ Value gettxout(const Array& params, bool fHelp)
     return ret;
 }
 
+/** Parse an address, or a hex encoded script, into the hash the address index keys it by */
+bool ParseAddrIndexScript(const string& str, uint160& hashScript)
+{
+    CBitcoinAddress address(str);
+    if (address.IsValid()) {
+        hashScript = GetAddrIndexScriptHash(GetScriptForDestination(address.Get()));
+        return true;
+    }
+    if (str.empty() || !IsHex(str))
+        return false;
+    vector<unsigned char> vch = ParseHex(str);
+    hashScript = GetAddrIndexScriptHash(CScript(vch.begin(), vch.end()));
+    return true;
+}
+
+/** Parse a page cursor, as returned in the next field of an address index page */
+bool ParseAddrIndexCursor(const string& str, string& strCursor)
+{
+    if (!IsHex(str) && !str.empty())
+        return false;
+    vector<unsigned char> vch = ParseHex(str);
+    strCursor.assign(vch.begin(), vch.end());
+    return true;
+}
+
+/** Number of confirmations of an address index entry at nHeight */
+static int AddrIndexConfirmations(int nTipHeight, int nHeight)
+{
+    // The index is written just before chainActive moves to the block it covers
+    return std::max(nTipHeight - nHeight + 1, 1);
+}
+
+/** Add the next and more fields of an address index page */
+static void AddrIndexPageToJSON(bool fMore, const string& strNext, Object& result)
+{
+    if (fMore)
+        result.push_back(Pair("next", HexStr(strNext.begin(), strNext.end())));
+    result.push_back(Pair("more", fMore));
+}
+
+/**
+ * Page of the address index history of a script, as returned by getaddresshistory. Reads the
+ * index without holding cs_main.
+ */
+bool AddrIndexHistoryToJSON(const uint160& hashScript, const string& strAfter, size_t nCount, Object& result)
+{
+    vector<CAddrIndexHistoryEntry> vEntries;
+    bool fMore;
+    string strNext;
+    if (!paddrindex->ReadHistory(hashScript, strAfter, nCount, vEntries, fMore, strNext))
+        return false;
+    int nTipHeight;
+    {
+        LOCK(cs_main);
+        nTipHeight = chainActive.Height();
+    }
+
+    Array entries;
+    BOOST_FOREACH(const CAddrIndexHistoryEntry& entry, vEntries) {
+        Object obj;
+        obj.push_back(Pair("txid", entry.txid.GetHex()));
+        obj.push_back(Pair("height", entry.nHeight));
+        obj.push_back(Pair("confirmations", AddrIndexConfirmations(nTipHeight, entry.nHeight)));
+        obj.push_back(Pair("category", entry.fSpend ? "spend" : "receive"));
+        obj.push_back(Pair(entry.fSpend ? "vin" : "vout", (int)entry.n));
+        obj.push_back(Pair("amount", ValueFromAmount(entry.fSpend ? -entry.nValue : entry.nValue)));
+        if (entry.fSpend) {
+            obj.push_back(Pair("prevtxid", entry.prevout.hash.GetHex()));
+            obj.push_back(Pair("prevvout", (int)entry.prevout.n));
+        }
+        entries.push_back(obj);
+    }
+    result.push_back(Pair("entries", entries));
+    AddrIndexPageToJSON(fMore, strNext, result);
+    return true;
+}
+
+/** Page of the unspent outputs of a script, as returned by getaddressutxos, read the same way */
+bool AddrIndexUnspentToJSON(const uint160& hashScript, const string& strAfter, size_t nCount, Object& result)
+{
+    vector<CAddrIndexUnspent> vUnspent;
+    bool fMore;
+    string strNext;
+    if (!paddrindex->ReadUnspent(hashScript, strAfter, nCount, vUnspent, fMore, strNext))
+        return false;
+    int nTipHeight;
+    {
+        LOCK(cs_main);
+        nTipHeight = chainActive.Height();
+    }
+
+    Array utxos;
+    BOOST_FOREACH(const CAddrIndexUnspent& unspent, vUnspent) {
+        Object obj;
+        obj.push_back(Pair("txid", unspent.outpoint.hash.GetHex()));
+        obj.push_back(Pair("vout", (int)unspent.outpoint.n));
+        obj.push_back(Pair("amount", ValueFromAmount(unspent.nValue)));
+        obj.push_back(Pair("height", unspent.nHeight));
+        obj.push_back(Pair("confirmations", AddrIndexConfirmations(nTipHeight, unspent.nHeight)));
+        utxos.push_back(obj);
+    }
+    result.push_back(Pair("utxos", utxos));
+    AddrIndexPageToJSON(fMore, strNext, result);
+    return true;
+}
+
+static uint160 AddrIndexScriptFromParam(const Value& param)
+{
+    if (!fAddrIndex)
+        throw JSONRPCError(RPC_MISC_ERROR, "The address index is disabled (start with -addrindex and -reindex to build it)");
+    uint160 hashScript;
+    if (!ParseAddrIndexScript(param.get_str(), hashScript))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Invalid Litecoin address or script");
+    return hashScript;
+}
+
+static void AddrIndexPageFromParams(const Array& params, size_t& nCount, string& strAfter)
+{
+    nCount = DEFAULT_ADDRINDEX_PAGE_SIZE;
+    strAfter.clear();
+    if (params.size() > 1) {
+        if (params[1].get_int() < 1 || params[1].get_int() > (int)MAX_ADDRINDEX_PAGE_SIZE)
+            throw JSONRPCError(RPC_INVALID_PARAMETER, strprintf("Count out of range (1 to %u)", MAX_ADDRINDEX_PAGE_SIZE));
+        nCount = params[1].get_int();
+    }
+    if (params.size() > 2 && !ParseAddrIndexCursor(params[2].get_str(), strAfter))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid cursor");
+}
+
+Value getaddresshistory(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getaddresshistory \"address\" ( count \"after\" )\n"
+            "\nReturns the confirmed outputs paying to an address and the inputs spending them, oldest first.\n"
+            "Requires -addrindex.\n"
+            "\nArguments:\n"
+            "1. \"address\"    (string, required) The litecoin address, or a hex encoded output script\n"
+            "2. count        (numeric, optional, default=" + strprintf("%u", DEFAULT_ADDRINDEX_PAGE_SIZE) + ") Number of entries to return, at most " + strprintf("%u", MAX_ADDRINDEX_PAGE_SIZE) + "\n"
+            "3. \"after\"      (string, optional) The next field of the previous page, to return the entries after it\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"entries\" : [\n"
+            "    {\n"
+            "      \"txid\" : \"txid\",          (string) The transaction id\n"
+            "      \"height\" : n,             (numeric) The height of the block containing it\n"
+            "      \"confirmations\" : n,      (numeric) The number of confirmations\n"
+            "      \"category\" : \"receive\",  (string) receive for an output, spend for an input\n"
+            "      \"vout\" : n,               (numeric) The output index, for receive\n"
+            "      \"vin\" : n,                (numeric) The input index, for spend\n"
+            "      \"amount\" : x.xxx,         (numeric) The amount in ltc, negative for spend\n"
+            "      \"prevtxid\" : \"txid\",      (string) The transaction of the output spent, for spend\n"
+            "      \"prevvout\" : n            (numeric) The index of the output spent, for spend\n"
+            "    }, ...\n"
+            "  ],\n"
+            "  \"next\" : \"cursor\",       (string) Where the next page starts, if there are entries past this page\n"
+            "  \"more\" : true|false        (boolean) Whether there are entries past this page\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddresshistory", "\"LPpjc6ZUB3RTcbtbR4sD9wXhYGpPmDkhRd\" 100")
+            + HelpExampleRpc("getaddresshistory", "\"LPpjc6ZUB3RTcbtbR4sD9wXhYGpPmDkhRd\", 100")
+        );
+
+    uint160 hashScript = AddrIndexScriptFromParam(params[0]);
+    size_t nCount;
+    string strAfter;
+    AddrIndexPageFromParams(params, nCount, strAfter);
+
+    Object ret;
+    if (!AddrIndexHistoryToJSON(hashScript, strAfter, nCount, ret))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Error reading the address index");
+    return ret;
+}
+
+Value getaddressutxos(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getaddressutxos \"address\" ( count \"after\" )\n"
+            "\nReturns the confirmed unspent outputs paying to an address, in txid order.\n"
+            "Requires -addrindex.\n"
+            "\nArguments:\n"
+            "1. \"address\"    (string, required) The litecoin address, or a hex encoded output script\n"
+            "2. count        (numeric, optional, default=" + strprintf("%u", DEFAULT_ADDRINDEX_PAGE_SIZE) + ") Number of outputs to return, at most " + strprintf("%u", MAX_ADDRINDEX_PAGE_SIZE) + "\n"
+            "3. \"after\"      (string, optional) The next field of the previous page, to return the outputs after it\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"utxos\" : [\n"
+            "    {\n"
+            "      \"txid\" : \"txid\",          (string) The transaction id\n"
+            "      \"vout\" : n,               (numeric) The output index\n"
+            "      \"amount\" : x.xxx,         (numeric) The amount in ltc\n"
+            "      \"height\" : n,             (numeric) The height of the block containing it\n"
+            "      \"confirmations\" : n       (numeric) The number of confirmations\n"
+            "    }, ...\n"
+            "  ],\n"
+            "  \"next\" : \"cursor\",       (string) Where the next page starts, if there are outputs past this page\n"
+            "  \"more\" : true|false        (boolean) Whether there are outputs past this page\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressutxos", "\"LPpjc6ZUB3RTcbtbR4sD9wXhYGpPmDkhRd\"")
+            + HelpExampleRpc("getaddressutxos", "\"LPpjc6ZUB3RTcbtbR4sD9wXhYGpPmDkhRd\"")
+        );
+
+    uint160 hashScript = AddrIndexScriptFromParam(params[0]);
+    size_t nCount;
+    string strAfter;
+    AddrIndexPageFromParams(params, nCount, strAfter);
+
+    Object ret;
+    if (!AddrIndexUnspentToJSON(hashScript, strAfter, nCount, ret))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Error reading the address index");
+    return ret;
+}
+
+Value getaddressbalance(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "getaddressbalance \"address\"\n"
+            "\nReturns the confirmed balance of an address. Requires -addrindex.\n"
+            "\nArguments:\n"
+            "1. \"address\"    (string, required) The litecoin address, or a hex encoded output script\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"balance\" : x.xxx,    (numeric) The total of the unspent outputs, in ltc\n"
+            "  \"received\" : x.xxx,   (numeric) The total ever received, in ltc\n"
+            "  \"utxos\" : n           (numeric) The number of unspent outputs\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getaddressbalance", "\"LPpjc6ZUB3RTcbtbR4sD9wXhYGpPmDkhRd\"")
+            + HelpExampleRpc("getaddressbalance", "\"LPpjc6ZUB3RTcbtbR4sD9wXhYGpPmDkhRd\"")
+        );
+
+    uint160 hashScript = AddrIndexScriptFromParam(params[0]);
+
+    CAddrIndexBalance balance;
+    if (!paddrindex->ReadBalance(hashScript, balance))
+        throw JSONRPCError(RPC_DATABASE_ERROR, "Error reading the address index");
+
+    Object ret;
+    ret.push_back(Pair("balance", ValueFromAmount(balance.nBalance)));
+    ret.push_back(Pair("received", ValueFromAmount(balance.nReceived)));
+    ret.push_back(Pair("utxos", balance.nUnspent));
+    return ret;
+}
+
 Value verifychain(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() > 2)
@@ -460,7 +800,9 @@ Value getblockchaininfo(const Array& params, bool fHelp)
             "  \"bestblockhash\": \"...\", (string) the hash of the currently best block\n"
             "  \"difficulty\": xxxxxx,     (numeric) the current difficulty\n"
             "  \"verificationprogress\": xxxx, (numeric) estimate of verification progress [0..1]\n"
-            "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"chainwork\": \"xxxx\",    (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"pruned\": xx,             (boolean) if the blocks are subject to pruning\n"
+            "  \"pruneheight\": xxxxxx,    (numeric) lowest-height block stored with its data (only present if pruning is enabled)\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getblockchaininfo", "")
@@ -475,6 +817,15 @@ Value getblockchaininfo(const Array& params, bool fHelp)
     obj.push_back(Pair("difficulty",            (double)GetDifficulty()));
     obj.push_back(Pair("verificationprogress",  Checkpoints::GuessVerificationProgress(chainActive.Tip())));
     obj.push_back(Pair("chainwork",             chainActive.Tip()->nChainWork.GetHex()));
+    obj.push_back(Pair("pruned",                fPruneMode));
+    if (fPruneMode)
+    {
+        CBlockIndex *block = chainActive.Tip();
+        while (block && block->pprev && (block->pprev->nStatus & BLOCK_HAVE_DATA))
+            block = block->pprev;
+
+        obj.push_back(Pair("pruneheight",        block->nHeight));
+    }
     return obj;
 }
 
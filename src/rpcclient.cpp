@@ -76,6 +76,9 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "sendrawtransaction", 1 },
     { "gettxout", 1 },
     { "gettxout", 2 },
+    { "gettxoutsetinfo", 0 },
+    { "getaddresshistory", 1 },
+    { "getaddressutxos", 1 },
     { "lockunspent", 0 },
     { "lockunspent", 1 },
     { "importprivkey", 2 },
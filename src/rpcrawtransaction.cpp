@@ -14,6 +14,7 @@
 #include "script/script.h"
 #include "script/sign.h"
 #include "script/standard.h"
+#include "spentindex.h"
 #include "uint256.h"
 #ifdef ENABLE_WALLET
 #include "wallet.h"
@@ -56,11 +57,16 @@ void ScriptPubKeyToJSON(const CScript& scriptPubKey, Object& out, bool fIncludeH
 
 void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
 {
-    entry.push_back(Pair("txid", tx.GetHash().GetHex()));
+    const uint256 txid = tx.GetHash();
+    entry.push_back(Pair("txid", txid.GetHex()));
     entry.push_back(Pair("version", tx.nVersion));
     entry.push_back(Pair("locktime", (int64_t)tx.nLockTime));
+    // With -spentindex, the outputs spent by a confirmed transaction are known without reading their blocks
+    bool fValueInKnown = fSpentIndex && !tx.IsCoinBase();
+    CAmount nValueIn = 0;
     Array vin;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
+        const CTxIn& txin = tx.vin[i];
         Object in;
         if (tx.IsCoinBase())
             in.push_back(Pair("coinbase", HexStr(txin.scriptSig.begin(), txin.scriptSig.end())));
@@ -71,6 +77,16 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
             o.push_back(Pair("asm", txin.scriptSig.ToString()));
             o.push_back(Pair("hex", HexStr(txin.scriptSig.begin(), txin.scriptSig.end())));
             in.push_back(Pair("scriptSig", o));
+            CSpentIndexValue spent;
+            if (fValueInKnown && pspentindex->ReadSpentInfo(txin.prevout, spent) && spent.txid == txid && spent.nInput == i) {
+                in.push_back(Pair("value", ValueFromAmount(spent.txout.nValue)));
+                CTxDestination address;
+                if (ExtractDestination(spent.txout.scriptPubKey, address))
+                    in.push_back(Pair("address", CBitcoinAddress(address).ToString()));
+                nValueIn += spent.txout.nValue;
+            } else {
+                fValueInKnown = false;
+            }
         }
         in.push_back(Pair("sequence", (int64_t)txin.nSequence));
         vin.push_back(in);
@@ -85,9 +101,17 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
         Object o;
         ScriptPubKeyToJSON(txout.scriptPubKey, o, true);
         out.push_back(Pair("scriptPubKey", o));
+        CSpentIndexValue spent;
+        if (fSpentIndex && pspentindex->ReadSpentInfo(COutPoint(txid, i), spent)) {
+            out.push_back(Pair("spentTxId", spent.txid.GetHex()));
+            out.push_back(Pair("spentIndex", (int64_t)spent.nInput));
+            out.push_back(Pair("spentHeight", spent.nHeight));
+        }
         vout.push_back(out);
     }
     entry.push_back(Pair("vout", vout));
+    if (fValueInKnown)
+        entry.push_back(Pair("fee", ValueFromAmount(nValueIn - tx.GetValueOut())));
 
     if (hashBlock != 0) {
         entry.push_back(Pair("blockhash", hashBlock.GetHex()));
@@ -138,6 +162,8 @@ Value getrawtransaction(const Array& params, bool fHelp)
             "         \"asm\": \"asm\",  (string) asm\n"
             "         \"hex\": \"hex\"   (string) hex\n"
             "       },\n"
+            "       \"value\": x.xxx,    (numeric, -spentindex only) The value of the output spent, in ltc\n"
+            "       \"address\": \"addr\", (string, -spentindex only) The address of the output spent, if it has one\n"
             "       \"sequence\": n      (numeric) The script sequence number\n"
             "     }\n"
             "     ,...\n"
@@ -155,10 +181,14 @@ Value getrawtransaction(const Array& params, bool fHelp)
             "           \"litecoinaddress\"        (string) litecoin address\n"
             "           ,...\n"
             "         ]\n"
-            "       }\n"
+            "       },\n"
+            "       \"spentTxId\" : \"id\",       (string, -spentindex only) The transaction spending the output, if spent\n"
+            "       \"spentIndex\" : n,          (numeric, -spentindex only) Its input spending the output\n"
+            "       \"spentHeight\" : n          (numeric, -spentindex only) The height of the block containing it\n"
             "     }\n"
             "     ,...\n"
             "  ],\n"
+            "  \"fee\" : x.xxx,            (numeric, -spentindex only) The fee in ltc, if the values of all inputs are known\n"
             "  \"blockhash\" : \"hash\",   (string) the block hash\n"
             "  \"confirmations\" : n,      (numeric) The confirmations\n"
             "  \"time\" : ttt,             (numeric) The transaction time in seconds since epoch (Jan 1 1970 GMT)\n"
@@ -484,6 +514,57 @@ Value decodescript(const Array& params, bool fHelp)
     return r;
 }
 
+/**
+ * Signs the inputs of a raw transaction for signrawtransaction, any number
+ * of them at once: an input's signature hash doesn't cover the scriptSigs
+ * of the others, so they all go by the same copy of the transaction.
+ */
+class CRawInputSigner
+{
+private:
+    const CKeyStore& keystore;
+    const CTransaction txTo;
+    const vector<CMutableTransaction>& txVariants;
+    const int nHashType;
+    const bool fHashSingle;
+
+public:
+    //! The scriptPubKey each input spends, if it is known
+    vector<char> vfHavePrevOut;
+    vector<CScript> vPrevPubKeys;
+    //! The resulting scriptSigs, and whether each one is complete
+    vector<CScript> vScriptSigs;
+    vector<char> vfComplete;
+
+    CRawInputSigner(const CKeyStore& keystoreIn, const CMutableTransaction& txToIn, const vector<CMutableTransaction>& txVariantsIn, int nHashTypeIn) :
+        keystore(keystoreIn), txTo(txToIn), txVariants(txVariantsIn), nHashType(nHashTypeIn),
+        fHashSingle((nHashTypeIn & ~SIGHASH_ANYONECANPAY) == SIGHASH_SINGLE),
+        vfHavePrevOut(txTo.vin.size(), false), vPrevPubKeys(txTo.vin.size()), vfComplete(txTo.vin.size(), false)
+    {
+        BOOST_FOREACH(const CTxIn& txin, txTo.vin)
+            vScriptSigs.push_back(txin.scriptSig);
+    }
+
+    void operator()(size_t i)
+    {
+        if (!vfHavePrevOut[i])
+            return;
+        const CScript& prevPubKey = vPrevPubKeys[i];
+        CScript& scriptSig = vScriptSigs[i];
+
+        scriptSig.clear();
+        // Only sign SIGHASH_SINGLE if there's a corresponding output:
+        if (!fHashSingle || (i < txTo.vout.size()))
+            ProduceSignature(keystore, prevPubKey, txTo, i, nHashType, scriptSig);
+
+        // ... and merge in other signatures:
+        BOOST_FOREACH(const CMutableTransaction& txv, txVariants) {
+            scriptSig = CombineSignatures(prevPubKey, txTo, i, scriptSig, txv.vin[i].scriptSig);
+        }
+        vfComplete[i] = VerifyScript(scriptSig, prevPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&txTo, i));
+    }
+};
+
 Value signrawtransaction(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 4)
@@ -669,28 +750,21 @@ Value signrawtransaction(const Array& params, bool fHelp)
             throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid sighash param");
     }
 
-    bool fHashSingle = ((nHashType & ~SIGHASH_ANYONECANPAY) == SIGHASH_SINGLE);
-
-    // Sign what we can:
+    CRawInputSigner signer(keystore, mergedTx, txVariants, nHashType);
     for (unsigned int i = 0; i < mergedTx.vin.size(); i++) {
-        CTxIn& txin = mergedTx.vin[i];
+        const CTxIn& txin = mergedTx.vin[i];
         const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-        if (coins == NULL || !coins->IsAvailable(txin.prevout.n)) {
-            fComplete = false;
+        if (coins == NULL || !coins->IsAvailable(txin.prevout.n))
             continue;
-        }
-        const CScript& prevPubKey = coins->vout[txin.prevout.n].scriptPubKey;
-
-        txin.scriptSig.clear();
-        // Only sign SIGHASH_SINGLE if there's a corresponding output:
-        if (!fHashSingle || (i < mergedTx.vout.size()))
-            SignSignature(keystore, prevPubKey, mergedTx, i, nHashType);
+        signer.vfHavePrevOut[i] = true;
+        signer.vPrevPubKeys[i] = coins->vout[txin.prevout.n].scriptPubKey;
+    }
 
-        // ... and merge in other signatures:
-        BOOST_FOREACH(const CMutableTransaction& txv, txVariants) {
-            txin.scriptSig = CombineSignatures(prevPubKey, mergedTx, i, txin.scriptSig, txv.vin[i].scriptSig);
-        }
-        if (!VerifyScript(txin.scriptSig, prevPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, MutableTransactionSignatureChecker(&mergedTx, i)))
+    // Sign what we can, on the script verification threads
+    ParallelFor(mergedTx.vin.size(), nScriptCheckThreads, boost::ref(signer));
+    for (unsigned int i = 0; i < mergedTx.vin.size(); i++) {
+        mergedTx.vin[i].scriptSig = signer.vScriptSigs[i];
+        if (!signer.vfComplete[i])
             fComplete = false;
     }
 
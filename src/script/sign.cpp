@@ -10,7 +10,9 @@
 #include "keystore.h"
 #include "script/standard.h"
 #include "uint256.h"
+#include "util.h"
 
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
 
 using namespace std;
@@ -91,17 +93,16 @@ bool Solver(const CKeyStore& keystore, const CScript& scriptPubKey, uint256 hash
     return false;
 }
 
-bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CMutableTransaction& txTo, unsigned int nIn, int nHashType)
+bool ProduceSignature(const CKeyStore &keystore, const CScript& fromPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType, CScript& scriptSigRet)
 {
     assert(nIn < txTo.vin.size());
-    CTxIn& txin = txTo.vin[nIn];
 
     // Leave out the signature from the hash, since a signature can't sign itself.
     // The checksig op will also drop the signatures from its hash.
     uint256 hash = SignatureHash(fromPubKey, txTo, nIn, nHashType);
 
     txnouttype whichType;
-    if (!Solver(keystore, fromPubKey, hash, nHashType, txin.scriptSig, whichType))
+    if (!Solver(keystore, fromPubKey, hash, nHashType, scriptSigRet, whichType))
         return false;
 
     if (whichType == TX_SCRIPTHASH)
@@ -109,21 +110,62 @@ bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CMutabl
         // Solver returns the subscript that need to be evaluated;
         // the final scriptSig is the signatures from that
         // and then the serialized subscript:
-        CScript subscript = txin.scriptSig;
+        CScript subscript = scriptSigRet;
 
         // Recompute txn hash using subscript in place of scriptPubKey:
         uint256 hash2 = SignatureHash(subscript, txTo, nIn, nHashType);
 
         txnouttype subType;
         bool fSolved =
-            Solver(keystore, subscript, hash2, nHashType, txin.scriptSig, subType) && subType != TX_SCRIPTHASH;
+            Solver(keystore, subscript, hash2, nHashType, scriptSigRet, subType) && subType != TX_SCRIPTHASH;
         // Append serialized subscript whether or not it is completely signed:
-        txin.scriptSig << static_cast<valtype>(subscript);
+        scriptSigRet << static_cast<valtype>(subscript);
         if (!fSolved) return false;
     }
+    return true;
+}
+
+static bool ProduceAndCheckSignature(const CKeyStore &keystore, const CScript& fromPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType, CScript& scriptSigRet)
+{
+    if (!ProduceSignature(keystore, fromPubKey, txTo, nIn, nHashType, scriptSigRet))
+        return false;
 
     // Test solution
-    return VerifyScript(txin.scriptSig, fromPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, MutableTransactionSignatureChecker(&txTo, nIn));
+    return VerifyScript(scriptSigRet, fromPubKey, STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&txTo, nIn));
+}
+
+bool SignSignature(const CKeyStore &keystore, const CScript& fromPubKey, CMutableTransaction& txTo, unsigned int nIn, int nHashType)
+{
+    assert(nIn < txTo.vin.size());
+    return ProduceAndCheckSignature(keystore, fromPubKey, CTransaction(txTo), nIn, nHashType, txTo.vin[nIn].scriptSig);
+}
+
+static void ProduceSignatureAt(const CKeyStore* pkeystore, const std::vector<CScript>* pvFromPubKeys, const CTransaction* ptxTo, int nHashType,
+                               std::vector<CScript>* pvScriptSigs, std::vector<char>* pvfSigned, size_t i)
+{
+    (*pvfSigned)[i] = ProduceAndCheckSignature(*pkeystore, (*pvFromPubKeys)[i], *ptxTo, i, nHashType, (*pvScriptSigs)[i]);
+}
+
+bool SignSignatures(const CKeyStore& keystore, const std::vector<CScript>& vFromPubKeys, CMutableTransaction& txTo, int nHashType, int nThreads)
+{
+    assert(vFromPubKeys.size() == txTo.vin.size());
+
+    // The signature hash of an input doesn't cover the scriptSigs of the
+    // others, so all inputs are signed against the same unsigned copy
+    const CTransaction txToConst(txTo);
+    std::vector<CScript> vScriptSigs(txTo.vin.size());
+    std::vector<char> vfSigned(txTo.vin.size(), false);
+    ParallelFor(txTo.vin.size(), nThreads,
+                boost::bind(&ProduceSignatureAt, &keystore, &vFromPubKeys, &txToConst, nHashType, &vScriptSigs, &vfSigned, _1));
+
+    bool fSigned = true;
+    for (unsigned int i = 0; i < txTo.vin.size(); i++)
+    {
+        txTo.vin[i].scriptSig = vScriptSigs[i];
+        if (!vfSigned[i])
+            fSigned = false;
+    }
+    return fSigned;
 }
 
 bool SignSignature(const CKeyStore &keystore, const CTransaction& txFrom, CMutableTransaction& txTo, unsigned int nIn, int nHashType)
@@ -8,14 +8,27 @@
 
 #include "script/interpreter.h"
 
+#include <vector>
+
 class CKeyStore;
 class CScript;
 class CTransaction;
 
 struct CMutableTransaction;
 
+/**
+ * Produce the scriptSig of input nIn of txTo, which spends fromPubKey, into
+ * scriptSigRet, without checking it. txTo is left alone, so it doesn't have
+ * to be copied for every input, and several inputs can be signed at once.
+ */
+bool ProduceSignature(const CKeyStore& keystore, const CScript& fromPubKey, const CTransaction& txTo, unsigned int nIn, int nHashType, CScript& scriptSigRet);
 bool SignSignature(const CKeyStore& keystore, const CScript& fromPubKey, CMutableTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
 bool SignSignature(const CKeyStore& keystore, const CTransaction& txFrom, CMutableTransaction& txTo, unsigned int nIn, int nHashType=SIGHASH_ALL);
+/**
+ * Sign and check every input of txTo, input i spending vFromPubKeys[i], on up
+ * to nThreads threads. Returns false if any input could not be signed.
+ */
+bool SignSignatures(const CKeyStore& keystore, const std::vector<CScript>& vFromPubKeys, CMutableTransaction& txTo, int nHashType, int nThreads);
 
 /**
  * Given two sets of signatures for scriptPubKey, possibly with OP_0 placeholders,
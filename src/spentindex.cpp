@@ -0,0 +1,56 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "spentindex.h"
+
+#include "primitives/block.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+CSpentIndexDB::CSpentIndexDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "spentindex", nCacheSize, fMemory, fWipe, CLevelDBParams::FromArgs("spentindex")) {
+}
+
+bool CSpentIndexDB::ConnectBlock(const CBlock& block, int nHeight, const vector<CSpentOutput>& vSpent, CLevelDBBatch& batch)
+{
+    size_t nSpent = 0;
+    for (unsigned int i = 1; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        const uint256 txid = tx.GetHash();
+        for (unsigned int j = 0; j < tx.vin.size(); j++) {
+            if (nSpent >= vSpent.size())
+                return error("%s : spent outputs missing", __func__);
+            batch.Write(make_pair('s', tx.vin[j].prevout), CSpentIndexValue(txid, j, nHeight, vSpent[nSpent++].txout));
+        }
+    }
+    if (nSpent != vSpent.size())
+        return error("%s : spent outputs do not match the block", __func__);
+    return true;
+}
+
+bool CSpentIndexDB::DisconnectBlock(const CBlock& block, CLevelDBBatch& batch)
+{
+    for (unsigned int i = 1; i < block.vtx.size(); i++) {
+        BOOST_FOREACH(const CTxIn& txin, block.vtx[i].vin)
+            batch.Erase(make_pair('s', txin.prevout));
+    }
+    return true;
+}
+
+void CSpentIndexDB::WriteBestBlock(CLevelDBBatch& batch, const uint256& hashBlock)
+{
+    batch.Write('B', hashBlock);
+}
+
+bool CSpentIndexDB::ReadBestBlock(uint256& hashBlock)
+{
+    return Read('B', hashBlock);
+}
+
+bool CSpentIndexDB::ReadSpentInfo(const COutPoint& outpoint, CSpentIndexValue& value)
+{
+    return Read(make_pair('s', outpoint), value);
+}
@@ -0,0 +1,73 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SPENTINDEX_H
+#define BITCOIN_SPENTINDEX_H
+
+#include "compressor.h"
+#include "leveldbwrapper.h"
+#include "primitives/transaction.h"
+#include "serialize.h"
+#include "uint256.h"
+#include "undo.h"
+
+#include <vector>
+
+class CBlock;
+
+/** Where an output was spent, and the output itself */
+struct CSpentIndexValue
+{
+    //! The spending transaction, and the index of its input
+    uint256 txid;
+    unsigned int nInput;
+    //! The height of the block containing the spending transaction
+    int nHeight;
+    //! The output spent
+    CTxOut txout;
+
+    CSpentIndexValue() : nInput(0), nHeight(0) {}
+    CSpentIndexValue(const uint256& txidIn, unsigned int nInputIn, int nHeightIn, const CTxOut& txoutIn) :
+        txid(txidIn), nInput(nInputIn), nHeight(nHeightIn), txout(txoutIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(txid);
+        READWRITE(VARINT(nInput));
+        READWRITE(VARINT(nHeight));
+        READWRITE(REF(CTxOutCompressor(REF(txout))));
+    }
+};
+
+/**
+ * Optional index (-spentindex) from each spent output to the input spending it, in its own
+ * database (spentindex/). It holds the value and script of every spent output, so the inputs
+ * of a confirmed transaction can be valued without reading the blocks or undo data they
+ * came from.
+ */
+class CSpentIndexDB : public CLevelDBWrapper
+{
+public:
+    CSpentIndexDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+private:
+    CSpentIndexDB(const CSpentIndexDB&);
+    void operator=(const CSpentIndexDB&);
+public:
+    /**
+     * Add the writes indexing a block connected at nHeight to batch, for the caller to
+     * apply with WriteBatch. vSpent holds the outputs spent by its inputs, in block order.
+     */
+    bool ConnectBlock(const CBlock& block, int nHeight, const std::vector<CSpentOutput>& vSpent, CLevelDBBatch& batch);
+    /** Add the writes undoing ConnectBlock for the same block to batch */
+    bool DisconnectBlock(const CBlock& block, CLevelDBBatch& batch);
+    /** Record in batch the block the index is up to date with, written along with its entries */
+    void WriteBestBlock(CLevelDBBatch& batch, const uint256& hashBlock);
+    bool ReadBestBlock(uint256& hashBlock);
+
+    bool ReadSpentInfo(const COutPoint& outpoint, CSpentIndexValue& value);
+};
+
+#endif // BITCOIN_SPENTINDEX_H
@@ -0,0 +1,239 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "addrindex.h"
+#include "primitives/block.h"
+#include "pubkey.h"
+#include "random.h"
+#include "script/standard.h"
+
+#include <string>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+CMutableTransaction MakeSpend(const COutPoint& prevout, const CScript& scriptPubKey, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = scriptPubKey;
+    tx.vout[0].nValue = nValue;
+    return tx;
+}
+
+void CheckBalance(CAddrIndexDB& db, const uint160& hashScript, CAmount nBalanceExpected, size_t nUnspentExpected, CAmount nReceivedExpected)
+{
+    CAddrIndexBalance balance;
+    BOOST_CHECK(db.ReadBalance(hashScript, balance));
+    BOOST_CHECK_EQUAL(balance.nBalance, nBalanceExpected);
+    BOOST_CHECK_EQUAL(balance.nUnspent, nUnspentExpected);
+    BOOST_CHECK_EQUAL(balance.nReceived, nReceivedExpected);
+}
+
+//! Connect or disconnect a block and write the index batch
+bool ApplyBlock(CAddrIndexDB& db, const CBlock& block, int nHeight, const std::vector<CSpentOutput>& vSpent, bool fConnect)
+{
+    CAddrIndexBatch batch;
+    bool fOk = fConnect ? db.ConnectBlock(block, nHeight, vSpent, batch) : db.DisconnectBlock(block, nHeight, vSpent, batch);
+    return fOk && db.WriteBatch(batch);
+}
+}
+
+BOOST_AUTO_TEST_SUITE(addrindex_tests)
+
+BOOST_AUTO_TEST_CASE(script_hash)
+{
+    // A pay-to-pubkey output is indexed with the pay-to-pubkey-hash ones of the same key.
+    std::vector<unsigned char> vchPubKey(33, 0);
+    vchPubKey[0] = 0x02;
+    vchPubKey[1] = 0x42;
+    CPubKey pubkey(vchPubKey);
+    CScript scriptPubKey = CScript() << ToByteVector(pubkey) << OP_CHECKSIG;
+    CScript scriptKeyHash = GetScriptForDestination(pubkey.GetID());
+    BOOST_CHECK(GetAddrIndexScriptHash(scriptPubKey) == GetAddrIndexScriptHash(scriptKeyHash));
+
+    // Other scripts are indexed as they are.
+    CScript scriptOther = CScript() << OP_TRUE;
+    BOOST_CHECK(GetAddrIndexScriptHash(scriptOther) == Hash160(scriptOther.begin(), scriptOther.end()));
+    BOOST_CHECK(GetAddrIndexScriptHash(scriptOther) != GetAddrIndexScriptHash(scriptKeyHash));
+}
+
+BOOST_AUTO_TEST_CASE(connect_disconnect)
+{
+    CAddrIndexDB db(1 << 20, true);
+
+    CScript scriptA = GetScriptForDestination(CKeyID(uint160(1)));
+    CScript scriptB = GetScriptForDestination(CKeyID(uint160(2)));
+    uint160 hashA = GetAddrIndexScriptHash(scriptA);
+    uint160 hashB = GetAddrIndexScriptHash(scriptB);
+
+    // Block 5: an older output of B.
+    CMutableTransaction tx0 = MakeSpend(COutPoint(GetRandHash(), 3), scriptB, 30);
+    CBlock block0;
+    block0.vtx.push_back(tx0);
+    std::vector<CSpentOutput> vSpent0;
+    vSpent0.push_back(CSpentOutput(CTxOut(30, CScript() << OP_TRUE), 1));
+    BOOST_CHECK(ApplyBlock(db, block0, 5, vSpent0, true));
+    CheckBalance(db, hashB, 30, 1, 30);
+
+    // Block 10: a coinbase paying A, and a spend of the older output of B paying A and B.
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vout.resize(2);
+    coinbase.vout[0].scriptPubKey = scriptA;
+    coinbase.vout[0].nValue = 50;
+    coinbase.vout[1].scriptPubKey = CScript() << OP_RETURN;
+    COutPoint prevoutOld(tx0.GetHash(), 0);
+    CMutableTransaction tx1 = MakeSpend(prevoutOld, scriptA, 20);
+    tx1.vout.push_back(CTxOut(9, scriptB));
+    CBlock block1;
+    block1.vtx.push_back(coinbase);
+    block1.vtx.push_back(tx1);
+    std::vector<CSpentOutput> vSpent1;
+    vSpent1.push_back(CSpentOutput(CTxOut(30, scriptB), 5));
+    BOOST_CHECK(ApplyBlock(db, block1, 10, vSpent1, true));
+
+    // Block 11: B receives A's output of tx1, then spends it within the same block back to A.
+    CMutableTransaction coinbase2 = coinbase;
+    coinbase2.vin[0].scriptSig = CScript() << 11;
+    CMutableTransaction tx2 = MakeSpend(COutPoint(tx1.GetHash(), 0), scriptB, 19);
+    CMutableTransaction tx3 = MakeSpend(COutPoint(tx2.GetHash(), 0), scriptA, 18);
+    CBlock block2;
+    block2.vtx.push_back(coinbase2);
+    block2.vtx.push_back(tx2);
+    block2.vtx.push_back(tx3);
+    std::vector<CSpentOutput> vSpent2;
+    vSpent2.push_back(CSpentOutput(CTxOut(20, scriptA), 10));
+    vSpent2.push_back(CSpentOutput(CTxOut(19, scriptB), 11));
+    BOOST_CHECK(ApplyBlock(db, block2, 11, vSpent2, true));
+
+    CheckBalance(db, hashA, 50 + 50 + 18, 3, 50 + 20 + 50 + 18);
+    CheckBalance(db, hashB, 9, 1, 30 + 9 + 19);
+
+    // History is ordered by height, and read in pages that resume after the last entry read.
+    std::vector<CAddrIndexHistoryEntry> vEntries;
+    bool fMore;
+    std::string strPage1, strNext;
+    BOOST_CHECK(db.ReadHistory(hashB, "", 2, vEntries, fMore, strPage1));
+    BOOST_CHECK(fMore);
+    BOOST_REQUIRE_EQUAL(vEntries.size(), 2U);
+    BOOST_CHECK_EQUAL(vEntries[0].nHeight, 5);
+    BOOST_CHECK(vEntries[0].txid == tx0.GetHash());
+    BOOST_CHECK_EQUAL(vEntries[1].nHeight, 10);
+    BOOST_CHECK(vEntries[1].txid == tx1.GetHash());
+    BOOST_CHECK(!vEntries[1].fSpend);
+    vEntries.clear();
+    BOOST_CHECK(db.ReadHistory(hashB, strPage1, 10, vEntries, fMore, strNext));
+    BOOST_CHECK(!fMore);
+    BOOST_REQUIRE_EQUAL(vEntries.size(), 3U);
+    BOOST_CHECK_EQUAL(vEntries[0].nHeight, 10);
+    BOOST_CHECK(vEntries[0].fSpend);
+    BOOST_CHECK(vEntries[0].prevout == prevoutOld);
+    for (unsigned int i = 1; i < vEntries.size(); i++)
+        BOOST_CHECK_EQUAL(vEntries[i].nHeight, 11);
+    bool fFoundSpend = false;
+    for (unsigned int i = 1; i < vEntries.size(); i++) {
+        if (vEntries[i].fSpend) {
+            BOOST_CHECK(vEntries[i].txid == tx3.GetHash());
+            BOOST_CHECK(vEntries[i].prevout == COutPoint(tx2.GetHash(), 0));
+            BOOST_CHECK_EQUAL(vEntries[i].nValue, 19);
+            fFoundSpend = true;
+        }
+    }
+    BOOST_CHECK(fFoundSpend);
+
+    std::vector<CAddrIndexUnspent> vUnspent;
+    BOOST_CHECK(db.ReadUnspent(hashB, "", 10, vUnspent, fMore, strNext));
+    BOOST_CHECK(!fMore);
+    BOOST_REQUIRE_EQUAL(vUnspent.size(), 1U);
+    BOOST_CHECK(vUnspent[0].outpoint == COutPoint(tx1.GetHash(), 1));
+    BOOST_CHECK_EQUAL(vUnspent[0].nValue, 9);
+    BOOST_CHECK_EQUAL(vUnspent[0].nHeight, 10);
+
+    // Disconnecting block 11 restores the outputs it spent, and forgets the ones it created.
+    BOOST_CHECK(ApplyBlock(db, block2, 11, vSpent2, false));
+    CheckBalance(db, hashA, 50 + 20, 2, 50 + 20);
+    CheckBalance(db, hashB, 9, 1, 30 + 9);
+    vEntries.clear();
+    BOOST_CHECK(db.ReadHistory(hashB, "", 10, vEntries, fMore, strNext));
+    BOOST_CHECK_EQUAL(vEntries.size(), 3U);
+    // A page still resumes in the right place after entries before or after it went away.
+    vEntries.clear();
+    BOOST_CHECK(db.ReadHistory(hashB, strPage1, 10, vEntries, fMore, strNext));
+    BOOST_REQUIRE_EQUAL(vEntries.size(), 1U);
+    BOOST_CHECK(vEntries[0].fSpend);
+
+    // And block 10 the older output of B.
+    BOOST_CHECK(ApplyBlock(db, block1, 10, vSpent1, false));
+    CheckBalance(db, hashA, 0, 0, 0);
+    CheckBalance(db, hashB, 30, 1, 30);
+    vUnspent.clear();
+    BOOST_CHECK(db.ReadUnspent(hashB, "", 10, vUnspent, fMore, strNext));
+    BOOST_REQUIRE_EQUAL(vUnspent.size(), 1U);
+    BOOST_CHECK(vUnspent[0].outpoint == prevoutOld);
+    BOOST_CHECK_EQUAL(vUnspent[0].nHeight, 5);
+
+    // Spent outputs that do not match the block are refused.
+    BOOST_CHECK(!ApplyBlock(db, block2, 11, vSpent1, true));
+}
+
+BOOST_AUTO_TEST_CASE(best_block)
+{
+    CAddrIndexDB db(1 << 20, true);
+    uint256 hashBest;
+    BOOST_CHECK(!db.ReadBestBlock(hashBest));
+
+    // The best block goes in the same batch as the entries it covers
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vout.push_back(CTxOut(50, GetScriptForDestination(CKeyID(uint160(1)))));
+    CBlock block;
+    block.vtx.push_back(coinbase);
+    CAddrIndexBatch batch;
+    BOOST_CHECK(db.ConnectBlock(block, 1, std::vector<CSpentOutput>(), batch));
+    db.WriteBestBlock(batch, block.GetHash());
+    BOOST_CHECK(!db.ReadBestBlock(hashBest));
+    BOOST_CHECK(db.WriteBatch(batch));
+    BOOST_CHECK(db.ReadBestBlock(hashBest));
+    BOOST_CHECK(hashBest == block.GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(missing_balances)
+{
+    // An index written before the totals were kept: only its entries are there
+    CAddrIndexDB db(1 << 20, true);
+    db.Erase('T');
+    CScript scriptA = GetScriptForDestination(CKeyID(uint160(1)));
+    uint160 hashA = GetAddrIndexScriptHash(scriptA);
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vout.push_back(CTxOut(50, scriptA));
+    coinbase.vout.push_back(CTxOut(7, scriptA));
+    CBlock block;
+    block.vtx.push_back(coinbase);
+    CAddrIndexBatch batch;
+    BOOST_CHECK(db.ConnectBlock(block, 1, std::vector<CSpentOutput>(), batch));
+    batch.mapBalances.clear();
+    BOOST_CHECK(db.WriteBatch(batch));
+    CMutableTransaction tx = MakeSpend(COutPoint(coinbase.GetHash(), 1), CScript() << OP_TRUE, 7);
+    CBlock block2;
+    block2.vtx.push_back(tx);
+    std::vector<CSpentOutput> vSpent;
+    vSpent.push_back(CSpentOutput(coinbase.vout[1], 1));
+    CAddrIndexBatch batch2;
+    BOOST_CHECK(db.ConnectBlock(block2, 2, vSpent, batch2));
+    batch2.mapBalances.clear();
+    BOOST_CHECK(db.WriteBatch(batch2));
+    CheckBalance(db, hashA, 0, 0, 0);
+
+    BOOST_CHECK(db.WriteMissingBalances());
+    CheckBalance(db, hashA, 50, 1, 57);
+    CheckBalance(db, GetAddrIndexScriptHash(CScript() << OP_TRUE), 7, 1, 7);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
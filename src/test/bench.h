@@ -0,0 +1,32 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TEST_BENCH_H
+#define BITCOIN_TEST_BENCH_H
+
+#include <stdint.h>
+#include <string>
+
+/**
+ * Timings too slow for the unit tests, run by test/bench_litecoin rather than
+ * by make check. Each benchmark sets up its own data and reports what it timed.
+ */
+typedef void (*BenchmarkFunction)();
+
+class CBenchmarkRegistration
+{
+public:
+    CBenchmarkRegistration(const char* pszName, BenchmarkFunction function);
+};
+
+/** Define a benchmark, run by its name */
+#define BENCHMARK(name) \
+    static void name(); \
+    static CBenchmarkRegistration name##_registration(#name, name); \
+    static void name()
+
+/** Print how long something took, given its start time in microseconds */
+void ReportTiming(const std::string& strWhat, int64_t nStartMicros);
+
+#endif // BITCOIN_TEST_BENCH_H
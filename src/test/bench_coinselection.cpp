@@ -0,0 +1,51 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "coinselection.h"
+#include "random.h"
+#include "tinyformat.h"
+#include "utilmoneystr.h"
+#include "utiltime.h"
+
+#include <set>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+BENCHMARK(coin_selection_100k)
+{
+    // A wallet with 100k coins between 0.001 and 10 coins, told apart by their output index
+    const int nCoins = 100000;
+    vector<CInputCoin> vCoins;
+    for (int i = 0; i < nCoins; i++)
+        vCoins.push_back(make_pair(COIN / 1000 + GetRand(10 * COIN), make_pair((const CWalletTx*)NULL, (unsigned int)i)));
+
+    int64_t nStart = GetTimeMicros();
+    CCoinSelectionPool pool(vCoins);
+    ReportTiming(strprintf("index %d coins", nCoins), nStart);
+
+    const int nSelections = 20;
+    nStart = GetTimeMicros();
+    for (int i = 0; i < nSelections; i++) {
+        // Targets a transaction with many outputs pays, plus some small change to the fee
+        CAmount nTarget = (i + 1) * 50 * COIN + GetRand(COIN);
+        set<pair<const CWalletTx*, unsigned int> > setCoinsRet;
+        CAmount nValueRet;
+        if (!pool.Select(nTarget, setCoinsRet, nValueRet) || nValueRet < nTarget) {
+            printf("  selection of %s failed\n", FormatMoney(nTarget).c_str());
+            return;
+        }
+    }
+    ReportTiming(strprintf("%d selections", nSelections), nStart);
+
+    // For reference, one pass of the stochastic search over all coins, as done before the pool
+    nStart = GetTimeMicros();
+    vector<char> vfBest;
+    CAmount nBest;
+    ApproximateBestSubset(vCoins, pool.GetTotal(), 50 * COIN + 1, vfBest, nBest, 1000);
+    ReportTiming("one unbounded subset search", nStart);
+}
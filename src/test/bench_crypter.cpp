@@ -0,0 +1,69 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "crypter.h"
+#include "key.h"
+#include "random.h"
+#include "script/standard.h"
+#include "tinyformat.h"
+#include "utiltime.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+using namespace std;
+
+namespace
+{
+/** Gives access to the encryption of a key store */
+class CBenchCryptoKeyStore : public CCryptoKeyStore
+{
+public:
+    using CCryptoKeyStore::EncryptKeys;
+    using CCryptoKeyStore::Unlock;
+};
+}
+
+BENCHMARK(encrypt_and_unlock_100k)
+{
+    // Keys are made once, with their public keys, so each run only times encryption
+    const int nKeys = 100000;
+    vector<CKey> vKeys(nKeys);
+    vector<CPubKey> vPubKeys(nKeys);
+    int64_t nStart = GetTimeMicros();
+    for (int i = 0; i < nKeys; i++) {
+        vKeys[i].MakeNewKey(i % 2 == 0);
+        vPubKeys[i] = vKeys[i].GetPubKey();
+    }
+    ReportTiming(strprintf("make %d keys", nKeys), nStart);
+
+    vector<int> vThreads;
+    vThreads.push_back(1);
+    vThreads.push_back(std::max(2, (int)boost::thread::hardware_concurrency()));
+    for (unsigned int t = 0; t < vThreads.size(); t++) {
+        CBenchCryptoKeyStore keystore;
+        for (int i = 0; i < nKeys; i++)
+            keystore.AddKeyPubKey(vKeys[i], vPubKeys[i]);
+        CKeyingMaterial vMasterKey(WALLET_CRYPTO_KEY_SIZE);
+        GetRandBytes(&vMasterKey[0], WALLET_CRYPTO_KEY_SIZE);
+
+        nStart = GetTimeMicros();
+        if (!keystore.EncryptKeys(vMasterKey, vThreads[t])) {
+            printf("  encryption on %d threads failed\n", vThreads[t]);
+            return;
+        }
+        ReportTiming(strprintf("encrypt on %d threads", vThreads[t]), nStart);
+
+        nStart = GetTimeMicros();
+        if (!keystore.Unlock(vMasterKey, vThreads[t])) {
+            printf("  unlock on %d threads failed\n", vThreads[t]);
+            return;
+        }
+        ReportTiming(strprintf("first unlock on %d threads", vThreads[t]), nStart);
+    }
+}
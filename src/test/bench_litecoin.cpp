@@ -0,0 +1,72 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chainparams.h"
+#include "ui_interface.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <map>
+
+#include <boost/foreach.hpp>
+
+CClientUIInterface uiInterface;
+#ifdef ENABLE_WALLET
+class CWallet;
+CWallet* pwalletMain;
+#endif
+
+namespace
+{
+typedef std::map<std::string, BenchmarkFunction> BenchmarkMap;
+
+//! Registered benchmarks, by name; a function so that it exists before any registration runs
+BenchmarkMap& Benchmarks()
+{
+    static BenchmarkMap mapBenchmarks;
+    return mapBenchmarks;
+}
+}
+
+CBenchmarkRegistration::CBenchmarkRegistration(const char* pszName, BenchmarkFunction function)
+{
+    Benchmarks()[pszName] = function;
+}
+
+void ReportTiming(const std::string& strWhat, int64_t nStartMicros)
+{
+    printf("  %s: %.2fms\n", strWhat.c_str(), (GetTimeMicros() - nStartMicros) * 0.001);
+    fflush(stdout);
+}
+
+/** Run every benchmark, or the ones named on the command line */
+int main(int argc, char* argv[])
+{
+    SetupEnvironment();
+    fPrintToDebugLog = false;
+    SelectParams(CBaseChainParams::MAIN);
+
+    std::vector<std::string> vNames;
+    for (int i = 1; i < argc; i++)
+        vNames.push_back(argv[i]);
+    if (vNames.empty()) {
+        BOOST_FOREACH(const BenchmarkMap::value_type& item, Benchmarks())
+            vNames.push_back(item.first);
+    }
+
+    BOOST_FOREACH(const std::string& strName, vNames) {
+        BenchmarkMap::const_iterator it = Benchmarks().find(strName);
+        if (it == Benchmarks().end()) {
+            fprintf(stderr, "Unknown benchmark %s\n", strName.c_str());
+            return 1;
+        }
+        printf("%s\n", strName.c_str());
+        int64_t nStart = GetTimeMicros();
+        it->second();
+        ReportTiming("total", nStart);
+    }
+    return 0;
+}
@@ -0,0 +1,66 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockcache.h"
+#include "main.h"
+#include "primitives/block.h"
+
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+boost::shared_ptr<const CBlock> MakeBlock(uint32_t nNonce)
+{
+    boost::shared_ptr<CBlock> pblock(new CBlock());
+    pblock->nNonce = nNonce;
+    return pblock;
+}
+
+boost::shared_ptr<const CBlockUndo> MakeUndo(size_t nTx)
+{
+    boost::shared_ptr<CBlockUndo> pundo(new CBlockUndo());
+    pundo->vtxundo.resize(nTx);
+    return pundo;
+}
+}
+
+BOOST_AUTO_TEST_SUITE(blockcache_tests)
+
+BOOST_AUTO_TEST_CASE(recent_blocks)
+{
+    CRecentBlockCache cache(2);
+    cache.Add(uint256(1), MakeBlock(1), MakeUndo(1));
+    cache.Add(uint256(2), MakeBlock(2), MakeUndo(2));
+    BOOST_CHECK_EQUAL(cache.size(), 2U);
+    BOOST_REQUIRE(cache.GetBlock(uint256(1)));
+    BOOST_CHECK_EQUAL(cache.GetBlock(uint256(1))->nNonce, 1U);
+    BOOST_REQUIRE(cache.GetUndo(uint256(2)));
+    BOOST_CHECK_EQUAL(cache.GetUndo(uint256(2))->vtxundo.size(), 2U);
+
+    // An entry in use stays valid after it is evicted.
+    boost::shared_ptr<const CBlock> pblock1 = cache.GetBlock(uint256(1));
+    cache.Add(uint256(3), MakeBlock(3), MakeUndo(3));
+    BOOST_CHECK_EQUAL(cache.size(), 2U);
+    BOOST_CHECK(!cache.GetBlock(uint256(1)));
+    BOOST_CHECK(!cache.GetUndo(uint256(1)));
+    BOOST_CHECK_EQUAL(pblock1->nNonce, 1U);
+
+    // Adding a block again replaces it and makes it the most recent.
+    cache.Add(uint256(2), MakeBlock(22), MakeUndo(22));
+    cache.Add(uint256(4), MakeBlock(4), MakeUndo(4));
+    BOOST_CHECK(!cache.GetBlock(uint256(3)));
+    BOOST_REQUIRE(cache.GetBlock(uint256(2)));
+    BOOST_CHECK_EQUAL(cache.GetBlock(uint256(2))->nNonce, 22U);
+
+    cache.SetMaxBlocks(1);
+    BOOST_CHECK_EQUAL(cache.size(), 1U);
+    BOOST_CHECK(cache.GetBlock(uint256(4)));
+
+    cache.SetMaxBlocks(0);
+    cache.Add(uint256(5), MakeBlock(5), MakeUndo(5));
+    BOOST_CHECK_EQUAL(cache.size(), 0U);
+    BOOST_CHECK(!cache.GetBlock(uint256(5)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,88 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilemap.h"
+#include "clientversion.h"
+#include "random.h"
+#include "serialize.h"
+#include "streams.h"
+#include "uint256.h"
+
+#include <stdio.h>
+
+#include <boost/filesystem.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+void AppendToFile(const boost::filesystem::path& path, const CDataStream& ss)
+{
+    FILE* file = fopen(path.string().c_str(), "ab");
+    BOOST_REQUIRE(file != NULL);
+    BOOST_REQUIRE_EQUAL(fwrite(&ss[0], 1, ss.size(), file), ss.size());
+    fclose(file);
+}
+}
+
+BOOST_AUTO_TEST_SUITE(blockfilemap_tests)
+
+BOOST_AUTO_TEST_CASE(memory_reader)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    uint256 hash = GetRandHash();
+    ss << hash << (uint32_t)42;
+
+    CMemoryReader reader(&ss[0], &ss[0] + ss.size(), SER_DISK, CLIENT_VERSION);
+    uint256 hashRead;
+    uint32_t n;
+    reader >> hashRead >> n;
+    BOOST_CHECK(hashRead == hash);
+    BOOST_CHECK_EQUAL(n, 42U);
+    BOOST_CHECK(reader.empty());
+    BOOST_CHECK_THROW(reader >> n, std::ios_base::failure);
+}
+
+BOOST_AUTO_TEST_CASE(mapper_follows_growth)
+{
+    boost::filesystem::path path = boost::filesystem::temp_directory_path() /
+        boost::filesystem::unique_path("blockfilemap_%%%%-%%%%.dat");
+
+    CDataStream ss1(SER_DISK, CLIENT_VERSION);
+    ss1 << (uint32_t)1 << (uint32_t)2;
+    AppendToFile(path, ss1);
+
+    CBlockFileMapper mapper(2);
+    boost::shared_ptr<CMappedFile> pmapped = mapper.Get(path, 8);
+    BOOST_REQUIRE(pmapped);
+    BOOST_CHECK_EQUAL(pmapped->size(), 8U);
+    // Asking again for the same range reuses the mapping.
+    BOOST_CHECK(mapper.Get(path, 4) == pmapped);
+    // More than the file holds cannot be mapped.
+    BOOST_CHECK(!mapper.Get(path, 12));
+
+    CDataStream ss2(SER_DISK, CLIENT_VERSION);
+    ss2 << (uint32_t)3;
+    AppendToFile(path, ss2);
+
+    // After the file grew, a longer range gets a new mapping; the old one stays usable.
+    boost::shared_ptr<CMappedFile> pgrown = mapper.Get(path, 12);
+    BOOST_REQUIRE(pgrown);
+    BOOST_CHECK(pgrown != pmapped);
+    BOOST_CHECK_EQUAL(pgrown->size(), 12U);
+
+    CMemoryReader reader(pgrown->data() + 4, pgrown->data() + pgrown->size(), SER_DISK, CLIENT_VERSION);
+    uint32_t a, b;
+    reader >> a >> b;
+    BOOST_CHECK_EQUAL(a, 2U);
+    BOOST_CHECK_EQUAL(b, 3U);
+    CMemoryReader readerOld(pmapped->data(), pmapped->data() + pmapped->size(), SER_DISK, CLIENT_VERSION);
+    readerOld >> a;
+    BOOST_CHECK_EQUAL(a, 1U);
+
+    mapper.Forget(path);
+    boost::filesystem::remove(path);
+    BOOST_CHECK(!mapper.Get(path, 0));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -175,4 +175,47 @@ BOOST_AUTO_TEST_CASE(coins_cache_simulation_test)
     BOOST_CHECK(missed_an_entry);
 }
 
+BOOST_AUTO_TEST_CASE(coins_set_hash)
+{
+    std::vector<std::pair<COutPoint, CTxOut> > outputs;
+    for (int i = 0; i < 20; i++) {
+        CTxOut out;
+        out.nValue = insecure_rand() % 100000;
+        out.scriptPubKey.assign(insecure_rand() & 0x3F, 0);
+        outputs.push_back(std::make_pair(COutPoint(GetRandHash(), i), out));
+    }
+
+    // Insertion order does not matter.
+    CCoinsSetHash forward, backward;
+    for (unsigned int i = 0; i < outputs.size(); i++) {
+        forward.Add(outputs[i].first, outputs[i].second);
+        backward.Add(outputs[outputs.size() - 1 - i].first, outputs[outputs.size() - 1 - i].second);
+    }
+    BOOST_CHECK(forward.GetHash() == backward.GetHash());
+    BOOST_CHECK_EQUAL(forward.GetOutputs(), 20);
+    BOOST_CHECK_EQUAL(forward.GetAmount(), backward.GetAmount());
+
+    // Digests of two halves add up to the whole; removing one half leaves the other.
+    CCoinsSetHash first, second;
+    for (unsigned int i = 0; i < outputs.size(); i++)
+        (i < 10 ? first : second).Add(outputs[i].first, outputs[i].second);
+    CCoinsSetHash sum = first;
+    sum += second;
+    BOOST_CHECK(sum.GetHash() == forward.GetHash());
+    for (unsigned int i = 0; i < 10; i++)
+        forward.Remove(outputs[i].first, outputs[i].second);
+    BOOST_CHECK(forward.GetHash() == second.GetHash());
+    BOOST_CHECK_EQUAL(forward.GetOutputs(), 10);
+    BOOST_CHECK_EQUAL(forward.GetAmount(), second.GetAmount());
+    sum -= first;
+    BOOST_CHECK(sum.GetHash() == second.GetHash());
+
+    // Different outputs give different digests.
+    CCoinsSetHash other = second;
+    other.Remove(outputs[10].first, outputs[10].second);
+    outputs[10].second.nValue++;
+    other.Add(outputs[10].first, outputs[10].second);
+    BOOST_CHECK(other.GetHash() != second.GetHash());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
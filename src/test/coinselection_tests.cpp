@@ -0,0 +1,182 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinselection.h"
+
+#include "random.h"
+
+#include <set>
+#include <utility>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+namespace
+{
+typedef set<pair<const CWalletTx*, unsigned int> > CoinSet;
+
+void AddCoin(vector<CInputCoin>& vCoins, const CAmount& nValue)
+{
+    // Coins are told apart by their output index alone
+    vCoins.push_back(make_pair(nValue, make_pair((const CWalletTx*)NULL, (unsigned int)vCoins.size())));
+}
+
+CAmount Total(const vector<CInputCoin>& vCoins, const vector<char>& vfSelected)
+{
+    CAmount nTotal = 0;
+    for (unsigned int i = 0; i < vCoins.size(); i++)
+        if (vfSelected[i])
+            nTotal += vCoins[i].first;
+    return nTotal;
+}
+}
+
+BOOST_AUTO_TEST_SUITE(coinselection_tests)
+
+BOOST_AUTO_TEST_CASE(bnb_exact_match)
+{
+    vector<CInputCoin> vCoins;
+    AddCoin(vCoins, 8 * CENT);
+    AddCoin(vCoins, 7 * CENT);
+    AddCoin(vCoins, 5 * CENT);
+    AddCoin(vCoins, 3 * CENT);
+    AddCoin(vCoins, 2 * CENT);
+
+    vector<char> vfSelected;
+    BOOST_CHECK(SelectCoinsBnB(vCoins, 10 * CENT, vfSelected));
+    BOOST_CHECK_EQUAL(Total(vCoins, vfSelected), 10 * CENT);
+    BOOST_CHECK(SelectCoinsBnB(vCoins, 25 * CENT, vfSelected));
+    BOOST_CHECK_EQUAL(Total(vCoins, vfSelected), 25 * CENT);
+    BOOST_CHECK(SelectCoinsBnB(vCoins, 1 * CENT + 2 * CENT, vfSelected));
+    BOOST_CHECK(!SelectCoinsBnB(vCoins, 1 * CENT, vfSelected));
+    BOOST_CHECK(!SelectCoinsBnB(vCoins, 26 * CENT, vfSelected));
+    BOOST_CHECK(!SelectCoinsBnB(vector<CInputCoin>(), 1 * CENT, vfSelected));
+
+    // Many equal coins don't blow up the search
+    vector<CInputCoin> vEqual;
+    for (int i = 0; i < 10000; i++)
+        AddCoin(vEqual, 2 * CENT);
+    BOOST_CHECK(SelectCoinsBnB(vEqual, 50 * CENT, vfSelected));
+    BOOST_CHECK_EQUAL(Total(vEqual, vfSelected), 50 * CENT);
+    BOOST_CHECK(!SelectCoinsBnB(vEqual, 51 * CENT, vfSelected));
+
+    // The search gives up after the given number of branches
+    BOOST_CHECK(!SelectCoinsBnB(vCoins, 10 * CENT, vfSelected, 1));
+}
+
+BOOST_AUTO_TEST_CASE(pool_selection)
+{
+    vector<CInputCoin> vCoins;
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+
+    BOOST_CHECK(!CCoinSelectionPool(vCoins).Select(1 * CENT, setCoinsRet, nValueRet));
+
+    AddCoin(vCoins, 3 * CENT);
+    AddCoin(vCoins, 4 * CENT);
+    AddCoin(vCoins, 6 * CENT);
+    AddCoin(vCoins, 20 * CENT);
+    CCoinSelectionPool pool(vCoins);
+    BOOST_CHECK_EQUAL(pool.size(), 4U);
+    BOOST_CHECK_EQUAL(pool.GetTotal(), 33 * CENT);
+
+    // A single coin of the exact amount
+    BOOST_CHECK(pool.Select(6 * CENT, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 6 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 1U);
+
+    // An exact subset rather than the larger coin
+    BOOST_CHECK(pool.Select(10 * CENT, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 10 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 2U);
+
+    // The smaller coins are not enough: the next larger coin
+    BOOST_CHECK(pool.Select(14 * CENT, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(nValueRet, 20 * CENT);
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 1U);
+
+    // Everything, and then not enough
+    BOOST_CHECK(pool.Select(33 * CENT, setCoinsRet, nValueRet));
+    BOOST_CHECK_EQUAL(setCoinsRet.size(), 4U);
+    BOOST_CHECK(!pool.Select(34 * CENT, setCoinsRet, nValueRet));
+    BOOST_CHECK(setCoinsRet.empty());
+}
+
+BOOST_AUTO_TEST_CASE(pool_limits_subset_search)
+{
+    // Many small coins, all of them below the target, and none adding up to it exactly
+    vector<CInputCoin> vCoins;
+    for (int i = 0; i < 20000; i++)
+        AddCoin(vCoins, 2 * CENT + (i % 50) * 2 * CENT);
+    CCoinSelectionPool pool(vCoins);
+
+    CoinSet setCoinsRet;
+    CAmount nValueRet;
+    CAmount nTarget = 1001 * CENT;
+    BOOST_CHECK(pool.Select(nTarget, setCoinsRet, nValueRet));
+    BOOST_CHECK_GE(nValueRet, nTarget + CENT);
+    // Only the largest coins were searched: 400 each of 100 and 98 cents, and 200 of 96 cents
+    BOOST_CHECK_LE(setCoinsRet.size(), MAX_SUBSET_SEARCH_COINS);
+    for (CoinSet::const_iterator it = setCoinsRet.begin(); it != setCoinsRet.end(); ++it)
+        BOOST_CHECK_GE(vCoins[it->second].first, 96 * CENT);
+
+    // More than those hold: the search widens as needed
+    nTarget = 300000 * CENT + 1;
+    BOOST_CHECK(pool.Select(nTarget, setCoinsRet, nValueRet));
+    BOOST_CHECK_GE(nValueRet, nTarget);
+}
+
+BOOST_AUTO_TEST_CASE(small_wallet_selection)
+{
+    for (int nRound = 0; nRound < 50; nRound++)
+    {
+        // A wallet small enough to try every subset of
+        const unsigned int nCoins = 10;
+        vector<CInputCoin> vCoins;
+        for (unsigned int i = 0; i < nCoins; i++)
+            AddCoin(vCoins, (1 + GetRand(100)) * CENT);
+        set<CAmount> setSums;
+        for (unsigned int nMask = 1; nMask < (1U << nCoins); nMask++)
+        {
+            CAmount nSum = 0;
+            for (unsigned int i = 0; i < nCoins; i++)
+                if (nMask & (1U << i))
+                    nSum += vCoins[i].first;
+            setSums.insert(nSum);
+        }
+        CCoinSelectionPool pool(vCoins);
+
+        for (int nTarget = 1; nTarget <= pool.GetTotal() / CENT + 1; nTarget += 1 + GetRand(20))
+        {
+            CAmount nTargetValue = nTarget * CENT;
+            CoinSet setCoinsRet;
+            CAmount nValueRet;
+            if (!pool.Select(nTargetValue, setCoinsRet, nValueRet))
+            {
+                BOOST_CHECK_GT(nTargetValue, pool.GetTotal());
+                continue;
+            }
+            CAmount nTotal = 0;
+            for (CoinSet::const_iterator it = setCoinsRet.begin(); it != setCoinsRet.end(); ++it)
+                nTotal += vCoins[it->second].first;
+            BOOST_CHECK_EQUAL(nTotal, nValueRet);
+            BOOST_CHECK_GE(nValueRet, nTargetValue);
+
+            // An exact match, whenever a search of every subset finds one
+            if (setSums.count(nTargetValue))
+            {
+                BOOST_CHECK_EQUAL(nValueRet, nTargetValue);
+                continue;
+            }
+            // Otherwise never more than the smallest coin worth the target plus a cent
+            for (unsigned int i = 0; i < nCoins; i++)
+                if (vCoins[i].first >= nTargetValue + CENT)
+                    BOOST_CHECK_LE(nValueRet, vCoins[i].first);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,82 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinsmemory.h"
+#include "random.h"
+#include "txdb.h"
+
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+CCoins MakeCoins(int nHeight, int nOutputs)
+{
+    CCoins coins;
+    coins.vout.resize(nOutputs);
+    for (int i = 0; i < nOutputs; i++) {
+        coins.vout[i].nValue = 1000 + i;
+        coins.vout[i].scriptPubKey = CScript() << OP_TRUE;
+    }
+    coins.nHeight = nHeight;
+    return coins;
+}
+}
+
+BOOST_AUTO_TEST_SUITE(coinsmemory_tests)
+
+BOOST_AUTO_TEST_CASE(load_and_write_through)
+{
+    CCoinsViewDB db(1 << 20, true);
+    uint256 txidKept = GetRandHash();
+    uint256 txidSpent = GetRandHash();
+    uint256 txidNew = GetRandHash();
+    {
+        CCoinsViewCache cache(&db);
+        *cache.ModifyCoins(txidKept) = MakeCoins(1, 2);
+        *cache.ModifyCoins(txidSpent) = MakeCoins(2, 1);
+        cache.SetBestBlock(uint256(1));
+        BOOST_CHECK(cache.Flush());
+    }
+
+    CCoinsViewMemory memory(&db);
+    BOOST_CHECK(memory.Load(db));
+    BOOST_CHECK_EQUAL(memory.GetCount(), 2U);
+    BOOST_CHECK(memory.GetSerializedSize() > 0);
+
+    CCoins coins;
+    BOOST_CHECK(memory.GetCoins(txidKept, coins));
+    BOOST_CHECK(coins == MakeCoins(1, 2));
+    BOOST_CHECK(memory.HaveCoins(txidSpent));
+    BOOST_CHECK(!memory.HaveCoins(txidNew));
+    BOOST_CHECK(memory.GetBestBlock() == uint256(1));
+
+    // Spend one transaction and add another, through a cache as validation does.
+    {
+        CCoinsViewCache cache(&memory);
+        cache.ModifyCoins(txidSpent)->Clear();
+        *cache.ModifyCoins(txidNew) = MakeCoins(3, 1);
+        cache.SetBestBlock(uint256(2));
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK_EQUAL(memory.GetCount(), 2U);
+    BOOST_CHECK(!memory.HaveCoins(txidSpent));
+    BOOST_CHECK(memory.GetCoins(txidNew, coins));
+    BOOST_CHECK(coins == MakeCoins(3, 1));
+
+    // The database received the same changes.
+    BOOST_CHECK(!db.HaveCoins(txidSpent));
+    BOOST_CHECK(db.GetCoins(txidNew, coins));
+    BOOST_CHECK(coins == MakeCoins(3, 1));
+    BOOST_CHECK(db.GetBestBlock() == uint256(2));
+
+    // And a fresh load sees them.
+    CCoinsViewMemory memoryReloaded(&db);
+    BOOST_CHECK(memoryReloaded.Load(db));
+    BOOST_CHECK_EQUAL(memoryReloaded.GetCount(), 2U);
+    BOOST_CHECK_EQUAL(memoryReloaded.GetSerializedSize(), memory.GetSerializedSize());
+    BOOST_CHECK(memoryReloaded.GetCoins(txidKept, coins));
+    BOOST_CHECK(coins == MakeCoins(1, 2));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,168 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "coinsprefetch.h"
+#include "primitives/block.h"
+#include "random.h"
+#include "sync.h"
+#include "utiltime.h"
+
+#include <map>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+namespace
+{
+class CCoinsViewMap : public CCoinsView
+{
+public:
+    std::map<uint256, CCoins> map_;
+    mutable CCriticalSection cs;
+    mutable int nReads;
+
+    CCoinsViewMap() : nReads(0) {}
+
+    int GetReads() const
+    {
+        LOCK(cs);
+        return nReads;
+    }
+
+    bool GetCoins(const uint256& txid, CCoins& coins) const
+    {
+        LOCK(cs);
+        nReads++;
+        std::map<uint256, CCoins>::const_iterator it = map_.find(txid);
+        if (it == map_.end())
+            return false;
+        coins = it->second;
+        return true;
+    }
+
+    bool HaveCoins(const uint256& txid) const
+    {
+        CCoins coins;
+        return GetCoins(txid, coins);
+    }
+
+    bool BatchWrite(CCoinsMap& mapCoins, const uint256& hashBlock)
+    {
+        for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end(); it++)
+            map_[it->first] = it->second.coins;
+        mapCoins.clear();
+        return true;
+    }
+};
+
+CCoins MakeCoins(int nHeight)
+{
+    CCoins coins;
+    coins.vout.resize(1);
+    coins.vout[0].nValue = 1000;
+    coins.nHeight = nHeight;
+    return coins;
+}
+
+bool WaitForReads(const CCoinsViewMap& view, int nCount)
+{
+    for (int i = 0; i < 500 && view.GetReads() < nCount; i++)
+        MilliSleep(10);
+    return view.GetReads() == nCount;
+}
+}
+
+BOOST_AUTO_TEST_SUITE(coinsprefetch_tests)
+
+BOOST_AUTO_TEST_CASE(prefetch_block_inputs)
+{
+    CCoinsViewMap base;
+    uint256 txidOld = GetRandHash();
+    uint256 txidMissing = GetRandHash();
+    base.map_[txidOld] = MakeCoins(1);
+
+    // A block spending an existing output, an unknown one, and one of its own.
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vout.resize(1);
+    CMutableTransaction spend1;
+    spend1.vin.resize(2);
+    spend1.vin[0].prevout = COutPoint(txidOld, 0);
+    spend1.vin[1].prevout = COutPoint(txidMissing, 0);
+    spend1.vout.resize(1);
+    CMutableTransaction spend2;
+    spend2.vin.resize(1);
+    spend2.vin[0].prevout = COutPoint(spend1.GetHash(), 0);
+    spend2.vout.resize(1);
+    CBlock block;
+    block.vtx.push_back(coinbase);
+    block.vtx.push_back(spend1);
+    block.vtx.push_back(spend2);
+
+    CCoinsViewPrefetch prefetch(&base, 1000);
+    boost::thread_group threads;
+    threads.create_thread(boost::bind(&CCoinsViewPrefetch::Thread, &prefetch));
+    threads.create_thread(boost::bind(&CCoinsViewPrefetch::Thread, &prefetch));
+
+    prefetch.Prefetch(block);
+    // Only the two outside prevouts hit the backing view, and only the existing one is staged.
+    BOOST_CHECK(WaitForReads(base, 2));
+    MilliSleep(10);
+    BOOST_CHECK_EQUAL(base.GetReads(), 2);
+    BOOST_CHECK_EQUAL(prefetch.GetStagedCount(), 1);
+
+    // Lookups are answered from the staging area, once.
+    CCoins coins;
+    BOOST_CHECK(prefetch.HaveCoins(txidOld));
+    BOOST_CHECK(prefetch.GetCoins(txidOld, coins));
+    BOOST_CHECK_EQUAL(coins.nHeight, 1);
+    BOOST_CHECK_EQUAL(base.GetReads(), 2);
+    BOOST_CHECK_EQUAL(prefetch.GetStagedCount(), 0);
+    BOOST_CHECK(prefetch.GetCoins(txidOld, coins));
+    BOOST_CHECK_EQUAL(base.GetReads(), 3);
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(prefetch_write_clears_staging)
+{
+    CCoinsViewMap base;
+    uint256 txid = GetRandHash();
+    base.map_[txid] = MakeCoins(1);
+
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = COutPoint(txid, 0);
+    spend.vout.resize(1);
+    CBlock block;
+    block.vtx.push_back(CMutableTransaction());
+    block.vtx.push_back(spend);
+
+    CCoinsViewPrefetch prefetch(&base, 1000);
+    boost::thread_group threads;
+    threads.create_thread(boost::bind(&CCoinsViewPrefetch::Thread, &prefetch));
+
+    prefetch.Prefetch(block);
+    BOOST_CHECK(WaitForReads(base, 1));
+    MilliSleep(10);
+    BOOST_CHECK_EQUAL(prefetch.GetStagedCount(), 1);
+
+    // A write through the prefetcher must not leave the old version behind.
+    CCoinsMap mapCoins;
+    mapCoins[txid].coins = MakeCoins(2);
+    mapCoins[txid].flags = CCoinsCacheEntry::DIRTY;
+    BOOST_CHECK(prefetch.BatchWrite(mapCoins, uint256(0)));
+    BOOST_CHECK_EQUAL(prefetch.GetStagedCount(), 0);
+
+    CCoins coins;
+    BOOST_CHECK(prefetch.GetCoins(txid, coins));
+    BOOST_CHECK_EQUAL(coins.nHeight, 2);
+
+    threads.interrupt_all();
+    threads.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,82 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypter.h"
+
+#include "key.h"
+#include "random.h"
+#include "script/standard.h"
+
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+namespace
+{
+/** Gives access to the encryption of a key store */
+class CTestCryptoKeyStore : public CCryptoKeyStore
+{
+public:
+    using CCryptoKeyStore::EncryptKeys;
+    using CCryptoKeyStore::Unlock;
+};
+
+CKeyingMaterial NewMasterKey()
+{
+    CKeyingMaterial vMasterKey(WALLET_CRYPTO_KEY_SIZE);
+    GetRandBytes(&vMasterKey[0], WALLET_CRYPTO_KEY_SIZE);
+    return vMasterKey;
+}
+
+void AddKeys(CCryptoKeyStore& keystore, vector<CKey>& vKeys, int nKeys)
+{
+    for (int i = 0; i < nKeys; i++)
+    {
+        CKey key;
+        key.MakeNewKey(i % 2 == 0);
+        BOOST_CHECK(keystore.AddKey(key));
+        vKeys.push_back(key);
+    }
+}
+}
+
+BOOST_AUTO_TEST_SUITE(crypter_tests)
+
+BOOST_AUTO_TEST_CASE(encrypt_and_unlock_on_threads)
+{
+    CTestCryptoKeyStore keystore;
+    vector<CKey> vKeys;
+    AddKeys(keystore, vKeys, 200);
+
+    CKeyingMaterial vMasterKey = NewMasterKey();
+    BOOST_CHECK(keystore.EncryptKeys(vMasterKey, 4));
+    BOOST_CHECK(keystore.IsCrypted());
+    BOOST_CHECK(keystore.IsLocked());
+    BOOST_CHECK(!keystore.EncryptKeys(vMasterKey, 4));
+
+    // A wrong master key is turned down
+    BOOST_CHECK(!keystore.Unlock(NewMasterKey(), 4));
+    BOOST_CHECK(keystore.IsLocked());
+
+    BOOST_CHECK(keystore.Unlock(vMasterKey, 4));
+    BOOST_CHECK(!keystore.IsLocked());
+    BOOST_FOREACH(const CKey& key, vKeys)
+    {
+        CKey keyOut;
+        BOOST_CHECK(keystore.GetKey(key.GetPubKey().GetID(), keyOut));
+        BOOST_CHECK(keyOut.GetPubKey() == key.GetPubKey());
+        BOOST_CHECK(keyOut.GetPrivKey() == key.GetPrivKey());
+    }
+
+    BOOST_CHECK(keystore.Lock());
+    BOOST_CHECK(keystore.IsLocked());
+    BOOST_CHECK(!keystore.Unlock(NewMasterKey(), 1));
+    BOOST_CHECK(keystore.Unlock(vMasterKey, 1));
+    BOOST_CHECK(!keystore.IsLocked());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
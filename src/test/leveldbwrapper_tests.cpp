@@ -0,0 +1,123 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "leveldbwrapper.h"
+#include "uint256.h"
+#include "util.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace {
+
+class CGenerationDB : public CLevelDBWrapper
+{
+public:
+    CGenerationDB(const boost::filesystem::path& path) : CLevelDBWrapper(path, 1 << 20) {
+        TrackWriteGeneration('G');
+    }
+};
+
+}
+
+BOOST_AUTO_TEST_SUITE(leveldbwrapper_tests)
+
+BOOST_AUTO_TEST_CASE(params_from_args)
+{
+    mapArgs.clear();
+    CLevelDBParams params = CLevelDBParams::FromArgs("chainstate");
+    BOOST_CHECK_EQUAL(params.strName, "chainstate");
+    BOOST_CHECK_EQUAL(params.nBloomBits, 10);
+    BOOST_CHECK_EQUAL(params.nWriteBufferSize, 0U);
+
+    // Database specific options take precedence over the general ones.
+    mapArgs["-dbbloombits"] = "12";
+    mapArgs["-chainstatedbbloombits"] = "0";
+    mapArgs["-dbwritebuffer"] = "8";
+    mapArgs["-dbcompression"] = "1";
+    params = CLevelDBParams::FromArgs("chainstate");
+    BOOST_CHECK_EQUAL(params.nBloomBits, 0);
+    BOOST_CHECK_EQUAL(params.nWriteBufferSize, 8U << 20);
+    BOOST_CHECK(params.fCompression);
+    params = CLevelDBParams::FromArgs("blockindex");
+    BOOST_CHECK_EQUAL(params.nBloomBits, 12);
+    mapArgs.clear();
+}
+
+BOOST_AUTO_TEST_CASE(stats)
+{
+    boost::filesystem::path path = GetTempPath() / boost::filesystem::unique_path("leveldbwrapper_%%%%-%%%%");
+    size_t nDatabases = CLevelDBWrapper::GetAllStats().size();
+    {
+        CLevelDBParams params("test");
+        params.nBloomBits = 0;
+        CLevelDBWrapper db(path, 1 << 20, true, false, params);
+        BOOST_CHECK_EQUAL(CLevelDBWrapper::GetAllStats().size(), nDatabases + 1);
+
+        CLevelDBBatch batch;
+        for (int i = 0; i < 100; i++)
+            batch.Write(i, uint256(i));
+        batch.Erase(100);
+        BOOST_CHECK(db.WriteBatch(batch));
+
+        CLevelDBStats stats = db.GetStats();
+        BOOST_CHECK_EQUAL(stats.params.strName, "test");
+        BOOST_CHECK_EQUAL(stats.params.nBloomBits, 0);
+        // Each write is a 4 byte key and a 32 byte value; the erase a 4 byte key.
+        BOOST_CHECK_EQUAL(stats.nBytesWritten, 100U * 36 + 4);
+        BOOST_CHECK(stats.strStats.find("Compactions") != std::string::npos);
+        BOOST_CHECK_EQUAL(stats.GetReadAmplification(), 0);
+
+        uint256 value;
+        BOOST_CHECK(db.Read(42, value));
+        BOOST_CHECK(value == uint256(42));
+    }
+    BOOST_CHECK_EQUAL(CLevelDBWrapper::GetAllStats().size(), nDatabases);
+}
+
+BOOST_AUTO_TEST_CASE(write_generation)
+{
+    boost::filesystem::path path = GetTempPath() / boost::filesystem::unique_path("leveldbwrapper_%%%%-%%%%");
+    {
+        CGenerationDB db(path);
+        BOOST_CHECK_EQUAL(db.GetWriteGeneration(), 0U);
+        BOOST_CHECK(db.Write(1, uint256(1)));
+        BOOST_CHECK(db.Erase(2));
+        CLevelDBBatch batch;
+        batch.Write(3, uint256(3));
+        batch.Write(4, uint256(4));
+        BOOST_CHECK(db.WriteBatch(batch, true));
+        BOOST_CHECK_EQUAL(db.GetWriteGeneration(), 3U);
+    }
+    {
+        // The generation survives reopening, and keeps counting from there
+        CGenerationDB db(path);
+        BOOST_CHECK_EQUAL(db.GetWriteGeneration(), 3U);
+        BOOST_CHECK(db.Sync());
+        BOOST_CHECK_EQUAL(db.GetWriteGeneration(), 4U);
+        uint64_t nGeneration;
+        BOOST_CHECK(db.Read('G', nGeneration));
+        BOOST_CHECK_EQUAL(nGeneration, 4U);
+    }
+    boost::filesystem::remove_all(path);
+}
+
+BOOST_AUTO_TEST_CASE(amplification)
+{
+    CLevelDBStats stats;
+    stats.nBytesWritten = 1048576;
+    CLevelDBLevelStats level = {0, 3, 1.0, 0.1, 0.0, 1.0};
+    stats.vLevels.push_back(level);
+    level.nLevel = 2;
+    level.nFiles = 5;
+    level.dCompactionReadMB = 2.0;
+    level.dCompactionWriteMB = 2.0;
+    stats.vLevels.push_back(level);
+    // The log, the flush to level 0 and the compaction into level 2.
+    BOOST_CHECK_CLOSE(stats.GetWriteAmplification(), 4.0, 0.001);
+    BOOST_CHECK_EQUAL(stats.GetReadAmplification(), 4);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
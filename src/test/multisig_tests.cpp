@@ -5,10 +5,12 @@
 #include "key.h"
 #include "keystore.h"
 #include "main.h"
+#include "random.h"
 #include "script/script.h"
 #include "script/script_error.h"
 #include "script/interpreter.h"
 #include "script/sign.h"
+#include "script/standard.h"
 #include "uint256.h"
 
 #ifdef ENABLE_WALLET
@@ -319,5 +321,57 @@ BOOST_AUTO_TEST_CASE(multisig_Sign)
     }
 }
 
+BOOST_AUTO_TEST_CASE(multisig_SignSignatures)
+{
+    // Test signing all inputs of a transaction at once, on several threads
+    CBasicKeyStore keystore;
+    CKey key[3];
+    for (int i = 0; i < 3; i++)
+    {
+        key[i].MakeNewKey(i != 1);
+        keystore.AddKey(key[i]);
+    }
+    CKey keyMissing;
+    keyMissing.MakeNewKey(true);
+
+    CScript a_and_b;
+    a_and_b << OP_2 << ToByteVector(key[0].GetPubKey()) << ToByteVector(key[1].GetPubKey()) << OP_2 << OP_CHECKMULTISIG;
+    keystore.AddCScript(a_and_b);
+
+    CScript scripts[5];
+    scripts[0] = GetScriptForDestination(key[0].GetPubKey().GetID());
+    scripts[1] = CScript() << ToByteVector(key[1].GetPubKey()) << OP_CHECKSIG;
+    scripts[2] = a_and_b;
+    scripts[3] = GetScriptForDestination(CScriptID(a_and_b));
+    scripts[4] = GetScriptForDestination(key[2].GetPubKey().GetID());
+
+    CMutableTransaction txTo;
+    vector<CScript> vFromPubKeys;
+    for (int i = 0; i < 50; i++)
+    {
+        txTo.vin.push_back(CTxIn(COutPoint(GetRandHash(), i)));
+        vFromPubKeys.push_back(scripts[i % 5]);
+    }
+    txTo.vout.resize(1);
+    txTo.vout[0].nValue = 1;
+
+    CMutableTransaction txSerial = txTo;
+    BOOST_CHECK(SignSignatures(keystore, vFromPubKeys, txSerial, SIGHASH_ALL, 1));
+    BOOST_CHECK(SignSignatures(keystore, vFromPubKeys, txTo, SIGHASH_ALL, 4));
+    // Signatures are deterministic, so the threads make no difference
+    BOOST_CHECK(txTo.GetHash() == txSerial.GetHash());
+    CTransaction tx(txTo);
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    {
+        ScriptError err;
+        BOOST_CHECK_MESSAGE(VerifyScript(tx.vin[i].scriptSig, vFromPubKeys[i], STANDARD_SCRIPT_VERIFY_FLAGS, TransactionSignatureChecker(&tx, i), &err),
+                            strprintf("input %d: %s", i, ScriptErrorString(err)));
+    }
+
+    // One input that can't be signed fails the whole
+    vFromPubKeys[17] = GetScriptForDestination(keyMissing.GetPubKey().GetID());
+    BOOST_CHECK(!SignSignatures(keystore, vFromPubKeys, txTo, SIGHASH_ALL, 4));
+}
+
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,158 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chain.h"
+#include "main.h"
+#include "random.h"
+#include "uint256.h"
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <vector>
+
+#include <boost/assign/list_of.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+const uint64_t MB = 1024 * 1024;
+
+/** A block file of 100MB of blocks and 20MB of undo data, holding blocks nFirst to nLast */
+CBlockFileInfo BlockFile(unsigned int nFirst, unsigned int nLast)
+{
+    CBlockFileInfo info;
+    info.AddBlock(nFirst, 0);
+    info.AddBlock(nLast, 0);
+    info.nSize = 100 * MB;
+    info.nUndoSize = 20 * MB;
+    return info;
+}
+
+/** An index entry for a block after pprev with the same work, stored in file nFile */
+CBlockIndex* AddFakeBlock(CBlockIndex* pprev, int nFile)
+{
+    CBlockIndex* pindex = new CBlockIndex();
+    pindex->pprev = pprev;
+    pindex->nHeight = pprev->nHeight + 1;
+    pindex->BuildSkip();
+    pindex->nChainWork = pprev->nChainWork;
+    pindex->nTx = 1;
+    pindex->nChainTx = pprev->nChainTx + 1;
+    // Received after the tip with as much work, so it sorts worse
+    pindex->nSequenceId = pprev->nSequenceId + 1000;
+    pindex->nStatus = BLOCK_VALID_TRANSACTIONS | BLOCK_HAVE_DATA;
+    pindex->nFile = nFile;
+    pindex->nDataPos = 8;
+    BlockMap::iterator mi = mapBlockIndex.insert(std::make_pair(GetRandHash(), pindex)).first;
+    pindex->phashBlock = &mi->first;
+    return pindex;
+}
+}
+
+BOOST_AUTO_TEST_SUITE(pruning_tests)
+
+BOOST_AUTO_TEST_CASE(select_files_to_prune)
+{
+    std::vector<CBlockFileInfo> vinfo;
+    for (unsigned int i = 0; i < 5; i++)
+        vinfo.push_back(BlockFile(i * 1000, i * 1000 + 999));
+
+    // Under the target, with room for another allocation: nothing to do
+    std::set<int> setFiles;
+    BOOST_CHECK_EQUAL(SelectFilesToPrune(vinfo, 4, 100000, 1000 * MB, setFiles), 600 * MB);
+    BOOST_CHECK(setFiles.empty());
+
+    // The oldest files go first, until the space used is below the target
+    BOOST_CHECK_EQUAL(SelectFilesToPrune(vinfo, 4, 100000, 400 * MB, setFiles), 360 * MB);
+    BOOST_CHECK(setFiles == std::set<int>(boost::assign::list_of(0)(1)));
+
+    // Never the file written to
+    setFiles.clear();
+    BOOST_CHECK_EQUAL(SelectFilesToPrune(vinfo, 4, 100000, 1, setFiles), 120 * MB);
+    BOOST_CHECK(setFiles == std::set<int>(boost::assign::list_of(0)(1)(2)(3)));
+
+    // Nor a file with blocks too close to the tip, or any after it
+    setFiles.clear();
+    BOOST_CHECK_EQUAL(SelectFilesToPrune(vinfo, 4, 2500, 1, setFiles), 360 * MB);
+    BOOST_CHECK(setFiles == std::set<int>(boost::assign::list_of(0)(1)));
+
+    // Files already pruned are skipped
+    vinfo[0].SetNull();
+    vinfo[1].SetNull();
+    setFiles.clear();
+    BOOST_CHECK_EQUAL(SelectFilesToPrune(vinfo, 4, 100000, 300 * MB, setFiles), 240 * MB);
+    BOOST_CHECK(setFiles == std::set<int>(boost::assign::list_of(2)));
+}
+
+BOOST_AUTO_TEST_CASE(prune_block_index_file)
+{
+    std::vector<uint256> vHash(4);
+    std::vector<CBlockIndex> vIndex(4);
+    BlockMap mapIndex;
+    for (int i = 0; i < 4; i++) {
+        vHash[i] = GetRandHash();
+        vIndex[i].phashBlock = &vHash[i];
+        vIndex[i].pprev = i ? &vIndex[i - 1] : NULL;
+        vIndex[i].nHeight = i;
+        vIndex[i].nStatus = BLOCK_VALID_TRANSACTIONS | BLOCK_HAVE_DATA | BLOCK_HAVE_UNDO;
+        vIndex[i].nFile = (i == 1 || i == 2) ? 3 : 4;
+        vIndex[i].nDataPos = 100 * (i + 1);
+        vIndex[i].nUndoPos = 10 * (i + 1);
+        mapIndex[vHash[i]] = &vIndex[i];
+    }
+    std::multimap<CBlockIndex*, CBlockIndex*> mapUnlinked;
+    for (int i = 1; i < 4; i++)
+        mapUnlinked.insert(std::make_pair(&vIndex[i - 1], &vIndex[i]));
+
+    std::vector<CBlockIndex*> vPruned = PruneBlockIndexFile(mapIndex, mapUnlinked, 3);
+    BOOST_CHECK_EQUAL(vPruned.size(), 2U);
+    for (int i = 0; i < 4; i++) {
+        bool fPruned = (i == 1 || i == 2);
+        BOOST_CHECK_EQUAL(std::count(vPruned.begin(), vPruned.end(), &vIndex[i]), fPruned ? 1 : 0);
+        BOOST_CHECK_EQUAL(!(vIndex[i].nStatus & BLOCK_HAVE_DATA), fPruned);
+        BOOST_CHECK_EQUAL(!(vIndex[i].nStatus & BLOCK_HAVE_UNDO), fPruned);
+        BOOST_CHECK(vIndex[i].nStatus & BLOCK_VALID_TRANSACTIONS);
+        BOOST_CHECK_EQUAL(vIndex[i].nFile, fPruned ? 0 : 4);
+        BOOST_CHECK_EQUAL(vIndex[i].nDataPos, fPruned ? 0U : 100U * (i + 1));
+        BOOST_CHECK_EQUAL(vIndex[i].nUndoPos, fPruned ? 0U : 10U * (i + 1));
+    }
+    // Only the block whose data is still there waits on its parent
+    BOOST_CHECK_EQUAL(mapUnlinked.size(), 1U);
+    BOOST_CHECK(mapUnlinked.begin()->first == &vIndex[2] && mapUnlinked.begin()->second == &vIndex[3]);
+}
+
+BOOST_AUTO_TEST_CASE(check_block_index_pruned)
+{
+    LOCK(cs_main);
+    BOOST_REQUIRE(chainActive.Tip());
+    bool fHavePrunedOld = fHavePruned;
+    bool fCheckBlockIndexOld = fCheckBlockIndex;
+    fCheckBlockIndex = true;
+
+    // A branch off the tip, the first block of it in a file of its own
+    CBlockIndex* pindexFirst = AddFakeBlock(chainActive.Tip(), 1000);
+    CBlockIndex* pindexSecond = AddFakeBlock(pindexFirst, 1001);
+    CheckBlockIndex();
+
+    // Once pruned, a block keeps its transaction count and validity, and the
+    // blocks after it keep their data
+    std::multimap<CBlockIndex*, CBlockIndex*> mapUnlinked;
+    fHavePruned = true;
+    BOOST_CHECK_EQUAL(PruneBlockIndexFile(mapBlockIndex, mapUnlinked, 1000).size(), 1U);
+    BOOST_CHECK(!(pindexFirst->nStatus & BLOCK_HAVE_DATA));
+    BOOST_CHECK(pindexSecond->nStatus & BLOCK_HAVE_DATA);
+    CheckBlockIndex();
+
+    uint256 hashFirst = pindexFirst->GetBlockHash();
+    uint256 hashSecond = pindexSecond->GetBlockHash();
+    mapBlockIndex.erase(hashSecond);
+    mapBlockIndex.erase(hashFirst);
+    delete pindexSecond;
+    delete pindexFirst;
+    fHavePruned = fHavePrunedOld;
+    fCheckBlockIndex = fCheckBlockIndexOld;
+}
+
+BOOST_AUTO_TEST_SUITE_END()
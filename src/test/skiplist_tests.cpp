@@ -99,4 +99,35 @@ BOOST_AUTO_TEST_CASE(getlocator_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(arena_test)
+{
+    CBlockIndexArena arena;
+
+    // A reserved range is handed out contiguously, in default-constructed state.
+    arena.Reserve(1000);
+    std::vector<CBlockIndex*> vEntries;
+    for (int i = 0; i < 1000; i++) {
+        vEntries.push_back(arena.Allocate());
+        BOOST_CHECK(vEntries[i]->pprev == NULL);
+        BOOST_CHECK(vEntries[i]->nChainWork == 0);
+        BOOST_CHECK_EQUAL(vEntries[i]->nStatus, 0U);
+        vEntries[i]->nHeight = i;
+        vEntries[i]->pprev = (i == 0) ? NULL : vEntries[i - 1];
+        if (i > 0)
+            BOOST_CHECK(vEntries[i] == vEntries[i - 1] + 1);
+    }
+
+    // Entries stay where they are when the arena grows or changes hands.
+    for (int i = 0; i < 3 * (int)CBlockIndexArena::DEFAULT_SLAB_SIZE; i++)
+        arena.Allocate();
+    CBlockIndexArena arenaOther;
+    arenaOther.swap(arena);
+    for (int i = 1; i < 1000; i++) {
+        vEntries[i]->BuildSkip();
+        BOOST_CHECK_EQUAL(vEntries[i]->nHeight, i);
+        BOOST_CHECK(vEntries[i]->GetAncestor(0) == vEntries[0]);
+    }
+    BOOST_CHECK(arena.Allocate() != NULL);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,71 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "primitives/block.h"
+#include "random.h"
+#include "script/script.h"
+#include "spentindex.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(spentindex_tests)
+
+BOOST_AUTO_TEST_CASE(connect_disconnect)
+{
+    CSpentIndexDB db(1 << 20, true);
+
+    COutPoint prevout1(GetRandHash(), 0);
+    COutPoint prevout2(GetRandHash(), 7);
+    CScript script = CScript() << OP_TRUE;
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vout.resize(1);
+    CMutableTransaction tx;
+    tx.vin.resize(2);
+    tx.vin[0].prevout = prevout1;
+    tx.vin[1].prevout = prevout2;
+    tx.vout.resize(1);
+    CBlock block;
+    block.vtx.push_back(coinbase);
+    block.vtx.push_back(tx);
+
+    std::vector<CSpentOutput> vSpent;
+    vSpent.push_back(CSpentOutput(CTxOut(1000, script), 1));
+    vSpent.push_back(CSpentOutput(CTxOut(2000, script), 2));
+    CLevelDBBatch batchConnect;
+    BOOST_CHECK(db.ConnectBlock(block, 5, vSpent, batchConnect));
+    db.WriteBestBlock(batchConnect, block.GetHash());
+    uint256 hashBest;
+    BOOST_CHECK(!db.ReadBestBlock(hashBest));
+    BOOST_CHECK(!db.Exists(std::make_pair('s', prevout1)));
+    BOOST_CHECK(db.WriteBatch(batchConnect));
+    BOOST_CHECK(db.ReadBestBlock(hashBest));
+    BOOST_CHECK(hashBest == block.GetHash());
+
+    CSpentIndexValue value;
+    BOOST_CHECK(db.ReadSpentInfo(prevout2, value));
+    BOOST_CHECK(value.txid == tx.GetHash());
+    BOOST_CHECK_EQUAL(value.nInput, 1U);
+    BOOST_CHECK_EQUAL(value.nHeight, 5);
+    BOOST_CHECK_EQUAL(value.txout.nValue, 2000);
+    BOOST_CHECK(value.txout.scriptPubKey == script);
+    // The coinbase input spends nothing.
+    BOOST_CHECK(!db.ReadSpentInfo(coinbase.vin[0].prevout, value));
+
+    CLevelDBBatch batchDisconnect;
+    BOOST_CHECK(db.DisconnectBlock(block, batchDisconnect));
+    BOOST_CHECK(db.WriteBatch(batchDisconnect));
+    BOOST_CHECK(!db.ReadSpentInfo(prevout1, value));
+    BOOST_CHECK(!db.ReadSpentInfo(prevout2, value));
+
+    // Spent outputs that do not match the block are refused.
+    vSpent.pop_back();
+    CLevelDBBatch batchBad;
+    BOOST_CHECK(!db.ConnectBlock(block, 5, vSpent, batchBad));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,57 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "random.h"
+#include "txdb.h"
+
+#include <utility>
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_AUTO_TEST_SUITE(txindex_tests)
+
+BOOST_AUTO_TEST_CASE(compact_entries)
+{
+    CBlockTreeDB db(1 << 20, true);
+    uint256 txid = GetRandHash();
+    // Shares the first bytes, and so the key prefix, with txid.
+    uint256 txidSimilar = txid;
+    *(txidSimilar.end() - 1) ^= 1;
+    uint256 txidOther = GetRandHash();
+
+    uint256 hashBlock;
+    BOOST_CHECK(!db.ReadTxIndexBestBlock(hashBlock));
+
+    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
+    vPos.push_back(std::make_pair(txid, CDiskTxPos(CDiskBlockPos(0, 100), 1)));
+    vPos.push_back(std::make_pair(txidSimilar, CDiskTxPos(CDiskBlockPos(0, 100), 200)));
+    BOOST_CHECK(db.WriteTxIndexEntries(vPos, uint256(1)));
+    // The same transaction again, in another block.
+    vPos.clear();
+    vPos.push_back(std::make_pair(txid, CDiskTxPos(CDiskBlockPos(3, 5000), 70000)));
+    BOOST_CHECK(db.WriteTxIndexEntries(vPos, uint256(2)));
+
+    BOOST_CHECK(db.ReadTxIndexBestBlock(hashBlock));
+    BOOST_CHECK(hashBlock == uint256(2));
+
+    std::vector<CDiskTxPos> vFound;
+    BOOST_CHECK(db.ReadTxIndexEntries(txid, vFound));
+    BOOST_CHECK_EQUAL(vFound.size(), 3U);
+    bool fFoundSecond = false;
+    for (unsigned int i = 0; i < vFound.size(); i++) {
+        if (vFound[i].nFile == 3) {
+            BOOST_CHECK_EQUAL(vFound[i].nPos, 5000U);
+            BOOST_CHECK_EQUAL(vFound[i].nTxOffset, 70000U);
+            fFoundSecond = true;
+        }
+    }
+    BOOST_CHECK(fFoundSecond);
+
+    vFound.clear();
+    BOOST_CHECK(!db.ReadTxIndexEntries(txidOther, vFound));
+    BOOST_CHECK(vFound.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -14,10 +14,16 @@
 #include <stdint.h>
 #include <vector>
 
+#include <boost/bind.hpp>
 #include <boost/test/unit_test.hpp>
 
 using namespace std;
 
+static void MarkVisited(vector<int>* pvVisited, size_t i)
+{
+    (*pvVisited)[i]++;
+}
+
 BOOST_AUTO_TEST_SUITE(util_tests)
 
 BOOST_AUTO_TEST_CASE(util_criticalsection)
@@ -354,4 +360,19 @@ BOOST_AUTO_TEST_CASE(test_FormatSubVersion)
     BOOST_CHECK_EQUAL(FormatSubVersion("Test", 99900, comments),std::string("/Test:0.9.99(comment1)/"));
     BOOST_CHECK_EQUAL(FormatSubVersion("Test", 99900, comments2),std::string("/Test:0.9.99(comment1; comment2)/"));
 }
+
+BOOST_AUTO_TEST_CASE(util_ParallelFor)
+{
+    // Every index is visited exactly once, whatever the number of threads
+    const int nThreads[] = {-1, 0, 1, 3, 16, 1000};
+    for (unsigned int t = 0; t < sizeof(nThreads) / sizeof(nThreads[0]); t++)
+    {
+        vector<int> vVisited(1001, 0);
+        ParallelFor(vVisited.size(), nThreads[t], boost::bind(&MarkVisited, &vVisited, _1));
+        BOOST_CHECK(vVisited == vector<int>(vVisited.size(), 1));
+    }
+    vector<int> vVisited;
+    ParallelFor(0, 4, boost::bind(&MarkVisited, &vVisited, _1));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
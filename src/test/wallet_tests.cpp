@@ -4,6 +4,11 @@
 
 #include "wallet.h"
 
+#include "random.h"
+#include "script/standard.h"
+#include "utiltime.h"
+#include "walletdb.h"
+
 #include <set>
 #include <stdint.h>
 #include <utility>
@@ -305,4 +310,257 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+static CWalletTx ConfirmedTx(CWallet* pwallet, const CMutableTransaction& tx, int nIndex)
+{
+    CWalletTx wtx(pwallet, tx);
+    wtx.hashBlock = chainActive.Tip()->GetBlockHash();
+    wtx.nIndex = nIndex;
+    wtx.fMerkleVerified = true;
+    return wtx;
+}
+
+BOOST_AUTO_TEST_CASE(balances_follow_wallet_transactions)
+{
+    CWallet walletBalances("wallet_balances.dat");
+    LOCK2(cs_main, walletBalances.cs_wallet);
+
+    CKey key;
+    key.MakeNewKey(true);
+    BOOST_CHECK(walletBalances.AddKeyPubKey(key, key.GetPubKey()));
+    CScript scriptMine = GetScriptForDestination(key.GetPubKey().GetID());
+    CKey keyOther;
+    keyOther.MakeNewKey(true);
+    CScript scriptOther = GetScriptForDestination(keyOther.GetPubKey().GetID());
+
+    CMutableTransaction txReceive;
+    txReceive.vin.resize(1);
+    txReceive.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txReceive.vout.push_back(CTxOut(COIN, scriptMine));
+    txReceive.vout.push_back(CTxOut(2 * COIN, scriptOther));
+    BOOST_CHECK(walletBalances.AddToWallet(ConfirmedTx(&walletBalances, txReceive, 1)));
+
+    CMutableTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vout.push_back(CTxOut(50 * COIN, scriptMine));
+    BOOST_CHECK(walletBalances.AddToWallet(ConfirmedTx(&walletBalances, txCoinBase, 0)));
+
+    CWalletBalances balances = walletBalances.GetBalances();
+    BOOST_CHECK_EQUAL(balances.nBalance, COIN);
+    BOOST_CHECK_EQUAL(balances.nUnconfirmed, 0);
+    BOOST_CHECK_EQUAL(balances.nImmature, 50 * COIN);
+    BOOST_CHECK_EQUAL(balances.nWatchOnly, 0);
+    BOOST_CHECK_EQUAL(walletBalances.GetBalance(), COIN);
+
+    std::vector<COutput> vAvailable;
+    walletBalances.AvailableCoins(vAvailable);
+    BOOST_REQUIRE_EQUAL(vAvailable.size(), 1U);
+    BOOST_CHECK(vAvailable[0].tx->GetHash() == txReceive.GetHash());
+    BOOST_CHECK_EQUAL(vAvailable[0].i, 0);
+
+    // Spending the coin in the chain takes it out of the balance and the available coins
+    CMutableTransaction txSpend;
+    txSpend.vin.resize(1);
+    txSpend.vin[0].prevout = COutPoint(txReceive.GetHash(), 0);
+    txSpend.vout.push_back(CTxOut(COIN / 2, scriptOther));
+    BOOST_CHECK(walletBalances.AddToWallet(ConfirmedTx(&walletBalances, txSpend, 2)));
+
+    balances = walletBalances.GetBalances();
+    BOOST_CHECK_EQUAL(balances.nBalance, 0);
+    BOOST_CHECK_EQUAL(balances.nImmature, 50 * COIN);
+    walletBalances.AvailableCoins(vAvailable);
+    BOOST_CHECK(vAvailable.empty());
+
+    // Rebuilding from scratch gives the same
+    walletBalances.MarkDirty();
+    BOOST_CHECK_EQUAL(walletBalances.GetBalance(), 0);
+    BOOST_CHECK_EQUAL(walletBalances.GetImmatureBalance(), 50 * COIN);
+}
+
+BOOST_AUTO_TEST_CASE(batched_wallet_writes)
+{
+    CWallet walletBatch("wallet_batch.dat");
+    LOCK2(cs_main, walletBatch.cs_wallet);
+
+    // A refill spanning several commits
+    BOOST_CHECK(walletBatch.TopUpKeyPool(WALLET_BATCH_SIZE + 10));
+    BOOST_CHECK(walletBatch.pwalletdbBatch == NULL);
+    BOOST_CHECK_EQUAL(walletBatch.setKeyPool.size(), WALLET_BATCH_SIZE + 11);
+    {
+        CWalletDB walletdb("wallet_batch.dat");
+        CKeyPool keypool;
+        BOOST_CHECK(walletdb.ReadPool(1, keypool));
+        BOOST_CHECK(walletBatch.HaveKey(keypool.vchPubKey.GetID()));
+        BOOST_CHECK(walletdb.ReadPool(WALLET_BATCH_SIZE + 11, keypool));
+        BOOST_CHECK(walletBatch.HaveKey(keypool.vchPubKey.GetID()));
+    }
+
+    {
+        CWalletDBBatch batch(&walletBatch);
+        BOOST_CHECK(walletBatch.pwalletdbBatch == &batch.GetDB());
+        {
+            CWalletDBBatch batchNested(&walletBatch);
+            BOOST_CHECK(&batchNested.GetDB() == &batch.GetDB());
+        }
+        BOOST_CHECK(walletBatch.pwalletdbBatch == &batch.GetDB());
+
+        // Adding a transaction from a block reads the accounting entries
+        // back, which has to go through the batch that wrote before it
+        for (int i = 0; i < 2; i++)
+        {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+            tx.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+            BOOST_CHECK(walletBatch.AddToWallet(ConfirmedTx(&walletBatch, tx, i)));
+            batch.Next();
+        }
+    }
+    BOOST_CHECK(walletBatch.pwalletdbBatch == NULL);
+
+    std::vector<uint256> vTxHash;
+    std::vector<CWalletTx> vWtx;
+    BOOST_CHECK_EQUAL(CWalletDB("wallet_batch.dat").FindWalletTx(&walletBatch, vTxHash, vWtx), DB_LOAD_OK);
+    BOOST_CHECK_EQUAL(vTxHash.size(), 2U);
+}
+
+BOOST_AUTO_TEST_CASE(load_wallet_on_threads)
+{
+    vector<CKeyID> vKeyIDs;
+    vector<uint256> vTxHashes;
+    {
+        CWallet walletSave("wallet_load.dat");
+        LOCK2(cs_main, walletSave.cs_wallet);
+        for (int i = 0; i < 100; i++)
+        {
+            CKey key;
+            key.MakeNewKey(i % 2 == 0);
+            BOOST_CHECK(walletSave.AddKeyPubKey(key, key.GetPubKey()));
+            vKeyIDs.push_back(key.GetPubKey().GetID());
+        }
+        for (int i = 0; i < 20; i++)
+        {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+            tx.vout.push_back(CTxOut(COIN, GetScriptForDestination(vKeyIDs[i])));
+            BOOST_CHECK(walletSave.AddToWallet(CWalletTx(&walletSave, tx)));
+            vTxHashes.push_back(tx.GetHash());
+        }
+    }
+
+    int nWalletThreadsSaved = nWalletThreads;
+    nWalletThreads = 4;
+    CWallet walletLoad("wallet_load.dat");
+    BOOST_CHECK_EQUAL(CWalletDB("wallet_load.dat").LoadWallet(&walletLoad), DB_LOAD_OK);
+    nWalletThreads = nWalletThreadsSaved;
+
+    LOCK2(cs_main, walletLoad.cs_wallet);
+    BOOST_FOREACH(const CKeyID& keyid, vKeyIDs)
+        BOOST_CHECK(walletLoad.HaveKey(keyid));
+    BOOST_CHECK_EQUAL(walletLoad.mapWallet.size(), vTxHashes.size());
+    BOOST_FOREACH(const uint256& hash, vTxHashes)
+    {
+        BOOST_REQUIRE(walletLoad.mapWallet.count(hash));
+        BOOST_CHECK(walletLoad.mapWallet[hash].GetHash() == hash);
+    }
+    // The loaded keys are used to recognize the loaded transactions
+    BOOST_CHECK_EQUAL(walletLoad.GetUnconfirmedBalance(), 20 * COIN);
+}
+
+BOOST_AUTO_TEST_CASE(ismine_follows_keystore)
+{
+    CWallet walletMine;
+    LOCK(walletMine.cs_wallet);
+
+    CKey key, keyLoaded, keyOther;
+    key.MakeNewKey(true);
+    keyLoaded.MakeNewKey(false);
+    keyOther.MakeNewKey(true);
+    CTxOut txoutKey(COIN, GetScriptForDestination(key.GetPubKey().GetID()));
+    CTxOut txoutLoaded(COIN, CScript() << ToByteVector(keyLoaded.GetPubKey()) << OP_CHECKSIG);
+    CScript scriptOther = GetScriptForDestination(keyOther.GetPubKey().GetID());
+    CTxOut txoutOther(COIN, scriptOther);
+    CScript redeemScript = GetScriptForDestination(key.GetPubKey().GetID());
+    CTxOut txoutScript(COIN, GetScriptForDestination(CScriptID(redeemScript)));
+
+    BOOST_CHECK_EQUAL(walletMine.IsMine(txoutKey), ISMINE_NO);
+    BOOST_CHECK(walletMine.AddKeyPubKey(key, key.GetPubKey()));
+    BOOST_CHECK_EQUAL(walletMine.IsMine(txoutKey), ISMINE_SPENDABLE);
+
+    BOOST_CHECK_EQUAL(walletMine.IsMine(txoutLoaded), ISMINE_NO);
+    BOOST_CHECK(walletMine.LoadKey(keyLoaded, keyLoaded.GetPubKey()));
+    BOOST_CHECK_EQUAL(walletMine.IsMine(txoutLoaded), ISMINE_SPENDABLE);
+
+    BOOST_CHECK_EQUAL(walletMine.IsMine(txoutScript), ISMINE_NO);
+    BOOST_CHECK(walletMine.AddCScript(redeemScript));
+    BOOST_CHECK_EQUAL(walletMine.IsMine(txoutScript), ISMINE_SPENDABLE);
+
+    BOOST_CHECK_EQUAL(walletMine.IsMine(txoutOther), ISMINE_NO);
+    BOOST_CHECK(walletMine.AddWatchOnly(scriptOther));
+    BOOST_CHECK_EQUAL(walletMine.IsMine(txoutOther), ISMINE_WATCH_ONLY);
+    BOOST_CHECK(walletMine.RemoveWatchOnly(scriptOther));
+    BOOST_CHECK_EQUAL(walletMine.IsMine(txoutOther), ISMINE_NO);
+
+    CMutableTransaction tx;
+    tx.vout.push_back(txoutOther);
+    BOOST_CHECK(!walletMine.IsMine(CTransaction(tx)));
+    tx.vout.push_back(txoutKey);
+    BOOST_CHECK(walletMine.IsMine(CTransaction(tx)));
+}
+
+BOOST_AUTO_TEST_CASE(resend_only_unconfirmed_due)
+{
+    CWallet walletResend("wallet_resend.dat");
+    LOCK2(cs_main, walletResend.cs_wallet);
+    const int64_t nNow = GetTime();
+    SetMockTime(nNow);
+
+    CMutableTransaction txConfirmed;
+    txConfirmed.vin.resize(1);
+    txConfirmed.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    txConfirmed.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+    BOOST_CHECK(walletResend.AddToWallet(ConfirmedTx(&walletResend, txConfirmed, 1)));
+
+    CMutableTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vout.push_back(CTxOut(50 * COIN, CScript() << OP_TRUE));
+    BOOST_CHECK(walletResend.AddToWallet(CWalletTx(&walletResend, txCoinBase)));
+
+    CMutableTransaction txOld;
+    txOld.vin.resize(1);
+    txOld.vin[0].prevout = COutPoint(txConfirmed.GetHash(), 0);
+    txOld.vout.push_back(CTxOut(COIN, CScript() << OP_TRUE));
+    BOOST_CHECK(walletResend.AddToWallet(CWalletTx(&walletResend, txOld)));
+
+    SetMockTime(nNow + 60);
+    CMutableTransaction txNew(txOld);
+    txNew.vout[0].nValue = COIN / 2;
+    BOOST_CHECK(walletResend.AddToWallet(CWalletTx(&walletResend, txNew)));
+
+    // Nothing has had time to get in a block yet
+    BOOST_CHECK(walletResend.GetTxsToResend(nNow + 5 * 60, nNow + 5 * 60).empty());
+
+    // Once it has, only the unconfirmed transaction, and only once per block
+    std::vector<CWalletTx*> vResend = walletResend.GetTxsToResend(nNow + 5 * 60 + 1, nNow + 5 * 60 + 1);
+    BOOST_REQUIRE_EQUAL(vResend.size(), 1U);
+    BOOST_CHECK(vResend[0]->GetHash() == txOld.GetHash());
+    BOOST_CHECK(walletResend.GetTxsToResend(nNow + 5 * 60 + 1, nNow + 6 * 60).empty());
+
+    // Oldest first
+    vResend = walletResend.GetTxsToResend(nNow + 10 * 60, nNow + 10 * 60);
+    BOOST_REQUIRE_EQUAL(vResend.size(), 2U);
+    BOOST_CHECK(vResend[0]->GetHash() == txOld.GetHash());
+    BOOST_CHECK(vResend[1]->GetHash() == txNew.GetHash());
+
+    // Getting in a block takes it out for good
+    BOOST_CHECK(walletResend.AddToWallet(ConfirmedTx(&walletResend, txNew, 2)));
+    vResend = walletResend.GetTxsToResend(nNow + 20 * 60, nNow + 20 * 60);
+    BOOST_REQUIRE_EQUAL(vResend.size(), 1U);
+    BOOST_CHECK(vResend[0]->GetHash() == txOld.GetHash());
+
+    SetMockTime(0);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
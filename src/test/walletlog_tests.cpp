@@ -0,0 +1,371 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "walletlog.h"
+
+#include "clientversion.h"
+#include "db.h"
+#include "streams.h"
+#include "tinyformat.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <boost/assign/list_of.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+CSerializeData Key(int n)
+{
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << std::make_pair(std::string("key"), n);
+    return CSerializeData(ss.begin(), ss.end());
+}
+
+CSerializeData Value(const std::string& str)
+{
+    return CSerializeData(str.begin(), str.end());
+}
+
+std::string ReadValue(const CWalletLog& log, int n)
+{
+    CSerializeData value;
+    if (!log.Read(Key(n), value))
+        return "";
+    return std::string(value.begin(), value.end());
+}
+
+std::vector<CWalletLogOp> WriteOp(int n, const std::string& str)
+{
+    return std::vector<CWalletLogOp>(1, CWalletLogOp(Key(n), Value(str)));
+}
+
+class CTestDB : public CDB
+{
+public:
+    CTestDB(const std::string& strFilename, const char* pszMode = "r+") : CDB(strFilename, pszMode) {}
+
+    using CDB::Read;
+    using CDB::Write;
+    using CDB::Erase;
+    using CDB::Exists;
+    using CDB::GetCursor;
+    using CDB::ReadAtCursor;
+
+    //! The names of the records with keys from ("name", strFrom) on
+    std::vector<std::string> List(const std::string& strFrom)
+    {
+        std::vector<std::string> vNames;
+        CDBCursor* pcursor = GetCursor();
+        unsigned int fFlags = DB_SET_RANGE;
+        while (true)
+        {
+            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+            if (fFlags == DB_SET_RANGE)
+                ssKey << std::make_pair(std::string("name"), strFrom);
+            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
+            int ret = ReadAtCursor(pcursor, ssKey, ssValue, fFlags);
+            fFlags = DB_NEXT;
+            if (ret != 0)
+                break;
+            std::string strType, strName;
+            ssKey >> strType;
+            if (strType != "name")
+                break;
+            ssKey >> strName;
+            vNames.push_back(strName);
+        }
+        delete pcursor;
+        return vNames;
+    }
+};
+}
+
+BOOST_AUTO_TEST_SUITE(walletlog_tests)
+
+BOOST_AUTO_TEST_CASE(walletlog_replay)
+{
+    boost::filesystem::path path = GetTempPath() / boost::filesystem::unique_path("walletlog_%%%%-%%%%");
+    {
+        CWalletLog log;
+        BOOST_CHECK(!log.Open(path, false));
+        BOOST_REQUIRE(log.Open(path, true));
+        BOOST_CHECK(CWalletLog::IsLogFile(path));
+
+        for (int i = 0; i < 100; i++)
+            BOOST_CHECK(log.Write(WriteOp(i, strprintf("value %d", i))));
+        BOOST_CHECK(log.Write(WriteOp(7, "overwritten")));
+        BOOST_CHECK(!log.Write(WriteOp(8, "not overwritten"), false));
+        BOOST_CHECK(log.Write(std::vector<CWalletLogOp>(1, CWalletLogOp(Key(9)))));
+
+        // A transaction of several operations is one entry
+        std::vector<CWalletLogOp> vOps;
+        vOps.push_back(CWalletLogOp(Key(200), Value("first")));
+        vOps.push_back(CWalletLogOp(Key(201), Value("second")));
+        vOps.push_back(CWalletLogOp(Key(200)));
+        BOOST_CHECK(log.Write(vOps));
+
+        BOOST_CHECK_EQUAL(log.size(), 100U);
+        BOOST_CHECK_EQUAL(ReadValue(log, 7), "overwritten");
+        BOOST_CHECK_EQUAL(ReadValue(log, 8), "value 8");
+        BOOST_CHECK(!log.Exists(Key(9)));
+        BOOST_CHECK(!log.Exists(Key(200)));
+        BOOST_CHECK_EQUAL(ReadValue(log, 201), "second");
+    }
+
+    // Opening again replays the same
+    CWalletLog log;
+    BOOST_REQUIRE(log.Open(path, false));
+    BOOST_CHECK_EQUAL(log.size(), 100U);
+    BOOST_CHECK_EQUAL(ReadValue(log, 0), "value 0");
+    BOOST_CHECK_EQUAL(ReadValue(log, 7), "overwritten");
+    BOOST_CHECK(!log.Exists(Key(9)));
+    BOOST_CHECK_EQUAL(ReadValue(log, 201), "second");
+
+    // Records are read in key order
+    CSerializeData key, value;
+    BOOST_CHECK(log.ReadNext(Key(5), true, key, value));
+    BOOST_CHECK(key == Key(5));
+    BOOST_CHECK(log.ReadNext(Key(8), false, key, value));
+    BOOST_CHECK(key == Key(10));
+    BOOST_CHECK(!log.ReadNext(Key(201), false, key, value));
+    log.Close();
+
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(walletlog_torn_entry)
+{
+    boost::filesystem::path path = GetTempPath() / boost::filesystem::unique_path("walletlog_%%%%-%%%%");
+    uint64_t nSize;
+    {
+        CWalletLog log;
+        BOOST_REQUIRE(log.Open(path, true));
+        BOOST_CHECK(log.Write(WriteOp(1, "one")));
+        nSize = log.GetFileSize();
+        BOOST_CHECK(log.Write(WriteOp(2, "two")));
+    }
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), nSize + (nSize - 12));
+
+    // Cut the last entry short, as a crash while appending it would
+    boost::filesystem::resize_file(path, nSize + 10);
+    {
+        CWalletLog log;
+        BOOST_REQUIRE(log.Open(path, false));
+        BOOST_CHECK_EQUAL(ReadValue(log, 1), "one");
+        BOOST_CHECK(!log.Exists(Key(2)));
+        BOOST_CHECK_EQUAL(log.GetFileSize(), nSize);
+        // New entries go after the last whole one
+        BOOST_CHECK(log.Write(WriteOp(3, "three")));
+    }
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), nSize + (nSize - 10));
+
+    // A corrupt entry ends the replay too
+    FILE* file = fopen(path.string().c_str(), "rb+");
+    BOOST_REQUIRE(file);
+    fseek(file, nSize + 8, SEEK_SET);
+    fputc('x', file);
+    fclose(file);
+    {
+        CWalletLog log;
+        BOOST_REQUIRE(log.Open(path, false));
+        BOOST_CHECK_EQUAL(ReadValue(log, 1), "one");
+        BOOST_CHECK(!log.Exists(Key(3)));
+    }
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), nSize);
+
+    // Not a log at all
+    file = fopen(path.string().c_str(), "wb");
+    BOOST_REQUIRE(file);
+    fputs("not a log", file);
+    fclose(file);
+    BOOST_CHECK(!CWalletLog::IsLogFile(path));
+    CWalletLog log;
+    BOOST_CHECK(!log.Open(path, false));
+
+    // The bytes dropped were saved next to the log, each time
+    std::vector<boost::filesystem::path> vBackups;
+    boost::filesystem::directory_iterator end;
+    for (boost::filesystem::directory_iterator it(path.parent_path()); it != end; ++it)
+        if (it->path().string().find(path.string() + ".") == 0)
+            vBackups.push_back(it->path());
+    BOOST_CHECK_EQUAL(vBackups.size(), 2U);
+    BOOST_FOREACH(const boost::filesystem::path& pathBackup, vBackups)
+        boost::filesystem::remove(pathBackup);
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(walletlog_corrupt_entry)
+{
+    boost::filesystem::path path = GetTempPath() / boost::filesystem::unique_path("walletlog_%%%%-%%%%");
+    uint64_t nSize, nSizeTwo;
+    {
+        CWalletLog log;
+        BOOST_REQUIRE(log.Open(path, true));
+        BOOST_CHECK(log.Write(WriteOp(1, "one")));
+        nSize = log.GetFileSize();
+        BOOST_CHECK(log.Write(WriteOp(2, "two")));
+        nSizeTwo = log.GetFileSize();
+        BOOST_CHECK(log.Write(WriteOp(3, "three")));
+    }
+    uint64_t nSizeOnDisk = boost::filesystem::file_size(path);
+
+    // Damage the entry in the middle
+    FILE* file = fopen(path.string().c_str(), "rb+");
+    BOOST_REQUIRE(file);
+    fseek(file, nSize + 8, SEEK_SET);
+    fputc('x', file);
+    fclose(file);
+
+    // The entries after it are not dropped, but the log can't be written
+    {
+        CWalletLog log;
+        BOOST_REQUIRE(log.Open(path, false));
+        BOOST_CHECK(log.IsCorrupt());
+        BOOST_CHECK_EQUAL(ReadValue(log, 1), "one");
+        BOOST_CHECK(!log.Exists(Key(3)));
+        BOOST_CHECK(!log.Write(WriteOp(4, "four")));
+        BOOST_CHECK(!log.Compact());
+        BOOST_CHECK(log.Flush());
+    }
+    BOOST_CHECK_EQUAL(boost::filesystem::file_size(path), nSizeOnDisk);
+
+    // Salvaging skips over it
+    {
+        CWalletLog log;
+        BOOST_REQUIRE(log.Open(path, false, true));
+        BOOST_CHECK(!log.IsCorrupt());
+        BOOST_CHECK_EQUAL(ReadValue(log, 1), "one");
+        BOOST_CHECK(!log.Exists(Key(2)));
+        BOOST_CHECK_EQUAL(ReadValue(log, 3), "three");
+        BOOST_CHECK(log.Write(WriteOp(4, "four")));
+    }
+    BOOST_CHECK_LT(boost::filesystem::file_size(path), nSizeOnDisk + (nSizeTwo - nSize));
+    {
+        CWalletLog log;
+        BOOST_REQUIRE(log.Open(path, false));
+        BOOST_CHECK(!log.IsCorrupt());
+        BOOST_CHECK_EQUAL(log.size(), 3U);
+        BOOST_CHECK_EQUAL(ReadValue(log, 3), "three");
+        BOOST_CHECK_EQUAL(ReadValue(log, 4), "four");
+    }
+
+    // The damaged file was saved next to the log
+    std::vector<boost::filesystem::path> vBackups;
+    boost::filesystem::directory_iterator end;
+    for (boost::filesystem::directory_iterator it(path.parent_path()); it != end; ++it)
+        if (it->path().string().find(path.string() + ".") == 0)
+            vBackups.push_back(it->path());
+    BOOST_CHECK_EQUAL(vBackups.size(), 1U);
+    BOOST_FOREACH(const boost::filesystem::path& pathBackup, vBackups)
+        boost::filesystem::remove(pathBackup);
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(walletlog_compact)
+{
+    boost::filesystem::path path = GetTempPath() / boost::filesystem::unique_path("walletlog_%%%%-%%%%");
+    CWalletLog log;
+    BOOST_REQUIRE(log.Open(path, true));
+
+    // Overwrite the same records many times over
+    const std::string strValue(100, 'v');
+    for (int nRound = 0; nRound < 20; nRound++)
+        for (int i = 0; i < 1000; i++)
+            BOOST_CHECK(log.Write(WriteOp(i, strprintf("%s %d", strValue, nRound))));
+    uint64_t nSize = log.GetFileSize();
+    BOOST_CHECK(log.Flush());
+    BOOST_CHECK_LT(log.GetFileSize() * 10, nSize);
+    BOOST_CHECK_EQUAL(log.GetFileSize(), boost::filesystem::file_size(path));
+    BOOST_CHECK_EQUAL(log.size(), 1000U);
+    BOOST_CHECK_EQUAL(ReadValue(log, 500), strValue + " 19");
+
+    // Nothing left to compact
+    nSize = log.GetFileSize();
+    BOOST_CHECK(log.Flush());
+    BOOST_CHECK_EQUAL(log.GetFileSize(), nSize);
+
+    // Records can be left out of a compaction, and writes go on after it
+    for (int i = 0; i < 10; i++)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey << std::make_pair(std::string("pool"), i);
+        BOOST_CHECK(log.Write(std::vector<CWalletLogOp>(1, CWalletLogOp(CSerializeData(ssKey.begin(), ssKey.end()), Value("pool")))));
+    }
+    BOOST_CHECK_EQUAL(log.size(), 1010U);
+    BOOST_CHECK(log.Compact("\x04pool"));
+    BOOST_CHECK_EQUAL(log.size(), 1000U);
+    BOOST_CHECK(log.Write(WriteOp(5000, "after")));
+    log.Close();
+
+    BOOST_REQUIRE(log.Open(path, false));
+    BOOST_CHECK_EQUAL(log.size(), 1001U);
+    BOOST_CHECK_EQUAL(ReadValue(log, 999), strValue + " 19");
+    BOOST_CHECK_EQUAL(ReadValue(log, 5000), "after");
+    log.Close();
+
+    boost::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(db_over_walletlog)
+{
+    const std::string strFile = "walletlog_db.dat";
+    bitdb.fCreateLogs = true;
+    {
+        CTestDB db(strFile, "cr+");
+        BOOST_CHECK(bitdb.IsLog(strFile, false));
+        int nVersion;
+        BOOST_CHECK(db.ReadVersion(nVersion));
+        BOOST_CHECK_EQUAL(nVersion, CLIENT_VERSION);
+
+        BOOST_CHECK(db.Write(std::make_pair(std::string("name"), std::string("a")), std::string("alice")));
+        BOOST_CHECK(db.Write(std::make_pair(std::string("name"), std::string("b")), std::string("bob")));
+        BOOST_CHECK(db.Write(std::make_pair(std::string("name"), std::string("c")), std::string("carol")));
+        BOOST_CHECK(!db.Write(std::make_pair(std::string("name"), std::string("c")), std::string("other"), false));
+        BOOST_CHECK(db.Write(std::make_pair(std::string("pool"), 1), 1));
+        std::string strValue;
+        BOOST_CHECK(db.Read(std::make_pair(std::string("name"), std::string("c")), strValue));
+        BOOST_CHECK_EQUAL(strValue, "carol");
+
+        // A transaction is seen through its own handle only, until committed
+        CTestDB dbOther(strFile);
+        BOOST_CHECK(db.TxnBegin());
+        BOOST_CHECK(db.Erase(std::make_pair(std::string("name"), std::string("a"))));
+        BOOST_CHECK(db.Write(std::make_pair(std::string("name"), std::string("d")), std::string("dave")));
+        BOOST_CHECK(!db.Exists(std::make_pair(std::string("name"), std::string("a"))));
+        BOOST_CHECK(dbOther.Exists(std::make_pair(std::string("name"), std::string("a"))));
+        BOOST_CHECK(db.List("") == boost::assign::list_of("b")("c")("d"));
+        BOOST_CHECK(dbOther.List("") == boost::assign::list_of("a")("b")("c"));
+        BOOST_CHECK(db.TxnAbort());
+        BOOST_CHECK(db.List("") == boost::assign::list_of("a")("b")("c"));
+
+        BOOST_CHECK(db.TxnBegin());
+        BOOST_CHECK(db.Erase(std::make_pair(std::string("name"), std::string("a"))));
+        BOOST_CHECK(db.Write(std::make_pair(std::string("name"), std::string("d")), std::string("dave")));
+        BOOST_CHECK(db.TxnCommit());
+        BOOST_CHECK(dbOther.List("b") == boost::assign::list_of("b")("c")("d"));
+        BOOST_CHECK(dbOther.Read(std::make_pair(std::string("name"), std::string("d")), strValue));
+        BOOST_CHECK_EQUAL(strValue, "dave");
+    }
+
+    // Rewriting compacts the log, leaving out the records asked
+    bitdb.CloseDb(strFile);
+    BOOST_CHECK(CDB::Rewrite(strFile, "\x04pool"));
+    {
+        CTestDB db(strFile);
+        BOOST_CHECK(!db.Exists(std::make_pair(std::string("pool"), 1)));
+        BOOST_CHECK(db.List("") == boost::assign::list_of("b")("c")("d"));
+    }
+
+    bitdb.fCreateLogs = false;
+    BOOST_CHECK(bitdb.RemoveDb(strFile));
+    BOOST_CHECK(!bitdb.IsLog(strFile, false));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,122 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "walletscan.h"
+
+#include "key.h"
+#include "keystore.h"
+#include "script/standard.h"
+#include "wallet_ismine.h"
+
+#include <boost/test/unit_test.hpp>
+
+namespace
+{
+CTxOut MakeOutput(const CScript& scriptPubKey)
+{
+    return CTxOut(1000, scriptPubKey);
+}
+}
+
+BOOST_AUTO_TEST_SUITE(walletscan_tests)
+
+BOOST_AUTO_TEST_CASE(filter_matches_wallet_outputs)
+{
+    CBasicKeyStore keystore;
+    CWalletScanFilter filter;
+
+    CKey key, keyOther, keyMultisig;
+    key.MakeNewKey(true);
+    keyOther.MakeNewKey(true);
+    keyMultisig.MakeNewKey(false);
+    CPubKey pubkey = key.GetPubKey();
+    keystore.AddKey(key);
+    filter.AddKey(pubkey.GetID());
+
+    CScript redeemScript = GetScriptForDestination(keyOther.GetPubKey().GetID());
+    keystore.AddCScript(redeemScript);
+    filter.AddRedeemScript(CScriptID(redeemScript));
+
+    CScript scriptWatched = GetScriptForDestination(keyOther.GetPubKey().GetID());
+    keystore.AddWatchOnly(scriptWatched);
+    filter.AddWatchOnly(scriptWatched);
+
+    // Whatever IsMine accepts passes the filter
+    CScript scriptPubKeyHash = GetScriptForDestination(pubkey.GetID());
+    CScript scriptPubKey = CScript() << ToByteVector(pubkey) << OP_CHECKSIG;
+    CScript scriptScriptHash = GetScriptForDestination(CScriptID(redeemScript));
+    BOOST_CHECK(IsMine(keystore, scriptPubKeyHash) != ISMINE_NO);
+    BOOST_CHECK(filter.IsRelevant(MakeOutput(scriptPubKeyHash)));
+    BOOST_CHECK(IsMine(keystore, scriptPubKey) != ISMINE_NO);
+    BOOST_CHECK(filter.IsRelevant(MakeOutput(scriptPubKey)));
+    BOOST_CHECK(filter.IsRelevant(MakeOutput(scriptScriptHash)));
+    BOOST_CHECK(IsMine(keystore, scriptWatched) != ISMINE_NO);
+    BOOST_CHECK(filter.IsRelevant(MakeOutput(scriptWatched)));
+
+    // Standard outputs to others are passed over
+    CKey keyStranger;
+    keyStranger.MakeNewKey(false);
+    CScript scriptStranger = GetScriptForDestination(keyStranger.GetPubKey().GetID());
+    CScript scriptStrangerPubKey = CScript() << ToByteVector(keyStranger.GetPubKey()) << OP_CHECKSIG;
+    CScript scriptStrangerHash = GetScriptForDestination(CScriptID(scriptStranger));
+    CScript scriptData = CScript() << OP_RETURN << ToByteVector(pubkey);
+    BOOST_CHECK(!filter.IsRelevant(MakeOutput(scriptStranger)));
+    BOOST_CHECK(!filter.IsRelevant(MakeOutput(scriptStrangerPubKey)));
+    BOOST_CHECK(!filter.IsRelevant(MakeOutput(scriptStrangerHash)));
+    BOOST_CHECK(!filter.IsRelevant(MakeOutput(scriptData)));
+
+    // Watch-only scripts can be removed again
+    filter.AddWatchOnly(scriptStranger);
+    BOOST_CHECK(filter.IsRelevant(MakeOutput(scriptStranger)));
+    filter.RemoveWatchOnly(scriptStranger);
+    BOOST_CHECK(!filter.IsRelevant(MakeOutput(scriptStranger)));
+
+    // Bare multisig can't be told apart without the keystore, so it is always checked
+    std::vector<CPubKey> vKeys;
+    vKeys.push_back(pubkey);
+    vKeys.push_back(keyMultisig.GetPubKey());
+    BOOST_CHECK(filter.IsRelevant(MakeOutput(GetScriptForMultisig(1, vKeys))));
+
+    CMutableTransaction tx;
+    tx.vout.push_back(MakeOutput(scriptStranger));
+    BOOST_CHECK(!filter.IsRelevant(CTransaction(tx)));
+    tx.vout.push_back(MakeOutput(scriptPubKeyHash));
+    BOOST_CHECK(filter.IsRelevant(CTransaction(tx)));
+}
+
+BOOST_AUTO_TEST_CASE(reader_keeps_order)
+{
+    CWalletScanFilter filter;
+    std::vector<CBlockIndex> vIndex(20);
+    std::vector<uint256> vHash(vIndex.size());
+    for (unsigned int i = 0; i < vIndex.size(); i++) {
+        vHash[i] = i;
+        vIndex[i].phashBlock = &vHash[i];
+        vIndex[i].nHeight = i;
+    }
+
+    CRescanBlockReader reader(filter, 4);
+    BOOST_CHECK(!reader.Pop());
+    // Blocks without data are handed back unread, in order
+    for (unsigned int i = 0; i < vIndex.size(); i++)
+        reader.Push(&vIndex[i]);
+    BOOST_CHECK_EQUAL(reader.size(), vIndex.size());
+    for (unsigned int i = 0; i < 10; i++) {
+        boost::shared_ptr<CRescanBlock> pentry = reader.Pop();
+        BOOST_REQUIRE(pentry);
+        BOOST_CHECK(pentry->pindex == &vIndex[i]);
+        BOOST_CHECK(!pentry->fRead);
+        BOOST_CHECK(pentry->vRelevant.empty());
+    }
+
+    reader.Clear();
+    BOOST_CHECK_EQUAL(reader.size(), 0U);
+    BOOST_CHECK(!reader.Pop());
+    reader.Push(&vIndex[3]);
+    boost::shared_ptr<CRescanBlock> pentry = reader.Pop();
+    BOOST_REQUIRE(pentry);
+    BOOST_CHECK(pentry->pindex == &vIndex[3]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -8,8 +8,13 @@
 #include "pow.h"
 #include "uint256.h"
 
+#include <algorithm>
+#include <deque>
 #include <stdint.h>
 
+#include <boost/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -25,7 +30,7 @@ void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
     batch.Write('B', hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, CLevelDBParams::FromArgs("chainstate")) {
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
@@ -63,7 +68,32 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     return db.WriteBatch(batch);
 }
 
-CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
+bool CCoinsViewDB::ReadAllCoins(const boost::function<void (const uint256&, const char*, const char*)>& fn) const {
+    /* It seems that there are no "const iterators" for LevelDB.  Since we
+       only need read operations on it, use a const-cast to get around
+       that restriction.  */
+    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << 'c';
+    for (pcursor->Seek(ssKeySet.str()); pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        leveldb::Slice slKey = pcursor->key();
+        CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+        char chType;
+        ssKey >> chType;
+        if (chType != 'c')
+            break;
+        uint256 txid;
+        ssKey >> txid;
+        leveldb::Slice slValue = pcursor->value();
+        fn(txid, slValue.data(), slValue.data() + slValue.size());
+    }
+    HandleError(pcursor->status());
+    return true;
+}
+
+CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe, CLevelDBParams::FromArgs("blockindex")) {
+    TrackWriteGeneration('G');
 }
 
 bool CBlockTreeDB::WriteBlockIndex(const CDiskBlockIndex& blockindex)
@@ -99,56 +129,271 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read('l', nFile);
 }
 
-bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
-    /* It seems that there are no "const iterators" for LevelDB.  Since we
-       only need read operations on it, use a const-cast to get around
-       that restriction.  */
-    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
+bool CBlockTreeDB::WriteBlockIndexSnapshotId(const uint256 &id) {
+    return Write('S', id, true);
+}
 
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock();
-    ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
-    while (pcursor->Valid()) {
-        boost::this_thread::interruption_point();
-        try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == 'c') {
+bool CBlockTreeDB::ReadBlockIndexSnapshotId(uint256 &id) {
+    return Read('S', id);
+}
+
+bool CBlockTreeDB::EraseBlockIndexSnapshotId() {
+    return Erase('S', true);
+}
+
+bool CBlockTreeDB::CountBlockIndex(uint64_t &nCount) {
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << 'b';
+    nCount = 0;
+    for (pcursor->Seek(ssKeySet.str()); pcursor->Valid() && pcursor->key().starts_with(ssKeySet.str()); pcursor->Next())
+        nCount++;
+    HandleError(pcursor->status());
+    return true;
+}
+
+bool CBlockTreeDB::HaveBlockIndex(const uint256 &hash) {
+    return Exists(make_pair('b', hash));
+}
+
+namespace {
+
+//! Number of txid ranges the coin database is split into for GetStats
+static const int COINS_STATS_RANGES = 64;
+//! Size at which a range's serialized coins are handed over for hashing
+static const size_t COINS_STATS_CHUNK_SIZE = 1 << 20;
+//! Maximum amount of serialized coins waiting for hashing in ranges after the one being hashed
+static const size_t COINS_STATS_MAX_BUFFERED = 32 << 20;
+
+/** Results of scanning one range of txids, in the order of the database. */
+struct CCoinsStatsRange {
+    //! Serialized coins for hashSerialized, not yet hashed
+    std::deque<boost::shared_ptr<CDataStream> > vChunks;
+    CCoinsSetHash setHash;
+    uint64_t nTransactions;
+    uint64_t nSerializedSize;
+    bool fDone;
+    bool fError;
+
+    CCoinsStatsRange() : nTransactions(0), nSerializedSize(0), fDone(false), fError(false) {}
+};
+
+/**
+ * Scan of a snapshot of the coin database for CCoinsViewDB::GetStats. The txid space is split
+ * into ranges that are scanned and deserialized on several threads. The serialized hash depends
+ * on the order of the database, so the calling thread hashes the ranges' output one range after
+ * the other; threads scanning later ranges wait while too much of it is buffered.
+ */
+class CCoinsStatsScan
+{
+private:
+    CLevelDBWrapper& db;
+    const leveldb::Snapshot* psnapshot;
+
+    CWaitableCriticalSection cs;
+    CConditionVariable cond;
+    //! All of the following are protected by cs.
+    std::vector<CCoinsStatsRange> vRanges;
+    int nNextRange;
+    int nRangeHashing;
+    size_t nBuffered;
+
+    void AddChunk(int nRange, boost::shared_ptr<CDataStream>& pchunk)
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            while (nRange != nRangeHashing && nBuffered >= COINS_STATS_MAX_BUFFERED)
+                cond.wait(lock);
+            vRanges[nRange].vChunks.push_back(pchunk);
+            nBuffered += pchunk->size();
+        }
+        cond.notify_all();
+        pchunk.reset(new CDataStream(SER_GETHASH, PROTOCOL_VERSION));
+    }
+
+    bool ScanRange(int nRange, CCoinsStatsRange& result)
+    {
+        const unsigned int nBegin = 256 * nRange / vRanges.size();
+        const unsigned int nEnd = 256 * (nRange + 1) / vRanges.size();
+
+        boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator(psnapshot));
+        const char chSeek[2] = {'c', (char)nBegin};
+        pcursor->Seek(leveldb::Slice(chSeek, sizeof(chSeek)));
+
+        boost::shared_ptr<CDataStream> pchunk(new CDataStream(SER_GETHASH, PROTOCOL_VERSION));
+        for (; pcursor->Valid(); pcursor->Next()) {
+            boost::this_thread::interruption_point();
+            try {
+                leveldb::Slice slKey = pcursor->key();
+                // Keys are 'c' followed by the txid, so the first txid byte selects the range
+                if (slKey.size() < 2 || slKey[0] != 'c' || (unsigned char)slKey[1] >= nEnd)
+                    break;
+                CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
+                uint256 txhash;
+                ssKey >> chType >> txhash;
                 leveldb::Slice slValue = pcursor->value();
                 CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
                 CCoins coins;
                 ssValue >> coins;
-                uint256 txhash;
-                ssKey >> txhash;
+
+                CDataStream& ss = *pchunk;
                 ss << txhash;
                 ss << VARINT(coins.nVersion);
                 ss << (coins.fCoinBase ? 'c' : 'n');
                 ss << VARINT(coins.nHeight);
-                stats.nTransactions++;
+                result.nTransactions++;
                 for (unsigned int i=0; i<coins.vout.size(); i++) {
                     const CTxOut &out = coins.vout[i];
                     if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
                         ss << VARINT(i+1);
                         ss << out;
-                        nTotalAmount += out.nValue;
+                        result.setHash.Add(COutPoint(txhash, i), out);
                     }
                 }
-                stats.nSerializedSize += 32 + slValue.size();
+                result.nSerializedSize += 32 + slValue.size();
                 ss << VARINT(0);
+                if (ss.size() >= COINS_STATS_CHUNK_SIZE)
+                    AddChunk(nRange, pchunk);
+            } catch (std::exception &e) {
+                return error("%s : Deserialize or I/O error - %s", __func__, e.what());
             }
-            pcursor->Next();
-        } catch (std::exception &e) {
-            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+        if (!pchunk->empty())
+            AddChunk(nRange, pchunk);
+        return true;
+    }
+
+    void Thread()
+    {
+        RenameThread("litecoin-coinstats");
+        while (true) {
+            int nRange;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                if (nNextRange >= (int)vRanges.size())
+                    return;
+                nRange = nNextRange++;
+            }
+
+            // Counters are only read by the hashing thread once fDone is set.
+            CCoinsStatsRange& result = vRanges[nRange];
+            bool fOk = ScanRange(nRange, result);
+
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                result.fDone = true;
+                result.fError = !fOk;
+            }
+            cond.notify_all();
         }
     }
-    stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
-    stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+
+    bool HashRanges(CCoinsStats &stats)
+    {
+        CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+        ss << stats.hashBlock;
+        CCoinsSetHash setHash;
+        for (int nRange = 0; nRange < (int)vRanges.size(); nRange++) {
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                nRangeHashing = nRange;
+            }
+            cond.notify_all();
+
+            CCoinsStatsRange& range = vRanges[nRange];
+            while (true) {
+                boost::shared_ptr<CDataStream> pchunk;
+                {
+                    boost::unique_lock<boost::mutex> lock(cs);
+                    while (range.vChunks.empty() && !range.fDone)
+                        cond.wait(lock);
+                    if (range.vChunks.empty())
+                        break;
+                    pchunk = range.vChunks.front();
+                    range.vChunks.pop_front();
+                    nBuffered -= pchunk->size();
+                }
+                cond.notify_all();
+                ss.write(&(*pchunk)[0], pchunk->size());
+            }
+            if (range.fError)
+                return false;
+
+            stats.nTransactions += range.nTransactions;
+            stats.nSerializedSize += range.nSerializedSize;
+            setHash += range.setHash;
+        }
+        stats.hashSerialized = ss.GetHash();
+        stats.nTransactionOutputs = setHash.GetOutputs();
+        stats.nTotalAmount = setHash.GetAmount();
+        stats.hashSet = setHash.GetHash();
+        return true;
+    }
+
+public:
+    CCoinsStatsScan(CLevelDBWrapper& dbIn, const leveldb::Snapshot* psnapshotIn) :
+        db(dbIn), psnapshot(psnapshotIn), vRanges(COINS_STATS_RANGES), nNextRange(0), nRangeHashing(0), nBuffered(0) {}
+
+    bool Run(int nThreads, CCoinsStats &stats)
+    {
+        boost::thread_group threads;
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CCoinsStatsScan::Thread, this));
+
+        bool ret;
+        try {
+            ret = HashRanges(stats);
+        } catch (...) {
+            threads.interrupt_all();
+            threads.join_all();
+            throw;
+        }
+        // After an error, threads may still be scanning later ranges.
+        threads.interrupt_all();
+        threads.join_all();
+        return ret;
+    }
+};
+
+} // anon namespace
+
+bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
+    /* It seems that there are no "const iterators" for LevelDB.  Since we
+       only need read operations on it, use a const-cast to get around
+       that restriction.  */
+    CLevelDBWrapper& dbScan = const_cast<CLevelDBWrapper&>(db);
+
+    // Scan a snapshot, so blocks can be connected (and flushed) in the meantime.
+    const leveldb::Snapshot* psnapshot = dbScan.GetSnapshot();
+    bool ret = false;
+    try {
+        {
+            boost::scoped_ptr<leveldb::Iterator> pcursor(dbScan.NewIterator(psnapshot));
+            pcursor->Seek("B");
+            if (pcursor->Valid() && pcursor->key() == "B") {
+                leveldb::Slice slValue = pcursor->value();
+                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                ssValue >> stats.hashBlock;
+            }
+        }
+
+        int nThreads = std::max(1, std::min((int)boost::thread::hardware_concurrency(), COINS_STATS_RANGES));
+        CCoinsStatsScan scan(dbScan, psnapshot);
+        ret = scan.Run(nThreads, stats);
+    } catch (...) {
+        dbScan.ReleaseSnapshot(psnapshot);
+        throw;
+    }
+    dbScan.ReleaseSnapshot(psnapshot);
+    if (!ret)
+        return false;
+
+    LOCK(cs_main);
+    BlockMap::iterator mi = mapBlockIndex.find(stats.hashBlock);
+    if (mi == mapBlockIndex.end())
+        return error("%s : best block of the coin database not found", __func__);
+    stats.nHeight = mi->second->nHeight;
     return true;
 }
 
@@ -156,13 +401,74 @@ bool CBlockTreeDB::ReadTxIndex(const uint256 &txid, CDiskTxPos &pos) {
     return Read(make_pair('t', txid), pos);
 }
 
-bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> >&vect) {
+namespace {
+
+/**
+ * Transaction index entry: 'T', the first bytes of the txid and the position of the transaction,
+ * with an empty value. This takes about 20 bytes per transaction instead of the 40 of a
+ * ('t', txid) key with a CDiskTxPos value. Several transactions may share a prefix, and the
+ * same transaction may be in several blocks.
+ */
+struct CTxIndexKey
+{
+    static const unsigned int TXID_PREFIX_SIZE = 8;
+
+    char chType;
+    unsigned char vchTxidPrefix[TXID_PREFIX_SIZE];
+    CDiskTxPos pos;
+
+    CTxIndexKey() : chType('T') {}
+
+    CTxIndexKey(const uint256& txid, const CDiskTxPos& posIn) : chType('T'), pos(posIn) {
+        memcpy(vchTxidPrefix, txid.begin(), TXID_PREFIX_SIZE);
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(chType);
+        READWRITE(FLATDATA(vchTxidPrefix));
+        READWRITE(pos);
+    }
+};
+
+}
+
+bool CBlockTreeDB::WriteTxIndexEntries(const std::vector<std::pair<uint256, CDiskTxPos> > &vPos, const uint256 &hashBlock) {
     CLevelDBBatch batch;
-    for (std::vector<std::pair<uint256,CDiskTxPos> >::const_iterator it=vect.begin(); it!=vect.end(); it++)
-        batch.Write(make_pair('t', it->first), it->second);
+    for (std::vector<std::pair<uint256, CDiskTxPos> >::const_iterator it = vPos.begin(); it != vPos.end(); it++)
+        batch.Write(CTxIndexKey(it->first, it->second), std::string());
+    batch.Write('I', hashBlock);
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::ReadTxIndexEntries(const uint256 &txid, std::vector<CDiskTxPos> &vPos) {
+    CTxIndexKey keyPrefix(txid, CDiskTxPos());
+    CDataStream ssKeyPrefix(SER_DISK, CLIENT_VERSION);
+    ssKeyPrefix << keyPrefix.chType << FLATDATA(keyPrefix.vchTxidPrefix);
+    const std::string strKeyPrefix = ssKeyPrefix.str();
+
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+    for (pcursor->Seek(strKeyPrefix); pcursor->Valid() && pcursor->key().starts_with(strKeyPrefix); pcursor->Next()) {
+        leveldb::Slice slKey = pcursor->key();
+        try {
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            CTxIndexKey key;
+            ssKey >> key;
+            vPos.push_back(key.pos);
+        } catch (std::exception &e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    HandleError(pcursor->status());
+    return !vPos.empty();
+}
+
+bool CBlockTreeDB::ReadTxIndexBestBlock(uint256 &hashBlock) {
+    return Read('I', hashBlock);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair('F', name), fValue ? '1' : '0');
 }
@@ -14,6 +14,8 @@
 #include <utility>
 #include <vector>
 
+#include <boost/function.hpp>
+
 class CCoins;
 class uint256;
 
@@ -37,6 +39,9 @@ public:
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     bool GetStats(CCoinsStats &stats) const;
+
+    //! Call fn with the txid and the serialized coins of every entry, in txid order
+    bool ReadAllCoins(const boost::function<void (const uint256&, const char*, const char*)>& fn) const;
 };
 
 /** Access to the block database (blocks/index/) */
@@ -56,9 +61,19 @@ public:
     bool WriteReindexing(bool fReindex);
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
-    bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    //! Add transaction index entries, and record the block they run up to, in one write
+    bool WriteTxIndexEntries(const std::vector<std::pair<uint256, CDiskTxPos> > &vPos, const uint256 &hashBlock);
+    //! Positions of the transactions whose txid starts like txid; callers must check the full txid
+    bool ReadTxIndexEntries(const uint256 &txid, std::vector<CDiskTxPos> &vPos);
+    bool ReadTxIndexBestBlock(uint256 &hashBlock);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
+    bool WriteBlockIndexSnapshotId(const uint256 &id);
+    bool ReadBlockIndexSnapshotId(uint256 &id);
+    bool EraseBlockIndexSnapshotId();
+    //! Number of block index entries, counted without parsing them
+    bool CountBlockIndex(uint64_t &nCount);
+    bool HaveBlockIndex(const uint256 &hash);
     bool LoadBlockIndexGuts();
 };
 
@@ -0,0 +1,139 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txindex.h"
+
+#include "init.h"
+#include "main.h"
+#include "txdb.h"
+#include "util.h"
+
+#include <utility>
+#include <vector>
+
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+void ThreadTxIndex()
+{
+    RenameThread("litecoin-txindex");
+
+    // Last block of the active chain that is indexed
+    const CBlockIndex* pindexLast = NULL;
+    {
+        LOCK(cs_main);
+        uint256 hashBest;
+        if (pblocktree->ReadTxIndexBestBlock(hashBest)) {
+            BlockMap::const_iterator mi = mapBlockIndex.find(hashBest);
+            if (mi != mapBlockIndex.end())
+                pindexLast = mi->second;
+        }
+        LogPrintf("Transaction index is up to height %d\n", pindexLast ? pindexLast->nHeight : -1);
+    }
+
+    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
+    const CBlockIndex* pindexWritten = pindexLast;
+    while (true) {
+        boost::this_thread::interruption_point();
+
+        const CBlockIndex* pindexNext;
+        {
+            LOCK(cs_main);
+            // Continue from the fork point after a reorganization
+            if (pindexLast && !chainActive.Contains(pindexLast))
+                pindexLast = chainActive.FindFork(pindexLast);
+            pindexNext = pindexLast ? chainActive.Next(pindexLast) : chainActive.Genesis();
+        }
+
+        if (pindexNext) {
+            CBlock block;
+            if (!ReadBlockFromDisk(block, pindexNext)) {
+                LogPrintf("%s: Failed to read block %s, retrying\n", __func__, pindexNext->GetBlockHash().ToString());
+                MilliSleep(1000);
+                continue;
+            }
+            CDiskTxPos pos(pindexNext->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
+            BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+                vPos.push_back(std::make_pair(tx.GetHash(), pos));
+                pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
+            }
+            pindexLast = pindexNext;
+        }
+
+        // Write when a batch is full, or when caught up with the tip
+        if (pindexLast != pindexWritten && (vPos.size() >= TXINDEX_BATCH_ENTRIES || !pindexNext)) {
+            if (!pblocktree->WriteTxIndexEntries(vPos, pindexLast->GetBlockHash())) {
+                LogPrintf("%s: Failed to write transaction index\n", __func__);
+                StartShutdown();
+                return;
+            }
+            LogPrint("txindex", "%s: Indexed %u transactions up to height %d\n", __func__, vPos.size(), pindexLast->nHeight);
+            vPos.clear();
+            pindexWritten = pindexLast;
+        }
+
+        if (!pindexNext) {
+            // Wait for the tip to move; the timeout covers a change just before we started waiting
+            boost::unique_lock<boost::mutex> lock(csBestBlock);
+            cvBlockChange.timed_wait(lock, boost::posix_time::seconds(1));
+        }
+    }
+}
+
+bool FindIndexedTransaction(const uint256& txid, CTransaction& tx, uint256& hashBlock, bool& fOffChain)
+{
+    fOffChain = false;
+    std::vector<CDiskTxPos> vPos;
+    if (!pblocktree->ReadTxIndexEntries(txid, vPos))
+        return false;
+
+    BOOST_FOREACH(const CDiskTxPos& pos, vPos) {
+        CTransaction txCandidate;
+        uint256 hashBlockCandidate;
+        if (!ReadTransactionFromDisk(txCandidate, hashBlockCandidate, pos) || txCandidate.GetHash() != txid)
+            continue;
+        tx = txCandidate;
+        hashBlock = hashBlockCandidate;
+
+        LOCK(cs_main);
+        BlockMap::const_iterator mi = mapBlockIndex.find(hashBlock);
+        if (mi != mapBlockIndex.end() && chainActive.Contains(mi->second))
+            return true;
+        fOffChain = true;
+    }
+    return false;
+}
+
+bool FindUnindexedTransaction(const uint256& txid, CTransaction& tx, uint256& hashBlock)
+{
+    AssertLockHeld(cs_main);
+
+    // Last block of the active chain that is indexed
+    const CBlockIndex* pindexIndexed = NULL;
+    uint256 hashBest;
+    if (pblocktree->ReadTxIndexBestBlock(hashBest)) {
+        BlockMap::const_iterator mi = mapBlockIndex.find(hashBest);
+        if (mi != mapBlockIndex.end())
+            pindexIndexed = chainActive.FindFork(mi->second);
+    }
+    int nUnindexed = chainActive.Height() - (pindexIndexed ? pindexIndexed->nHeight : -1);
+    if (nUnindexed > TXINDEX_MAX_UNINDEXED_SCAN) {
+        LogPrint("txindex", "%s: %d blocks are not indexed yet, not scanning them\n", __func__, nUnindexed);
+        return false;
+    }
+
+    for (const CBlockIndex* pindex = chainActive.Tip(); pindex != pindexIndexed; pindex = pindex->pprev) {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex))
+            return error("%s : Failed to read block %s", __func__, pindex->GetBlockHash().ToString());
+        BOOST_FOREACH(const CTransaction& txCandidate, block.vtx) {
+            if (txCandidate.GetHash() == txid) {
+                tx = txCandidate;
+                hashBlock = pindex->GetBlockHash();
+                return true;
+            }
+        }
+    }
+    return false;
+}
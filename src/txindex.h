@@ -0,0 +1,43 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXINDEX_H
+#define BITCOIN_TXINDEX_H
+
+class CTransaction;
+class uint256;
+
+/** Number of transaction index entries collected before they are written in one batch */
+static const unsigned int TXINDEX_BATCH_ENTRIES = 100000;
+/**
+ * Most blocks past the end of the transaction index that lookups scan. The index normally
+ * trails the tip by a block at most; while it is built, lookups do not wait for it.
+ */
+static const int TXINDEX_MAX_UNINDEXED_SCAN = 6;
+
+/**
+ * Build the transaction index (-txindex), and keep it up to date, by following the active
+ * chain from the last block indexed. Runs until interrupted.
+ *
+ * Entries are written together with the hash of the last block they cover, so the index
+ * resumes where it stopped. Entries of blocks that were disconnected are left in place;
+ * lookups verify the txid and prefer the copy in the active chain.
+ */
+void ThreadTxIndex();
+
+/**
+ * Find a transaction through the transaction index in a block of the active chain, and the hash
+ * of that block. If it is only in blocks off the active chain, returns false with one of them
+ * in tx and hashBlock, and fOffChain set.
+ */
+bool FindIndexedTransaction(const uint256& txid, CTransaction& tx, uint256& hashBlock, bool& fOffChain);
+
+/**
+ * Find a transaction in the blocks of the active chain that the transaction index does not
+ * cover yet, newest first. Gives up if more than TXINDEX_MAX_UNINDEXED_SCAN blocks are left.
+ * Requires cs_main.
+ */
+bool FindUnindexedTransaction(const uint256& txid, CTransaction& tx, uint256& hashBlock);
+
+#endif // BITCOIN_TXINDEX_H
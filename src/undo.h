@@ -53,6 +53,18 @@ public:
     }
 };
 
+/** Output spent by a transaction input, with the height of the block that created it.
+ *  Unlike in CTxInUndo, the height is always known. Used to maintain the optional indexes.
+ */
+struct CSpentOutput
+{
+    CTxOut txout;
+    int nHeight;
+
+    CSpentOutput() : nHeight(0) {}
+    CSpentOutput(const CTxOut& txoutIn, int nHeightIn) : txout(txoutIn), nHeight(nHeightIn) {}
+};
+
 /** Undo information for a CTransaction */
 class CTxUndo
 {
@@ -750,3 +750,19 @@ void SetThreadPriority(int nPriority)
 #endif // PRIO_THREAD
 #endif // WIN32
 }
+
+static void ParallelForStride(size_t nStart, size_t nStride, size_t nCount, const boost::function<void (size_t)>& func)
+{
+    for (size_t i = nStart; i < nCount; i += nStride)
+        func(i);
+}
+
+void ParallelFor(size_t nCount, int nThreads, const boost::function<void (size_t)>& func)
+{
+    size_t nStride = nThreads > 1 ? std::max((size_t)1, std::min((size_t)nThreads, nCount)) : 1;
+    boost::thread_group threads;
+    for (size_t i = 1; i < nStride; i++)
+        threads.create_thread(boost::bind(&ParallelForStride, i, nStride, nCount, boost::cref(func)));
+    ParallelForStride(0, nStride, nCount, func);
+    threads.join_all();
+}
@@ -25,6 +25,7 @@
 #include <vector>
 
 #include <boost/filesystem/path.hpp>
+#include <boost/function.hpp>
 #include <boost/thread/exceptions.hpp>
 
 extern std::map<std::string, std::string> mapArgs;
@@ -164,6 +165,13 @@ bool SoftSetBoolArg(const std::string& strArg, bool fValue);
 void SetThreadPriority(int nPriority);
 void RenameThread(const char* name);
 
+/**
+ * Call func(i) for every i in [0, nCount), spread over up to nThreads threads
+ * of which the calling thread is one, and return once all calls have. func
+ * must not throw.
+ */
+void ParallelFor(size_t nCount, int nThreads, const boost::function<void (size_t)>& func);
+
 /**
  * Standard wrapper for do-something-forever thread functions.
  * "Forever" really means until the thread is interrupted.
@@ -14,7 +14,9 @@
 #include "timedata.h"
 #include "util.h"
 #include "utilmoneystr.h"
+#include "walletscan.h"
 
+#include <algorithm>
 #include <assert.h>
 
 #include <boost/algorithm/string/replace.hpp>
@@ -30,6 +32,8 @@ CAmount maxTxFee = DEFAULT_TRANSACTION_MAXFEE;
 unsigned int nTxConfirmTarget = 2;
 bool bSpendZeroConfChange = true;
 bool fSendFreeTransactions = false;
+int nRescanThreads = DEFAULT_RESCAN_THREADS;
+int nWalletThreads = DEFAULT_WALLET_THREADS;
 bool fPayAtLeastCustomFee = true;
 
 CAmount nMinimumInputThreshold = DEFAULT_MINIMUM_INPUT_THRESHOLD;
@@ -40,20 +44,19 @@ CAmount nMinimumInputThreshold = DEFAULT_MINIMUM_INPUT_THRESHOLD;
  */
 CFeeRate CWallet::minTxFee = CFeeRate(DEFAULT_TX_FEE);
 
+int GetWalletThreads()
+{
+    int nThreads = nWalletThreads;
+    if (nThreads <= 0)
+        nThreads += boost::thread::hardware_concurrency();
+    return std::max(1, std::min(nThreads, MAX_WALLET_THREADS));
+}
+
 /** @defgroup mapWallet
  *
  * @{
  */
 
-struct CompareValueOnly
-{
-    bool operator()(const pair<CAmount, pair<const CWalletTx*, unsigned int> >& t1,
-                    const pair<CAmount, pair<const CWalletTx*, unsigned int> >& t2) const
-    {
-        return t1.first < t2.first;
-    }
-};
-
 std::string COutput::ToString() const
 {
     return strprintf("COutput(%s, %d, %d) [%s]", tx->GetHash().ToString(), i, nDepth, FormatMoney(tx->vout[i].nValue));
@@ -100,6 +103,10 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     AssertLockHeld(cs_wallet); // mapKeyMetadata
     if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
         return false;
+    {
+        LOCK(cs_KeyStore);
+        filterMine.AddKey(pubkey.GetID());
+    }
 
     // check if we need to remove from watch-only
     CScript script;
@@ -110,6 +117,10 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     if (!fFileBacked)
         return true;
     if (!IsCrypted()) {
+        if (pwalletdbBatch)
+            return pwalletdbBatch->WriteKey(pubkey,
+                                            secret.GetPrivKey(),
+                                            mapKeyMetadata[pubkey.GetID()]);
         return CWalletDB(strWalletFile).WriteKey(pubkey,
                                                  secret.GetPrivKey(),
                                                  mapKeyMetadata[pubkey.GetID()]);
@@ -122,6 +133,10 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
 {
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
         return false;
+    {
+        LOCK(cs_KeyStore);
+        filterMine.AddKey(vchPubKey.GetID());
+    }
     if (!fFileBacked)
         return true;
     {
@@ -130,6 +145,10 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
             return pwalletdbEncryption->WriteCryptedKey(vchPubKey,
                                                         vchCryptedSecret,
                                                         mapKeyMetadata[vchPubKey.GetID()]);
+        else if (pwalletdbBatch)
+            return pwalletdbBatch->WriteCryptedKey(vchPubKey,
+                                                   vchCryptedSecret,
+                                                   mapKeyMetadata[vchPubKey.GetID()]);
         else
             return CWalletDB(strWalletFile).WriteCryptedKey(vchPubKey,
                                                             vchCryptedSecret,
@@ -138,6 +157,15 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
     return false;
 }
 
+bool CWallet::LoadKey(const CKey& key, const CPubKey &pubkey)
+{
+    if (!CCryptoKeyStore::AddKeyPubKey(key, pubkey))
+        return false;
+    LOCK(cs_KeyStore);
+    filterMine.AddKey(pubkey.GetID());
+    return true;
+}
+
 bool CWallet::LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &meta)
 {
     AssertLockHeld(cs_wallet); // mapKeyMetadata
@@ -150,15 +178,25 @@ bool CWallet::LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &meta)
 
 bool CWallet::LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret)
 {
-    return CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret);
+    if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
+        return false;
+    LOCK(cs_KeyStore);
+    filterMine.AddKey(vchPubKey.GetID());
+    return true;
 }
 
 bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    {
+        LOCK(cs_KeyStore);
+        filterMine.AddRedeemScript(CScriptID(redeemScript));
+    }
     if (!fFileBacked)
         return true;
+    if (pwalletdbBatch)
+        return pwalletdbBatch->WriteCScript(Hash160(redeemScript), redeemScript);
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
 }
 
@@ -175,17 +213,27 @@ bool CWallet::LoadCScript(const CScript& redeemScript)
         return true;
     }
 
-    return CCryptoKeyStore::AddCScript(redeemScript);
+    if (!CCryptoKeyStore::AddCScript(redeemScript))
+        return false;
+    LOCK(cs_KeyStore);
+    filterMine.AddRedeemScript(CScriptID(redeemScript));
+    return true;
 }
 
 bool CWallet::AddWatchOnly(const CScript &dest)
 {
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
+    {
+        LOCK(cs_KeyStore);
+        filterMine.AddWatchOnly(dest);
+    }
     nTimeFirstKey = 1; // No birthday information for watch-only keys.
     NotifyWatchonlyChanged(true);
     if (!fFileBacked)
         return true;
+    if (pwalletdbBatch)
+        return pwalletdbBatch->WriteWatchOnly(dest);
     return CWalletDB(strWalletFile).WriteWatchOnly(dest);
 }
 
@@ -194,18 +242,28 @@ bool CWallet::RemoveWatchOnly(const CScript &dest)
     AssertLockHeld(cs_wallet);
     if (!CCryptoKeyStore::RemoveWatchOnly(dest))
         return false;
+    {
+        LOCK(cs_KeyStore);
+        filterMine.RemoveWatchOnly(dest);
+    }
     if (!HaveWatchOnly())
         NotifyWatchonlyChanged(false);
     if (fFileBacked)
-        if (!CWalletDB(strWalletFile).EraseWatchOnly(dest))
+    {
+        if (pwalletdbBatch ? !pwalletdbBatch->EraseWatchOnly(dest) : !CWalletDB(strWalletFile).EraseWatchOnly(dest))
             return false;
+    }
 
     return true;
 }
 
 bool CWallet::LoadWatchOnly(const CScript &dest)
 {
-    return CCryptoKeyStore::AddWatchOnly(dest);
+    if (!CCryptoKeyStore::AddWatchOnly(dest))
+        return false;
+    LOCK(cs_KeyStore);
+    filterMine.AddWatchOnly(dest);
+    return true;
 }
 
 bool CWallet::Unlock(const SecureString& strWalletPassphrase)
@@ -221,7 +279,7 @@ bool CWallet::Unlock(const SecureString& strWalletPassphrase)
                 return false;
             if (!crypter.Decrypt(pMasterKey.second.vchCryptedKey, vMasterKey))
                 continue; // try another master key
-            if (CCryptoKeyStore::Unlock(vMasterKey))
+            if (CCryptoKeyStore::Unlock(vMasterKey, GetWalletThreads()))
                 return true;
         }
     }
@@ -244,7 +302,7 @@ bool CWallet::ChangeWalletPassphrase(const SecureString& strOldWalletPassphrase,
                 return false;
             if (!crypter.Decrypt(pMasterKey.second.vchCryptedKey, vMasterKey))
                 return false;
-            if (CCryptoKeyStore::Unlock(vMasterKey))
+            if (CCryptoKeyStore::Unlock(vMasterKey, GetWalletThreads()))
             {
                 int64_t nStartTime = GetTimeMillis();
                 crypter.SetKeyFromPassphrase(strNewWalletPassphrase, pMasterKey.second.vchSalt, pMasterKey.second.nDeriveIterations, pMasterKey.second.nDerivationMethod);
@@ -297,6 +355,8 @@ bool CWallet::SetMinVersion(enum WalletFeature nVersion, CWalletDB* pwalletdbIn,
 
     if (fFileBacked)
     {
+        if (!pwalletdbIn)
+            pwalletdbIn = pwalletdbBatch;
         CWalletDB* pwalletdb = pwalletdbIn ? pwalletdbIn : new CWalletDB(strWalletFile);
         if (nWalletVersion > 40000)
             pwalletdb->WriteMinVersion(nWalletVersion);
@@ -419,6 +479,122 @@ void CWallet::AddToSpends(const uint256& wtxid)
         AddToSpends(txin.prevout, wtxid);
 }
 
+/**
+ * Outpoint is spent for good if a transaction in the active chain spends it.
+ * Unlike IsSpent, a spend that is only in the memory pool doesn't count, as
+ * it can still be conflicted without the wallet being told about it.
+ */
+bool CWallet::IsSpentInChain(const COutPoint& outpoint) const
+{
+    pair<TxSpends::const_iterator, TxSpends::const_iterator> range;
+    range = mapTxSpends.equal_range(outpoint);
+
+    for (TxSpends::const_iterator it = range.first; it != range.second; ++it)
+    {
+        std::map<uint256, CWalletTx>::const_iterator mit = mapWallet.find(it->second);
+        if (mit != mapWallet.end() && mit->second.GetDepthInMainChain() > 0)
+            return true;
+    }
+    return false;
+}
+
+bool CWallet::MayHaveUnspentOutput(const CWalletTx& wtx) const
+{
+    const uint256& hash = wtx.GetHash();
+    for (unsigned int i = 0; i < wtx.vout.size(); i++)
+    {
+        if (IsMine(wtx.vout[i]) != ISMINE_NO && !IsSpentInChain(COutPoint(hash, i)))
+            return true;
+    }
+    return false;
+}
+
+void CWallet::InvalidateUnspentTxs()
+{
+    AssertLockHeld(cs_wallet);
+    fUnspentTxsValid = false;
+    setUnspentTxs.clear();
+    setUnspentTxsPending.clear();
+    nWalletTxGeneration++;
+}
+
+void CWallet::UpdateUnspentTxs() const
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (!fUnspentTxsValid)
+    {
+        setUnspentTxs.clear();
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        {
+            if (MayHaveUnspentOutput(it->second))
+                setUnspentTxs.insert(it->first);
+        }
+        setUnspentTxsPending.clear();
+        fUnspentTxsValid = true;
+        return;
+    }
+
+    BOOST_FOREACH(const uint256& hash, setUnspentTxsPending)
+    {
+        map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+        if (it != mapWallet.end() && MayHaveUnspentOutput(it->second))
+            setUnspentTxs.insert(hash);
+        else
+            setUnspentTxs.erase(hash);
+    }
+    setUnspentTxsPending.clear();
+}
+
+void CWallet::InvalidateUnconfirmedTxs()
+{
+    AssertLockHeld(cs_wallet);
+    fUnconfirmedTxsValid = false;
+    mapUnconfirmedTxs.clear();
+    setResendQueue.clear();
+    setUnconfirmedTxsPending.clear();
+}
+
+void CWallet::UpdateUnconfirmedTx(const uint256& hash)
+{
+    map<uint256, CWalletTx>::const_iterator it = mapWallet.find(hash);
+    bool fUnconfirmed = it != mapWallet.end() && !it->second.IsCoinBase() && it->second.GetDepthInMainChain() <= 0;
+    map<uint256, int64_t>::iterator mi = mapUnconfirmedTxs.find(hash);
+    if (fUnconfirmed && mi == mapUnconfirmedTxs.end())
+    {
+        // Don't rebroadcast until it's had plenty of time that
+        // it should have gotten in already by now.
+        int64_t nTime = (int64_t)it->second.nTimeReceived + 5 * 60;
+        mapUnconfirmedTxs.insert(make_pair(hash, nTime));
+        setResendQueue.insert(make_pair(nTime, hash));
+    }
+    else if (!fUnconfirmed && mi != mapUnconfirmedTxs.end())
+    {
+        setResendQueue.erase(make_pair(mi->second, hash));
+        mapUnconfirmedTxs.erase(mi);
+    }
+}
+
+void CWallet::UpdateUnconfirmedTxs()
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    if (!fUnconfirmedTxsValid)
+    {
+        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            UpdateUnconfirmedTx(it->first);
+        setUnconfirmedTxsPending.clear();
+        fUnconfirmedTxsValid = true;
+        return;
+    }
+
+    BOOST_FOREACH(const uint256& hash, setUnconfirmedTxsPending)
+        UpdateUnconfirmedTx(hash);
+    setUnconfirmedTxsPending.clear();
+}
+
 bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
 {
     if (IsCrypted())
@@ -470,7 +646,7 @@ bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
             pwalletdbEncryption->WriteMasterKey(nMasterKeyMaxID, kMasterKey);
         }
 
-        if (!EncryptKeys(vMasterKey))
+        if (!EncryptKeys(vMasterKey, GetWalletThreads()))
         {
             if (fFileBacked) {
                 pwalletdbEncryption->TxnAbort();
@@ -516,6 +692,8 @@ int64_t CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
 {
     AssertLockHeld(cs_wallet); // nOrderPosNext
     int64_t nRet = nOrderPosNext++;
+    if (!pwalletdb)
+        pwalletdb = pwalletdbBatch;
     if (pwalletdb) {
         pwalletdb->WriteOrderPosNext(nOrderPosNext);
     } else {
@@ -527,7 +705,9 @@ int64_t CWallet::IncOrderPosNext(CWalletDB *pwalletdb)
 CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries, std::string strAccount)
 {
     AssertLockHeld(cs_wallet); // mapWallet
-    CWalletDB walletdb(strWalletFile);
+    // Read through the batch in progress, if any: it holds locks on the
+    // database pages it has written, which another handle would wait on
+    CWalletDB* pwalletdb = pwalletdbBatch ? pwalletdbBatch : new CWalletDB(strWalletFile);
 
     // First: get all CWalletTx and CAccountingEntry into a sorted-by-order multimap.
     TxItems txOrdered;
@@ -540,7 +720,9 @@ CWallet::TxItems CWallet::OrderedTxItems(std::list<CAccountingEntry>& acentries,
         txOrdered.insert(make_pair(wtx->nOrderPos, TxPair(wtx, (CAccountingEntry*)0)));
     }
     acentries.clear();
-    walletdb.ListAccountCreditDebit(strAccount, acentries);
+    pwalletdb->ListAccountCreditDebit(strAccount, acentries);
+    if (!pwalletdbBatch)
+        delete pwalletdb;
     BOOST_FOREACH(CAccountingEntry& entry, acentries)
     {
         txOrdered.insert(make_pair(entry.nOrderPos, TxPair((CWalletTx*)0, &entry)));
@@ -555,6 +737,7 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        InvalidateUnspentTxs();
     }
 }
 
@@ -567,6 +750,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         mapWallet[hash] = wtxIn;
         mapWallet[hash].BindWallet(this);
         AddToSpends(hash);
+        InvalidateUnspentTxs();
+        InvalidateUnconfirmedTxs();
     }
     else
     {
@@ -662,6 +847,21 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet)
         // Break debit/credit balance caches:
         wtx.MarkDirty();
 
+        // The transaction's outputs, and the ones it spends, may have
+        // changed between unspent and spent in the chain:
+        if (fUnspentTxsValid)
+        {
+            setUnspentTxsPending.insert(hash);
+            if (!wtx.IsCoinBase()) {
+                BOOST_FOREACH(const CTxIn& txin, wtx.vin)
+                    setUnspentTxsPending.insert(txin.prevout.hash);
+            }
+        }
+        nWalletTxGeneration++;
+        // ... and may have gone in or out of a block
+        if (fUnconfirmedTxsValid)
+            setUnconfirmedTxsPending.insert(hash);
+
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
 
@@ -725,6 +925,9 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         LOCK(cs_wallet);
         if (mapWallet.erase(hash))
             CWalletDB(strWalletFile).EraseTx(hash);
+        // mapTxSpends still refers to the erased transaction, which no longer counts as a spend
+        InvalidateUnspentTxs();
+        InvalidateUnconfirmedTxs();
     }
     return;
 }
@@ -770,7 +973,7 @@ bool CWallet::IsChange(const CTxOut& txout) const
     // a better way of identifying which outputs are 'the send' and which are
     // 'the change' will need to be implemented (maybe extend CWalletTx to remember
     // which output, if any, was change).
-    if (::IsMine(*this, txout.scriptPubKey))
+    if (IsMine(txout))
     {
         CTxDestination address;
         if (!ExtractDestination(txout.scriptPubKey, address))
@@ -921,6 +1124,8 @@ void CWalletTx::GetAccountAmounts(const string& strAccount, CAmount& nReceived,
 
 bool CWalletTx::WriteToDisk()
 {
+    if (pwallet->pwalletdbBatch)
+        return pwallet->pwalletdbBatch->WriteTx(GetHash(), *this);
     return CWalletDB(pwallet->strWalletFile).WriteTx(GetHash(), *this);
 }
 
@@ -935,6 +1140,8 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
     int64_t nNow = GetTime();
 
     CBlockIndex* pindex = pindexStart;
+    CWalletScanFilter filter;
+    double dProgressStart, dProgressTip;
     {
         LOCK2(cs_main, cs_wallet);
 
@@ -943,44 +1150,101 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
         while (pindex && nTimeFirstKey && (pindex->GetBlockTime() < (nTimeFirstKey - 7200)))
             pindex = chainActive.Next(pindex);
 
+        // The reader threads match blocks against a copy of the filter, as
+        // keys may be added while they run
+        {
+            LOCK(cs_KeyStore);
+            filter = filterMine;
+        }
+
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
-        while (pindex)
+        dProgressStart = Checkpoints::GuessVerificationProgress(pindex, false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainActive.Tip(), false);
+    }
+
+    // Blocks are read and matched against the filter ahead on reader threads. The
+    // locks are only taken to queue blocks and to add the matching transactions,
+    // a chunk of blocks at a time, so the node keeps running during a long rescan.
+    int nThreads = nRescanThreads;
+    if (nThreads <= 0)
+        nThreads += boost::thread::hardware_concurrency();
+    nThreads = std::max(1, std::min(nThreads, MAX_RESCAN_THREADS));
+    CRescanBlockReader reader(filter, nThreads);
+    CBlockIndex* pindexNextRead = pindex;
+    while (true)
+    {
         {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+            LOCK(cs_main);
+            while (pindexNextRead && reader.size() < MAX_RESCAN_BLOCKS_BUFFERED) {
+                reader.Push(pindexNextRead);
+                pindexNextRead = chainActive.Next(pindexNextRead);
+            }
+        }
+
+        std::vector<boost::shared_ptr<CRescanBlock> > vChunk;
+        while (vChunk.size() < RESCAN_BLOCKS_PER_LOCK) {
+            boost::shared_ptr<CRescanBlock> pentry = reader.Pop();
+            if (!pentry)
+                break;
+            vChunk.push_back(pentry);
+        }
+        if (vChunk.empty())
+            break;
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+        {
+            LOCK2(cs_main, cs_wallet);
+            CWalletDBBatch batch(this);
+            BOOST_FOREACH(const boost::shared_ptr<CRescanBlock>& pentry, vChunk)
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
-            }
-            pindex = chainActive.Next(pindex);
-            if (GetTime() >= nNow + 60) {
-                nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
+                pindex = pentry->pindex;
+                if (!chainActive.Contains(pindex)) {
+                    // The chain was reorganized since the block was queued; continue from the fork.
+                    reader.Clear();
+                    pindexNextRead = chainActive.Next(chainActive.FindFork(pindex));
+                    break;
+                }
+                if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+                    ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+
+                const CBlock& block = pentry->block;
+                for (unsigned int i = 0; i < block.vtx.size(); i++)
+                {
+                    const CTransaction& tx = block.vtx[i];
+                    // Outputs not matching the filter are not ours, so only transactions
+                    // already in the wallet or spending from it are left to check.
+                    bool fCheck = pentry->vRelevant[i] || (fUpdate && mapWallet.count(tx.GetHash()));
+                    for (unsigned int j = 0; !fCheck && j < tx.vin.size(); j++)
+                        fCheck = !tx.IsCoinBase() && mapWallet.count(tx.vin[j].prevout.hash);
+                    if (fCheck && AddToWalletIfInvolvingMe(tx, &block, fUpdate)) {
+                        ret++;
+                        batch.Next();
+                    }
+                }
+                if (GetTime() >= nNow + 60) {
+                    nNow = GetTime();
+                    LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(pindex));
+                }
             }
         }
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+        boost::this_thread::interruption_point();
     }
+    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
     return ret;
 }
 
 void CWallet::ReacceptWalletTransactions()
 {
     LOCK2(cs_main, cs_wallet);
-    BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
+    UpdateUnconfirmedTxs();
+    // Coinbases and transactions in the chain aren't in the index
+    for (map<uint256, int64_t>::const_iterator it = mapUnconfirmedTxs.begin(); it != mapUnconfirmedTxs.end(); ++it)
     {
-        const uint256& wtxid = item.first;
-        CWalletTx& wtx = item.second;
-        assert(wtx.GetHash() == wtxid);
+        CWalletTx& wtx = mapWallet[it->first];
+        assert(wtx.GetHash() == it->first);
 
         int nDepth = wtx.GetDepthInMainChain();
 
-        if (!wtx.IsCoinBase() && nDepth < 0)
+        if (nDepth < 0)
         {
             // Try to add to memory pool
             LOCK(mempool.cs);
@@ -1031,23 +1295,44 @@ void CWallet::ResendWalletTransactions()
     // Rebroadcast any of our txes that aren't in a block yet
     LogPrintf("ResendWalletTransactions()\n");
     {
-        LOCK(cs_wallet);
-        // Sort them in chronological order
-        multimap<unsigned int, CWalletTx*> mapSorted;
-        BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
-        {
-            CWalletTx& wtx = item.second;
-            // Don't rebroadcast until it's had plenty of time that
-            // it should have gotten in already by now.
-            if (nTimeBestReceived - (int64_t)wtx.nTimeReceived > 5 * 60)
-                mapSorted.insert(make_pair(wtx.nTimeReceived, &wtx));
-        }
-        BOOST_FOREACH(PAIRTYPE(const unsigned int, CWalletTx*)& item, mapSorted)
-        {
-            CWalletTx& wtx = *item.second;
-            wtx.RelayWalletTransaction();
-        }
+        LOCK2(cs_main, cs_wallet);
+        vector<CWalletTx*> vResend = GetTxsToResend(nTimeBestReceived, nLastResend);
+        BOOST_FOREACH(CWalletTx* pwtx, vResend)
+            pwtx->RelayWalletTransaction();
+    }
+}
+
+vector<CWalletTx*> CWallet::GetTxsToResend(int64_t nTimeBestBlock, int64_t nTimeNow)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+    UpdateUnconfirmedTxs();
+
+    vector<pair<unsigned int, CWalletTx*> > vSorted;
+    vector<uint256> vDue;
+    for (set<pair<int64_t, uint256> >::const_iterator it = setResendQueue.begin(); it != setResendQueue.end() && it->first < nTimeBestBlock; ++it)
+    {
+        CWalletTx& wtx = mapWallet[it->second];
+        vSorted.push_back(make_pair(wtx.nTimeReceived, &wtx));
+        vDue.push_back(it->second);
+    }
+
+    // Not again before there's been a new block
+    BOOST_FOREACH(const uint256& hash, vDue)
+    {
+        int64_t& nTime = mapUnconfirmedTxs[hash];
+        setResendQueue.erase(make_pair(nTime, hash));
+        nTime = nTimeNow;
+        setResendQueue.insert(make_pair(nTime, hash));
     }
+
+    // Sort them in chronological order
+    sort(vSorted.begin(), vSorted.end());
+    vector<CWalletTx*> vResult;
+    vResult.reserve(vSorted.size());
+    for (unsigned int i = 0; i < vSorted.size(); i++)
+        vResult.push_back(vSorted[i].second);
+    return vResult;
 }
 
 /** @} */ // end of mapWallet
@@ -1061,94 +1346,75 @@ void CWallet::ResendWalletTransactions()
  */
 
 
-CAmount CWallet::GetBalance() const
+CWalletBalances CWallet::GetBalances() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    LOCK2(cs_main, cs_wallet);
+    unsigned int nMempoolUpdated = mempool.GetTransactionsUpdated();
+    if (fBalancesCached && pindexBalances == chainActive.Tip() &&
+        nBalancesMempoolUpdated == nMempoolUpdated && nBalancesGeneration == nWalletTxGeneration)
+        return cachedBalances;
+
+    UpdateUnspentTxs();
+
+    CWalletBalances balances;
+    // Whether a transaction is final can change with the time alone
+    bool fAllFinal = true;
+    BOOST_FOREACH(const uint256& hash, setUnspentTxs)
+    {
+        const CWalletTx* pcoin = &mapWallet.find(hash)->second;
+        bool fFinal = IsFinalTx(*pcoin);
+        bool fTrusted = pcoin->IsTrusted();
+        fAllFinal &= fFinal;
+        if (fTrusted)
+        {
+            balances.nBalance += pcoin->GetAvailableCredit();
+            balances.nWatchOnly += pcoin->GetAvailableWatchOnlyCredit();
+        }
+        if (!fFinal || (!fTrusted && pcoin->GetDepthInMainChain() == 0))
         {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+            balances.nUnconfirmed += pcoin->GetAvailableCredit();
+            balances.nUnconfirmedWatchOnly += pcoin->GetAvailableWatchOnlyCredit();
         }
+        balances.nImmature += pcoin->GetImmatureCredit();
+        balances.nImmatureWatchOnly += pcoin->GetImmatureWatchOnlyCredit();
     }
 
-    return nTotal;
+    fBalancesCached = fAllFinal;
+    cachedBalances = balances;
+    pindexBalances = chainActive.Tip();
+    nBalancesMempoolUpdated = nMempoolUpdated;
+    nBalancesGeneration = nWalletTxGeneration;
+    return balances;
+}
+
+CAmount CWallet::GetBalance() const
+{
+    return GetBalances().nBalance;
 }
 
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nUnconfirmed;
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nImmature;
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    return GetBalances().nWatchOnly;
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nUnconfirmedWatchOnly;
 }
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    return GetBalances().nImmatureWatchOnly;
 }
 
 /**
@@ -1160,10 +1426,10 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        UpdateUnspentTxs();
+        BOOST_FOREACH(const uint256& wtxid, setUnspentTxs)
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            const CWalletTx* pcoin = &mapWallet.find(wtxid)->second;
 
             if (!IsFinalTx(*pcoin))
                 continue;
@@ -1181,75 +1447,22 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
             for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
                 isminetype mine = IsMine(pcoin->vout[i]);
                 if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && pcoin->vout[i].nValue >= nMinimumInputThreshold &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i)))
+                    !IsLockedCoin(wtxid, i) && pcoin->vout[i].nValue >= nMinimumInputThreshold &&
+                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(wtxid, i)))
                         vCoins.push_back(COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
             }
         }
     }
 }
 
-static void ApproximateBestSubset(vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > >vValue, const CAmount& nTotalLower, const CAmount& nTargetValue,
-                                  vector<char>& vfBest, CAmount& nBest, int iterations = 1000)
-{
-    vector<char> vfIncluded;
-
-    vfBest.assign(vValue.size(), true);
-    nBest = nTotalLower;
-
-    seed_insecure_rand();
-
-    for (int nRep = 0; nRep < iterations && nBest != nTargetValue; nRep++)
-    {
-        vfIncluded.assign(vValue.size(), false);
-        CAmount nTotal = 0;
-        bool fReachedTarget = false;
-        for (int nPass = 0; nPass < 2 && !fReachedTarget; nPass++)
-        {
-            for (unsigned int i = 0; i < vValue.size(); i++)
-            {
-                //The solver here uses a randomized algorithm,
-                //the randomness serves no real security purpose but is just
-                //needed to prevent degenerate behavior and it is important
-                //that the rng is fast. We do not use a constant random sequence,
-                //because there may be some privacy improvement by making
-                //the selection random.
-                if (nPass == 0 ? insecure_rand()&1 : !vfIncluded[i])
-                {
-                    nTotal += vValue[i].first;
-                    vfIncluded[i] = true;
-                    if (nTotal >= nTargetValue)
-                    {
-                        fReachedTarget = true;
-                        if (nTotal < nBest)
-                        {
-                            nBest = nTotal;
-                            vfBest = vfIncluded;
-                        }
-                        nTotal -= vValue[i].first;
-                        vfIncluded[i] = false;
-                    }
-                }
-            }
-        }
-    }
-}
-
-bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, vector<COutput> vCoins,
-                                 set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
+const CCoinSelectionPool& CWallet::GetCoinPool(const vector<COutput>& vCoins, int nConfMine, int nConfTheirs, CoinPoolMap& mapPools) const
 {
-    setCoinsRet.clear();
-    nValueRet = 0;
-
-    // List of values less than target
-    pair<CAmount, pair<const CWalletTx*,unsigned int> > coinLowestLarger;
-    coinLowestLarger.first = std::numeric_limits<CAmount>::max();
-    coinLowestLarger.second.first = NULL;
-    vector<pair<CAmount, pair<const CWalletTx*,unsigned int> > > vValue;
-    CAmount nTotalLower = 0;
-
-    random_shuffle(vCoins.begin(), vCoins.end(), GetRandInt);
+    CoinPoolMap::iterator it = mapPools.find(make_pair(nConfMine, nConfTheirs));
+    if (it != mapPools.end())
+        return it->second;
 
+    vector<CInputCoin> vValue;
+    vValue.reserve(vCoins.size());
     BOOST_FOREACH(const COutput &output, vCoins)
     {
         if (!output.fSpendable)
@@ -1261,90 +1474,28 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
             continue;
 
         int i = output.i;
-        CAmount n = pcoin->vout[i].nValue;
-
-        pair<CAmount,pair<const CWalletTx*,unsigned int> > coin = make_pair(n,make_pair(pcoin, i));
-
-        if (n == nTargetValue)
-        {
-            setCoinsRet.insert(coin.second);
-            nValueRet += coin.first;
-            return true;
-        }
-        else if (n < nTargetValue + CENT)
-        {
-            vValue.push_back(coin);
-            nTotalLower += n;
-        }
-        else if (n < coinLowestLarger.first)
-        {
-            coinLowestLarger = coin;
-        }
-    }
-
-    if (nTotalLower == nTargetValue)
-    {
-        for (unsigned int i = 0; i < vValue.size(); ++i)
-        {
-            setCoinsRet.insert(vValue[i].second);
-            nValueRet += vValue[i].first;
-        }
-        return true;
-    }
-
-    if (nTotalLower < nTargetValue)
-    {
-        if (coinLowestLarger.second.first == NULL)
-            return false;
-        setCoinsRet.insert(coinLowestLarger.second);
-        nValueRet += coinLowestLarger.first;
-        return true;
-    }
-
-    // Solve subset sum by stochastic approximation
-    sort(vValue.rbegin(), vValue.rend(), CompareValueOnly());
-    vector<char> vfBest;
-    CAmount nBest;
-
-    ApproximateBestSubset(vValue, nTotalLower, nTargetValue, vfBest, nBest, 1000);
-    if (nBest != nTargetValue && nTotalLower >= nTargetValue + CENT)
-        ApproximateBestSubset(vValue, nTotalLower, nTargetValue + CENT, vfBest, nBest, 1000);
-
-    // If we have a bigger coin and (either the stochastic approximation didn't find a good solution,
-    //                                   or the next bigger coin is closer), return the bigger coin
-    if (coinLowestLarger.second.first &&
-        ((nBest != nTargetValue && nBest < nTargetValue + CENT) || coinLowestLarger.first <= nBest))
-    {
-        setCoinsRet.insert(coinLowestLarger.second);
-        nValueRet += coinLowestLarger.first;
-    }
-    else {
-        for (unsigned int i = 0; i < vValue.size(); i++)
-            if (vfBest[i])
-            {
-                setCoinsRet.insert(vValue[i].second);
-                nValueRet += vValue[i].first;
-            }
-
-        LogPrint("selectcoins", "SelectCoins() best subset: ");
-        for (unsigned int i = 0; i < vValue.size(); i++)
-            if (vfBest[i])
-                LogPrint("selectcoins", "%s ", FormatMoney(vValue[i].first));
-        LogPrint("selectcoins", "total %s\n", FormatMoney(nBest));
+        vValue.push_back(make_pair(pcoin->vout[i].nValue, make_pair(pcoin, i)));
     }
+    return mapPools.insert(make_pair(make_pair(nConfMine, nConfTheirs), CCoinSelectionPool(vValue))).first->second;
+}
 
-    return true;
+bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const vector<COutput>& vCoins,
+                                 set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const
+{
+    CoinPoolMap mapPools;
+    return GetCoinPool(vCoins, nConfMine, nConfTheirs, mapPools).Select(nTargetValue, setCoinsRet, nValueRet);
 }
 
-bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl) const
+bool CWallet::SelectCoins(const vector<COutput>& vAvailableCoins, CoinPoolMap& mapPools, const CAmount& nTargetValue,
+                          set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl) const
 {
-    vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, coinControl);
+    setCoinsRet.clear();
+    nValueRet = 0;
 
     // coin control -> return all selected outputs (we want all selected to go into the transaction for sure)
     if (coinControl && coinControl->HasSelected())
     {
-        BOOST_FOREACH(const COutput& out, vCoins)
+        BOOST_FOREACH(const COutput& out, vAvailableCoins)
         {
             if(!out.fSpendable)
                 continue;
@@ -1354,9 +1505,9 @@ bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*
         return (nValueRet >= nTargetValue);
     }
 
-    return (SelectCoinsMinConf(nTargetValue, 1, 6, vCoins, setCoinsRet, nValueRet) ||
-            SelectCoinsMinConf(nTargetValue, 1, 1, vCoins, setCoinsRet, nValueRet) ||
-            (bSpendZeroConfChange && SelectCoinsMinConf(nTargetValue, 0, 1, vCoins, setCoinsRet, nValueRet)));
+    return (GetCoinPool(vAvailableCoins, 1, 6, mapPools).Select(nTargetValue, setCoinsRet, nValueRet) ||
+            GetCoinPool(vAvailableCoins, 1, 1, mapPools).Select(nTargetValue, setCoinsRet, nValueRet) ||
+            (bSpendZeroConfChange && GetCoinPool(vAvailableCoins, 0, 1, mapPools).Select(nTargetValue, setCoinsRet, nValueRet)));
 }
 
 
@@ -1388,6 +1539,12 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, CAmount> >& vecSend,
     {
         LOCK2(cs_main, cs_wallet);
         {
+            // The coins to choose from don't change while the fee is worked
+            // out, so look them up and index them only once
+            vector<COutput> vAvailableCoins;
+            AvailableCoins(vAvailableCoins, true, coinControl);
+            CoinPoolMap mapPools;
+
             nFeeRet = 0;
             while (true)
             {
@@ -1417,7 +1574,7 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, CAmount> >& vecSend,
                 // Choose coins to use
                 set<pair<const CWalletTx*,unsigned int> > setCoins;
                 CAmount nValueIn = 0;
-                if (!SelectCoins(nTotalValue, setCoins, nValueIn, coinControl))
+                if (!SelectCoins(vAvailableCoins, mapPools, nTotalValue, setCoins, nValueIn, coinControl))
                 {
                     strFailReason = _("Insufficient funds");
                     return false;
@@ -1491,13 +1648,15 @@ bool CWallet::CreateTransaction(const vector<pair<CScript, CAmount> >& vecSend,
                     txNew.vin.push_back(CTxIn(coin.first->GetHash(),coin.second));
 
                 // Sign
-                int nIn = 0;
+                std::vector<CScript> vFromPubKeys;
+                vFromPubKeys.reserve(setCoins.size());
                 BOOST_FOREACH(const PAIRTYPE(const CWalletTx*,unsigned int)& coin, setCoins)
-                    if (!SignSignature(*this, *coin.first, txNew, nIn++))
-                    {
-                        strFailReason = _("Signing transaction failed");
-                        return false;
-                    }
+                    vFromPubKeys.push_back(coin.first->vout[coin.second].scriptPubKey);
+                if (!SignSignatures(*this, vFromPubKeys, txNew, SIGHASH_ALL, GetWalletThreads()))
+                {
+                    strFailReason = _("Signing transaction failed");
+                    return false;
+                }
 
                 // Embed the constructed transaction data in wtxNew.
                 *static_cast<CTransaction*>(&wtxNew) = CTransaction(txNew);
@@ -1697,6 +1856,12 @@ bool CWallet::SetAddressBook(const CTxDestination& address, const string& strNam
                              strPurpose, (fUpdated ? CT_UPDATED : CT_NEW) );
     if (!fFileBacked)
         return false;
+    if (pwalletdbBatch)
+    {
+        if (!strPurpose.empty() && !pwalletdbBatch->WritePurpose(CBitcoinAddress(address).ToString(), strPurpose))
+            return false;
+        return pwalletdbBatch->WriteName(CBitcoinAddress(address).ToString(), strName);
+    }
     if (!strPurpose.empty() && !CWalletDB(strWalletFile).WritePurpose(CBitcoinAddress(address).ToString(), strPurpose))
         return false;
     return CWalletDB(strWalletFile).WriteName(CBitcoinAddress(address).ToString(), strName);
@@ -1746,9 +1911,12 @@ bool CWallet::NewKeyPool()
 {
     {
         LOCK(cs_wallet);
-        CWalletDB walletdb(strWalletFile);
+        CWalletDBBatch batch(this);
         BOOST_FOREACH(int64_t nIndex, setKeyPool)
-            walletdb.ErasePool(nIndex);
+        {
+            batch.GetDB().ErasePool(nIndex);
+            batch.Next();
+        }
         setKeyPool.clear();
 
         if (IsLocked())
@@ -1758,8 +1926,9 @@ bool CWallet::NewKeyPool()
         for (int i = 0; i < nKeys; i++)
         {
             int64_t nIndex = i+1;
-            walletdb.WritePool(nIndex, CKeyPool(GenerateNewKey()));
+            batch.GetDB().WritePool(nIndex, CKeyPool(GenerateNewKey()));
             setKeyPool.insert(nIndex);
+            batch.Next();
         }
         LogPrintf("CWallet::NewKeyPool wrote %d new keys\n", nKeys);
     }
@@ -1774,7 +1943,7 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
         if (IsLocked())
             return false;
 
-        CWalletDB walletdb(strWalletFile);
+        CWalletDBBatch batch(this);
 
         // Top up key pool
         unsigned int nTargetSize;
@@ -1788,10 +1957,11 @@ bool CWallet::TopUpKeyPool(unsigned int kpSize)
             int64_t nEnd = 1;
             if (!setKeyPool.empty())
                 nEnd = *(--setKeyPool.end()) + 1;
-            if (!walletdb.WritePool(nEnd, CKeyPool(GenerateNewKey())))
+            if (!batch.GetDB().WritePool(nEnd, CKeyPool(GenerateNewKey())))
                 throw runtime_error("TopUpKeyPool() : writing generated key failed");
             setKeyPool.insert(nEnd);
             LogPrintf("keypool added key %d, size=%u\n", nEnd, setKeyPool.size());
+            batch.Next();
         }
     }
     return true;
@@ -2022,6 +2192,52 @@ set<CTxDestination> CWallet::GetAccountAddresses(string strAccount) const
     return result;
 }
 
+CWalletDBBatch::CWalletDBBatch(CWallet* pwalletIn) : pwallet(pwalletIn), pwalletdb(NULL), fOwner(false), nItems(0)
+{
+    AssertLockHeld(pwallet->cs_wallet);
+    if (pwallet->pwalletdbBatch)
+    {
+        pwalletdb = pwallet->pwalletdbBatch;
+        return;
+    }
+
+    fOwner = true;
+    pwalletdb = new CWalletDB(pwallet->strWalletFile);
+    if (!pwallet->fFileBacked)
+        return;
+    // Without a transaction, the writes still share one open database
+    if (!pwalletdb->TxnBegin())
+        LogPrintf("%s: unable to begin wallet database transaction\n", __func__);
+    pwallet->pwalletdbBatch = pwalletdb;
+}
+
+CWalletDBBatch::~CWalletDBBatch()
+{
+    if (!fOwner)
+        return;
+    if (pwallet->pwalletdbBatch == pwalletdb)
+    {
+        pwallet->pwalletdbBatch = NULL;
+        // The writes are already reflected in memory, so commit even when unwinding
+        if (!pwalletdb->TxnCommit() && pwallet->fFileBacked)
+            LogPrintf("%s: unable to commit wallet database transaction\n", __func__);
+    }
+    delete pwalletdb;
+}
+
+void CWalletDBBatch::Next()
+{
+    if (!fOwner || ++nItems < WALLET_BATCH_SIZE)
+        return;
+    nItems = 0;
+    if (!pwallet->fFileBacked)
+        return;
+    if (!pwalletdb->TxnCommit())
+        LogPrintf("%s: unable to commit wallet database transaction\n", __func__);
+    if (!pwalletdb->TxnBegin())
+        LogPrintf("%s: unable to begin wallet database transaction\n", __func__);
+}
+
 bool CReserveKey::GetReservedKey(CPubKey& pubkey)
 {
     if (nIndex == -1)
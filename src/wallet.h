@@ -7,6 +7,7 @@
 #define BITCOIN_WALLET_H
 
 #include "amount.h"
+#include "coinselection.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
 #include "crypter.h"
@@ -16,6 +17,7 @@
 #include "ui_interface.h"
 #include "wallet_ismine.h"
 #include "walletdb.h"
+#include "walletscan.h"
 
 #include <algorithm>
 #include <map>
@@ -34,6 +36,8 @@ extern CAmount maxTxFee;
 extern unsigned int nTxConfirmTarget;
 extern bool bSpendZeroConfChange;
 extern bool fSendFreeTransactions;
+extern int nRescanThreads;
+extern int nWalletThreads;
 extern bool fPayAtLeastCustomFee;
 
 extern CAmount nMinimumInputThreshold;
@@ -48,6 +52,15 @@ static const CAmount DEFAULT_TRANSACTION_MAXFEE = 0.1 * COIN;
 static const CAmount nHighTransactionMaxFeeWarning = 100 * nHighTransactionFeeWarning;
 //! Largest (in bytes) free transaction we're willing to create
 static const unsigned int MAX_FREE_TRANSACTION_CREATE_SIZE = 5000;
+//! Number of keys, transactions or other items whose writes a CWalletDBBatch commits together
+static const unsigned int WALLET_BATCH_SIZE = 1000;
+//! -walletthreads default (0 = one per core)
+static const int DEFAULT_WALLET_THREADS = 0;
+//! Maximum number of threads decoding wallet records at load, checking and encrypting keys, or signing
+static const int MAX_WALLET_THREADS = 16;
+
+//! Number of threads to use for the wallet's CPU bound work, from -walletthreads
+int GetWalletThreads();
 
 class CAccountingEntry;
 class CCoinControl;
@@ -105,6 +118,19 @@ public:
     StringMap destdata;
 };
 
+/** The balances of a wallet, as shown by getinfo and the GUI. */
+struct CWalletBalances
+{
+    CAmount nBalance;
+    CAmount nUnconfirmed;
+    CAmount nImmature;
+    CAmount nWatchOnly;
+    CAmount nUnconfirmedWatchOnly;
+    CAmount nImmatureWatchOnly;
+
+    CWalletBalances() : nBalance(0), nUnconfirmed(0), nImmature(0), nWatchOnly(0), nUnconfirmedWatchOnly(0), nImmatureWatchOnly(0) {}
+};
+
 /** 
  * A CWallet is an extension of a keystore, which also maintains a set of transactions and balances,
  * and provides the ability to create new transactions.
@@ -112,7 +138,11 @@ public:
 class CWallet : public CCryptoKeyStore, public CValidationInterface
 {
 private:
-    bool SelectCoins(const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl *coinControl = NULL) const;
+    //! Coins indexed for selection, by the (nConfMine, nConfTheirs) they were filtered with
+    typedef std::map<std::pair<int, int>, CCoinSelectionPool> CoinPoolMap;
+    const CCoinSelectionPool& GetCoinPool(const std::vector<COutput>& vCoins, int nConfMine, int nConfTheirs, CoinPoolMap& mapPools) const;
+    bool SelectCoins(const std::vector<COutput>& vAvailableCoins, CoinPoolMap& mapPools, const CAmount& nTargetValue,
+                     std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl *coinControl = NULL) const;
 
     CWalletDB *pwalletdbEncryption;
 
@@ -137,6 +167,59 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    /**
+     * Transactions with an output of ours that no transaction in the active
+     * chain spends. Every transaction that can contribute to a balance or to
+     * AvailableCoins is in here, so those only have to look at our unspent
+     * coins instead of the whole wallet history. Entries are re-checked
+     * lazily: AddToWallet and EraseFromWallet queue the transactions whose
+     * state may have changed in setUnspentTxsPending, and MarkDirty drops the
+     * set to be rebuilt. All protected by cs_wallet.
+     */
+    mutable std::set<uint256> setUnspentTxs;
+    mutable std::set<uint256> setUnspentTxsPending;
+    mutable bool fUnspentTxsValid;
+    //! Bumped on every change to the wallet's transactions
+    unsigned int nWalletTxGeneration;
+
+    //! Balances from the last GetBalances() call, and what they were computed against
+    mutable CWalletBalances cachedBalances;
+    mutable bool fBalancesCached;
+    mutable const CBlockIndex* pindexBalances;
+    mutable unsigned int nBalancesMempoolUpdated;
+    mutable unsigned int nBalancesGeneration;
+
+    bool IsSpentInChain(const COutPoint& outpoint) const;
+    bool MayHaveUnspentOutput(const CWalletTx& wtx) const;
+    void InvalidateUnspentTxs();
+    void UpdateUnspentTxs() const;
+
+    /**
+     * Transactions that may not be in a block of the active chain, with the
+     * time after which a new block makes them due to be rebroadcast, and the
+     * same ordered by that time. Resending only looks at the front of
+     * setResendQueue, and reaccepting at these transactions alone. Kept up to
+     * date like setUnspentTxs: AddToWallet queues the transaction it changed
+     * in setUnconfirmedTxsPending, and loading or erasing transactions has
+     * the index rebuilt. All protected by cs_wallet.
+     */
+    std::map<uint256, int64_t> mapUnconfirmedTxs;
+    std::set<std::pair<int64_t, uint256> > setResendQueue;
+    std::set<uint256> setUnconfirmedTxsPending;
+    bool fUnconfirmedTxsValid;
+
+    void InvalidateUnconfirmedTxs();
+    void UpdateUnconfirmedTx(const uint256& hash);
+    void UpdateUnconfirmedTxs();
+
+    /**
+     * What the wallet's keys, redeem scripts and watch-only scripts can be
+     * paid to, kept in step with the keystore and protected by cs_KeyStore.
+     * Most outputs the wallet is asked about aren't ours, and this tells so
+     * with a hash lookup instead of solving their script.
+     */
+    CWalletScanFilter filterMine;
+
 public:
     /*
      * Main wallet lock.
@@ -153,6 +236,9 @@ public:
     std::set<int64_t> setKeyPool;
     std::map<CKeyID, CKeyMetadata> mapKeyMetadata;
 
+    //! Handle of the CWalletDBBatch in progress, which all writes go through while it exists
+    CWalletDB *pwalletdbBatch;
+
     typedef std::map<unsigned int, CMasterKey> MasterKeyMap;
     MasterKeyMap mapMasterKeys;
     unsigned int nMasterKeyMaxID;
@@ -183,10 +269,18 @@ public:
         fFileBacked = false;
         nMasterKeyMaxID = 0;
         pwalletdbEncryption = NULL;
+        pwalletdbBatch = NULL;
         nOrderPosNext = 0;
         nNextResend = 0;
         nLastResend = 0;
         nTimeFirstKey = 0;
+        fUnspentTxsValid = false;
+        fUnconfirmedTxsValid = false;
+        nWalletTxGeneration = 0;
+        fBalancesCached = false;
+        pindexBalances = NULL;
+        nBalancesMempoolUpdated = 0;
+        nBalancesGeneration = 0;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
@@ -208,7 +302,7 @@ public:
     bool CanSupportFeature(enum WalletFeature wf) { AssertLockHeld(cs_wallet); return nWalletMaxVersion >= wf; }
 
     void AvailableCoins(std::vector<COutput>& vCoins, bool fOnlyConfirmed=true, const CCoinControl *coinControl = NULL) const;
-    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, std::vector<COutput> vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
+    bool SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int nConfTheirs, const std::vector<COutput>& vCoins, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet) const;
 
     bool IsSpent(const uint256& hash, unsigned int n) const;
 
@@ -226,7 +320,7 @@ public:
     //! Adds a key to the store, and saves it to disk.
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
     //! Adds a key to the store, without saving it to disk (used by LoadWallet)
-    bool LoadKey(const CKey& key, const CPubKey &pubkey) { return CCryptoKeyStore::AddKeyPubKey(key, pubkey); }
+    bool LoadKey(const CKey& key, const CPubKey &pubkey);
     //! Load metadata (used by LoadWallet)
     bool LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &metadata);
 
@@ -284,6 +378,14 @@ public:
     int ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate = false);
     void ReacceptWalletTransactions();
     void ResendWalletTransactions();
+    /**
+     * The transactions not in a block yet that are due to be rebroadcast, now
+     * that the best block was received at nTimeBestBlock, oldest first. They
+     * are due again once a block is received after nTimeNow.
+     */
+    std::vector<CWalletTx*> GetTxsToResend(int64_t nTimeBestBlock, int64_t nTimeNow);
+    /** All six balances below, computed in one pass over the unspent coins and cached until something changes. */
+    CWalletBalances GetBalances() const;
     CAmount GetBalance() const;
     CAmount GetUnconfirmedBalance() const;
     CAmount GetImmatureBalance() const;
@@ -317,6 +419,11 @@ public:
     CAmount GetDebit(const CTxIn& txin, const isminefilter& filter) const;
     isminetype IsMine(const CTxOut& txout) const
     {
+        {
+            LOCK(cs_KeyStore);
+            if (!filterMine.IsRelevant(txout))
+                return ISMINE_NO;
+        }
         return ::IsMine(*this, txout.scriptPubKey);
     }
     CAmount GetCredit(const CTxOut& txout, const isminefilter& filter) const
@@ -441,6 +548,39 @@ public:
     boost::signals2::signal<void (bool fHaveWatchOnly)> NotifyWatchonlyChanged;
 };
 
+/**
+ * Groups the database writes of a bulk wallet operation (refilling the key
+ * pool, a rescan, an import) into a few database transactions, instead of
+ * opening the database and committing a transaction for every record.
+ * cs_wallet must be held for as long as the batch exists, so that no other
+ * thread writes to the wallet in between. A batch started while another is
+ * in progress just adds to that one.
+ */
+class CWalletDBBatch
+{
+private:
+    CWallet* pwallet;
+    CWalletDB* pwalletdb;
+    //! False for a batch nested in another
+    bool fOwner;
+    unsigned int nItems;
+
+    CWalletDBBatch(const CWalletDBBatch&);
+    CWalletDBBatch& operator=(const CWalletDBBatch&);
+
+public:
+    CWalletDBBatch(CWallet* pwalletIn);
+    ~CWalletDBBatch();
+
+    CWalletDB& GetDB() { return *pwalletdb; }
+
+    /**
+     * Count one item of the operation. Every WALLET_BATCH_SIZE items the
+     * writes so far are committed, so no transaction grows without bound.
+     */
+    void Next();
+};
+
 /** A key allocated from the key pool. */
 class CReserveKey
 {
@@ -12,6 +12,7 @@
 #include "util.h"
 #include "utiltime.h"
 #include "wallet.h"
+#include "walletlog.h"
 
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
@@ -209,7 +210,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
 {
     bool fAllAccounts = (strAccount == "*");
 
-    Dbc* pcursor = GetCursor();
+    CDBCursor* pcursor = GetCursor();
     if (!pcursor)
         throw runtime_error("CWalletDB::ListAccountCreditDebit() : cannot create DB cursor");
     unsigned int fFlags = DB_SET_RANGE;
@@ -226,7 +227,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
             break;
         else if (ret != 0)
         {
-            pcursor->close();
+            delete pcursor;
             throw runtime_error("CWalletDB::ListAccountCreditDebit() : error scanning DB");
         }
 
@@ -245,7 +246,7 @@ void CWalletDB::ListAccountCreditDebit(const string& strAccount, list<CAccountin
         entries.push_back(acentry);
     }
 
-    pcursor->close();
+    delete pcursor;
 }
 
 DBErrors CWalletDB::ReorderTransactions(CWallet* pwallet)
@@ -342,36 +343,54 @@ public:
     }
 };
 
-bool
-ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
-             CWalletScanState &wss, string& strType, string& strErr)
+/** A wallet record as read from the database, and what could be decoded from it ahead of loading it into the wallet */
+class CWalletRecord {
+public:
+    CDataStream ssKey;
+    CDataStream ssValue;
+    string strType;
+    string strErr;
+    //! Whether DecodeKeyValue has run on the record
+    bool fDecoded;
+    bool fDecodeOK;
+    //! For "key" and "wkey": the checked key pair
+    CPubKey vchPubKey;
+    CKey key;
+    //! For "tx": the checked transaction, and whether it was repaired
+    CWalletTx wtx;
+    bool fUpgraded;
+
+    CWalletRecord() : ssKey(SER_DISK, CLIENT_VERSION), ssValue(SER_DISK, CLIENT_VERSION) {
+        fDecoded = false;
+        fDecodeOK = true;
+        fUpgraded = false;
+    }
+};
+
+/**
+ * Unserialize the record type, and decode and check keys and transactions,
+ * which is most of the work of loading a wallet. Touches nothing but the
+ * record, and doesn't throw, so records can be decoded on any thread.
+ */
+static void DecodeKeyValue(CWalletRecord& rec)
 {
+    rec.fDecoded = true;
     try {
-        // Unserialize
-        // Taking advantage of the fact that pair serialization
-        // is just the two items serialized one after the other
-        ssKey >> strType;
-        if (strType == "name")
-        {
-            string strAddress;
-            ssKey >> strAddress;
-            ssValue >> pwallet->mapAddressBook[CBitcoinAddress(strAddress).Get()].name;
-        }
-        else if (strType == "purpose")
-        {
-            string strAddress;
-            ssKey >> strAddress;
-            ssValue >> pwallet->mapAddressBook[CBitcoinAddress(strAddress).Get()].purpose;
-        }
-        else if (strType == "tx")
+        CDataStream& ssKey = rec.ssKey;
+        CDataStream& ssValue = rec.ssValue;
+        ssKey >> rec.strType;
+        if (rec.strType == "tx")
         {
             uint256 hash;
             ssKey >> hash;
-            CWalletTx wtx;
+            CWalletTx& wtx = rec.wtx;
             ssValue >> wtx;
             CValidationState state;
             if (!(CheckTransaction(wtx, state) && (wtx.GetHash() == hash) && state.IsValid()))
-                return false;
+            {
+                rec.fDecodeOK = false;
+                return;
+            }
 
             // Undo serialize changes in 31600
             if (31404 <= wtx.fTimeReceivedIsTxTime && wtx.fTimeReceivedIsTxTime <= 31703)
@@ -381,69 +400,33 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
                     char fTmp;
                     char fUnused;
                     ssValue >> fTmp >> fUnused >> wtx.strFromAccount;
-                    strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
-                                       wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
+                    rec.strErr = strprintf("LoadWallet() upgrading tx ver=%d %d '%s' %s",
+                                           wtx.fTimeReceivedIsTxTime, fTmp, wtx.strFromAccount, hash.ToString());
                     wtx.fTimeReceivedIsTxTime = fTmp;
                 }
                 else
                 {
-                    strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
+                    rec.strErr = strprintf("LoadWallet() repairing tx ver=%d %s", wtx.fTimeReceivedIsTxTime, hash.ToString());
                     wtx.fTimeReceivedIsTxTime = 0;
                 }
-                wss.vWalletUpgrade.push_back(hash);
+                rec.fUpgraded = true;
             }
-
-            if (wtx.nOrderPos == -1)
-                wss.fAnyUnordered = true;
-
-            pwallet->AddToWallet(wtx, true);
         }
-        else if (strType == "acentry")
+        else if (rec.strType == "key" || rec.strType == "wkey")
         {
-            string strAccount;
-            ssKey >> strAccount;
-            uint64_t nNumber;
-            ssKey >> nNumber;
-            if (nNumber > nAccountingEntryNumber)
-                nAccountingEntryNumber = nNumber;
-
-            if (!wss.fAnyUnordered)
-            {
-                CAccountingEntry acentry;
-                ssValue >> acentry;
-                if (acentry.nOrderPos == -1)
-                    wss.fAnyUnordered = true;
-            }
-        }
-        else if (strType == "watchs")
-        {
-            CScript script;
-            ssKey >> script;
-            char fYes;
-            ssValue >> fYes;
-            if (fYes == '1')
-                pwallet->LoadWatchOnly(script);
-
-            // Watch-only addresses have no birthday information for now,
-            // so set the wallet birthday to the beginning of time.
-            pwallet->nTimeFirstKey = 1;
-        }
-        else if (strType == "key" || strType == "wkey")
-        {
-            CPubKey vchPubKey;
+            CPubKey& vchPubKey = rec.vchPubKey;
             ssKey >> vchPubKey;
             if (!vchPubKey.IsValid())
             {
-                strErr = "Error reading wallet database: CPubKey corrupt";
-                return false;
+                rec.strErr = "Error reading wallet database: CPubKey corrupt";
+                rec.fDecodeOK = false;
+                return;
             }
-            CKey key;
             CPrivKey pkey;
             uint256 hash = 0;
 
-            if (strType == "key")
+            if (rec.strType == "key")
             {
-                wss.nKeys++;
                 ssValue >> pkey;
             } else {
                 CWalletKey wkey;
@@ -474,19 +457,106 @@ ReadKeyValue(CWallet* pwallet, CDataStream& ssKey, CDataStream& ssValue,
 
                 if (Hash(vchKey.begin(), vchKey.end()) != hash)
                 {
-                    strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
-                    return false;
+                    rec.strErr = "Error reading wallet database: CPubKey/CPrivKey corrupt";
+                    rec.fDecodeOK = false;
+                    return;
                 }
 
                 fSkipCheck = true;
             }
 
-            if (!key.Load(pkey, vchPubKey, fSkipCheck))
+            if (!rec.key.Load(pkey, vchPubKey, fSkipCheck))
             {
-                strErr = "Error reading wallet database: CPrivKey corrupt";
-                return false;
+                rec.strErr = "Error reading wallet database: CPrivKey corrupt";
+                rec.fDecodeOK = false;
+                return;
+            }
+        }
+    } catch (...)
+    {
+        rec.fDecodeOK = false;
+    }
+}
+
+static void DecodeKeyValueAt(vector<CWalletRecord>* pvRecords, size_t i)
+{
+    DecodeKeyValue((*pvRecords)[i]);
+}
+
+/** Load a record into the wallet, decoding it first unless that was done already */
+bool
+ReadKeyValue(CWallet* pwallet, CWalletRecord& rec, CWalletScanState &wss)
+{
+    if (!rec.fDecoded)
+        DecodeKeyValue(rec);
+    if (!rec.fDecodeOK)
+        return false;
+
+    CDataStream& ssKey = rec.ssKey;
+    CDataStream& ssValue = rec.ssValue;
+    const string& strType = rec.strType;
+    string& strErr = rec.strErr;
+    try {
+        // Taking advantage of the fact that pair serialization
+        // is just the two items serialized one after the other,
+        // the type was unserialized from ssKey by DecodeKeyValue
+        if (strType == "name")
+        {
+            string strAddress;
+            ssKey >> strAddress;
+            ssValue >> pwallet->mapAddressBook[CBitcoinAddress(strAddress).Get()].name;
+        }
+        else if (strType == "purpose")
+        {
+            string strAddress;
+            ssKey >> strAddress;
+            ssValue >> pwallet->mapAddressBook[CBitcoinAddress(strAddress).Get()].purpose;
+        }
+        else if (strType == "tx")
+        {
+            if (rec.fUpgraded)
+                wss.vWalletUpgrade.push_back(rec.wtx.GetHash());
+
+            if (rec.wtx.nOrderPos == -1)
+                wss.fAnyUnordered = true;
+
+            pwallet->AddToWallet(rec.wtx, true);
+        }
+        else if (strType == "acentry")
+        {
+            string strAccount;
+            ssKey >> strAccount;
+            uint64_t nNumber;
+            ssKey >> nNumber;
+            if (nNumber > nAccountingEntryNumber)
+                nAccountingEntryNumber = nNumber;
+
+            if (!wss.fAnyUnordered)
+            {
+                CAccountingEntry acentry;
+                ssValue >> acentry;
+                if (acentry.nOrderPos == -1)
+                    wss.fAnyUnordered = true;
             }
-            if (!pwallet->LoadKey(key, vchPubKey))
+        }
+        else if (strType == "watchs")
+        {
+            CScript script;
+            ssKey >> script;
+            char fYes;
+            ssValue >> fYes;
+            if (fYes == '1')
+                pwallet->LoadWatchOnly(script);
+
+            // Watch-only addresses have no birthday information for now,
+            // so set the wallet birthday to the beginning of time.
+            pwallet->nTimeFirstKey = 1;
+        }
+        else if (strType == "key" || strType == "wkey")
+        {
+            if (strType == "key")
+                wss.nKeys++;
+            if (!pwallet->LoadKey(rec.key, rec.vchPubKey))
             {
                 strErr = "Error reading wallet database: LoadKey failed";
                 return false;
@@ -610,6 +680,13 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
     bool fNoncriticalErrors = false;
     DBErrors result = DB_LOAD_OK;
 
+    // Only the records before the damage to a corrupt record log were read
+    if (bitdb.IsLogCorrupt(strFile))
+    {
+        LogPrintf("%s is corrupt; run with -salvagewallet to recover the records after the damage\n", strFile);
+        return DB_CORRUPT;
+    }
+
     try {
         LOCK(pwallet->cs_wallet);
         int nMinVersion = 0;
@@ -621,48 +698,67 @@ DBErrors CWalletDB::LoadWallet(CWallet* pwallet)
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             LogPrintf("Error getting wallet database cursor\n");
             return DB_CORRUPT;
         }
 
-        while (true)
+        // Records are read in chunks. The keys and transactions of a chunk
+        // are decoded and checked on several threads, then all its records
+        // are loaded into the wallet in the order they were read.
+        int nThreads = GetWalletThreads();
+        vector<CWalletRecord> vRecords;
+        vRecords.reserve(WALLET_LOAD_CHUNK_SIZE);
+        bool fDone = false;
+        while (!fDone)
         {
-            // Read next record
-            CDataStream ssKey(SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(SER_DISK, CLIENT_VERSION);
-            int ret = ReadAtCursor(pcursor, ssKey, ssValue);
-            if (ret == DB_NOTFOUND)
-                break;
-            else if (ret != 0)
+            // Read next records
+            vRecords.clear();
+            while (vRecords.size() < WALLET_LOAD_CHUNK_SIZE)
             {
-                LogPrintf("Error reading next record from wallet database\n");
-                return DB_CORRUPT;
+                vRecords.push_back(CWalletRecord());
+                CWalletRecord& rec = vRecords.back();
+                int ret = ReadAtCursor(pcursor, rec.ssKey, rec.ssValue);
+                if (ret == DB_NOTFOUND)
+                {
+                    vRecords.pop_back();
+                    fDone = true;
+                    break;
+                }
+                else if (ret != 0)
+                {
+                    LogPrintf("Error reading next record from wallet database\n");
+                    return DB_CORRUPT;
+                }
             }
 
-            // Try to be tolerant of single corrupt records:
-            string strType, strErr;
-            if (!ReadKeyValue(pwallet, ssKey, ssValue, wss, strType, strErr))
+            ParallelFor(vRecords.size(), nThreads, boost::bind(&DecodeKeyValueAt, &vRecords, _1));
+
+            BOOST_FOREACH(CWalletRecord& rec, vRecords)
             {
-                // losing keys is considered a catastrophic error, anything else
-                // we assume the user can live with:
-                if (IsKeyType(strType))
-                    result = DB_CORRUPT;
-                else
+                // Try to be tolerant of single corrupt records:
+                if (!ReadKeyValue(pwallet, rec, wss))
                 {
-                    // Leave other errors alone, if we try to fix them we might make things worse.
-                    fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
-                    if (strType == "tx")
-                        // Rescan if there is a bad transaction record:
-                        SoftSetBoolArg("-rescan", true);
+                    // losing keys is considered a catastrophic error, anything else
+                    // we assume the user can live with:
+                    if (IsKeyType(rec.strType))
+                        result = DB_CORRUPT;
+                    else
+                    {
+                        // Leave other errors alone, if we try to fix them we might make things worse.
+                        fNoncriticalErrors = true; // ... but do warn the user there is something wrong.
+                        if (rec.strType == "tx")
+                            // Rescan if there is a bad transaction record:
+                            SoftSetBoolArg("-rescan", true);
+                    }
                 }
+                if (!rec.strErr.empty())
+                    LogPrintf("%s\n", rec.strErr);
             }
-            if (!strErr.empty())
-                LogPrintf("%s\n", strErr);
         }
-        pcursor->close();
+        delete pcursor;
     }
     catch (boost::thread_interrupted) {
         throw;
@@ -721,7 +817,7 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, vector<uint256>& vTxHash, vec
         }
 
         // Get cursor
-        Dbc* pcursor = GetCursor();
+        CDBCursor* pcursor = GetCursor();
         if (!pcursor)
         {
             LogPrintf("Error getting wallet database cursor\n");
@@ -755,7 +851,7 @@ DBErrors CWalletDB::FindWalletTx(CWallet* pwallet, vector<uint256>& vTxHash, vec
                 vWtx.push_back(wtx);
             }
         }
-        pcursor->close();
+        delete pcursor;
     }
     catch (boost::thread_interrupted) {
         throw;
@@ -892,8 +988,52 @@ bool BackupWallet(const CWallet& wallet, const string& strDest)
 //
 // Try to (very carefully!) recover wallet.dat if there is a problem.
 //
+/**
+ * Recover the record log filename: save a copy of it, then replay it
+ * skipping its bad entries, and rewrite it with the records found.
+ */
+static bool RecoverLog(CDBEnv& dbenv, const std::string& filename, bool fOnlyKeys)
+{
+    boost::filesystem::path pathBackup = GetDataDir() / strprintf("wallet.%d.bak", GetTime());
+    try {
+        boost::filesystem::copy_file(GetDataDir() / filename, pathBackup);
+    } catch (const boost::filesystem::filesystem_error& e) {
+        LogPrintf("Failed to copy %s to %s - %s\n", filename, pathBackup.string(), e.what());
+        return false;
+    }
+    LogPrintf("Copied %s to %s\n", filename, pathBackup.string());
+
+    CWalletLog* plog = dbenv.SalvageLog(filename);
+    if (!plog)
+        return false;
+    LogPrintf("Salvage found %u records\n", plog->size());
+    if (!fOnlyKeys)
+        return true;
+
+    CWallet dummyWallet;
+    CWalletScanState wss;
+    std::vector<CWalletLogOp> vErase;
+    CSerializeData key, value;
+    for (bool fFirst = true; plog->ReadNext(key, fFirst, key, value); fFirst = false)
+    {
+        CWalletRecord rec;
+        rec.ssKey = CDataStream(key, SER_DISK, CLIENT_VERSION);
+        rec.ssValue = CDataStream(value, SER_DISK, CLIENT_VERSION);
+        bool fReadOK = ReadKeyValue(&dummyWallet, rec, wss);
+        if (IsKeyType(rec.strType) && fReadOK)
+            continue;
+        if (IsKeyType(rec.strType))
+            LogPrintf("WARNING: CWalletDB::Recover skipping %s: %s\n", rec.strType, rec.strErr);
+        vErase.push_back(CWalletLogOp(key));
+    }
+    return plog->Write(vErase) && plog->Compact();
+}
+
 bool CWalletDB::Recover(CDBEnv& dbenv, std::string filename, bool fOnlyKeys)
 {
+    if (dbenv.IsLog(filename, false))
+        return RecoverLog(dbenv, filename, fOnlyKeys);
+
     // Recovery procedure:
     // move wallet.dat to wallet.timestamp.bak
     // Call Salvage with fAggressive=true to
@@ -944,16 +1084,15 @@ bool CWalletDB::Recover(CDBEnv& dbenv, std::string filename, bool fOnlyKeys)
     {
         if (fOnlyKeys)
         {
-            CDataStream ssKey(row.first, SER_DISK, CLIENT_VERSION);
-            CDataStream ssValue(row.second, SER_DISK, CLIENT_VERSION);
-            string strType, strErr;
-            bool fReadOK = ReadKeyValue(&dummyWallet, ssKey, ssValue,
-                                        wss, strType, strErr);
-            if (!IsKeyType(strType))
+            CWalletRecord rec;
+            rec.ssKey = CDataStream(row.first, SER_DISK, CLIENT_VERSION);
+            rec.ssValue = CDataStream(row.second, SER_DISK, CLIENT_VERSION);
+            bool fReadOK = ReadKeyValue(&dummyWallet, rec, wss);
+            if (!IsKeyType(rec.strType))
                 continue;
             if (!fReadOK)
             {
-                LogPrintf("WARNING: CWalletDB::Recover skipping %s: %s\n", strType, strErr);
+                LogPrintf("WARNING: CWalletDB::Recover skipping %s: %s\n", rec.strType, rec.strErr);
                 continue;
             }
         }
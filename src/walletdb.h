@@ -17,6 +17,9 @@
 #include <utility>
 #include <vector>
 
+//! Number of wallet records read ahead and decoded together when loading a wallet
+static const unsigned int WALLET_LOAD_CHUNK_SIZE = 10000;
+
 class CAccount;
 class CAccountingEntry;
 struct CBlockLocator;
@@ -0,0 +1,463 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "walletlog.h"
+
+#include "blockfilemap.h"
+#include "clientversion.h"
+#include "hash.h"
+#include "streams.h"
+#include "util.h"
+#include "utiltime.h"
+
+#include <limits>
+
+#include <boost/filesystem.hpp>
+#include <boost/foreach.hpp>
+#include <boost/scoped_ptr.hpp>
+
+using namespace std;
+
+namespace {
+
+//! Start of every record log file, followed by the format version
+const unsigned char pchLogMagic[8] = { 0x8a, 'w', 'l', 'o', 'g', 0x0d, 0x0a, 0x1a };
+
+//! What a record adds to the file when compaction writes it out
+uint64_t RecordSize(const CSerializeData& key, const CSerializeData& value)
+{
+    return 1 + ::GetSerializeSize(key, SER_DISK, CLIENT_VERSION) + ::GetSerializeSize(value, SER_DISK, CLIENT_VERSION);
+}
+
+bool WriteHeader(FILE* file, uint64_t& nSize)
+{
+    CDataStream ssHeader(SER_DISK, CLIENT_VERSION);
+    ssHeader.write((const char*)pchLogMagic, sizeof(pchLogMagic));
+    ssHeader << WALLETLOG_VERSION;
+    if (fwrite(&ssHeader[0], 1, ssHeader.size(), file) != ssHeader.size() || fflush(file) != 0)
+        return false;
+    nSize = ssHeader.size();
+    return true;
+}
+
+/**
+ * Append an entry of vOps: its size, the operations, and their hash. On
+ * failure the file is cut back to nSize, so it never ends in a torn entry
+ * that the next one would be appended after.
+ */
+bool AppendEntry(FILE* file, const vector<CWalletLogOp>& vOps, uint64_t& nSize)
+{
+    CDataStream ssEntry(SER_DISK, CLIENT_VERSION);
+    ssEntry << vOps;
+    uint256 hash = Hash(ssEntry.begin(), ssEntry.end());
+
+    CDataStream ssRecord(SER_DISK, CLIENT_VERSION);
+    ssRecord.reserve(ssEntry.size() + 4 + sizeof(hash));
+    ssRecord << (uint32_t)ssEntry.size();
+    ssRecord.write(&ssEntry[0], ssEntry.size());
+    ssRecord << hash;
+    if (fwrite(&ssRecord[0], 1, ssRecord.size(), file) != ssRecord.size() || fflush(file) != 0)
+    {
+        TruncateFile(file, nSize);
+        fseek(file, nSize, SEEK_SET);
+        return false;
+    }
+    nSize += ssRecord.size();
+    return true;
+}
+
+bool ReadBytes(FILE* file, CSerializeData& vch, size_t nSize)
+{
+    vch.resize(nSize);
+    return nSize == 0 || fread(&vch[0], 1, nSize, file) == nSize;
+}
+
+/**
+ * Read the entry at nPos of the nDataSize bytes at pdata into vOps, and set
+ * nSize to the bytes it takes. Returns false if there is no whole, intact
+ * entry there.
+ */
+bool ParseEntry(const char* pdata, size_t nDataSize, size_t nPos, vector<CWalletLogOp>& vOps, size_t& nSize)
+{
+    uint32_t nEntrySize;
+    uint256 hash;
+    if (nDataSize - nPos < sizeof(nEntrySize))
+        return false;
+    CDataStream(pdata + nPos, pdata + nPos + sizeof(nEntrySize), SER_DISK, CLIENT_VERSION) >> nEntrySize;
+    if (nEntrySize > MAX_SIZE || nDataSize - nPos - sizeof(nEntrySize) < (uint64_t)nEntrySize + sizeof(hash))
+        return false;
+
+    const char* pbegin = pdata + nPos + sizeof(nEntrySize);
+    memcpy(hash.begin(), pbegin + nEntrySize, sizeof(hash));
+    if (hash != Hash(pbegin, pbegin + nEntrySize))
+        return false;
+    try {
+        CDataStream(pbegin, pbegin + nEntrySize, SER_DISK, CLIENT_VERSION) >> vOps;
+    } catch (const std::exception&) {
+        return false;
+    }
+    nSize = sizeof(nEntrySize) + nEntrySize + sizeof(hash);
+    return true;
+}
+
+//! Offset of the first intact entry at pdata from nPos on, or nDataSize if there is none
+size_t FindEntry(const char* pdata, size_t nDataSize, size_t nPos)
+{
+    vector<CWalletLogOp> vOps;
+    size_t nSize;
+    for (; nPos < nDataSize; nPos++)
+        if (ParseEntry(pdata, nDataSize, nPos, vOps, nSize))
+            break;
+    return std::min(nPos, nDataSize);
+}
+
+}
+
+CWalletLog::CWalletLog() : file(NULL), nFileSize(0), nLiveSize(0), fCorrupt(false)
+{
+}
+
+CWalletLog::~CWalletLog()
+{
+    Close();
+}
+
+bool CWalletLog::IsLogFile(const boost::filesystem::path& path)
+{
+    FILE* file = fopen(path.string().c_str(), "rb");
+    if (!file)
+        return false;
+    unsigned char pchMagic[sizeof(pchLogMagic)];
+    bool fLog = fread(pchMagic, 1, sizeof(pchMagic), file) == sizeof(pchMagic) &&
+                memcmp(pchMagic, pchLogMagic, sizeof(pchMagic)) == 0;
+    fclose(file);
+    return fLog;
+}
+
+bool CWalletLog::Open(const boost::filesystem::path& pathIn, bool fCreate, bool fSalvage)
+{
+    LOCK(cs);
+    if (file)
+        return error("%s : %s is already open", __func__, path.string());
+
+    path = pathIn;
+    mapRecords.clear();
+    nLiveSize = 0;
+    fCorrupt = false;
+    if (!boost::filesystem::exists(path))
+    {
+        if (!fCreate)
+            return error("%s : %s doesn't exist", __func__, path.string());
+        file = fopen(path.string().c_str(), "wb+");
+        if (!file)
+            return error("%s : can't create %s", __func__, path.string());
+        if (!WriteHeader(file, nFileSize))
+        {
+            Close();
+            return error("%s : can't write to %s", __func__, path.string());
+        }
+        FileCommit(file);
+        return true;
+    }
+
+    file = fopen(path.string().c_str(), "rb+");
+    if (!file)
+        return error("%s : can't open %s", __func__, path.string());
+
+    CSerializeData vchHeader;
+    int nVersion = 0;
+    if (ReadBytes(file, vchHeader, sizeof(pchLogMagic) + sizeof(nVersion)) &&
+        memcmp(&vchHeader[0], pchLogMagic, sizeof(pchLogMagic)) == 0)
+    {
+        CDataStream ssVersion(vchHeader.begin() + sizeof(pchLogMagic), vchHeader.end(), SER_DISK, CLIENT_VERSION);
+        ssVersion >> nVersion;
+    }
+    if (nVersion <= 0 || nVersion > WALLETLOG_VERSION)
+    {
+        Close();
+        return error("%s : %s is not a record log, or one of an unknown version", __func__, path.string());
+    }
+
+    // Replay from a mapping of the file, so that only the live records take
+    // up memory, or from a copy where files cannot be mapped (Windows)
+    int64_t nStart = GetTimeMillis();
+    uint64_t nSizeOnDisk = boost::filesystem::file_size(path);
+    if (nSizeOnDisk < vchHeader.size() || nSizeOnDisk - vchHeader.size() > std::numeric_limits<size_t>::max())
+    {
+        Close();
+        return error("%s : can't read %s", __func__, path.string());
+    }
+    boost::scoped_ptr<CMappedFile> pmapped(CMappedFile::Open(path));
+    CSerializeData vch;
+    const char* pdata;
+    size_t nDataSize = nSizeOnDisk - vchHeader.size();
+    if (pmapped && pmapped->size() == nSizeOnDisk)
+    {
+        pmapped->WillNeed(0, pmapped->size());
+        pdata = pmapped->data() + vchHeader.size();
+    }
+    else
+    {
+        pmapped.reset();
+        if (!ReadBytes(file, vch, nDataSize))
+        {
+            Close();
+            return error("%s : can't read %s", __func__, path.string());
+        }
+        pdata = vch.empty() ? NULL : &vch[0];
+    }
+
+    // A bad entry with no intact one after it is what a crash while
+    // appending leaves, and is dropped. One with intact entries after it
+    // is damage, that only salvaging skips over.
+    unsigned int nEntries = 0;
+    uint64_t nSkipped = 0;
+    size_t nPos = 0;
+    while (nPos < nDataSize)
+    {
+        vector<CWalletLogOp> vOps;
+        size_t nEntrySize;
+        if (ParseEntry(pdata, nDataSize, nPos, vOps, nEntrySize))
+        {
+            BOOST_FOREACH(const CWalletLogOp& op, vOps)
+                Apply(op);
+            nPos += nEntrySize;
+            nEntries++;
+            continue;
+        }
+        size_t nNext = FindEntry(pdata, nDataSize, nPos + 1);
+        if (nNext == nDataSize)
+            break;
+        if (!fSalvage)
+        {
+            fCorrupt = true;
+            LogPrintf("%s : %s has a corrupt entry at offset %u with intact entries after it; run with -salvagewallet to recover them\n",
+                      __func__, path.string(), vchHeader.size() + nPos);
+            break;
+        }
+        LogPrintf("%s : skipping %u bytes of %s at offset %u that are not an intact entry\n",
+                  __func__, nNext - nPos, path.string(), vchHeader.size() + nPos);
+        nSkipped += nNext - nPos;
+        nPos = nNext;
+    }
+    nFileSize = vchHeader.size() + nPos;
+    pmapped.reset();
+    CSerializeData().swap(vch);
+
+    if (!fCorrupt && nSizeOnDisk > nFileSize - nSkipped)
+    {
+        boost::filesystem::path pathBackup = path.string() + strprintf(".%d.bak", GetTime());
+        for (int n = 1; boost::filesystem::exists(pathBackup); n++)
+            pathBackup = path.string() + strprintf(".%d.%d.bak", GetTime(), n);
+        LogPrintf("%s : %s has %u bytes that are not whole entries; dropping them, original saved as %s\n",
+                  __func__, path.string(), nSizeOnDisk - (nFileSize - nSkipped), pathBackup.string());
+        try {
+            boost::filesystem::copy_file(path, pathBackup);
+        } catch (const boost::filesystem::filesystem_error& e) {
+            Close();
+            return error("%s : can't save %s: %s", __func__, pathBackup.string(), e.what());
+        }
+        if (!TruncateFile(file, nFileSize))
+        {
+            Close();
+            return error("%s : can't truncate %s", __func__, path.string());
+        }
+    }
+    fseek(file, nFileSize, SEEK_SET);
+    if (nSkipped && !Compact())
+    {
+        Close();
+        return error("%s : can't rewrite %s without the bytes skipped", __func__, path.string());
+    }
+
+    LogPrint("db", "%s : replayed %u entries of %s, %u records, in %dms\n", __func__, nEntries, path.string(),
+             mapRecords.size(), GetTimeMillis() - nStart);
+    return true;
+}
+
+void CWalletLog::Close()
+{
+    LOCK(cs);
+    if (!file)
+        return;
+    FileCommit(file);
+    fclose(file);
+    file = NULL;
+    mapRecords.clear();
+    nFileSize = 0;
+    nLiveSize = 0;
+    fCorrupt = false;
+}
+
+bool CWalletLog::IsOpen() const
+{
+    LOCK(cs);
+    return file != NULL;
+}
+
+bool CWalletLog::IsCorrupt() const
+{
+    LOCK(cs);
+    return fCorrupt;
+}
+
+void CWalletLog::Apply(const CWalletLogOp& op)
+{
+    RecordMap::iterator it = mapRecords.find(op.key);
+    if (it != mapRecords.end())
+    {
+        nLiveSize -= RecordSize(it->first, it->second);
+        if (op.fErase)
+            mapRecords.erase(it);
+        else
+            it->second = op.value;
+    }
+    else if (!op.fErase)
+        mapRecords.insert(make_pair(op.key, op.value));
+    if (!op.fErase)
+        nLiveSize += RecordSize(op.key, op.value);
+}
+
+bool CWalletLog::Read(const CSerializeData& key, CSerializeData& value) const
+{
+    LOCK(cs);
+    RecordMap::const_iterator it = mapRecords.find(key);
+    if (it == mapRecords.end())
+        return false;
+    value = it->second;
+    return true;
+}
+
+bool CWalletLog::Exists(const CSerializeData& key) const
+{
+    LOCK(cs);
+    return mapRecords.count(key) != 0;
+}
+
+bool CWalletLog::Write(const vector<CWalletLogOp>& vOps, bool fOverwrite)
+{
+    LOCK(cs);
+    if (!file || fCorrupt)
+        return false;
+    if (!fOverwrite) {
+        BOOST_FOREACH(const CWalletLogOp& op, vOps)
+            if (!op.fErase && mapRecords.count(op.key))
+                return false;
+    }
+    if (vOps.empty())
+        return true;
+
+    if (!AppendEntry(file, vOps, nFileSize))
+        return error("%s : can't write to %s", __func__, path.string());
+    BOOST_FOREACH(const CWalletLogOp& op, vOps)
+        Apply(op);
+    return true;
+}
+
+bool CWalletLog::ReadNext(const CSerializeData& key, bool fInclusive, CSerializeData& keyRet, CSerializeData& valueRet) const
+{
+    LOCK(cs);
+    RecordMap::const_iterator it = fInclusive ? mapRecords.lower_bound(key) : mapRecords.upper_bound(key);
+    if (it == mapRecords.end())
+        return false;
+    keyRet = it->first;
+    valueRet = it->second;
+    return true;
+}
+
+bool CWalletLog::Flush()
+{
+    LOCK(cs);
+    if (!file)
+        return false;
+    FileCommit(file);
+    if (fCorrupt)
+        return true;
+
+    uint64_t nWaste = nFileSize - std::min(nFileSize, nLiveSize);
+    if (nWaste >= WALLETLOG_COMPACT_MIN_WASTE && nWaste > nFileSize / 2)
+        return Compact();
+    return true;
+}
+
+bool CWalletLog::Compact(const char* pszSkip)
+{
+    LOCK(cs);
+    // The records of a corrupt log are only those before the damage
+    if (!file || fCorrupt)
+        return false;
+
+    int64_t nStart = GetTimeMillis();
+    boost::filesystem::path pathCompact = path.string() + ".compact";
+    FILE* fileCompact = fopen(pathCompact.string().c_str(), "wb+");
+    if (!fileCompact)
+        return error("%s : can't create %s", __func__, pathCompact.string());
+
+    uint64_t nSize = 0;
+    bool fSuccess = WriteHeader(fileCompact, nSize);
+    vector<CSerializeData> vSkipped;
+    vector<CWalletLogOp> vOps;
+    vOps.reserve(WALLETLOG_COMPACT_BATCH);
+    for (RecordMap::const_iterator it = mapRecords.begin(); fSuccess && it != mapRecords.end(); ++it)
+    {
+        if (pszSkip && !it->first.empty() && strncmp(&it->first[0], pszSkip, std::min(it->first.size(), strlen(pszSkip))) == 0)
+        {
+            vSkipped.push_back(it->first);
+            continue;
+        }
+        vOps.push_back(CWalletLogOp(it->first, it->second));
+        if (vOps.size() == WALLETLOG_COMPACT_BATCH)
+        {
+            fSuccess = AppendEntry(fileCompact, vOps, nSize);
+            vOps.clear();
+        }
+    }
+    if (fSuccess && !vOps.empty())
+        fSuccess = AppendEntry(fileCompact, vOps, nSize);
+    if (fSuccess)
+        FileCommit(fileCompact);
+    fclose(fileCompact);
+    if (!fSuccess)
+    {
+        boost::filesystem::remove(pathCompact);
+        return error("%s : can't write to %s", __func__, pathCompact.string());
+    }
+
+    // The file must be closed to be replaced on Windows
+    FileCommit(file);
+    fclose(file);
+    fSuccess = RenameOver(pathCompact, path);
+    file = fopen(path.string().c_str(), "rb+");
+    if (!file)
+    {
+        mapRecords.clear();
+        return error("%s : can't reopen %s", __func__, path.string());
+    }
+    if (!fSuccess)
+    {
+        fseek(file, nFileSize, SEEK_SET);
+        boost::filesystem::remove(pathCompact);
+        return error("%s : can't replace %s", __func__, path.string());
+    }
+    fseek(file, nSize, SEEK_SET);
+
+    BOOST_FOREACH(const CSerializeData& key, vSkipped)
+        Apply(CWalletLogOp(key));
+    LogPrint("db", "%s : compacted %s from %u to %u bytes in %dms\n", __func__, path.string(), nFileSize, nSize,
+             GetTimeMillis() - nStart);
+    nFileSize = nSize;
+    return true;
+}
+
+size_t CWalletLog::size() const
+{
+    LOCK(cs);
+    return mapRecords.size();
+}
+
+uint64_t CWalletLog::GetFileSize() const
+{
+    LOCK(cs);
+    return nFileSize;
+}
@@ -0,0 +1,141 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_WALLETLOG_H
+#define BITCOIN_WALLETLOG_H
+
+#include "allocators.h"
+#include "serialize.h"
+#include "sync.h"
+
+#include <algorithm>
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#include <boost/filesystem/path.hpp>
+
+//! Version of the record log file format
+static const int WALLETLOG_VERSION = 1;
+//! Number of records compaction writes per log entry
+static const unsigned int WALLETLOG_COMPACT_BATCH = 1000;
+//! Flush compacts a log once this many bytes of it, and more than half, are overwritten or erased records
+static const uint64_t WALLETLOG_COMPACT_MIN_WASTE = 1 << 20;
+
+/** One write or erase of a record, as the log keeps them */
+class CWalletLogOp
+{
+public:
+    bool fErase;
+    CSerializeData key;
+    CSerializeData value;
+
+    CWalletLogOp() : fErase(false) {}
+    CWalletLogOp(const CSerializeData& keyIn, const CSerializeData& valueIn) : fErase(false), key(keyIn), value(valueIn) {}
+    explicit CWalletLogOp(const CSerializeData& keyIn) : fErase(true), key(keyIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(fErase);
+        READWRITE(key);
+        if (!fErase)
+            READWRITE(value);
+    }
+};
+
+/** Orders keys byte by byte, as Berkeley DB does */
+struct CWalletLogKeyCompare
+{
+    bool operator()(const CSerializeData& a, const CSerializeData& b) const
+    {
+        size_t nMin = std::min(a.size(), b.size());
+        int n = nMin ? memcmp(&a[0], &b[0], nMin) : 0;
+        return n < 0 || (n == 0 && a.size() < b.size());
+    }
+};
+
+/**
+ * A database file kept as an append-only log of checksummed entries.
+ *
+ * Each entry holds one or more writes and erases of records, and is
+ * appended in one go with the double-SHA256 of its contents, so that it
+ * applies completely or not at all. Nothing in the file is ever written
+ * over: a crash can at most leave a torn entry at the end, which is dropped
+ * when the log is next opened. A bad entry anywhere else is damage to the
+ * file, and leaves the log corrupt until it is salvaged. The live records are indexed in memory while
+ * the log is replayed on opening, so reads never touch the file. Records
+ * overwritten or erased stay in the file until it is compacted, rewritten
+ * with the live records alone to a new file that then takes its place.
+ */
+class CWalletLog
+{
+public:
+    typedef std::map<CSerializeData, CSerializeData, CWalletLogKeyCompare> RecordMap;
+
+private:
+    mutable CCriticalSection cs;
+    boost::filesystem::path path;
+    FILE* file;
+    RecordMap mapRecords;
+    //! Size of the file, and the part of it taken by the live records
+    uint64_t nFileSize;
+    uint64_t nLiveSize;
+    //! Whether the replay stopped at a bad entry with intact ones after it
+    bool fCorrupt;
+
+    void Apply(const CWalletLogOp& op);
+
+    CWalletLog(const CWalletLog&);
+    void operator=(const CWalletLog&);
+
+public:
+    CWalletLog();
+    ~CWalletLog();
+
+    //! Whether the file at path starts like a record log
+    static bool IsLogFile(const boost::filesystem::path& path);
+
+    /**
+     * Open the log at pathIn and replay it, or create it if it doesn't exist
+     * and fCreate is set. A bad entry at the end of the file is cut off,
+     * after saving a copy. A bad entry with intact ones after it ends the
+     * replay and leaves the log corrupt: it can then be read but not
+     * written. With fSalvage, bad entries are skipped over instead, and the
+     * file is rewritten without them, after saving a copy.
+     */
+    bool Open(const boost::filesystem::path& pathIn, bool fCreate, bool fSalvage = false);
+    void Close();
+    bool IsOpen() const;
+    bool IsCorrupt() const;
+
+    bool Read(const CSerializeData& key, CSerializeData& value) const;
+    bool Exists(const CSerializeData& key) const;
+    /**
+     * Append vOps as one entry and apply them. Without fOverwrite, fails
+     * without writing anything if one of the records written exists.
+     */
+    bool Write(const std::vector<CWalletLogOp>& vOps, bool fOverwrite = true);
+    /**
+     * Read the record with the smallest key after key, or at key too if
+     * fInclusive is set. Returns false if there is none.
+     */
+    bool ReadNext(const CSerializeData& key, bool fInclusive, CSerializeData& keyRet, CSerializeData& valueRet) const;
+
+    /** Commit the file to disk, and compact it if enough of it is overwritten or erased records. */
+    bool Flush();
+    /**
+     * Rewrite the file with only the live records, leaving out those whose
+     * key starts with pszSkip, if given.
+     */
+    bool Compact(const char* pszSkip = NULL);
+
+    size_t size() const;
+    uint64_t GetFileSize() const;
+};
+
+#endif // BITCOIN_WALLETLOG_H
@@ -0,0 +1,174 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "walletscan.h"
+
+#include "main.h"
+#include "pubkey.h"
+#include "script/standard.h"
+#include "util.h"
+
+#include <string.h>
+
+#include <boost/foreach.hpp>
+
+void CWalletScanFilter::AddKey(const CKeyID& keyid)
+{
+    setKeyIDs.insert(keyid);
+}
+
+void CWalletScanFilter::AddRedeemScript(const CScriptID& scriptid)
+{
+    setScriptIDs.insert(scriptid);
+}
+
+void CWalletScanFilter::AddWatchOnly(const CScript& script)
+{
+    setWatchOnly.insert(script);
+}
+
+void CWalletScanFilter::RemoveWatchOnly(const CScript& script)
+{
+    setWatchOnly.erase(script);
+}
+
+bool CWalletScanFilter::IsRelevant(const CTxOut& txout) const
+{
+    const CScript& script = txout.scriptPubKey;
+    if (!setWatchOnly.empty() && setWatchOnly.count(script))
+        return true;
+
+    // Pay-to-pubkey-hash
+    if (script.size() == 25 && script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20 &&
+        script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG) {
+        uint160 hash;
+        memcpy(hash.begin(), &script[3], 20);
+        return setKeyIDs.count(hash) != 0;
+    }
+
+    // Pay-to-script-hash
+    if (script.IsPayToScriptHash()) {
+        uint160 hash;
+        memcpy(hash.begin(), &script[2], 20);
+        return setScriptIDs.count(hash) != 0;
+    }
+
+    // Pay-to-pubkey, with a compressed or uncompressed key
+    if (((script.size() == 35 && script[0] == 33) || (script.size() == 67 && script[0] == 65)) &&
+        script.back() == OP_CHECKSIG)
+        return setKeyIDs.count(CPubKey(script.begin() + 1, script.end() - 1).GetID()) != 0;
+
+    // Data carrier outputs can't be spent by anyone
+    if (!script.empty() && script[0] == OP_RETURN)
+        return false;
+
+    return true;
+}
+
+bool CWalletScanFilter::IsRelevant(const CTransaction& tx) const
+{
+    BOOST_FOREACH(const CTxOut& txout, tx.vout) {
+        if (IsRelevant(txout))
+            return true;
+    }
+    return false;
+}
+
+CRescanBlockReader::CRescanBlockReader(const CWalletScanFilter& filterIn, int nThreads) :
+    filter(filterIn), nNextRead(0), fStop(false)
+{
+    for (int i = 0; i < std::max(nThreads, 1); i++)
+        threads.create_thread(boost::bind(&CRescanBlockReader::ThreadRead, this));
+}
+
+CRescanBlockReader::~CRescanBlockReader()
+{
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fStop = true;
+    }
+    cond.notify_all();
+    threads.join_all();
+}
+
+void CRescanBlockReader::ThreadRead()
+{
+    RenameThread("litecoin-rescan");
+    while (true) {
+        boost::shared_ptr<CRescanBlock> pentry;
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            while (!fStop && nNextRead >= queue.size())
+                cond.wait(lock);
+            if (fStop)
+                return;
+            pentry = queue[nNextRead++];
+        }
+
+        if (!pentry->pos.IsNull()) {
+            try {
+                pentry->fRead = ReadBlockFromDisk(pentry->block, pentry->pos) && pentry->block.GetHash() == pentry->hash;
+            } catch (const std::exception& e) {
+                LogPrintf("%s: Deserialize or I/O error - %s\n", __func__, e.what());
+                pentry->fRead = false;
+            }
+        }
+        if (pentry->fRead) {
+            pentry->vRelevant.resize(pentry->block.vtx.size());
+            for (unsigned int i = 0; i < pentry->block.vtx.size(); i++)
+                pentry->vRelevant[i] = filter.IsRelevant(pentry->block.vtx[i]);
+        } else {
+            LogPrintf("%s: unable to read block %s for rescan\n", __func__, pentry->hash.ToString());
+            pentry->block.SetNull();
+        }
+
+        {
+            boost::unique_lock<boost::mutex> lock(cs);
+            pentry->fDone = true;
+        }
+        cond.notify_all();
+    }
+}
+
+void CRescanBlockReader::Push(CBlockIndex* pindex)
+{
+    boost::shared_ptr<CRescanBlock> pentry(new CRescanBlock());
+    pentry->pindex = pindex;
+    pentry->hash = pindex->GetBlockHash();
+    if (pindex->nStatus & BLOCK_HAVE_DATA)
+        pentry->pos = pindex->GetBlockPos();
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        queue.push_back(pentry);
+    }
+    cond.notify_all();
+}
+
+boost::shared_ptr<CRescanBlock> CRescanBlockReader::Pop()
+{
+    boost::shared_ptr<CRescanBlock> pentry;
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (queue.empty())
+        return pentry;
+    while (!queue.front()->fDone)
+        cond.wait(lock);
+    pentry = queue.front();
+    queue.pop_front();
+    nNextRead--;
+    return pentry;
+}
+
+void CRescanBlockReader::Clear()
+{
+    // Blocks being read stay alive with the threads reading them
+    boost::unique_lock<boost::mutex> lock(cs);
+    queue.clear();
+    nNextRead = 0;
+}
+
+size_t CRescanBlockReader::size()
+{
+    boost::unique_lock<boost::mutex> lock(cs);
+    return queue.size();
+}
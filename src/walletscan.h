@@ -0,0 +1,124 @@
+// Copyright (c) 2015 The Bitcoin developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_WALLETSCAN_H
+#define BITCOIN_WALLETSCAN_H
+
+#include "chain.h"
+#include "primitives/block.h"
+#include "script/script.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <deque>
+#include <vector>
+
+#include <boost/functional/hash.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <boost/unordered_set.hpp>
+
+class CKeyID;
+class CScriptID;
+
+//! -rescanthreads default (0 = one per core)
+static const int DEFAULT_RESCAN_THREADS = 0;
+//! Maximum number of threads reading blocks for a wallet rescan
+static const int MAX_RESCAN_THREADS = 16;
+//! Maximum number of blocks read ahead of the one being scanned
+static const unsigned int MAX_RESCAN_BLOCKS_BUFFERED = 256;
+//! Number of read blocks scanned per acquisition of cs_main and cs_wallet
+static const unsigned int RESCAN_BLOCKS_PER_LOCK = 32;
+
+struct CHash160Hasher
+{
+    size_t operator()(const uint160& hash) const { return hash.GetLow64(); }
+};
+
+struct CScriptHasher
+{
+    size_t operator()(const CScript& script) const { return boost::hash_range(script.begin(), script.end()); }
+};
+
+/**
+ * The destinations a wallet can be paid to, used to pass over most
+ * transactions of a rescan, and most outputs of the transactions relayed
+ * to or mined by the node, without running IsMine on them.
+ *
+ * Pay-to-pubkey(-hash) outputs are matched by key ID, pay-to-script-hash
+ * outputs by the IDs of the wallet's redeem scripts, and any output by the
+ * exact watch-only scripts. Outputs of other shapes (bare multisig,
+ * nonstandard) may still be ours and always match, so only a miss is final.
+ */
+class CWalletScanFilter
+{
+private:
+    boost::unordered_set<uint160, CHash160Hasher> setKeyIDs;
+    boost::unordered_set<uint160, CHash160Hasher> setScriptIDs;
+    boost::unordered_set<CScript, CScriptHasher> setWatchOnly;
+
+public:
+    void AddKey(const CKeyID& keyid);
+    void AddRedeemScript(const CScriptID& scriptid);
+    void AddWatchOnly(const CScript& script);
+    void RemoveWatchOnly(const CScript& script);
+
+    /** Whether an output may be ours. */
+    bool IsRelevant(const CTxOut& txout) const;
+    /** Whether any output of a transaction may be ours. Inputs are left to the caller. */
+    bool IsRelevant(const CTransaction& tx) const;
+};
+
+/** A block read for a wallet rescan. */
+struct CRescanBlock
+{
+    CBlockIndex* pindex;
+    CDiskBlockPos pos;
+    uint256 hash;
+    CBlock block;
+    //! False if the block could not be read (e.g. it was pruned)
+    bool fRead;
+    //! Which transactions have an output matching the filter
+    std::vector<bool> vRelevant;
+    //! Set once a reader thread is done with the block. Protected by CRescanBlockReader::cs.
+    bool fDone;
+
+    CRescanBlock() : pindex(NULL), fRead(false), fDone(false) {}
+};
+
+/**
+ * Reads and deserializes the blocks of a wallet rescan on a pool of threads,
+ * ahead of the wallet scanning them, and matches their outputs against a
+ * filter. Blocks are handed back in the order they were queued.
+ */
+class CRescanBlockReader
+{
+private:
+    const CWalletScanFilter& filter;
+    boost::thread_group threads;
+
+    CWaitableCriticalSection cs;
+    CConditionVariable cond;
+    //! All of the following are protected by cs.
+    std::deque<boost::shared_ptr<CRescanBlock> > queue;
+    //! Position in queue of the first block no thread has picked up yet
+    size_t nNextRead;
+    bool fStop;
+
+    void ThreadRead();
+
+public:
+    CRescanBlockReader(const CWalletScanFilter& filterIn, int nThreads);
+    ~CRescanBlockReader();
+
+    /** Queue a block to be read. Its position is taken from pindex now, so cs_main must be held. */
+    void Push(CBlockIndex* pindex);
+    /** Wait until the oldest queued block has been read and take it. Returns an empty pointer if nothing is queued. */
+    boost::shared_ptr<CRescanBlock> Pop();
+    /** Drop all queued blocks, e.g. when the chain they were taken from was reorganized. */
+    void Clear();
+    size_t size();
+};
+
+#endif // BITCOIN_WALLETSCAN_H